@@ -0,0 +1,125 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "definitions.h"
+
+namespace neodb {
+
+// BufferPool recycles the page aligned buffers of IOBuf, so the read and flush paths don't call
+// the allocator for every IO.
+//
+// Buffers are grouped by power-of-two size classes from a page up to `kMaxPooledSize`, and a
+// request is served by the smallest class that fits, so the waste is bounded by half of the
+// buffer. Each thread caches up to `kThreadCacheBytes` of released buffers without any locking,
+// the rest go to a shared free list capped by `capacity` bytes, beyond which they are freed.
+// Larger buffers bypass the pool.
+//
+// The buffers could be backed by 2MB huge pages to save the TLB misses of the large memcpy. We try
+// the reserved huge pages (MAP_HUGETLB) first, then the transparent huge pages (MADV_HUGEPAGE),
+// and fallback to the regular pages. Each buffer of 2MB or larger has its own mapping. Smaller
+// buffers are carved from a shared 2MB mapping, so they are always kept by the pool regardless of
+// the capacity.
+class BufferPool {
+ public:
+  static BufferPool& Instance();
+
+  // @param size The requested bytes, which should be page aligned.
+  // @return A page aligned buffer, or nullptr if out of memory.
+  char* Allocate(uint64_t size);
+
+  // @param size The requested bytes of the buffer's Allocate().
+  void Release(char* buf, uint64_t size);
+
+  // Limit the bytes kept by the shared free list, the extra ones will be freed on release.
+  void SetCapacity(uint64_t bytes);
+
+  // Apply the DB options to the process-wide pool. Only the first call takes effect, so another DB
+  // instance in the process cannot reconfigure the pool under the running one, a different
+  // configuration is ignored with a warning.
+  void Configure(uint64_t capacity, bool huge_pages);
+
+  uint64_t GetCapacity() const { return capacity_; }
+
+  // Only the buffers allocated afterwards are affected.
+  void EnableHugePages(bool enable) { huge_pages_ = enable; }
+
+  bool HugePagesEnabled() const { return huge_pages_; }
+
+  // @return The bytes that were mapped for the huge page backed buffers.
+  uint64_t GetHugePageBytes() const { return huge_page_bytes_; }
+
+  // @return The bytes kept by the shared free list, not including the thread caches.
+  uint64_t GetCachedBytes() const { return cached_bytes_; }
+
+  // @return The number of buffers that were allocated from the system.
+  uint64_t GetAllocatedNum() const { return allocated_num_; }
+
+  // @return The number of allocations that were served by a recycled buffer.
+  uint64_t GetReusedNum() const { return reused_num_; }
+
+  static constexpr uint64_t kMaxPooledSize = 4UL << 20;
+
+  static constexpr uint64_t kThreadCacheBytes = 4UL << 20;
+
+  static constexpr uint64_t kHugePageSize = 2UL << 20;
+
+ private:
+  // Page, 2 pages, ..., `kMaxPooledSize`.
+  static constexpr uint32_t kClassNum = 11;
+
+  struct ThreadCache;
+
+  BufferPool() = default;
+
+  // @return The size class that fits `size`, or -1 if it's too large to be pooled.
+  static int32_t GetClass(uint64_t size);
+
+  static uint64_t GetClassSize(uint32_t cls) { return uint64_t(IO_PAGE_SIZE) << cls; }
+
+  static ThreadCache& GetThreadCache();
+
+  // Take a buffer from the shared free list or the system.
+  char* AllocateShared(uint32_t cls);
+
+  // Give a buffer back to the shared free list or the system.
+  void ReleaseShared(char* buf, uint32_t cls);
+
+  // Allocate a buffer of the class from the huge pages, should be called with `mtx_` held.
+  // @return nullptr if no huge page could be mapped.
+  char* AllocateHugePages(uint32_t cls);
+
+  // Map `size` bytes (a multiple of `kHugePageSize`) aligned to the huge page size.
+  static char* MapHugePages(uint64_t size);
+
+  // Give a buffer out of the free lists back to the system, should be called with `mtx_` held.
+  // @return False if the buffer was carved from a shared mapping, which could not be freed.
+  bool FreeLocked(char* buf, uint32_t cls);
+
+  std::mutex mtx_;
+
+  std::vector<char*> free_bufs_[kClassNum];
+
+  std::atomic<uint64_t> capacity_{256UL << 20};
+
+  std::atomic<uint64_t> cached_bytes_{0};
+
+  std::atomic<uint64_t> allocated_num_{0};
+
+  std::atomic<uint64_t> reused_num_{0};
+
+  std::atomic<bool> huge_pages_{false};
+
+  // Set by the first Configure().
+  bool configured_ = false;
+
+  // The huge page mappings, start address -> size.
+  std::map<char*, uint64_t> huge_mappings_;
+
+  std::atomic<uint64_t> huge_page_bytes_{0};
+};
+}  // namespace neodb
@@ -10,4 +10,7 @@
 
 #define MAX_KEY_SIZE (1024)
 
-#define MAX_VALUE_SIZE (32UL << 20)
\ No newline at end of file
+#define MAX_VALUE_SIZE (32UL << 20)
+
+// Encoded item meta: key size 2B + value size 4B
+#define ITEM_META_SIZE 6
@@ -8,25 +8,28 @@
 #include <memory>
 #include <string>
 
+#include "buffer_pool.h"
 #include "definitions.h"
 
 namespace neodb {
 
-// IOBuf will always hold the ownership of the underlying data buffer.
-// In contrast, a Slice will only hold references.
+// IOBuf will always hold the ownership of the underlying data buffer, a view shares it with its
+// parent. In contrast, a Slice will only hold references.
 class IOBuf {
  public:
   IOBuf() = default;
 
-  // Allocate memory for future use.
+  // Allocate memory for future use, the buffer is borrowed from the BufferPool and given back
+  // on destruction.
   explicit IOBuf(uint32_t capacity) : capacity_(capacity) {
     // capacity aligned to page size.
     capacity_ = (capacity + IO_PAGE_SIZE - 1) / IO_PAGE_SIZE * IO_PAGE_SIZE;
-    int ret = posix_memalign((void**)&buf_, IO_PAGE_SIZE, capacity_);
-    if (ret != 0) {
+    buf_ = BufferPool::Instance().Allocate(capacity_);
+    if (buf_ == nullptr) {
       // TODO error handling?
     }
     original_buf_ = buf_;
+    original_capacity_ = capacity_;
   }
 
   // Allocate memory & copy target string
@@ -35,9 +38,13 @@ class IOBuf {
   }
 
   // Take the ownership of the input buffer.
-  IOBuf(char* buf, uint32_t size) : capacity_(size), size_(size), buf_(buf) {}
+  IOBuf(char* buf, uint32_t size) : buf_(buf), size_(size), capacity_(size) {}
 
-  ~IOBuf() { free(original_buf_); }
+  // A read-only view of [offset, offset + size) of the parent, which is kept alive by the view.
+  IOBuf(const std::shared_ptr<IOBuf>& parent, uint32_t offset, uint32_t size)
+      : buf_(parent->Buffer() + offset), size_(size), capacity_(size), parent_(parent) {}
+
+  ~IOBuf() { BufferPool::Instance().Release(original_buf_, original_capacity_); }
 
   void Append(const char* src, uint32_t size) {
     memcpy(buf_ + size_, src, size);
@@ -96,11 +103,17 @@ class IOBuf {
   // the middle of the original buffer after shrinking.
   char* original_buf_ = nullptr;
 
+  // The capacity of the original buffer, which is needed to give it back to the pool.
+  uint32_t original_capacity_ = 0;
+
   // current occupied size
   uint32_t size_ = 0;
 
   // Max usable size.
   // If the buffer was shrunk, then the capacity will also be changed.
   uint32_t capacity_ = 0;
+
+  // The owner of the buffer if it's a view.
+  std::shared_ptr<IOBuf> parent_;
 };
 }  // namespace neodb
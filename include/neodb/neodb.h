@@ -4,9 +4,11 @@
 #include <utility>
 #include <vector>
 
+#include "neodb/buffer_pool.h"
 #include "neodb/io_buf.h"
 #include "neodb/options.h"
 #include "neodb/status.h"
+#include "neodb/write_batch.h"
 #include "store.h"
 #include "trace_points.h"
 
@@ -18,20 +20,44 @@ class NeoDB {
  public:
   explicit NeoDB(DBOptions options)
       : options_(std::move(options)), store_num_(options_.store_options_list_.size()) {
+    BufferPool::Instance().Configure(options_.buffer_pool_capacity_, options_.huge_page_buffers_);
+    if (options_.write_buffer_budget_ > 0) {
+      write_budget_ = std::make_shared<WriteBudget>(options_.write_buffer_budget_);
+    }
     for (int i = 0; i < options_.store_options_list_.size(); ++i) {
       auto store_options = options_.store_options_list_[i];
       LOG(INFO, "Init store {}, device name: {}", i, store_options.device_path_);
-      stores_.emplace_back(new Store(store_options));
+      stores_.emplace_back(new Store(store_options, write_budget_));
     }
   }
 
   ~NeoDB() = default;
 
   // memcpy Put
-  Status Put(const std::string& key, const std::string& value);
+  Status Put(const std::string& key, const std::string& value,
+             const WriteOptions& options = WriteOptions());
 
   // zero-copy Put
-  Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value);
+  Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value,
+             const WriteOptions& options = WriteOptions());
+
+  // Non-blocking Put, it returns Status::Busy() instead of waiting if the write budget ran out or
+  // the flush is behind, so the caller could shed or redirect the write.
+  Status TryPut(const std::string& key, const std::string& value);
+
+  Status TryPut(const std::string& key, const std::shared_ptr<IOBuf>& value);
+
+  // Put all items of the batch. The items are grouped by their stores and write buffers, so each
+  // group takes the write buffer and updates the index once.
+  Status Write(const WriteBatch& batch, const WriteOptions& options = WriteOptions());
+
+  // Streaming Put of a large value, the caller appends the value's chunks to the writer as they
+  // arrive and then commits it. The chunks are written to the device along the way instead of
+  // being buffered as a whole, see ValueWriter. The writers should be closed before the DB.
+  // @return Status::NotSupported() unless the store has multiple flush encoders on a
+  // conventional device.
+  Status OpenValueWriter(const std::string& key, uint32_t value_size,
+                         std::unique_ptr<ValueWriter>* writer);
 
   // memcpy Get
   Status Get(const std::string& key, std::string* value);
@@ -39,8 +65,24 @@ class NeoDB {
   // zero-copy Get
   Status Get(const std::string& key, std::shared_ptr<IOBuf>& value);
 
-  // Flush all existing buffer to the disk.
-  //  Status Flush();
+  // Async zero-copy Get, the callback will be invoked by Poll() if the value needs to be read from
+  // the device, or invoked immediately if it's still in memory.
+  Status AsyncGet(const std::string& key, const Store::GetCallback& cb);
+
+  // Run the callbacks of all finished async reads.
+  // @return The number of finished IO requests.
+  uint32_t Poll();
+
+  // Like Poll(), but block until any IO finished or timeout if nothing finished yet. The callbacks
+  // should not call Poll() or Wait() themselves.
+  uint32_t Wait(uint64_t timeout_us = 1000);
+
+  // Flush all existing buffer to the disk, it returns once the puts that returned before were
+  // written to the device and synced.
+  Status Flush();
+
+  // @return The write stalls of all stores.
+  WriteStallStats GetWriteStallStats() const;
 
   std::shared_ptr<Index> DEBUG_GetIndex(int idx) { return stores_[idx]->DEBUG_GetIndex(); }
 
@@ -50,6 +92,9 @@ class NeoDB {
   // total number of device stores
   uint32_t store_num_ = 0;
 
+  // Shared by the stores, so it's destroyed after them.
+  std::shared_ptr<WriteBudget> write_budget_;
+
   std::vector<std::unique_ptr<Store>> stores_;
 };
 }  // namespace neodb
@@ -8,10 +8,81 @@ namespace neodb {
 
 struct StoreOptions;
 
-enum DeviceType { kFile, kBlock };
+// kZonedFile emulates a zoned namespace device on top of a regular file.
+// kSimulated keeps the data in memory and models the device timing with `sim_device_`, so the
+// algorithms could be compared reproducibly without a real SSD.
+enum DeviceType { kFile, kBlock, kZonedFile, kSimulated };
+
+// The async IO engine used by the device's IOHandle.
+enum IOEngineType { kPosixAIO, kIOUring };
+
+// How the device file is accessed.
+// kDirectIO: bypass the page cache with O_DIRECT, all IO should be page aligned.
+// kBufferedIO: go through the page cache.
+// kBufferedIOWithFadvise: go through the page cache, but drop the pages once the IO finished, so
+// the page cache won't grow with the device data.
+enum IOMode { kDirectIO, kBufferedIO, kBufferedIOWithFadvise };
+
+// Token bucket limits of a class of device IO, 0 means unlimited.
+struct RateLimit {
+  uint64_t bytes_per_sec_ = 0;
+  uint64_t iops_ = 0;
+};
+
+// Latency of a simulated device operation, a fixed part plus an exponentially distributed jitter
+// with the given mean, so it has a long tail like a real SSD.
+struct SimLatency {
+  uint64_t base_us_ = 0;
+  uint64_t jitter_us_ = 0;
+};
+
+// The device model of kSimulated devices.
+struct SimDeviceOptions {
+  SimLatency read_latency_ = {80, 20};
+  SimLatency write_latency_ = {20, 10};
+
+  // Transfer bandwidth of each direction, 0 means unlimited.
+  uint64_t read_bytes_per_sec_ = 3000UL << 20;
+  uint64_t write_bytes_per_sec_ = 2000UL << 20;
+
+  // Number of requests served in parallel, the following ones queue up behind them. So the
+  // latency grows with the queue depth once the device is saturated.
+  uint32_t parallelism_ = 8;
+
+  // Probability of a latency spike for each operation in parts per million, e.g. to model the
+  // device's internal GC.
+  uint32_t spike_ppm_ = 0;
+  uint64_t spike_latency_us_ = 10UL * 1000;
+
+  // Seed of the random jitters and spikes.
+  uint64_t seed_ = 0;
+};
 
 struct DBOptions {
   std::vector<StoreOptions> store_options_list_;
+
+  // Back the pooled IOBuf memory (the values in write buffers and the IO buffers) with 2MB huge
+  // pages, fallback to the regular pages if none is available.
+  bool huge_page_buffers_ = false;
+
+  // Bytes of the released IOBuf memory that could be kept for reuse, shared by all stores.
+  //
+  // The buffer pool is process-wide, it's configured by the first DB of the process, the pool
+  // options of the later ones are ignored.
+  uint64_t buffer_pool_capacity_ = 256UL << 20;
+
+  // Bytes of the buffered writes that are not yet flushed, shared by all stores. A Put waits and a
+  // TryPut fails beyond it, 0 means each store is only limited by its write buffer numbers, which
+  // is the default.
+  uint64_t write_buffer_budget_ = 0;
+};
+
+// Options of a single write.
+struct WriteOptions {
+  // Return only after the item was written to the device and synced, so it survives a crash or
+  // power loss. The concurrent durable writes are grouped into the same write buffer, so they
+  // share its flush IO and the device sync, and wait together.
+  bool sync_ = false;
 };
 
 // The options will be loaded on system start.
@@ -21,14 +92,28 @@ struct StoreOptions {
 
   std::string device_path_;
 
-  // The device path could be a sub-range of the hardware or file.
+  // The device path could be a sub-range of the hardware or file, it should be page aligned.
+  // Only respected by kBlock devices.
   uint64_t device_offset_ = 0;
 
+  // kBlock opens `device_path_` as a raw block device without any file system.
   DeviceType type_ = kFile;
 
+  // For kBlock devices, it caps the capacity discovered from the device.
   uint64_t device_capacity_ = 10UL << 30;
 
   uint64_t device_zone_capacity_ = 256UL << 20;
+  // If io_uring is not supported by the kernel, we will fallback to posix aio.
+  IOEngineType io_engine_ = kPosixAIO;
+
+  // Maximum in-flight requests of the IO engine. If adaptive, it's only the initial value and will
+  // be adjusted between [8, 128] by the completion latency and throughput.
+  uint32_t io_depth_ = 20;
+  bool adaptive_io_depth_ = false;
+
+  // If the file system doesn't support O_DIRECT (e.g. tmpfs), we will fallback to buffered IO.
+  IOMode read_io_mode_ = kDirectIO;
+  IOMode write_io_mode_ = kDirectIO;
 
   // Maximum capacity of each write buffer.
   // Total system memory usage:
@@ -39,11 +124,48 @@ struct StoreOptions {
   uint64_t writable_buffer_num_ = 10;
 
   uint64_t immutable_buffer_num_ = 10;
+  // Maximum in-flight IO buffers (IO_FLUSH_SIZE each) of the flush worker, so encoding could be
+  // overlapped with device writes.
+  uint32_t flush_io_buffer_num_ = 4;
+
+  // Number of data zones that are open for writing at the same time, each has its own flush
+  // worker. The immutable buffers are striped over them, so the flushing could use the device's
+  // internal parallelism.
+  uint32_t open_data_zone_num_ = 1;
+
+  // Number of encoding workers of each open data zone. Each worker takes an immutable buffer and
+  // reserves the ranges of the zone to write, so the encoding could use more cores than the open
+  // zones. Zoned devices only take sequential writes, so they always have a single worker.
+  //
+  // The ValueWriter is only supported with multiple workers.
+  uint32_t flush_encoder_num_ = 1;
+
+  // Number of the open data zones that only take hot data, 0 disables the hot/cold separation. An
+  // overwrite is considered hot, since the key is likely to be overwritten again soon, so the hot
+  // zones die together and GC rarely has to drop live cold data. It should be less than
+  // `open_data_zone_num_`.
+  uint32_t hot_data_zone_num_ = 0;
+
+  // Page aligned values larger than this are written directly from the user's buffer with a
+  // vectored IO instead of being copied into the IO buffer, 0 means always copy.
+  uint32_t zero_copy_value_size_ = 64UL << 10;
+
+  // Bandwidth and IOPS limits of the background IO, so they won't saturate the device and hurt the
+  // foreground reads. Could be adjusted at runtime by Store::SetRateLimit.
+  RateLimit flush_rate_limit_;
+  RateLimit gc_rate_limit_;
+
+  // Limits of the discards of the reset zones, which are issued in background. A discard skips the
+  // limit if a write is waiting for it.
+  RateLimit discard_rate_limit_;
 
   // If empty zone number less than this, we should trigger GC.
   uint32_t gc_threshold_zone_num_ = 3;
 
   bool recover_exist_db_ = false;
+
+  // Only respected by kSimulated devices.
+  SimDeviceOptions sim_device_;
 };
 
 struct LoggerOptions {
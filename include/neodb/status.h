@@ -5,7 +5,7 @@
 namespace neodb {
 class Status {
  public:
-  enum Code { kOK = 0, kNotFound, kIOError, kIOBusy };
+  enum Code { kOK = 0, kNotFound, kIOError, kIOBusy, kNotSupported };
 
  public:
   static Status OK(const std::string& msg = "") { return {Code::kOK, msg}; }
@@ -16,6 +16,8 @@ class Status {
 
   static Status IOError(const std::string& msg = "") { return {Code::kIOError, msg}; }
 
+  static Status NotSupported(const std::string& msg = "") { return {Code::kNotSupported, msg}; }
+
   static Status StatusError(const std::string& msg = "status not valid") {
     return {Code::kIOError, msg};
   }
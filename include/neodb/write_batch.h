@@ -0,0 +1,40 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "io_buf.h"
+
+namespace neodb {
+
+// WriteBatch collects the puts that are written together by NeoDB::Write(), so the items of the
+// same store and write buffer share the buffer's entrance and the index update. If a key is put
+// more than once, the last one wins.
+//
+// NOT THREAD SAFE.
+class WriteBatch {
+ public:
+  using Item = std::pair<std::string, std::shared_ptr<IOBuf>>;
+
+  // memcpy Put
+  void Put(const std::string& key, const std::string& value) {
+    items_.emplace_back(key, std::make_shared<IOBuf>(value));
+  }
+
+  // zero-copy Put
+  void Put(const std::string& key, const std::shared_ptr<IOBuf>& value) {
+    items_.emplace_back(key, value);
+  }
+
+  const std::vector<Item>& GetItems() const { return items_; }
+
+  uint32_t Count() const { return items_.size(); }
+
+  void Clear() { items_.clear(); }
+
+ private:
+  std::vector<Item> items_;
+};
+}  // namespace neodb
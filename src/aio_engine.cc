@@ -1,8 +1,24 @@
 #include "aio_engine.h"
 
 #include <aio.h>
+#include <poll.h>
+
+#include <algorithm>
+#ifndef __APPLE__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 namespace neodb {
+namespace {
+inline struct timespec ToTimespec(uint64_t timeout_us) {
+  struct timespec ts {};
+  ts.tv_sec = (time_t)(timeout_us / 1000000);
+  ts.tv_nsec = (long)(timeout_us % 1000000 * 1000);
+  return ts;
+}
+}  // namespace
+
 inline std::string IORequest::GetTypeName(IORequestType type) {
   switch (type) {
     case kAsyncWrite:
@@ -13,140 +29,657 @@ inline std::string IORequest::GetTypeName(IORequestType type) {
   return "NotKnown";
 }
 
-Status PosixAIOEngine::AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
-                                  const std::function<void(uint64_t)>& cb) {
-  if (requests_.size() >= io_depth_) {
-    LOG(ERROR, "io depth full, please try again later, cur: {}", io_depth_);
-    return Status::Busy();
+void AIOEngine::RunCallbacks() {
+  std::unique_lock<std::mutex> lk(mtx_);
+  if (running_callbacks_) {
+    return;
   }
+  running_callbacks_ = true;
+  while (!completions_.empty()) {
+    Completion c = std::move(completions_.front());
+    completions_.pop_front();
+    lk.unlock();
+    if (c.cb_ != nullptr) {
+      c.cb_(c.offset_, c.res_);
+    }
+    lk.lock();
+  }
+  running_callbacks_ = false;
+}
 
-  requests_.push_back({.aio_req_ = {}, .type_ = kAsyncWrite});
-  auto& request = requests_.back();
-  memset(&request.aio_req_, 0, sizeof(struct aiocb));
-  request.aio_req_.aio_offset = (off_t)offset;
-  request.aio_req_.aio_buf = (void*)buffer;
-  request.aio_req_.aio_nbytes = size;
-  request.aio_req_.aio_fildes = fd;
-  request.cb_ = cb;
+void AIOEngine::InitSlots() {
+  slots_.resize(kMaxIODepth);
+  free_slots_.reserve(kMaxIODepth);
+  for (uint32_t i = 0; i < kMaxIODepth; ++i) {
+    free_slots_.push_back(kMaxIODepth - 1 - i);
+  }
+  write_order_.resize(kMaxIODepth);
+}
 
-  int ret = aio_write(&request.aio_req_);
-  if (ret == -1) {
-    auto msg = "aio_write failed, err msg: " + std::string(strerror(errno));
-    LOG(ERROR, msg);
-    requests_.pop_back();
-    return Status::IOError(msg);
+void AIOEngine::SetIODepth(uint32_t depth, bool adaptive) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  uint32_t min_depth = adaptive ? kMinIODepth : 1;
+  io_depth_ = std::min(std::max(depth, min_depth), kMaxIODepth);
+  adaptive_ = adaptive;
+  window_start_us_ = clock_->NowInUs();
+  window_completions_ = 0;
+  window_bytes_ = 0;
+  window_latency_us_ = 0;
+  window_peak_in_flight_ = 0;
+}
+
+void AIOEngine::RecordCompletion(const IORequest& req) {
+  uint64_t now = clock_->NowInUs();
+  window_completions_++;
+  window_bytes_ += req.size_;
+  window_latency_us_ += now - req.submit_us_;
+  if (window_completions_ >= kDepthWindow) {
+    AdaptIODepth(now);
   }
+}
+
+void AIOEngine::AdaptIODepth(uint64_t now_us) {
+  // Normalize the latency by the IO size, so large writes and small reads could be compared.
+  double pages = std::max<double>(1.0, double(window_bytes_) / 4096);
+  double latency = double(window_latency_us_) / pages;
+  uint64_t elapsed = std::max<uint64_t>(1, now_us - window_start_us_);
+  uint64_t throughput = window_bytes_ * 1000000 / elapsed;
+  avg_latency_ = avg_latency_ == 0 ? latency : avg_latency_ * 0.7 + latency * 0.3;
+  min_latency_ = min_latency_ == 0 ? avg_latency_ : std::min(min_latency_ * 1.001, avg_latency_);
+
+  uint32_t depth = io_depth_;
+  if (avg_latency_ > min_latency_ * kLatencyTolerance && throughput < throughput_ * 1.1) {
+    depth = std::max(kMinIODepth, depth * 3 / 4);
+  } else if (window_peak_in_flight_ >= depth * 3 / 4) {
+    // Only grow if the requests were actually limited by the depth.
+    depth = std::min(kMaxIODepth, depth + 1);
+  }
+  if (depth != io_depth_) {
+    LOG(DEBUG, "io depth: {} -> {}, latency per page: {}us, min: {}us, throughput: {}MB/s",
+        io_depth_.load(), depth, avg_latency_, min_latency_, throughput >> 20);
+    io_depth_ = depth;
+  }
+  throughput_ = throughput;
+  window_start_us_ = now_us;
+  window_completions_ = 0;
+  window_bytes_ = 0;
+  window_latency_us_ = 0;
+  window_peak_in_flight_ = 0;
+}
 
+int32_t AIOEngine::AllocateSlot(IORequestType type, uint64_t offset, uint64_t size,
+                                IOCallback&& cb) {
+  if (free_slots_.empty() || in_flight_ >= io_depth_) {
+    LOG(DEBUG, "io depth full, please try again later, cur: {}", io_depth_.load());
+    return -1;
+  }
+  uint32_t slot = free_slots_.back();
+  free_slots_.pop_back();
+  auto& req = slots_[slot];
+  req.type_ = type;
+  req.cb_ = std::move(cb);
+  req.offset_ = offset;
+  req.size_ = size;
+  req.res_ = 0;
+  req.in_use_ = true;
+  req.done_ = false;
+  if (type == kAsyncWrite) {
+    write_order_[(write_order_head_ + write_order_size_) % kMaxIODepth] = slot;
+    write_order_size_++;
+  }
+  in_flight_++;
+  if (adaptive_) {
+    req.submit_us_ = clock_->NowInUs();
+    window_peak_in_flight_ = std::max<uint32_t>(window_peak_in_flight_, in_flight_);
+  }
+  return (int32_t)slot;
+}
+
+void AIOEngine::CancelSlot(uint32_t slot) {
+  auto& req = slots_[slot];
+  // The slot was the latest allocated one, so it must be at the tail of the write order.
+  if (req.type_ == kAsyncWrite) {
+    write_order_size_--;
+  }
+  req.cb_ = nullptr;
+  req.in_use_ = false;
+  free_slots_.push_back(slot);
+  in_flight_--;
+}
+
+uint32_t AIOEngine::FinishSlot(uint32_t slot, int64_t res) {
+  uint32_t cnt = 0;
+  auto release = [&](uint32_t idx) {
+    auto& req = slots_[idx];
+    if (req.res_ >= 0) {
+      cnt++;
+    }
+    completions_.push_back({std::move(req.cb_), req.offset_, req.res_});
+    req.cb_ = nullptr;
+    req.in_use_ = false;
+    req.done_ = false;
+    if (req.waiters_ > 0) {
+      req.parked_ = true;
+    } else {
+      free_slots_.push_back(idx);
+    }
+    in_flight_--;
+  };
+
+  auto& req = slots_[slot];
+  req.res_ = res;
+  req.done_ = true;
+  if (adaptive_) {
+    RecordCompletion(req);
+  }
+  if (req.type_ == kAsyncRead) {
+    release(slot);
+    return cnt;
+  }
+  // Writes are delivered in the submission order, a finished write waits for all its
+  // predecessors.
+  while (write_order_size_ > 0 && slots_[write_order_[write_order_head_]].done_) {
+    release(write_order_[write_order_head_]);
+    write_order_head_ = (write_order_head_ + 1) % kMaxIODepth;
+    write_order_size_--;
+  }
+  return cnt;
+}
+
+void AIOEngine::PinSlots(const std::vector<uint32_t>& slots) {
+  for (auto slot : slots) {
+    slots_[slot].waiters_++;
+  }
+}
+
+void AIOEngine::UnpinSlots(const std::vector<uint32_t>& slots) {
+  for (auto slot : slots) {
+    auto& req = slots_[slot];
+    req.waiters_--;
+    if (req.waiters_ == 0 && req.parked_) {
+      req.parked_ = false;
+      free_slots_.push_back(slot);
+    }
+  }
+}
+
+Status PosixAIOEngine::AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
+                                  IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return Submit(kAsyncWrite, fd, offset, const_cast<char*>(buffer), size, std::move(cb));
+}
+
+Status PosixAIOEngine::AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size,
+                                 IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return Submit(kAsyncRead, fd, offset, buffer, size, std::move(cb));
+}
+
+Status PosixAIOEngine::AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                                   IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  uint32_t parts = iov.size();
+  if (parts > kMaxIODepth) {
+    return Status::IOError("Too many parts of a vectored write: " + std::to_string(parts));
+  }
+  // All parts should be submitted together, so none of them could be rejected as busy.
+  if (in_flight_ + parts > io_depth_ || GetFreeSlotNum() < parts) {
+    LOG(DEBUG, "io depth full, please try again later, cur: {}", io_depth_.load());
+    return Status::Busy();
+  }
+  // The callbacks are run one at a time, so the state needs no lock. The part that finishes last
+  // reports the result of the whole request.
+  struct VectoredWrite {
+    IOCallback cb_;
+    uint64_t offset_;
+    uint64_t total_ = 0;
+    uint32_t pending_;
+    int64_t err_ = 0;
+  };
+  auto state = std::make_shared<VectoredWrite>();
+  state->cb_ = std::move(cb);
+  state->offset_ = offset;
+  state->pending_ = parts;
+  for (auto& part : iov) {
+    state->total_ += part.iov_len;
+  }
+  auto part_cb = [state](uint64_t, int64_t res) {
+    if (res < 0 && state->err_ == 0) {
+      state->err_ = res;
+    }
+    if (--state->pending_ == 0 && state->cb_ != nullptr) {
+      state->cb_(state->offset_, state->err_ < 0 ? state->err_ : (int64_t)state->total_);
+    }
+  };
+  uint64_t part_offset = offset;
+  for (uint32_t i = 0; i < parts; ++i) {
+    auto s = Submit(kAsyncWrite, fd, part_offset, (char*)iov[i].iov_base, iov[i].iov_len,
+                    IOCallback(part_cb));
+    if (!s.ok()) {
+      if (i == 0) {
+        return s;
+      }
+      // The submitted parts cannot be cancelled, so the failure is reported once they finished.
+      state->err_ = -EIO;
+      state->pending_ -= parts - i;
+      return Status::OK();
+    }
+    part_offset += iov[i].iov_len;
+  }
   return Status::OK();
 }
 
-Status PosixAIOEngine::AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, char** cb) {
-  if (requests_.size() >= io_depth_) {
-    LOG(ERROR, "io depth full, please try again later, cur: {}", io_depth_);
+Status PosixAIOEngine::Submit(IORequestType type, int fd, uint64_t offset, char* buffer,
+                              uint64_t size, IOCallback&& cb) {
+  int32_t slot = AllocateSlot(type, offset, size, std::move(cb));
+  if (slot == -1) {
     return Status::Busy();
   }
-  requests_.push_back({.aio_req_ = {}, .type_ = kAsyncRead});
-  auto& request = requests_.back();
+
+  auto& request = slots_[slot];
   memset(&request.aio_req_, 0, sizeof(struct aiocb));
   request.aio_req_.aio_offset = (off_t)offset;
   request.aio_req_.aio_buf = (void*)buffer;
   request.aio_req_.aio_nbytes = size;
   request.aio_req_.aio_fildes = fd;
 
-  int ret = aio_read(&request.aio_req_);
+  int ret = type == kAsyncWrite ? aio_write(&request.aio_req_) : aio_read(&request.aio_req_);
   // If request submission failed
   if (ret == -1) {
-    LOG(ERROR, "aio_read failed, ret: {}, err: {}, offset: {}, sz: {}", ret, strerror(errno),
-        offset, size);
-    requests_.pop_back();
-    return Status::IOError("aio read failed!");
+    auto msg = IORequest::GetTypeName(type) + " failed, err msg: " + std::string(strerror(errno));
+    LOG(ERROR, "{}, offset: {}, sz: {}", msg, offset, size);
+    CancelSlot(slot);
+    return Status::IOError(msg);
   }
   return Status::OK();
 }
 
-// TODO Probably we should check the event by their submission order?
 uint32_t PosixAIOEngine::Poll() {
   uint32_t cnt = 0;
-  auto it = requests_.begin();
-  while (it != requests_.end()) {
-    auto& req = *it;
-    int err_value = aio_error(&req.aio_req_);
-
-    // If the request was canceled, we remove & skip it.
-    // TODO Cancel all following requests
-    if (err_value == ECANCELED) {
-      it = requests_.erase(it);
-      continue;
-    }
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    // Reap every finished request no matter where it is, a slow request won't block the others.
+    for (uint32_t slot = 0; slot < slots_.size(); ++slot) {
+      auto& req = slots_[slot];
+      if (!req.in_use_ || req.done_) {
+        continue;
+      }
+      int err_value = aio_error(&req.aio_req_);
+      if (err_value == EINPROGRESS) {
+        continue;
+      }
 
-    // If the request is not yet completed, we shouldn't skip it because we need to
-    // keep the completion order.
-    if (err_value == EINPROGRESS) {
-      break;
-    }
-
-    // If the request has an error.
-    // TODO Cancel all following requests
-    if (err_value != 0) {
-      LOG(ERROR, "I/O failed, aio_error: {}, errmsg: {}, offset: {}", err_value, strerror(errno),
-          req.aio_req_.aio_offset);
-      it = requests_.erase(it);
-      continue;
-    }
-
-    // If there's no operation error occurs, we should check the return value.
-    int ret_value = aio_return(&req.aio_req_);
-    if (ret_value == -1) {
-      LOG(ERROR, "I/O failed, aio_return: {}, errmsg: {}, offset: {}", ret_value, strerror(errno),
-          req.aio_req_.aio_offset);
-      it = requests_.erase(it);
-      continue;
+      int64_t res = aio_return(&req.aio_req_);
+      if (err_value == ECANCELED) {
+        res = -ECANCELED;
+      } else if (err_value != 0) {
+        // If the request has an error.
+        LOG(ERROR, "I/O failed, aio_error: {}, errmsg: {}, offset: {}", err_value,
+            strerror(err_value), req.offset_);
+        res = -err_value;
+      } else if (res != (int64_t)req.size_) {
+        LOG(ERROR, "I/O partially finished, expect: {}, actual: {}, offset: {}", req.size_, res,
+            req.offset_);
+        res = -EIO;
+      }
+      cnt += FinishSlot(slot, res);
     }
+  }
+  RunCallbacks();
+  return cnt;
+}
 
-    // Otherwise, the operation success
-    if(it->cb_ != nullptr) {
-      it->cb_(it->aio_req_.aio_offset);
+uint32_t PosixAIOEngine::Wait(uint64_t timeout_us) {
+  std::vector<uint32_t> slots;
+  std::vector<const struct aiocb*> pending;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    for (uint32_t i = 0; i < slots_.size(); i++) {
+      if (slots_[i].in_use_ && !slots_[i].done_) {
+        slots.push_back(i);
+        pending.push_back(&slots_[i].aio_req_);
+      }
     }
-    it = requests_.erase(it);
-    cnt++;
+    PinSlots(slots);
   }
-  return cnt;
+  // The requests may be reaped by another thread meanwhile, but their slots are pinned, so the
+  // aiocbs won't be reused before aio_suspend returned. At worst we wait until the timeout.
+  if (!pending.empty()) {
+    struct timespec ts = ToTimespec(timeout_us);
+    aio_suspend(pending.data(), (int)pending.size(), &ts);
+    std::lock_guard<std::mutex> lk(mtx_);
+    UnpinSlots(slots);
+  }
+  return Poll();
 }
 
 // This is a mocking async write which implemented by sync write.
 Status MockAIOEngine::AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
-                                 const std::function<void(uint64_t)>& cb) {
-  if (requests_.size() >= io_depth_) {
-    LOG(ERROR, "io depth full, please try again later, cur: {}", io_depth_);
+                                 IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  int32_t slot = AllocateSlot(kAsyncWrite, offset, size, std::move(cb));
+  if (slot == -1) {
     return Status::Busy();
   }
-  requests_.push_back({.aio_req_ = {}, .type_ = kAsyncWrite});
   auto ret = pwrite(fd, buffer, size, offset);
-  if (ret != size) {
+  if (ret != (ssize_t)size) {
     LOG(ERROR, "pwrite error : {}, offset: {}, fd : {}", strerror(errno), offset, fd);
+    CancelSlot(slot);
     return Status::IOError();
   }
+  slots_[slot].res_ = ret;
+  finished_slots_.push_back(slot);
   return Status::OK();
 }
 
-Status MockAIOEngine::AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, char** cb) {
-  if (requests_.size() >= io_depth_) {
-    LOG(ERROR, "io depth full, please try again later, cur: {}", io_depth_);
+Status MockAIOEngine::AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size,
+                                IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  int32_t slot = AllocateSlot(kAsyncRead, offset, size, std::move(cb));
+  if (slot == -1) {
     return Status::Busy();
   }
-  requests_.push_back({.aio_req_ = {}, .type_ = kAsyncRead});
   auto ret = pread(fd, buffer, size, offset);
-  if (ret != size) {
+  if (ret != (ssize_t)size) {
     LOG(ERROR, "pread error : {}, offset: {}, fd : {}", strerror(errno), offset, fd);
+    CancelSlot(slot);
     return Status::IOError();
   }
+  slots_[slot].res_ = ret;
+  finished_slots_.push_back(slot);
+  return Status::OK();
+}
+
+Status MockAIOEngine::AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                                  IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  uint64_t total = 0;
+  for (auto& part : iov) {
+    total += part.iov_len;
+  }
+  int32_t slot = AllocateSlot(kAsyncWrite, offset, total, std::move(cb));
+  if (slot == -1) {
+    return Status::Busy();
+  }
+  auto ret = pwritev(fd, iov.data(), (int)iov.size(), (off_t)offset);
+  if (ret != (ssize_t)total) {
+    LOG(ERROR, "pwritev error : {}, offset: {}, fd : {}", strerror(errno), offset, fd);
+    CancelSlot(slot);
+    return Status::IOError();
+  }
+  slots_[slot].res_ = ret;
+  finished_slots_.push_back(slot);
   return Status::OK();
 }
 
 uint32_t MockAIOEngine::Poll() {
-  uint32_t cnt = requests_.size();
-  requests_.clear();
+  uint32_t cnt = 0;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    for (auto slot : finished_slots_) {
+      cnt += FinishSlot(slot, slots_[slot].res_);
+    }
+    finished_slots_.clear();
+  }
+  RunCallbacks();
   return cnt;
 }
 
+#ifndef __APPLE__
+namespace {
+inline int IOUringSetup(unsigned entries, struct io_uring_params* p) {
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+inline int IOUringEnter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0);
+}
+
+inline int IOUringRegister(int fd, unsigned opcode, void* arg, unsigned nr_args) {
+  return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// IORING_OP_READ/WRITE were added in 5.6, along with the probe, while io_uring itself is
+// available since 5.1. On the older kernels the requests would all fail with -EINVAL.
+// @return True if the ring supports all the opcodes the engine issues.
+bool IOUringSupportsOps(int ring_fd) {
+  const unsigned ops_len = 256;
+  std::vector<char> buf(sizeof(struct io_uring_probe) + ops_len * sizeof(struct io_uring_probe_op));
+  auto* probe = reinterpret_cast<struct io_uring_probe*>(buf.data());
+  if (IOUringRegister(ring_fd, IORING_REGISTER_PROBE, probe, ops_len) < 0) {
+    LOG(ERROR, "io_uring probe failed, err: {}", strerror(errno));
+    return false;
+  }
+  for (uint8_t op : {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_WRITEV}) {
+    if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+      LOG(ERROR, "io_uring opcode {} is not supported", op);
+      return false;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+IOUringEngine::IOUringEngine() {
+  struct io_uring_params params {};
+  ring_fd_ = IOUringSetup(kMaxIODepth, &params);
+  if (ring_fd_ == -1) {
+    LOG(ERROR, "io_uring_setup failed, err: {}", strerror(errno));
+    return;
+  }
+  if (!IOUringSupportsOps(ring_fd_)) {
+    close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+
+  sq_ring_sz_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_ring_sz_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  // Since kernel 5.4 both rings could be mapped with a single mmap call.
+  bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap) {
+    sq_ring_sz_ = cq_ring_sz_ = std::max(sq_ring_sz_, cq_ring_sz_);
+  }
+  sq_ring_ptr_ = mmap(nullptr, sq_ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_SQ_RING);
+  if (sq_ring_ptr_ == MAP_FAILED) {
+    LOG(ERROR, "io_uring mmap sq ring failed, err: {}", strerror(errno));
+    sq_ring_ptr_ = nullptr;
+    close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+  if (single_mmap) {
+    cq_ring_ptr_ = sq_ring_ptr_;
+  } else {
+    cq_ring_ptr_ = mmap(nullptr, cq_ring_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring_fd_, IORING_OFF_CQ_RING);
+    if (cq_ring_ptr_ == MAP_FAILED) {
+      LOG(ERROR, "io_uring mmap cq ring failed, err: {}", strerror(errno));
+      cq_ring_ptr_ = nullptr;
+      munmap(sq_ring_ptr_, sq_ring_sz_);
+      sq_ring_ptr_ = nullptr;
+      close(ring_fd_);
+      ring_fd_ = -1;
+      return;
+    }
+  }
+  sqes_sz_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  sqes_ = (struct io_uring_sqe*)mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring_fd_, IORING_OFF_SQES);
+  if (sqes_ == MAP_FAILED) {
+    LOG(ERROR, "io_uring mmap sqes failed, err: {}", strerror(errno));
+    sqes_ = nullptr;
+    if (!single_mmap) {
+      munmap(cq_ring_ptr_, cq_ring_sz_);
+    }
+    munmap(sq_ring_ptr_, sq_ring_sz_);
+    sq_ring_ptr_ = cq_ring_ptr_ = nullptr;
+    close(ring_fd_);
+    ring_fd_ = -1;
+    return;
+  }
+
+  char* sq_ptr = (char*)sq_ring_ptr_;
+  sq_head_ = (unsigned*)(sq_ptr + params.sq_off.head);
+  sq_tail_ = (unsigned*)(sq_ptr + params.sq_off.tail);
+  sq_mask_ = (unsigned*)(sq_ptr + params.sq_off.ring_mask);
+  sq_array_ = (unsigned*)(sq_ptr + params.sq_off.array);
+  char* cq_ptr = (char*)cq_ring_ptr_;
+  cq_head_ = (unsigned*)(cq_ptr + params.cq_off.head);
+  cq_tail_ = (unsigned*)(cq_ptr + params.cq_off.tail);
+  cq_mask_ = (unsigned*)(cq_ptr + params.cq_off.ring_mask);
+  cqes_ = (struct io_uring_cqe*)(cq_ptr + params.cq_off.cqes);
+
+  // The kernel may round up the entries, but we still respect the io depth through the slots.
+  LOG(INFO, "io_uring engine initialized, sq entries: {}, cq entries: {}", params.sq_entries,
+      params.cq_entries);
+}
+
+IOUringEngine::~IOUringEngine() {
+  if (ring_fd_ == -1) {
+    return;
+  }
+  while (GetInFlightRequests() > 0) {
+    Poll();
+  }
+  munmap(sqes_, sqes_sz_);
+  if (cq_ring_ptr_ != sq_ring_ptr_) {
+    munmap(cq_ring_ptr_, cq_ring_sz_);
+  }
+  munmap(sq_ring_ptr_, sq_ring_sz_);
+  close(ring_fd_);
+}
+
+Status IOUringEngine::AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
+                                 IOCallback cb) {
+  return PrepareRequest(IORING_OP_WRITE, fd, offset, const_cast<char*>(buffer), size, kAsyncWrite,
+                        std::move(cb));
+}
+
+Status IOUringEngine::AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size,
+                                IOCallback cb) {
+  return PrepareRequest(IORING_OP_READ, fd, offset, buffer, size, kAsyncRead, std::move(cb));
+}
+
+Status IOUringEngine::AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                                  IOCallback cb) {
+  uint64_t total = 0;
+  for (auto& part : iov) {
+    total += part.iov_len;
+  }
+  return PrepareRequest(IORING_OP_WRITEV, fd, offset, nullptr, total, kAsyncWrite, std::move(cb),
+                        &iov);
+}
+
+Status IOUringEngine::PrepareRequest(uint8_t opcode, int fd, uint64_t offset, char* buffer,
+                                     uint64_t size, IORequestType type, IOCallback&& cb,
+                                     const std::vector<struct iovec>* iov) {
+  if (ring_fd_ == -1) {
+    return Status::IOError("io_uring engine is not initialized");
+  }
+  std::lock_guard<std::mutex> lk(mtx_);
+  int32_t slot = AllocateSlot(type, offset, size, std::move(cb));
+  if (slot == -1) {
+    return Status::Busy();
+  }
+  uint64_t addr = (uint64_t)buffer;
+  uint32_t len = (uint32_t)size;
+  if (iov != nullptr) {
+    // The slot keeps the iovecs, so the caller's vector could be released after submission.
+    auto& iovecs = slots_[slot].iovecs_;
+    iovecs.assign(iov->begin(), iov->end());
+    addr = (uint64_t)iovecs.data();
+    len = (uint32_t)iovecs.size();
+  }
+
+  // Only the submitter touches the SQ tail, while the kernel updates the head.
+  unsigned tail = *sq_tail_;
+  unsigned idx = tail & *sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->off = offset;
+  sqe->addr = addr;
+  sqe->len = len;
+  sqe->user_data = slot;
+  sq_array_[idx] = idx;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+  to_submit_++;
+  return Status::OK();
+}
+
+uint32_t IOUringEngine::Submit() {
+  if (to_submit_ == 0) {
+    return 0;
+  }
+  int ret = IOUringEnter(ring_fd_, to_submit_, 0, 0);
+  if (ret < 0) {
+    // EAGAIN/EBUSY means the kernel is short of resources, retry on next Poll().
+    if (errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+      LOG(ERROR, "io_uring_enter failed, err: {}, to submit: {}", strerror(errno), to_submit_);
+    }
+    return 0;
+  }
+  to_submit_ -= ret;
+  return ret;
+}
+
+uint32_t IOUringEngine::Poll() {
+  if (ring_fd_ == -1) {
+    return 0;
+  }
+  uint32_t cnt = 0;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    Submit();
+
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+      uint32_t slot = (uint32_t)cqe->user_data;
+      int64_t res = cqe->res;
+      head++;
+
+      auto& req = slots_[slot];
+      if (res < 0) {
+        LOG(ERROR, "I/O failed, type: {}, errmsg: {}, offset: {}",
+            IORequest::GetTypeName(req.type_), strerror(-res), req.offset_);
+      } else if ((uint64_t)res != req.size_) {
+        LOG(ERROR, "I/O partially finished, type: {}, expect: {}, actual: {}, offset: {}",
+            IORequest::GetTypeName(req.type_), req.size_, res, req.offset_);
+        res = -EIO;
+      }
+      cnt += FinishSlot(slot, res);
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+  RunCallbacks();
+  return cnt;
+}
+
+uint32_t IOUringEngine::Wait(uint64_t timeout_us) {
+  if (ring_fd_ == -1) {
+    return 0;
+  }
+  bool ready;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    Submit();
+    ready = *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE) || in_flight_ == 0;
+  }
+  if (!ready) {
+    // The ring fd is readable once the CQ ring has any entry.
+    struct pollfd pfd {};
+    pfd.fd = ring_fd_;
+    pfd.events = POLLIN;
+    struct timespec ts = ToTimespec(timeout_us);
+    ppoll(&pfd, 1, &ts, nullptr);
+  }
+  return Poll();
+}
+#endif
+
 }  // namespace neodb
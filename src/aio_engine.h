@@ -1,50 +1,211 @@
 #pragma once
 #include <aio.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#ifndef __APPLE__
+#include <linux/io_uring.h>
+#endif
 
-#include <list>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <vector>
 
+#include "clock.h"
 #include "logger.h"
 #include "neodb/status.h"
 
 namespace neodb {
 
+// Completion callback of an async IO request, it will be invoked on both success and failure.
+// @param offset The device offset of the request.
+// @param res The transferred bytes on success, or a negative errno if the request failed.
+using IOCallback = std::function<void(uint64_t offset, int64_t res)>;
+
 enum IORequestType { kAsyncWrite, kAsyncRead };
+// A pre-allocated request slot, which will be reused once its request finished.
 struct IORequest {
-  // TODO change to a more generalize member variable instead of using posix aio data structure.
+  // Only used by the posix aio engine.
   struct aiocb aio_req_;
+  // Only used by the io_uring engine's vectored writes, which should be kept until finished.
+  std::vector<struct iovec> iovecs_;
   IORequestType type_;
-  std::function<void(uint64_t)> cb_;
+  IOCallback cb_;
+  uint64_t offset_ = 0;
+  uint64_t size_ = 0;
+  // Result of a finished request.
+  int64_t res_ = 0;
+  // Only recorded if the io depth is adaptive.
+  uint64_t submit_us_ = 0;
+  bool in_use_ = false;
+  bool done_ = false;
+  // Threads waiting on the request outside of the engine's lock, e.g. in aio_suspend. A slot
+  // finished meanwhile is parked until they all left, so it's never reused under a waiter.
+  uint32_t waiters_ = 0;
+  bool parked_ = false;
 
   static inline std::string GetTypeName(IORequestType type);
 };
 
 // An AIO Engine could be either io_uring, posix aio, libaio or spdk.
+// The engine is thread-safe, requests could be submitted and polled from different threads. The
+// callbacks are invoked by a thread that calls Poll(), outside of the engine's lock, so a callback
+// is free to submit new requests. Only one thread invokes the callbacks at a time, the finished
+// requests that other pollers reaped meanwhile are left to it, so a poller may return before its
+// callbacks ran.
+//
+// Requests are reaped as soon as they finished, regardless of their submission order. But the
+// write callbacks are always invoked in the submission order, so the callers could rely on the
+// write pointer order (e.g. an item that spans two IO buffers is only visible after both of them
+// were finished). Read callbacks are invoked immediately.
+//
+// The io depth could be adaptive, it's adjusted with AIMD on every `kDepthWindow` completions:
+// grow by one if the engine was nearly saturated and the latency stays close to the lowest one
+// ever seen, or shrink by a quarter if the average latency grew without any throughput gain,
+// which means the extra requests only queue up inside the device.
 class AIOEngine {
  public:
-  AIOEngine() = default;
+  AIOEngine() { InitSlots(); }
 
   virtual ~AIOEngine() = default;
 
   virtual Status AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
-                            const std::function<void(uint64_t)>& cb) = 0;
+                            IOCallback cb) = 0;
+
+  virtual Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size,
+                           IOCallback cb) = 0;
 
-  virtual Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, char** cb) = 0;
+  // Write multiple buffers to the continuous device range starts from `offset`. The callback is
+  // invoked once with the total size when all parts finished, or with the first error.
+  virtual Status AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                             IOCallback cb) = 0;
 
   // Poll the result and run the callback functions of each IO request.
   // @return The total number of finished IO requests.
   virtual uint32_t Poll() = 0;
 
-  virtual uint32_t GetInFlightRequests() { return requests_.size(); }
+  // Block until any request finished or timeout, then run the callbacks like Poll().
+  // The default one doesn't block and ignores the timeout, it's for the engines that finish the
+  // requests on submission, which have nothing to wait for.
+  // @return The total number of finished IO requests.
+  virtual uint32_t Wait(uint64_t /*timeout_us*/) { return Poll(); }
+
+  virtual uint32_t GetInFlightRequests() { return in_flight_; }
+
+  uint32_t GetIODepth() const { return io_depth_; }
+
+  // @param depth The maximum in-flight requests, or the initial one if adaptive.
+  void SetIODepth(uint32_t depth, bool adaptive);
+
+  // Replace the time source of the adaptive io depth.
+  virtual void SetClock(Clock* clock) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    clock_ = clock;
+  }
+
+  // @return The completed bytes per second of the latest adaptive window.
+  uint64_t GetThroughput() const { return throughput_; }
 
-  virtual bool Busy() { return requests_.size() >= io_depth_; }
+  virtual bool Busy() { return in_flight_ >= io_depth_; }
+
+  // The slab size, which is the upper bound of the adaptive io depth.
+  static constexpr uint32_t kMaxIODepth = 128;
+  static constexpr uint32_t kMinIODepth = 8;
 
  protected:
+  // A finished request whose callback is waiting to run.
+  struct Completion {
+    IOCallback cb_;
+    uint64_t offset_;
+    int64_t res_;
+  };
+
+  // Take a free request slot, should be called with `mtx_` held.
+  // @return The slot index, or -1 if the io depth is full.
+  int32_t AllocateSlot(IORequestType type, uint64_t offset, uint64_t size, IOCallback&& cb);
+
+  // Give back a slot whose request was never submitted, should be called with `mtx_` held.
+  void CancelSlot(uint32_t slot);
+
+  // @return The slots that could be allocated regardless of the io depth, some may be pinned by
+  // the waiters. Should be called with `mtx_` held.
+  uint32_t GetFreeSlotNum() const { return free_slots_.size(); }
+
+  // Mark a request finished and queue the deliverable callbacks, should be called with `mtx_`
+  // held.
+  // @return The number of successful requests that were queued.
+  uint32_t FinishSlot(uint32_t slot, int64_t res);
+
+  // Run the queued callbacks, should be called without holding `mtx_`. Only one thread runs them
+  // at a time, so they run in the queued order even if multiple threads poll. If another thread
+  // is running them, the queued ones are left to it.
+  void RunCallbacks();
+
+  // Pin the in-flight requests that will be waited on outside of `mtx_`, and unpin them after
+  // the wait, which frees the slots parked meanwhile. Both should be called with `mtx_` held.
+  void PinSlots(const std::vector<uint32_t>& slots);
+  void UnpinSlots(const std::vector<uint32_t>& slots);
+
   // maximum in-flight IO requests. If exceeded, we should wait.
-  int io_depth_ = 20;
+  std::atomic<uint32_t> io_depth_{20};
+
+  std::atomic<uint32_t> in_flight_{0};
+
+  // Protects the engine's request bookkeeping.
+  std::mutex mtx_;
+
+  // A fixed slab of request slots sized to `kMaxIODepth`, so there's no allocation per request.
+  std::vector<IORequest> slots_;
+
+  // The callbacks to run, in the order their requests were delivered, protected by `mtx_`.
+  std::deque<Completion> completions_;
+
+  // A thread is running the callbacks, protected by `mtx_`.
+  bool running_callbacks_ = false;
+
+ private:
+  void InitSlots();
+
+  // Feed a finished request to the depth controller, should be called with `mtx_` held.
+  void RecordCompletion(const IORequest& req);
+
+  // Adjust the io depth at the end of a window, should be called with `mtx_` held.
+  void AdaptIODepth(uint64_t now_us);
+
+  // Completions of each adaptive window.
+  static constexpr uint32_t kDepthWindow = 32;
+
+  // The latency is considered grown if it's this times of the lowest one.
+  static constexpr double kLatencyTolerance = 2.0;
+
+  bool adaptive_ = false;
 
-  std::list<IORequest> requests_;
+  Clock* clock_ = Clock::Default();
+
+  // Statistics of the current window.
+  uint64_t window_start_us_ = 0;
+  uint32_t window_completions_ = 0;
+  uint64_t window_bytes_ = 0;
+  uint64_t window_latency_us_ = 0;
+  uint32_t window_peak_in_flight_ = 0;
+
+  // Moving average of the window latency per page, so a single slow window won't shrink the
+  // depth.
+  double avg_latency_ = 0;
+
+  // Lowest average latency ever seen, it slowly drifts up so it could follow the device.
+  double min_latency_ = 0;
+
+  std::atomic<uint64_t> throughput_{0};
+
+  std::vector<uint32_t> free_slots_;
+
+  // In-flight write slots in their submission order, as a ring buffer.
+  std::vector<uint32_t> write_order_;
+  uint32_t write_order_head_ = 0;
+  uint32_t write_order_size_ = 0;
 };
 
 // aio.h wrapper
@@ -53,19 +214,32 @@ class PosixAIOEngine : public AIOEngine {
   PosixAIOEngine() = default;
 
   ~PosixAIOEngine() override {
-    while (Busy()) {
-      Poll();
+    while (GetInFlightRequests() > 0) {
+      Wait(1000);
     }
   }
 
   // TODO Zero-copy to DMA memory.
   Status AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
-                    const std::function<void(uint64_t)>& cb) override;
+                    IOCallback cb) override;
+
+  Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, IOCallback cb) override;
 
-  Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, char** cb) override;
+  // Posix aio has no vectored write, so each part is submitted as a separate request. The parts
+  // are only submitted if all of them could take a slot. If a part failed to submit, the parts
+  // before it are still written, and the callback reports the failure once they finished.
+  Status AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                     IOCallback cb) override;
 
-  // TODO Probably we should check the event by their submission order?
   uint32_t Poll() override;
+
+  // Wait on the in-flight requests with aio_suspend.
+  uint32_t Wait(uint64_t timeout_us) override;
+
+ private:
+  // Should be called with `mtx_` held.
+  Status Submit(IORequestType type, int fd, uint64_t offset, char* buffer, uint64_t size,
+                IOCallback&& cb);
 };
 
 // A MockAIOEngine uses sync IO to emulate the async engine.
@@ -76,18 +250,85 @@ class MockAIOEngine : public AIOEngine {
   ~MockAIOEngine() override = default;
 
   Status AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
-                    const std::function<void(uint64_t)>& cb) override;
+                    IOCallback cb) override;
 
-  Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, char** cb) override;
+  Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, IOCallback cb) override;
 
-  // The mock aio engine does nothing in Poll().
+  Status AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                     IOCallback cb) override;
+
+  // The IO was already done on submission, so we only run the callbacks here.
   uint32_t Poll() override;
+
+ private:
+  // Slots that were already finished but not yet polled.
+  std::vector<uint32_t> finished_slots_;
 };
 
 // libaio.h wrapper
 // class KernelAIOEngine : public AIOEngine {};
 
-// io_uring wrapper implementation
-// class IOUringEngine : public AIOEngine {};
+#ifndef __APPLE__
+// io_uring wrapper implementation, talks to the kernel through the raw syscalls so we don't need
+// liburing as a dependency.
+// Submissions are queued into the SQ ring and handed to the kernel in batch on the next Poll(),
+// completions are reaped from the CQ ring without any syscall.
+class IOUringEngine : public AIOEngine {
+ public:
+  IOUringEngine();
+
+  ~IOUringEngine() override;
+
+  // @return False if the kernel doesn't support io_uring or the opcodes we use (or it was
+  // disabled), the caller should fallback to another engine.
+  bool Valid() const { return ring_fd_ != -1; }
+
+  Status AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
+                    IOCallback cb) override;
+
+  Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, IOCallback cb) override;
+
+  Status AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                     IOCallback cb) override;
+
+  // Submit all queued requests and run the callbacks of the finished ones.
+  uint32_t Poll() override;
+
+  // Submit all queued requests and wait until the CQ ring is readable.
+  uint32_t Wait(uint64_t timeout_us) override;
+
+ private:
+  // @param iov The buffers of a vectored request, `buffer` is ignored if it's set.
+  Status PrepareRequest(uint8_t opcode, int fd, uint64_t offset, char* buffer, uint64_t size,
+                        IORequestType type, IOCallback&& cb,
+                        const std::vector<struct iovec>* iov = nullptr);
+
+  // Hand all queued SQEs to the kernel, should be called with `mtx_` held.
+  // @return The number of submitted requests.
+  uint32_t Submit();
+
+  int ring_fd_ = -1;
+
+  // Mapped ring memory, see io_uring_setup(2).
+  void* sq_ring_ptr_ = nullptr;
+  void* cq_ring_ptr_ = nullptr;
+  size_t sq_ring_sz_ = 0;
+  size_t cq_ring_sz_ = 0;
+  struct io_uring_sqe* sqes_ = nullptr;
+  size_t sqes_sz_ = 0;
+
+  unsigned* sq_head_ = nullptr;
+  unsigned* sq_tail_ = nullptr;
+  unsigned* sq_mask_ = nullptr;
+  unsigned* sq_array_ = nullptr;
+  unsigned* cq_head_ = nullptr;
+  unsigned* cq_tail_ = nullptr;
+  unsigned* cq_mask_ = nullptr;
+  struct io_uring_cqe* cqes_ = nullptr;
+
+  // SQEs that were queued but not yet submitted to the kernel.
+  uint32_t to_submit_ = 0;
+};
+#endif
 
 }  // namespace neodb
@@ -5,6 +5,7 @@
 #include <unistd.h>
 
 #include <memory>
+#include <thread>
 
 #include "utils.h"
 
@@ -67,7 +68,7 @@ TEST_F(IOEngineTest, MultipleAIOReadWriteTest) {
 
   // Write
   char* buffers[total_requests];
-  for (int i = 0; i < total_requests; ++i) {
+  for (uint32_t i = 0; i < total_requests; ++i) {
     posix_memalign((void**)&buffers[i], page_size, page_size);
     memset(buffers[i], 0, page_size);
     std::string data = std::to_string('a' + i);
@@ -87,7 +88,7 @@ TEST_F(IOEngineTest, MultipleAIOReadWriteTest) {
   // Sync Read
   char* buf = nullptr;
   posix_memalign((void**)&buf, page_size, page_size);
-  for (int i = 0; i < total_requests; ++i) {
+  for (uint32_t i = 0; i < total_requests; ++i) {
     memset(buf, 0, page_size);
     SyncRead(read_fd_, buf, i * page_size, page_size);
     std::string data = std::to_string('a' + i);
@@ -96,7 +97,7 @@ TEST_F(IOEngineTest, MultipleAIOReadWriteTest) {
   free(buf);
 
   // Async Read & Poll
-  for (int i = 0; i < total_requests; ++i) {
+  for (uint32_t i = 0; i < total_requests; ++i) {
     memset(buffers[i], 0, page_size);
     auto s = io_engine_->AsyncRead(read_fd_, i * page_size, buffers[i], page_size, nullptr);
     ASSERT_TRUE(s.ok());
@@ -110,10 +111,250 @@ TEST_F(IOEngineTest, MultipleAIOReadWriteTest) {
   }
   EXPECT_EQ(cnt, total_requests);
 
-  for (int i = 0; i < total_requests; ++i) {
+  for (uint32_t i = 0; i < total_requests; ++i) {
     std::string data = std::to_string('a' + i);
     EXPECT_EQ(data, std::string(buffers[i], data.size()));
     free(buffers[i]);
   }
 }
+
+TEST_F(IOEngineTest, WriteCompletionOrderTest) {
+  uint64_t page_size = 4UL << 10;
+  uint32_t total_requests = 20;
+  // The first write is much larger, so it's likely to finish after the later ones.
+  uint64_t large_size = 4UL << 20;
+
+  char* large_buf = nullptr;
+  posix_memalign((void**)&large_buf, page_size, large_size);
+  memset(large_buf, 'x', large_size);
+  std::vector<uint64_t> finished;
+  auto cb = [&](uint64_t offset, int64_t res) {
+    EXPECT_GT(res, 0);
+    finished.push_back(offset);
+  };
+  auto s = io_engine_->AsyncWrite(write_fd_, 0, large_buf, large_size, cb);
+  ASSERT_TRUE(s.ok());
+
+  std::vector<char*> buffers(total_requests - 1);
+  for (uint32_t i = 0; i < total_requests - 1; ++i) {
+    posix_memalign((void**)&buffers[i], page_size, page_size);
+    memset(buffers[i], 'a' + i, page_size);
+    s = io_engine_->AsyncWrite(write_fd_, large_size + i * page_size, buffers[i], page_size, cb);
+    ASSERT_TRUE(s.ok());
+  }
+  // All request slots are taken.
+  EXPECT_TRUE(io_engine_->Busy());
+  s = io_engine_->AsyncWrite(write_fd_, 0, large_buf, page_size, cb);
+  EXPECT_EQ(s.code(), Status::kIOBusy);
+
+  uint32_t cnt = 0;
+  while (cnt < total_requests) {
+    cnt += io_engine_->Poll();
+  }
+  ASSERT_EQ(finished.size(), total_requests);
+  EXPECT_EQ(finished[0], 0);
+  for (uint32_t i = 1; i < total_requests; ++i) {
+    EXPECT_EQ(finished[i], large_size + (i - 1) * page_size);
+  }
+  EXPECT_EQ(io_engine_->GetInFlightRequests(), 0);
+
+  // The slots should be reusable.
+  bool read_done = false;
+  s = io_engine_->AsyncRead(read_fd_, large_size, buffers[0], page_size,
+                            [&](uint64_t, int64_t res) {
+                              EXPECT_EQ(res, page_size);
+                              read_done = true;
+                            });
+  ASSERT_TRUE(s.ok());
+  while (!read_done) {
+    io_engine_->Poll();
+  }
+  EXPECT_EQ(buffers[0][0], 'a');
+
+  free(large_buf);
+  for (auto buf : buffers) {
+    free(buf);
+  }
+}
+
+TEST_F(IOEngineTest, ConcurrentPollersTest) {
+  uint64_t page_size = 4UL << 10;
+  uint32_t total_requests = 2000;
+  uint32_t batch = 16;
+  char* buf = nullptr;
+  posix_memalign((void**)&buf, page_size, page_size);
+  memset(buf, 'c', page_size);
+
+  // Multiple threads keep polling, while the write callbacks should still run one at a time in
+  // the submission order.
+  std::vector<uint64_t> finished;
+  std::atomic<uint32_t> running{0};
+  std::atomic<bool> overlapped{false};
+  auto cb = [&](uint64_t offset, int64_t res) {
+    if (running++ > 0) {
+      overlapped = true;
+    }
+    EXPECT_EQ(res, page_size);
+    finished.push_back(offset);
+    running--;
+  };
+  std::atomic<bool> stop{false};
+  std::vector<std::thread> pollers;
+  for (int t = 0; t < 4; ++t) {
+    pollers.emplace_back([&]() {
+      while (!stop) {
+        io_engine_->Poll();
+      }
+    });
+  }
+  for (uint32_t i = 0; i < total_requests; i += batch) {
+    for (uint32_t j = i; j < i + batch; ++j) {
+      while (!io_engine_->AsyncWrite(write_fd_, (j % 1024) * page_size, buf, page_size, cb).ok()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+  while (io_engine_->GetInFlightRequests() > 0) {
+    std::this_thread::yield();
+  }
+  stop = true;
+  for (auto& poller : pollers) {
+    poller.join();
+  }
+  io_engine_->Poll();
+  EXPECT_FALSE(overlapped);
+  ASSERT_EQ(finished.size(), total_requests);
+  for (uint32_t i = 0; i < total_requests; ++i) {
+    EXPECT_EQ(finished[i], (i % 1024) * page_size);
+  }
+  free(buf);
+}
+
+TEST_F(IOEngineTest, VectoredWriteTest) {
+  std::vector<std::unique_ptr<AIOEngine>> engines;
+  engines.push_back(std::move(io_engine_));
+#ifndef __APPLE__
+  auto uring = std::make_unique<IOUringEngine>();
+  if (uring->Valid()) {
+    engines.push_back(std::move(uring));
+  }
+#endif
+  uint64_t page_size = 4UL << 10;
+  uint32_t parts = 4;
+  for (auto& engine : engines) {
+    std::vector<char*> buffers(parts);
+    std::vector<struct iovec> iov;
+    for (uint32_t i = 0; i < parts; ++i) {
+      posix_memalign((void**)&buffers[i], page_size, page_size * (i + 1));
+      memset(buffers[i], 'a' + i, page_size * (i + 1));
+      iov.push_back({buffers[i], page_size * (i + 1)});
+    }
+    int64_t result = 0;
+    auto s = engine->AsyncWritev(write_fd_, page_size, iov,
+                                 [&](uint64_t, int64_t res) { result = res; });
+    ASSERT_TRUE(s.ok());
+    while (engine->GetInFlightRequests() > 0) {
+      engine->Poll();
+    }
+    EXPECT_EQ(result, page_size * 10);
+
+    char* buf = nullptr;
+    posix_memalign((void**)&buf, page_size, page_size * 10);
+    SyncRead(read_fd_, buf, page_size, page_size * 10);
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < parts; ++i) {
+      EXPECT_EQ(std::string(buf + pos, page_size * (i + 1)),
+                std::string(page_size * (i + 1), 'a' + i));
+      pos += page_size * (i + 1);
+      free(buffers[i]);
+    }
+    free(buf);
+  }
+}
+
+TEST_F(IOEngineTest, WaitTest) {
+  std::vector<std::unique_ptr<AIOEngine>> engines;
+  engines.push_back(std::move(io_engine_));
+#ifndef __APPLE__
+  auto uring = std::make_unique<IOUringEngine>();
+  if (uring->Valid()) {
+    engines.push_back(std::move(uring));
+  }
+#endif
+  uint64_t size = 4UL << 20;
+  char* buf = nullptr;
+  posix_memalign((void**)&buf, 4096, size);
+  memset(buf, 'w', size);
+  for (auto& engine : engines) {
+    bool done = false;
+    auto s = engine->AsyncWrite(write_fd_, 0, buf, size,
+                                [&](uint64_t, int64_t res) {
+                                  EXPECT_EQ(res, size);
+                                  done = true;
+                                });
+    ASSERT_TRUE(s.ok());
+    // Each Wait blocks until the write finished instead of spinning.
+    uint32_t rounds = 0;
+    while (!done) {
+      engine->Wait(1000000);
+      rounds++;
+    }
+    EXPECT_LE(rounds, 2);
+    EXPECT_EQ(engine->GetInFlightRequests(), 0);
+    // Nothing in flight, so it should return at once.
+    EXPECT_EQ(engine->Wait(1000000), 0);
+  }
+  free(buf);
+}
+
+#ifndef __APPLE__
+TEST_F(IOEngineTest, IOUringReadWriteTest) {
+  auto uring = std::make_unique<IOUringEngine>();
+  if (!uring->Valid()) {
+    GTEST_SKIP() << "io_uring is not supported";
+  }
+  io_engine_ = std::move(uring);
+  uint64_t page_size = 4UL << 10;
+  uint32_t total_requests = 16;
+
+  // Write & Poll, all callbacks should be invoked.
+  char* buffers[total_requests];
+  std::vector<uint64_t> finished;
+  for (uint32_t i = 0; i < total_requests; ++i) {
+    posix_memalign((void**)&buffers[i], page_size, page_size);
+    memset(buffers[i], 0, page_size);
+    std::string data = std::to_string('a' + i);
+    memcpy(buffers[i], data.c_str(), data.size());
+    auto s = io_engine_->AsyncWrite(write_fd_, i * page_size, buffers[i], page_size,
+                                    [&](uint64_t offset, int64_t res) {
+                                      EXPECT_EQ(res, page_size);
+                                      finished.push_back(offset);
+                                    });
+    EXPECT_TRUE(s.ok());
+  }
+  EXPECT_EQ(io_engine_->GetInFlightRequests(), total_requests);
+  uint32_t cnt = 0;
+  while (cnt < total_requests) {
+    cnt += io_engine_->Poll();
+  }
+  EXPECT_EQ(finished.size(), total_requests);
+  EXPECT_EQ(io_engine_->GetInFlightRequests(), 0);
+
+  // Async Read & Poll
+  for (uint32_t i = 0; i < total_requests; ++i) {
+    memset(buffers[i], 0, page_size);
+    auto s = io_engine_->AsyncRead(read_fd_, i * page_size, buffers[i], page_size, nullptr);
+    ASSERT_TRUE(s.ok());
+  }
+  cnt = 0;
+  while (cnt < total_requests) {
+    cnt += io_engine_->Poll();
+  }
+  for (uint32_t i = 0; i < total_requests; ++i) {
+    std::string data = std::to_string('a' + i);
+    EXPECT_EQ(data, std::string(buffers[i], data.size()));
+    free(buffers[i]);
+  }
+}
+#endif
 }  // namespace neodb
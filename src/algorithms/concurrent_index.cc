@@ -1,5 +1,7 @@
 #include "concurrent_index.h"
 
+#include <algorithm>
+
 #include "neodb/histogram.h"
 #include "utils.h"
 
@@ -11,6 +13,14 @@ Status ConcurrentArt::Put(const std::string& key, uint64_t value) {
   return art_trees_[idx].Put(key, value);
 }
 
+Status ConcurrentArt::Exchange(const std::string& key, uint64_t value, uint64_t* old_value) {
+  uint32_t idx = GetHashedIndex(key);
+  std::unique_lock<std::shared_mutex> lk(mutex_arr_[idx]);
+  auto s = art_trees_[idx].Get(key, old_value);
+  art_trees_[idx].Put(key, value);
+  return s;
+}
+
 Status ConcurrentArt::Get(const std::string& key, uint64_t* value) {
   uint32_t idx = GetHashedIndex(key);
   std::shared_lock<std::shared_mutex> lk(mutex_arr_[idx]);
@@ -29,6 +39,27 @@ Status ConcurrentArt::Delete(const std::string& key) {
   return art_trees_[idx].Delete(key);
 }
 
+Status ConcurrentArt::Delete(const std::string& key, uint64_t* value) {
+  uint32_t idx = GetHashedIndex(key);
+  std::unique_lock<std::shared_mutex> lk(mutex_arr_[idx]);
+  auto s = art_trees_[idx].Get(key, value);
+  if (!s.ok()) {
+    return s;
+  }
+  return art_trees_[idx].Delete(key);
+}
+
+Status ConcurrentArt::DeleteIfMatch(const std::string& key, uint64_t expected) {
+  uint32_t idx = GetHashedIndex(key);
+  std::unique_lock<std::shared_mutex> lk(mutex_arr_[idx]);
+  uint64_t value = 0;
+  auto s = art_trees_[idx].Get(key, &value);
+  if (!s.ok() || value != expected) {
+    return Status::NotFound();
+  }
+  return art_trees_[idx].Delete(key);
+}
+
 // Concurrent hash map implementations.
 
 Status ConcurrentHashMap::Put(const std::string& key, const std::shared_ptr<IOBuf>& value) {
@@ -38,10 +69,31 @@ Status ConcurrentHashMap::Put(const std::string& key, const std::shared_ptr<IOBu
   return Status::OK();
 }
 
+Status ConcurrentHashMap::MultiPut(
+    const std::vector<std::pair<std::string, std::shared_ptr<IOBuf>>>& items) {
+  // Sorted by (bucket, position), so the items' order is kept within each bucket.
+  std::vector<std::pair<uint32_t, uint32_t>> order;
+  order.reserve(items.size());
+  for (uint32_t i = 0; i < items.size(); ++i) {
+    order.emplace_back(GetHashedIndex(items[i].first), i);
+  }
+  std::sort(order.begin(), order.end());
+  for (uint32_t begin = 0; begin < order.size();) {
+    uint32_t idx = order[begin].first;
+    std::unique_lock<std::shared_mutex> lk(mutex_arr_[idx]);
+    auto& hashmap = hash_maps_[idx];
+    for (; begin < order.size() && order[begin].first == idx; ++begin) {
+      auto& item = items[order[begin].second];
+      hashmap[item.first] = item.second;
+    }
+  }
+  return Status::OK();
+}
+
 Status ConcurrentHashMap::Get(const std::string& key, std::shared_ptr<IOBuf>& value) {
   uint32_t idx = GetHashedIndex(key);
   std::shared_lock<std::shared_mutex> lk(mutex_arr_[idx]);
-  auto hashmap = hash_maps_[idx];
+  auto& hashmap = hash_maps_[idx];
   auto it = hashmap.find(key);
   if (it == hashmap.end()) {
     return Status::NotFound();
@@ -53,17 +105,30 @@ Status ConcurrentHashMap::Get(const std::string& key, std::shared_ptr<IOBuf>& va
 Status ConcurrentHashMap::Delete(const std::string& key) {
   uint32_t idx = GetHashedIndex(key);
   std::unique_lock<std::shared_mutex> lk(mutex_arr_[idx]);
-  auto hashmap = hash_maps_[idx];
+  auto& hashmap = hash_maps_[idx];
   if (hashmap.erase(key) > 0) {
     return Status::OK();
   }
   return Status::NotFound();
 }
 
+Status ConcurrentHashMap::DeleteIfMatch(const std::string& key,
+                                        const std::shared_ptr<IOBuf>& expected) {
+  uint32_t idx = GetHashedIndex(key);
+  std::unique_lock<std::shared_mutex> lk(mutex_arr_[idx]);
+  auto& hashmap = hash_maps_[idx];
+  auto it = hashmap.find(key);
+  if (it == hashmap.end() || it->second != expected) {
+    return Status::NotFound();
+  }
+  hashmap.erase(it);
+  return Status::OK();
+}
+
 bool ConcurrentHashMap::Exist(const std::string& key) {
   uint32_t idx = GetHashedIndex(key);
   std::shared_lock<std::shared_mutex> lk(mutex_arr_[idx]);
-  auto hashmap = hash_maps_[idx];
+  auto& hashmap = hash_maps_[idx];
   auto it = hashmap.find(key);
   if (it != hashmap.end()) {
     return true;
@@ -27,8 +27,18 @@ class ConcurrentArt {
 
   Status Get(const std::string& key, uint64_t* value);
 
+  // Put the key and take out the value it replaced.
+  // @return Status::NotFound() if the key didn't exist, the value is put anyway.
+  Status Exchange(const std::string& key, uint64_t value, uint64_t* old_value);
+
   Status Delete(const std::string& key);
 
+  // Delete the key and take out its value.
+  Status Delete(const std::string& key, uint64_t* value);
+
+  // Delete the key only if its value is still `expected`.
+  Status DeleteIfMatch(const std::string& key, uint64_t expected);
+
   bool Exist(const std::string& key);
 
  private:
@@ -53,10 +63,16 @@ class ConcurrentHashMap {
 
   Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value);
 
+  // Put the items with a single lock of each bucket, the later one wins for a duplicated key.
+  Status MultiPut(const std::vector<std::pair<std::string, std::shared_ptr<IOBuf>>>& items);
+
   Status Get(const std::string& key, std::shared_ptr<IOBuf>& value);
 
   Status Delete(const std::string& key);
 
+  // Delete the key only if its value is still `expected`.
+  Status DeleteIfMatch(const std::string& key, const std::shared_ptr<IOBuf>& expected);
+
   bool Exist(const std::string& key);
 
  private:
@@ -60,6 +60,22 @@ TEST_F(ConcurrentIndexTest, ArtIndexTest) {
   LOG(INFO, "ART Index Time Cost: {} us", t2 - t1);
 }
 
+TEST_F(ConcurrentIndexTest, HashMapMultiPutTest) {
+  ConcurrentHashMap hashmap(20);
+  std::vector<std::pair<std::string, std::shared_ptr<IOBuf>>> items;
+  for (int i = 0; i < 1000; ++i) {
+    items.emplace_back("key" + std::to_string(i), std::make_shared<IOBuf>(std::to_string(i)));
+  }
+  // The later one of a duplicated key wins.
+  items.emplace_back("key0", std::make_shared<IOBuf>("new"));
+  ASSERT_TRUE(hashmap.MultiPut(items).ok());
+  for (int i = 0; i < 1000; ++i) {
+    std::shared_ptr<IOBuf> value;
+    ASSERT_TRUE(hashmap.Get("key" + std::to_string(i), value).ok());
+    EXPECT_EQ(value->Data(), i == 0 ? "new" : std::to_string(i));
+  }
+}
+
 TEST_F(ConcurrentIndexTest, HashMapIndexTest) {
   LOG(INFO, "HashMapIndexTest...");
   auto t1 = TimeUtils::GetCurrentTimeInUs();
@@ -0,0 +1,231 @@
+#include "neodb/buffer_pool.h"
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#include "logger.h"
+
+namespace neodb {
+
+// Released buffers of a thread, they are handed to the shared free list once the thread exits.
+struct BufferPool::ThreadCache {
+  ~ThreadCache() {
+    auto& pool = BufferPool::Instance();
+    for (uint32_t cls = 0; cls < kClassNum; ++cls) {
+      for (auto* buf : bufs_[cls]) {
+        pool.ReleaseShared(buf, cls);
+      }
+    }
+  }
+
+  std::vector<char*> bufs_[kClassNum];
+
+  uint64_t bytes_ = 0;
+};
+
+BufferPool& BufferPool::Instance() {
+  // Never destroyed, so the thread caches could still be drained at exit.
+  static auto* pool = new BufferPool();
+  return *pool;
+}
+
+BufferPool::ThreadCache& BufferPool::GetThreadCache() {
+  thread_local ThreadCache cache;
+  return cache;
+}
+
+int32_t BufferPool::GetClass(uint64_t size) {
+  if (size > kMaxPooledSize) {
+    return -1;
+  }
+  uint32_t cls = 0;
+  while (GetClassSize(cls) < size) {
+    cls++;
+  }
+  return int32_t(cls);
+}
+
+char* BufferPool::Allocate(uint64_t size) {
+  int32_t cls = GetClass(size);
+  if (cls == -1) {
+    char* buf = nullptr;
+    if (posix_memalign((void**)&buf, IO_PAGE_SIZE, size) != 0) {
+      return nullptr;
+    }
+    return buf;
+  }
+  auto& cache = GetThreadCache();
+  auto& bufs = cache.bufs_[cls];
+  if (!bufs.empty()) {
+    char* buf = bufs.back();
+    bufs.pop_back();
+    cache.bytes_ -= GetClassSize(cls);
+    reused_num_++;
+    return buf;
+  }
+  return AllocateShared(cls);
+}
+
+void BufferPool::Release(char* buf, uint64_t size) {
+  if (buf == nullptr) {
+    return;
+  }
+  int32_t cls = GetClass(size);
+  if (cls == -1) {
+    free(buf);
+    return;
+  }
+  auto& cache = GetThreadCache();
+  if (cache.bytes_ + GetClassSize(cls) <= kThreadCacheBytes) {
+    cache.bufs_[cls].push_back(buf);
+    cache.bytes_ += GetClassSize(cls);
+    return;
+  }
+  ReleaseShared(buf, cls);
+}
+
+void BufferPool::SetCapacity(uint64_t bytes) {
+  capacity_ = bytes;
+  std::lock_guard<std::mutex> lk(mtx_);
+  // Free the largest buffers first, they are the cheapest to allocate again per byte.
+  for (int32_t cls = kClassNum - 1; cls >= 0 && cached_bytes_ > capacity_; --cls) {
+    auto& bufs = free_bufs_[cls];
+    std::vector<char*> kept;
+    while (!bufs.empty() && cached_bytes_ > capacity_) {
+      if (FreeLocked(bufs.back(), cls)) {
+        cached_bytes_ -= GetClassSize(cls);
+      } else {
+        kept.push_back(bufs.back());
+      }
+      bufs.pop_back();
+    }
+    bufs.insert(bufs.end(), kept.begin(), kept.end());
+  }
+}
+
+void BufferPool::Configure(uint64_t capacity, bool huge_pages) {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (configured_) {
+      if (capacity != capacity_ || huge_pages != huge_pages_) {
+        LOG(WARNING,
+            "The buffer pool was already configured, capacity: {}, huge pages: {}, ignore the "
+            "new capacity: {}, huge pages: {}",
+            capacity_.load(), huge_pages_.load(), capacity, huge_pages);
+      }
+      return;
+    }
+    configured_ = true;
+  }
+  EnableHugePages(huge_pages);
+  SetCapacity(capacity);
+}
+
+char* BufferPool::AllocateShared(uint32_t cls) {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (!free_bufs_[cls].empty()) {
+      char* buf = free_bufs_[cls].back();
+      free_bufs_[cls].pop_back();
+      cached_bytes_ -= GetClassSize(cls);
+      reused_num_++;
+      return buf;
+    }
+  }
+  char* buf = nullptr;
+  if (huge_pages_) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    buf = AllocateHugePages(cls);
+  }
+  if (buf == nullptr && posix_memalign((void**)&buf, IO_PAGE_SIZE, GetClassSize(cls)) != 0) {
+    return nullptr;
+  }
+  allocated_num_++;
+  return buf;
+}
+
+void BufferPool::ReleaseShared(char* buf, uint32_t cls) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  if (cached_bytes_ + GetClassSize(cls) <= capacity_ || !FreeLocked(buf, cls)) {
+    free_bufs_[cls].push_back(buf);
+    cached_bytes_ += GetClassSize(cls);
+  }
+}
+
+char* BufferPool::AllocateHugePages(uint32_t cls) {
+  uint64_t class_size = GetClassSize(cls);
+  uint64_t map_size = std::max(class_size, kHugePageSize);
+  char* addr = MapHugePages(map_size);
+  if (addr == nullptr) {
+    return nullptr;
+  }
+  huge_mappings_[addr] = map_size;
+  huge_page_bytes_ += map_size;
+  // Carve the rest of the mapping into the free list, the lower ones are taken first.
+  for (uint64_t offset = map_size - class_size; offset > 0; offset -= class_size) {
+    free_bufs_[cls].push_back(addr + offset);
+    cached_bytes_ += class_size;
+  }
+  return addr;
+}
+
+char* BufferPool::MapHugePages(uint64_t size) {
+#ifndef __APPLE__
+  static std::atomic<bool> hugetlb_failed{false};
+  if (!hugetlb_failed) {
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED) {
+      return static_cast<char*>(addr);
+    }
+    // Most likely no huge page was reserved, don't try again.
+    hugetlb_failed = true;
+    LOG(INFO, "No reserved huge page for the buffer pool, fallback to transparent huge pages");
+  }
+  // Map one more huge page, so the range could be aligned to the huge page size.
+  void* raw = mmap(nullptr, size + kHugePageSize, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED) {
+    LOG(ERROR, "Failed to map the buffer pool memory, size: {}, error: {}", size,
+        std::strerror(errno));
+    return nullptr;
+  }
+  auto start = reinterpret_cast<uintptr_t>(raw);
+  uintptr_t aligned = (start + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+  if (aligned > start) {
+    munmap(raw, aligned - start);
+  }
+  munmap(reinterpret_cast<void*>(aligned + size), start + kHugePageSize - aligned);
+  auto* addr = reinterpret_cast<char*>(aligned);
+  static std::atomic<bool> thp_failed{false};
+  if (madvise(addr, size, MADV_HUGEPAGE) != 0 && !thp_failed.exchange(true)) {
+    LOG(WARNING, "Transparent huge pages are not available, error: {}", std::strerror(errno));
+  }
+  return addr;
+#else
+  return nullptr;
+#endif
+}
+
+bool BufferPool::FreeLocked(char* buf, uint32_t cls) {
+  auto it = huge_mappings_.upper_bound(buf);
+  if (it != huge_mappings_.begin()) {
+    --it;
+    if (buf < it->first + it->second) {
+      // Only a buffer that has its own mapping could be unmapped.
+      if (it->first != buf || it->second != GetClassSize(cls)) {
+        return false;
+      }
+      munmap(buf, it->second);
+      huge_page_bytes_ -= it->second;
+      huge_mappings_.erase(it);
+      return true;
+    }
+  }
+  free(buf);
+  return true;
+}
+}  // namespace neodb
@@ -0,0 +1,144 @@
+#include "neodb/buffer_pool.h"
+
+#include <cstring>
+#include <memory>
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "neodb/io_buf.h"
+#include "utils.h"
+
+namespace neodb {
+class BufferPoolTest : public ::testing::Test {
+ public:
+  void SetUp() override { InitLogger(); }
+
+  void TearDown() override {}
+};
+
+TEST_F(BufferPoolTest, ReuseTest) {
+  auto& pool = BufferPool::Instance();
+  // A released buffer is served again to the same size class, regardless of the exact size.
+  char* buf = pool.Allocate(3 * IO_PAGE_SIZE);
+  ASSERT_NE(buf, nullptr);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(buf) % IO_PAGE_SIZE, 0);
+  pool.Release(buf, 3 * IO_PAGE_SIZE);
+  uint64_t allocated = pool.GetAllocatedNum();
+  uint64_t reused = pool.GetReusedNum();
+  EXPECT_EQ(pool.Allocate(4 * IO_PAGE_SIZE), buf);
+  EXPECT_EQ(pool.GetAllocatedNum(), allocated);
+  EXPECT_EQ(pool.GetReusedNum(), reused + 1);
+
+  // Another size class never takes it.
+  char* other = pool.Allocate(8 * IO_PAGE_SIZE);
+  EXPECT_NE(other, buf);
+  pool.Release(other, 8 * IO_PAGE_SIZE);
+  pool.Release(buf, 4 * IO_PAGE_SIZE);
+
+  // Large buffers bypass the pool.
+  allocated = pool.GetAllocatedNum();
+  char* large = pool.Allocate(BufferPool::kMaxPooledSize + IO_PAGE_SIZE);
+  ASSERT_NE(large, nullptr);
+  pool.Release(large, BufferPool::kMaxPooledSize + IO_PAGE_SIZE);
+  EXPECT_EQ(pool.GetAllocatedNum(), allocated);
+}
+
+TEST_F(BufferPoolTest, SharedCacheTest) {
+  auto& pool = BufferPool::Instance();
+  // The buffers beyond the thread cache go to the shared free list, and the cache of an exited
+  // thread is drained into it, both are capped by the capacity.
+  pool.SetCapacity(8 * BufferPool::kMaxPooledSize);
+  std::thread([&]() {
+    std::vector<char*> bufs;
+    for (int i = 0; i < 4; ++i) {
+      bufs.push_back(pool.Allocate(BufferPool::kMaxPooledSize));
+    }
+    for (auto* buf : bufs) {
+      pool.Release(buf, BufferPool::kMaxPooledSize);
+    }
+  }).join();
+  EXPECT_EQ(pool.GetCachedBytes(), 4 * BufferPool::kMaxPooledSize);
+
+  // Another thread could take them.
+  uint64_t allocated = pool.GetAllocatedNum();
+  std::thread([&]() {
+    char* buf = pool.Allocate(BufferPool::kMaxPooledSize);
+    pool.Release(buf, BufferPool::kMaxPooledSize);
+  }).join();
+  EXPECT_EQ(pool.GetAllocatedNum(), allocated);
+
+  pool.SetCapacity(BufferPool::kMaxPooledSize);
+  EXPECT_EQ(pool.GetCachedBytes(), BufferPool::kMaxPooledSize);
+  pool.SetCapacity(256UL << 20);
+}
+
+TEST_F(BufferPoolTest, HugePageTest) {
+  auto& pool = BufferPool::Instance();
+  pool.EnableHugePages(true);
+  // The 2MB buffers have their own mappings, aligned to the huge page size.
+  std::vector<char*> bufs;
+  for (int i = 0; i < 3; ++i) {
+    bufs.push_back(pool.Allocate(BufferPool::kHugePageSize));
+    ASSERT_NE(bufs.back(), nullptr);
+    EXPECT_EQ(reinterpret_cast<uintptr_t>(bufs.back()) % BufferPool::kHugePageSize, 0);
+    memset(bufs.back(), 1, BufferPool::kHugePageSize);
+  }
+  EXPECT_EQ(pool.GetHugePageBytes(), 3 * BufferPool::kHugePageSize);
+
+  // Smaller buffers are carved from a shared mapping, and the rest of it is kept for reuse.
+  uint64_t allocated = pool.GetAllocatedNum();
+  char* small = pool.Allocate(64UL << 10);
+  ASSERT_NE(small, nullptr);
+  EXPECT_EQ(pool.GetHugePageBytes(), 4 * BufferPool::kHugePageSize);
+  char* next = pool.Allocate(64UL << 10);
+  EXPECT_EQ(next, small + (64UL << 10));
+  EXPECT_EQ(pool.GetAllocatedNum(), allocated + 1);
+
+  // Only the buffers with their own mappings are unmapped over the capacity.
+  pool.SetCapacity(0);
+  std::thread([&]() {
+    for (auto* buf : bufs) {
+      pool.Release(buf, BufferPool::kHugePageSize);
+    }
+  }).join();
+  pool.Release(next, 64UL << 10);
+  pool.Release(small, 64UL << 10);
+  EXPECT_EQ(pool.GetHugePageBytes(), BufferPool::kHugePageSize);
+  pool.EnableHugePages(false);
+  pool.SetCapacity(256UL << 20);
+}
+
+TEST_F(BufferPoolTest, ConfigureOnceTest) {
+  auto& pool = BufferPool::Instance();
+  // The first DB's options win, a later DB in the same process cannot change the pool.
+  pool.Configure(128UL << 20, false);
+  EXPECT_EQ(pool.GetCapacity(), 128UL << 20);
+  pool.Configure(0, true);
+  EXPECT_EQ(pool.GetCapacity(), 128UL << 20);
+  EXPECT_FALSE(pool.HugePagesEnabled());
+  pool.SetCapacity(256UL << 20);
+}
+
+TEST_F(BufferPoolTest, IOBufTest) {
+  auto& pool = BufferPool::Instance();
+  char* ptr = nullptr;
+  {
+    auto buf = std::make_shared<IOBuf>(100);
+    EXPECT_EQ(buf->Capacity(), IO_PAGE_SIZE);
+    buf->Append("1234567890");
+    buf->Shrink(2, 4);
+    EXPECT_EQ(buf->Data(), "3456");
+    ptr = buf->Buffer() - 2;
+  }
+  // The shrunk buffer is given back as a whole.
+  uint64_t reused = pool.GetReusedNum();
+  IOBuf buf(IO_PAGE_SIZE);
+  EXPECT_EQ(buf.Buffer(), ptr);
+  EXPECT_EQ(pool.GetReusedNum(), reused + 1);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+}  // namespace neodb
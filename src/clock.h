@@ -0,0 +1,54 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+namespace neodb {
+
+// A monotonic time source in microseconds. The rate limiters, the IO scheduler, the adaptive io
+// depth and the simulated device read the time from it, so the tests could drive them with a
+// manual clock instead of the wall clock.
+class Clock {
+ public:
+  virtual ~Clock() = default;
+
+  virtual uint64_t NowInUs() = 0;
+
+  virtual void SleepForUs(uint64_t us) = 0;
+
+  // @return The process-wide steady clock.
+  static Clock* Default();
+};
+
+class SteadyClock : public Clock {
+ public:
+  uint64_t NowInUs() override {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+  }
+
+  void SleepForUs(uint64_t us) override {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+  }
+};
+
+// A clock that only moves when it's advanced, sleeping on it returns at once.
+class ManualClock : public Clock {
+ public:
+  uint64_t NowInUs() override { return now_us_; }
+
+  void SleepForUs(uint64_t us) override { now_us_ += us; }
+
+  void Advance(uint64_t us) { now_us_ += us; }
+
+ private:
+  std::atomic<uint64_t> now_us_{1000000};
+};
+
+inline Clock* Clock::Default() {
+  static SteadyClock clock;
+  return &clock;
+}
+}  // namespace neodb
@@ -0,0 +1,125 @@
+#include "discard_queue.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "logger.h"
+
+namespace neodb {
+
+DiscardQueue::DiscardQueue(DiscardFunc discard) : discard_(std::move(discard)) {
+  worker_ = std::thread([this]() { Run(); });
+}
+
+DiscardQueue::~DiscardQueue() {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    stopped_ = true;
+  }
+  cv_.notify_all();
+  worker_.join();
+}
+
+void DiscardQueue::Submit(uint64_t offset, uint64_t size) {
+  if (size == 0) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    // Merge with the adjacent ranges, so they could be discarded with a single command.
+    auto next = pending_.lower_bound(offset);
+    if (next != pending_.begin()) {
+      auto prev = std::prev(next);
+      if (prev->first + prev->second == offset) {
+        offset = prev->first;
+        size += prev->second;
+        pending_.erase(prev);
+      }
+    }
+    if (next != pending_.end() && offset + size == next->first) {
+      size += next->second;
+      pending_.erase(next);
+    }
+    pending_[offset] = size;
+    pending_num_ = pending_.size() + (discarding_size_ > 0 ? 1 : 0);
+  }
+  cv_.notify_all();
+}
+
+void DiscardQueue::WaitForRange(uint64_t offset, uint64_t size) {
+  if (pending_num_ == 0) {
+    return;
+  }
+  std::unique_lock<std::mutex> lk(mtx_);
+  if (!Overlapped(offset, size)) {
+    return;
+  }
+  waiters_++;
+  cv_.notify_all();
+  cv_.wait(lk, [&]() { return !Overlapped(offset, size); });
+  waiters_--;
+}
+
+void DiscardQueue::WaitForAll() {
+  std::unique_lock<std::mutex> lk(mtx_);
+  waiters_++;
+  cv_.notify_all();
+  cv_.wait(lk, [&]() { return pending_.empty() && discarding_size_ == 0; });
+  waiters_--;
+}
+
+uint64_t DiscardQueue::GetPendingBytes() {
+  std::lock_guard<std::mutex> lk(mtx_);
+  uint64_t bytes = discarding_size_;
+  for (auto& range : pending_) {
+    bytes += range.second;
+  }
+  return bytes;
+}
+
+bool DiscardQueue::Overlapped(uint64_t offset, uint64_t size) const {
+  if (discarding_size_ > 0 && offset < discarding_offset_ + discarding_size_ &&
+      discarding_offset_ < offset + size) {
+    return true;
+  }
+  // The first range that ends after `offset` is the only candidate, since they never overlap.
+  auto it = pending_.upper_bound(offset);
+  if (it != pending_.begin() && std::prev(it)->first + std::prev(it)->second > offset) {
+    return true;
+  }
+  return it != pending_.end() && it->first < offset + size;
+}
+
+void DiscardQueue::Run() {
+  std::unique_lock<std::mutex> lk(mtx_);
+  while (true) {
+    cv_.wait(lk, [&]() { return stopped_ || !pending_.empty(); });
+    if (pending_.empty()) {
+      // Stopped and drained.
+      return;
+    }
+    // Pace the discards unless a writer is blocked by them, or the queue is stopping.
+    uint64_t wait_us;
+    while (waiters_ == 0 && !stopped_ && (wait_us = limiter_.GetWaitTimeUs()) > 0) {
+      cv_.wait_for(lk, std::chrono::microseconds(wait_us));
+    }
+    // The lowest range first, new adjacent ranges may have been merged into it while waiting.
+    auto it = pending_.begin();
+    discarding_offset_ = it->first;
+    discarding_size_ = it->second;
+    pending_.erase(it);
+    limiter_.Consume(discarding_size_);
+
+    lk.unlock();
+    discard_(discarding_offset_, discarding_size_);
+    discard_num_++;
+    discarded_bytes_ += discarding_size_;
+    LOG(DEBUG, "Discarded range, offset: {}, size: {}", discarding_offset_, discarding_size_);
+    lk.lock();
+
+    discarding_size_ = 0;
+    pending_num_ = pending_.size();
+    cv_.notify_all();
+  }
+}
+}  // namespace neodb
@@ -0,0 +1,84 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include "neodb/options.h"
+#include "rate_limiter.h"
+
+namespace neodb {
+
+// DiscardQueue issues the discards of reset zones from a background thread, so a reset could be
+// recorded at once without waiting for the device.
+//
+// Adjacent ranges are merged into a single discard, and the discards are paced by a token bucket
+// so they won't compete with the foreground IO. A range should never be written while its discard
+// is still pending, the writers should call WaitForRange() first, which also lets the pending
+// discards skip the rate limit.
+class DiscardQueue {
+ public:
+  // Discard the device range synchronously.
+  using DiscardFunc = std::function<void(uint64_t offset, uint64_t size)>;
+
+  explicit DiscardQueue(DiscardFunc discard);
+
+  // All pending discards are issued before the queue is destroyed.
+  ~DiscardQueue();
+
+  void Submit(uint64_t offset, uint64_t size);
+
+  // Block until no pending discard overlaps the range.
+  void WaitForRange(uint64_t offset, uint64_t size);
+
+  // Block until all pending discards finished.
+  void WaitForAll();
+
+  void SetRateLimit(const RateLimit& limit) {
+    limiter_.SetLimit(limit.bytes_per_sec_, limit.iops_);
+  }
+
+  uint64_t GetPendingBytes();
+
+  // @return The number of discards that were issued to the device.
+  uint64_t GetDiscardNum() const { return discard_num_; }
+
+  uint64_t GetDiscardedBytes() const { return discarded_bytes_; }
+
+ private:
+  void Run();
+
+  // Should be called with `mtx_` held.
+  bool Overlapped(uint64_t offset, uint64_t size) const;
+
+  DiscardFunc discard_;
+
+  std::mutex mtx_;
+  std::condition_variable cv_;
+
+  // Merged ranges that are not yet issued, offset -> size.
+  std::map<uint64_t, uint64_t> pending_;
+
+  // The range that is being discarded, size 0 means none.
+  uint64_t discarding_offset_ = 0;
+  uint64_t discarding_size_ = 0;
+
+  // Number of writers that are blocked by the pending discards.
+  uint32_t waiters_ = 0;
+
+  // Fast path for the writers, so they don't take the lock if nothing is pending.
+  std::atomic<uint32_t> pending_num_{0};
+
+  RateLimiter limiter_;
+
+  std::atomic<uint64_t> discard_num_{0};
+  std::atomic<uint64_t> discarded_bytes_{0};
+
+  bool stopped_ = false;
+
+  std::thread worker_;
+};
+}  // namespace neodb
@@ -18,7 +18,7 @@ std::shared_ptr<Zone> GC::SelectGCCandidate(const std::vector<std::shared_ptr<Zo
   uint64_t max_expired_bytes = 0;
   for (const auto& zone : zones) {
     oldest_finish_age = std::max(oldest_finish_age, (now - zone->finish_time_us_));
-    max_expired_bytes = std::max(zone->expired_bytes_, max_expired_bytes);
+    max_expired_bytes = std::max(zone->expired_bytes_.load(), max_expired_bytes);
   }
 
   // Loop calculate scores of each zone.
@@ -9,11 +9,35 @@
 #include "neodb/status.h"
 
 namespace neodb {
-void Index::Put(const std::string& key, const Index::ValueVariant& value) {
+bool Index::Put(const std::string& key, const Index::ValueVariant& value, LBAValue* replaced) {
+  LBAValue old_value = 0;
+  Status s = Status::OK();
   if (std::holds_alternative<LBAValue>(value)) {
-    lba_index_->Put(key, std::get<LBAValue>(value));
+    s = lba_index_->Exchange(key, std::get<LBAValue>(value), &old_value);
+    // The buffered version is expired by its flush, which finds it replaced.
+    mem_index_->Delete(key);
   } else {
+    // The memory value is put first, so the key is always found.
     mem_index_->Put(key, std::get<MemValue>(value));
+    s = lba_index_->Delete(key, &old_value);
+  }
+  if (!s.ok()) {
+    return false;
+  }
+  if (replaced != nullptr) {
+    *replaced = old_value;
+  }
+  return true;
+}
+
+void Index::MultiPut(const std::vector<std::pair<std::string, MemValue>>& items,
+                     std::vector<LBAValue>* replaced) {
+  mem_index_->MultiPut(items);
+  for (auto& item : items) {
+    LBAValue old_value = 0;
+    if (lba_index_->Delete(item.first, &old_value).ok() && replaced != nullptr) {
+      replaced->push_back(old_value);
+    }
   }
 }
 
@@ -46,10 +70,27 @@ bool Index::Update(const std::string& key, const Index::ValueVariant& value) {
   return false;
 }
 
+bool Index::UpdateIfMatch(const std::string& key, const Index::MemValue& expected,
+                          Index::LBAValue value, std::vector<LBAValue>* replaced) {
+  if (!mem_index_->DeleteIfMatch(key, expected).ok()) {
+    return false;
+  }
+  // An older version could be put by a flush that raced with the overwrite.
+  LBAValue old_value = 0;
+  if (lba_index_->Exchange(key, value, &old_value).ok() && replaced != nullptr) {
+    replaced->push_back(old_value);
+  }
+  return true;
+}
+
 bool Index::Delete(const std::string& key) {
   return lba_index_->Delete(key).ok() || mem_index_->Delete(key).ok();
 }
 
+bool Index::DeleteIfMatch(const std::string& key, Index::LBAValue value) {
+  return lba_index_->DeleteIfMatch(key, value).ok();
+}
+
 bool Index::Exist(const std::string& key) {
   return lba_index_->Exist(key) || mem_index_->Exist(key);
 }
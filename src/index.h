@@ -6,8 +6,10 @@
 #include <string>
 #include <utility>
 #include <variant>
+#include <vector>
 
 #include "algorithms/concurrent_index.h"
+#include "neodb/definitions.h"
 #include "neodb/io_buf.h"
 #include "neodb/status.h"
 
@@ -18,7 +20,7 @@ class Index {
   // Memory index value.
   using MemValue = std::shared_ptr<IOBuf>;
   // LBA index value, colored pointer.
-  // [7 bits, target item's size indicator, maximum 512KB]
+  // [7 bits, target item's size indicator in 4KB pages, maximum 512KB, 0 means unknown]
   // [1 bit, pinned or not]
   // [11 access frequency indicator]
   // [45 bits, LBA, maximum: 32TB]
@@ -26,6 +28,31 @@ class Index {
   // Index could possibly point to either memory or lba.
   using ValueVariant = std::variant<MemValue, LBAValue>;
 
+  // Encode the LBA and its item's aligned read size (starts from the LBA's page) into an index
+  // value. Items larger than 508KB are encoded with an unknown size (0).
+  static LBAValue EncodeLBAValue(uint64_t lba, uint64_t item_read_size) {
+    uint64_t pages = (item_read_size + IO_PAGE_SIZE - 1) / IO_PAGE_SIZE;
+    if (pages > kItemSizeMask) {
+      pages = 0;
+    }
+    return (pages << kItemSizeShift) | (lba & kLBAMask);
+  }
+
+  static uint64_t DecodeLBA(LBAValue value) { return value & kLBAMask; }
+
+  // Move the item's LBA by `delta` bytes, its read size is kept.
+  static LBAValue MoveLBAValue(LBAValue value, int64_t delta) {
+    return (value & ~kLBAMask) | ((DecodeLBA(value) + delta) & kLBAMask);
+  }
+
+  // Largest item read size that could be encoded, 508KB.
+  static constexpr uint64_t kMaxItemReadSize = 127 * IO_PAGE_SIZE;
+
+  // @return The aligned read size of the item, or 0 if it's unknown.
+  static uint64_t DecodeItemReadSize(LBAValue value) {
+    return ((value >> kItemSizeShift) & kItemSizeMask) * IO_PAGE_SIZE;
+  }
+
  public:
   Index() {
     mem_index_ = std::make_unique<ConcurrentHashMap>(20);
@@ -33,19 +60,42 @@ class Index {
   }
   ~Index() = default;
 
-  void Put(const std::string& key, const ValueVariant& value);
+  // A key is either in memory or on the device, putting one of them drops the other, so the
+  // flushed version replaced by an overwrite is reported to only one of the racing writers.
+  // @param replaced Set to the replaced flushed version, which should be expired.
+  // @return True if a flushed version was replaced.
+  bool Put(const std::string& key, const ValueVariant& value, LBAValue* replaced = nullptr);
+
+  // Put the memory values in a batch, the later one wins for a duplicated key.
+  // @param replaced Appended with the replaced flushed versions.
+  void MultiPut(const std::vector<std::pair<std::string, MemValue>>& items,
+                std::vector<LBAValue>* replaced = nullptr);
 
   Status Get(const std::string& key, ValueVariant& value);
 
   bool Update(const std::string& key, const ValueVariant& value);
 
+  // Move a flushed key to its LBA, only if the key still refers to the flushed memory value.
+  // @param replaced Appended with the flushed version that was replaced, if any.
+  // @return False if the key was deleted or overwritten.
+  bool UpdateIfMatch(const std::string& key, const MemValue& expected, LBAValue value,
+                     std::vector<LBAValue>* replaced = nullptr);
+
   bool Delete(const std::string& key);
 
+  // Delete the key only if it still refers to the item at `value`, so the key's newer version
+  // won't be dropped along with an old one.
+  bool DeleteIfMatch(const std::string& key, LBAValue value);
+
   bool Exist(const std::string& key);
 
   bool ExistInLBA(const std::string& key);
 
  private:
+  static constexpr uint64_t kLBAMask = (1UL << 45) - 1;
+  static constexpr uint64_t kItemSizeShift = 57;
+  static constexpr uint64_t kItemSizeMask = (1UL << 7) - 1;
+
   std::unique_ptr<ConcurrentHashMap> mem_index_;
   //  tbb::concurrent_hash_map<std::string, std::shared_ptr<IOBuf> > mem_index_;
   //  std::unordered_map<std::string, std::shared_ptr<IOBuf>> mem_index_;
@@ -3,6 +3,9 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#ifndef __APPLE__
+#include <linux/fs.h>
+#endif
 
 #include "logger.h"
 #include "neodb/io_buf.h"
@@ -12,40 +15,54 @@ namespace neodb {
 
 Status FileIOHandle::Write(uint64_t offset, std::shared_ptr<IOBuf> data) {
   uint32_t buf_sz = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
+  discard_queue_->WaitForRange(offset, buf_sz);
+  io_scheduler_->AcquireRateLimit(kFlush, buf_sz);
   uint64_t ret = pwrite(write_fd_, data->Buffer(), buf_sz, int64_t(offset));
   if (ret != buf_sz) {
     LOG(ERROR, "Failed to write data, ret: {}, msg: {} ", ret, std::strerror(errno));
     return Status::IOError("Write failed!");
   }
+  DropPageCache(write_fd_, write_mode_, offset, buf_sz);
   return Status::OK();
 }
 
 Status FileIOHandle::AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data,
-                                const std::function<void(uint64_t)>& cb) {
-  // If the engine's io depth is full.
-  while (aio_engine_->Busy()) {
-    aio_engine_->Poll();
-  }
-
+                                const IOCallback& cb, IOClass io_class) {
   uint32_t buf_sz = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
-  auto s = aio_engine_->AsyncWrite(write_fd_, offset, data->Buffer(), buf_sz, cb);
-
+  discard_queue_->WaitForRange(offset, buf_sz);
+  auto s = io_scheduler_->AsyncWrite(io_class, write_fd_, offset, data->Buffer(), buf_sz,
+                                     WrapWriteCallback(cb));
   if (!s.ok()) {
     LOG(ERROR, "Failed to write data, code: {}, msg: {} ", s.code(), s.msg());
-    return Status::IOError("Write failed!");
+    return s;
   }
-  aio_engine_->Poll();
   return Status::OK();
 }
 
 Status FileIOHandle::ReadAppend(uint64_t offset, uint32_t size, std::shared_ptr<IOBuf> data) {
   assert(data->AvailableSize() >= size);
+  if (read_mode_ == kDirectIO &&
+      (offset % IO_PAGE_SIZE != 0 || size % IO_PAGE_SIZE != 0 ||
+       reinterpret_cast<uintptr_t>(data->Buffer()) % IO_PAGE_SIZE != 0)) {
+    // O_DIRECT requires aligned offset, size and memory, so we read the covering pages into an
+    // aligned buffer first.
+    uint64_t aligned_offset = offset / IO_PAGE_SIZE * IO_PAGE_SIZE;
+    auto aligned = std::make_shared<IOBuf>(offset - aligned_offset + size);
+    auto s = Read(aligned_offset, aligned);
+    if (!s.ok()) {
+      return s;
+    }
+    memcpy(data->Buffer(), aligned->Buffer() + (offset - aligned_offset), size);
+    data->IncreaseSize(size);
+    return Status::OK();
+  }
   uint64_t ret = pread(read_fd_, data->Buffer(), size, int64_t(offset));
   data->IncreaseSize(size);
   if (ret != size) {
     LOG(ERROR, "Failed to read data: {} ", std::strerror(errno));
     return Status::IOError("Read failed!");
   }
+  DropPageCache(read_fd_, read_mode_, offset, size);
   return Status::OK();
 }
 
@@ -58,6 +75,27 @@ Status FileIOHandle::Read(uint64_t offset, std::shared_ptr<IOBuf> data) {
     return Status::IOError(std::strerror(errno));
   }
   data->IncreaseSize(ret);
+  DropPageCache(read_fd_, read_mode_, offset, ret);
+  return Status::OK();
+}
+
+Status FileIOHandle::AsyncRead(uint64_t offset, const std::shared_ptr<IOBuf>& data,
+                               const IOCallback& cb, IOClass io_class) {
+  assert(data->Capacity() % IO_PAGE_SIZE == 0);
+  auto read_cb = [this, data, cb](uint64_t offset, int64_t res) {
+    if (res > 0) {
+      data->IncreaseSize(res);
+      DropPageCache(read_fd_, read_mode_, offset, res);
+    }
+    cb(offset, res);
+  };
+  auto s = io_scheduler_->AsyncRead(io_class, read_fd_, offset, data->Buffer(), data->Capacity(),
+                                    read_cb);
+  if (!s.ok()) {
+    LOG(ERROR, "Failed to submit read, msg: {}, offset: {}, read_sz: {}", s.msg(), offset,
+        data->Capacity());
+    return s;
+  }
   return Status::OK();
 }
 
@@ -72,14 +110,63 @@ Status FileIOHandle::AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t siz
   return Status::OK();
 }
 
-//Status FileIOHandle::AsyncAppend(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data,
-//                                 const std::function<void(uint64_t)>& cb) {
-//  auto s = AsyncWrite(zone->wp_, data, [&](uint64_t offset) {
-//    assert(zone->wp_ == offset);
-//    zone->wp_ += data->Size();
-//  });
-//  return s;
-//}
+Status FileIOHandle::AsyncAppend(const std::shared_ptr<Zone>& zone,
+                                 const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                                 IOClass io_class) {
+  // For conventional devices the LBA is decided on submission, so the write pointer could be moved
+  // forward before the IO finished. Note that the callback may recycle the buffer before
+  // AsyncWrite returns, so we should remember the size first.
+  uint64_t size = data->Size();
+  auto s = AsyncWrite(zone->wp_, data, cb, io_class);
+  if (s.ok()) {
+    zone->wp_ += size;
+  }
+  return s;
+}
+
+Status FileIOHandle::AsyncAppendv(const std::shared_ptr<Zone>& zone,
+                                  const std::vector<struct iovec>& iov, const IOCallback& cb,
+                                  IOClass io_class) {
+  uint64_t size = 0;
+  for (auto& part : iov) {
+    assert(part.iov_len % IO_PAGE_SIZE == 0);
+    size += part.iov_len;
+  }
+  auto s = AsyncWritev(zone->wp_, iov, cb, io_class);
+  if (s.ok()) {
+    zone->wp_ += size;
+  }
+  return s;
+}
+
+Status FileIOHandle::AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov,
+                                 const IOCallback& cb, IOClass io_class) {
+  uint64_t size = 0;
+  for (auto& vec : iov) {
+    size += vec.iov_len;
+  }
+  discard_queue_->WaitForRange(offset, size);
+  auto s = io_scheduler_->AsyncWritev(io_class, write_fd_, offset, iov, WrapWriteCallback(cb));
+  if (!s.ok()) {
+    LOG(ERROR, "Failed to write data, code: {}, msg: {} ", s.code(), s.msg());
+    return s;
+  }
+  return Status::OK();
+}
+
+IOCallback FileIOHandle::WrapWriteCallback(const IOCallback& cb) {
+  if (write_mode_ != kBufferedIOWithFadvise) {
+    return cb;
+  }
+  return [this, cb](uint64_t offset, int64_t res) {
+    if (res > 0) {
+      DropPageCache(write_fd_, write_mode_, offset, res);
+    }
+    if (cb != nullptr) {
+      cb(offset, res);
+    }
+  };
+}
 
 std::vector<std::shared_ptr<Zone>> FileIOHandle::GetDeviceZones() {
   std::vector<std::shared_ptr<Zone>> zones;
@@ -100,12 +187,22 @@ std::vector<std::shared_ptr<Zone>> FileIOHandle::GetDeviceZones() {
 void FileIOHandle::ResetZone(const std::shared_ptr<Zone>& zone) {
   zone->state_ = ZoneState::EMPTY;
   zone->wp_ = zone->offset_;
-  Trim(write_fd_, zone->wp_, zone->capacity_bytes_);
+  discard_queue_->Submit(zone->offset_, zone->capacity_bytes_);
+}
+
+void FileIOHandle::DropPageCache(int fd, IOMode mode, uint64_t offset, uint64_t size) {
+#ifndef __APPLE__
+  // For written pages, this also kicks off their write back. Pages that are still dirty will be
+  // kept by the kernel, it's only a hint.
+  if (mode == kBufferedIOWithFadvise) {
+    posix_fadvise(fd, (off_t)offset, (off_t)size, POSIX_FADV_DONTNEED);
+  }
+#endif
 }
 
 void FileIOHandle::Trim(int fd, uint64_t offset, uint64_t sz) {
 #ifndef __APPLE__
-  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE, offset, sz) == -1) {
+  if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, sz) == -1) {
     LOG(ERROR, "fstrim failed, offset: {}, length: {}, error: {}", offset, sz,
         std::strerror(errno));
     return;
@@ -115,4 +212,285 @@ void FileIOHandle::Trim(int fd, uint64_t offset, uint64_t sz) {
 #endif
 }
 
+Status FileIOHandle::Sync() {
+  if (fdatasync(write_fd_) == -1) {
+    LOG(ERROR, "Failed to sync the device, error: {}", std::strerror(errno));
+    return Status::IOError("Sync failed!");
+  }
+  return Status::OK();
+}
+
+void FileIOHandle::ApplyIOOptions(const StoreOptions& options) {
+  io_scheduler_->SetIODepth(options.io_depth_, options.adaptive_io_depth_);
+  io_scheduler_->SetRateLimit(kFlush, options.flush_rate_limit_);
+  io_scheduler_->SetRateLimit(kGC, options.gc_rate_limit_);
+  discard_queue_->SetRateLimit(options.discard_rate_limit_);
+}
+
+BlockIOHandle::BlockIOHandle(const StoreOptions& options)
+    : FileIOHandle(options.device_path_, GetUsableCapacity(options),
+                   options.device_zone_capacity_, options.io_engine_, options.read_io_mode_,
+                   options.write_io_mode_),
+      device_offset_(options.device_offset_) {
+  ApplyIOOptions(options);
+  struct stat st {};
+  if (fstat(write_fd_, &st) == 0) {
+    is_block_device_ = S_ISBLK(st.st_mode);
+  }
+  LOG(INFO, "BlockIOHandle opened {}, block device: {}, offset: {}, capacity: {}", filename_,
+      is_block_device_, device_offset_, file_size_);
+}
+
+std::vector<std::shared_ptr<Zone>> BlockIOHandle::GetDeviceZones() {
+  std::vector<std::shared_ptr<Zone>> zones;
+  uint64_t zone_num = file_size_ / zone_capacity_;
+  for (uint64_t i = 0; i < zone_num; ++i) {
+    auto zone = std::make_shared<Zone>();
+    zone->id_ = i;
+    zone->offset_ = device_offset_ + i * zone_capacity_;
+    zone->capacity_bytes_ = zone_capacity_;
+    zone->wp_ = zone->offset_;
+    zones.push_back(std::move(zone));
+  }
+  return zones;
+}
+
+void BlockIOHandle::Trim(int fd, uint64_t offset, uint64_t sz) {
+#ifndef __APPLE__
+  if (is_block_device_) {
+    uint64_t range[2] = {offset, sz};
+    if (ioctl(fd, BLKDISCARD, &range) == -1) {
+      LOG(ERROR, "BLKDISCARD failed, offset: {}, length: {}, error: {}", offset, sz,
+          std::strerror(errno));
+    }
+    return;
+  }
+#endif
+  FileIOHandle::Trim(fd, offset, sz);
+}
+
+uint64_t BlockIOHandle::GetDeviceSize(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    LOG(ERROR, "Failed to open device {}, error: {}", path, std::strerror(errno));
+    return 0;
+  }
+  struct stat st {};
+  bool is_block = fstat(fd, &st) == 0 && S_ISBLK(st.st_mode);
+  uint64_t size = is_block ? 0 : st.st_size;
+#ifndef __APPLE__
+  if (is_block && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+    LOG(ERROR, "BLKGETSIZE64 failed, device: {}, error: {}", path, std::strerror(errno));
+    size = 0;
+  }
+#endif
+  close(fd);
+  return size;
+}
+
+uint64_t BlockIOHandle::GetUsableCapacity(const StoreOptions& options) {
+  uint64_t device_size = GetDeviceSize(options.device_path_);
+  if (options.device_offset_ % IO_PAGE_SIZE != 0 || options.device_offset_ >= device_size) {
+    LOG(ERROR, "Invalid device offset: {}, device size: {}", options.device_offset_, device_size);
+    abort();
+  }
+  uint64_t capacity = std::min(device_size - options.device_offset_, options.device_capacity_);
+  return capacity / options.device_zone_capacity_ * options.device_zone_capacity_;
+}
+
+ZonedIOHandle::ZonedIOHandle(const StoreOptions& options) : FileIOHandle(options) {
+  InitDeviceZones();
+}
+
+ZonedIOHandle::ZonedIOHandle(std::string filename, uint64_t file_size, uint64_t zone_capacity,
+                             IOEngineType engine_type)
+    : FileIOHandle(std::move(filename), file_size, zone_capacity, engine_type) {
+  InitDeviceZones();
+}
+
+void ZonedIOHandle::InitDeviceZones() {
+  device_zones_.resize(file_size_ / zone_capacity_);
+  for (uint64_t i = 0; i < device_zones_.size(); ++i) {
+    device_zones_[i].wp_ = i * zone_capacity_;
+  }
+}
+
+Status ZonedIOHandle::Write(uint64_t offset, std::shared_ptr<IOBuf> data) {
+  uint64_t size = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
+  auto s = ReserveWrite(offset, size);
+  if (!s.ok()) {
+    return s;
+  }
+  s = FileIOHandle::Write(offset, std::move(data));
+  if (!s.ok()) {
+    CancelReservation(offset, size);
+  }
+  return s;
+}
+
+Status ZonedIOHandle::AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data,
+                                 const IOCallback& cb, IOClass io_class) {
+  uint64_t size = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
+  auto s = ReserveWrite(offset, size);
+  if (!s.ok()) {
+    return s;
+  }
+  s = FileIOHandle::AsyncWrite(offset, data, cb, io_class);
+  if (!s.ok()) {
+    CancelReservation(offset, size);
+  }
+  return s;
+}
+
+Status ZonedIOHandle::AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov,
+                                  const IOCallback& cb, IOClass io_class) {
+  uint64_t size = 0;
+  for (auto& part : iov) {
+    assert(part.iov_len % IO_PAGE_SIZE == 0);
+    size += part.iov_len;
+  }
+  auto s = ReserveWrite(offset, size);
+  if (!s.ok()) {
+    return s;
+  }
+  s = FileIOHandle::AsyncWritev(offset, iov, cb, io_class);
+  if (!s.ok()) {
+    CancelReservation(offset, size);
+  }
+  return s;
+}
+
+Status ZonedIOHandle::AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t size) {
+  assert(size % IO_PAGE_SIZE == 0);
+  auto zeros = std::make_shared<IOBuf>(size);
+  zeros->AppendZeros(size);
+  return Append(zone, zeros);
+}
+
+Status ZonedIOHandle::AsyncAppend(const std::shared_ptr<Zone>& zone,
+                                  const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                                  IOClass io_class) {
+  uint64_t size = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
+  uint64_t lba = 0;
+  auto s = ReserveAppend(zone->id_, size, &lba);
+  if (!s.ok()) {
+    return s;
+  }
+  s = FileIOHandle::AsyncWrite(lba, data, cb, io_class);
+  if (!s.ok()) {
+    CancelReservation(lba, size);
+    return s;
+  }
+  // The host only tracks how much space of the zone was taken.
+  zone->wp_ += size;
+  return s;
+}
+
+Status ZonedIOHandle::AsyncAppendv(const std::shared_ptr<Zone>& zone,
+                                   const std::vector<struct iovec>& iov, const IOCallback& cb,
+                                   IOClass io_class) {
+  uint64_t size = 0;
+  for (auto& part : iov) {
+    assert(part.iov_len % IO_PAGE_SIZE == 0);
+    size += part.iov_len;
+  }
+  uint64_t lba = 0;
+  auto s = ReserveAppend(zone->id_, size, &lba);
+  if (!s.ok()) {
+    return s;
+  }
+  s = FileIOHandle::AsyncWritev(lba, iov, cb, io_class);
+  if (!s.ok()) {
+    CancelReservation(lba, size);
+    return s;
+  }
+  zone->wp_ += size;
+  return s;
+}
+
+void ZonedIOHandle::ResetZone(const std::shared_ptr<Zone>& zone) {
+  {
+    std::lock_guard<std::mutex> lk(device_zones_mtx_);
+    auto& device_zone = device_zones_[zone->id_];
+    device_zone.state_ = ZoneState::EMPTY;
+    device_zone.wp_ = zone->id_ * zone_capacity_;
+  }
+  FileIOHandle::ResetZone(zone);
+}
+
+Status ZonedIOHandle::FinishZone(const std::shared_ptr<Zone>& zone) {
+  std::lock_guard<std::mutex> lk(device_zones_mtx_);
+  auto& device_zone = device_zones_[zone->id_];
+  if (device_zone.state_ == ZoneState::OFFLINE) {
+    return Status::IOError("Zone is offline");
+  }
+  device_zone.state_ = ZoneState::FULL;
+  return Status::OK();
+}
+
+ZoneState ZonedIOHandle::GetZoneState(uint64_t zone_id) {
+  std::lock_guard<std::mutex> lk(device_zones_mtx_);
+  return device_zones_[zone_id].state_;
+}
+
+uint64_t ZonedIOHandle::GetZoneWritePointer(uint64_t zone_id) {
+  std::lock_guard<std::mutex> lk(device_zones_mtx_);
+  return device_zones_[zone_id].wp_;
+}
+
+Status ZonedIOHandle::ReserveWrite(uint64_t offset, uint64_t size) {
+  uint64_t zone_id = offset / zone_capacity_;
+  std::lock_guard<std::mutex> lk(device_zones_mtx_);
+  if (zone_id >= device_zones_.size()) {
+    return Status::IOError("Write beyond the device capacity");
+  }
+  if (offset != device_zones_[zone_id].wp_) {
+    LOG(ERROR, "Unaligned write of zone {}, offset: {}, write pointer: {}", zone_id, offset,
+        device_zones_[zone_id].wp_);
+    return Status::IOError("Unaligned write");
+  }
+  return Advance(zone_id, size);
+}
+
+Status ZonedIOHandle::ReserveAppend(uint64_t zone_id, uint64_t size, uint64_t* lba) {
+  std::lock_guard<std::mutex> lk(device_zones_mtx_);
+  if (zone_id >= device_zones_.size()) {
+    return Status::IOError("Append to an invalid zone");
+  }
+  *lba = device_zones_[zone_id].wp_;
+  return Advance(zone_id, size);
+}
+
+void ZonedIOHandle::CancelReservation(uint64_t offset, uint64_t size) {
+  uint64_t zone_id = offset / zone_capacity_;
+  std::lock_guard<std::mutex> lk(device_zones_mtx_);
+  auto& device_zone = device_zones_[zone_id];
+  if (device_zone.wp_ != offset + size) {
+    // Someone wrote after the range, which is now a hole that could never be written.
+    LOG(ERROR, "Zone {} is left with an unwritten range, offset: {}, size: {}", zone_id, offset,
+        size);
+    device_zone.state_ = ZoneState::OFFLINE;
+    return;
+  }
+  device_zone.wp_ = offset;
+  device_zone.state_ = offset == zone_id * zone_capacity_ ? ZoneState::EMPTY : ZoneState::OPEN;
+}
+
+Status ZonedIOHandle::Advance(uint64_t zone_id, uint64_t size) {
+  auto& device_zone = device_zones_[zone_id];
+  if (device_zone.state_ == ZoneState::FULL || device_zone.state_ == ZoneState::OFFLINE) {
+    LOG(ERROR, "Write to a zone that's not writable, zone: {}, state: {}", zone_id,
+        (int)device_zone.state_);
+    return Status::IOError("Zone is not writable");
+  }
+  uint64_t zone_end = (zone_id + 1) * zone_capacity_;
+  if (device_zone.wp_ + size > zone_end) {
+    LOG(ERROR, "Write exceeds the zone capacity, zone: {}, write pointer: {}, size: {}", zone_id,
+        device_zone.wp_, size);
+    return Status::IOError("Zone boundary violation");
+  }
+  device_zone.wp_ += size;
+  device_zone.state_ = device_zone.wp_ == zone_end ? ZoneState::FULL : ZoneState::OPEN;
+  return Status::OK();
+}
 }  // namespace neodb
@@ -4,6 +4,7 @@
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <cassert>
@@ -12,10 +13,14 @@
 #include <cstring>
 #include <memory>
 #include <utility>
+#include <vector>
 
 #include "aio_engine.h"
+#include "discard_queue.h"
+#include "io_scheduler.h"
 #include "logger.h"
 #include "neodb/io_buf.h"
+#include "neodb/options.h"
 #include "neodb/status.h"
 #include "utils.h"
 #include "zone.h"
@@ -23,20 +28,40 @@
 namespace neodb {
 class IOHandle {
  public:
+  // Default timeout of a single Wait(), which bounds the delay if the completion we are waiting
+  // for was reaped by another thread.
+  static constexpr uint64_t kWaitTimeoutUs = 1000;
+
   virtual ~IOHandle() = default;
 
+  // Write data synchronously, it's counted as flush IO and waits for the flush rate limit.
   virtual Status Write(uint64_t offset, std::shared_ptr<IOBuf> data) = 0;
 
+  // Write data asynchronously, the request is queued by the IO scheduler with its IO class.
   virtual Status AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data,
-                            const std::function<void(uint64_t)>& cb) = 0;
+                            const IOCallback& cb, IOClass io_class = kFlush) = 0;
 
   // Read certain amount of data and append to the data buffer.
-  // The data buffer is pre-allocated, and its free space should be enough.
+  // The data buffer is pre-allocated, and its free space should be enough. The offset and size
+  // don't need to be aligned, even for direct IO.
   virtual Status ReadAppend(uint64_t offset, uint32_t size, std::shared_ptr<IOBuf> data) = 0;
 
-  // Read data into the pre-allocated buffer with the size of data capacity.
+  // Read data into the pre-allocated buffer with the size of data capacity, the offset should be
+  // page aligned.
   virtual Status Read(uint64_t offset, std::shared_ptr<IOBuf> data) = 0;
 
+  // Read data into the pre-allocated buffer with the size of data capacity asynchronously, the
+  // buffer's size will be set before the callback was invoked.
+  // Note that the data buffer should be kept alive until the callback was invoked.
+  virtual Status AsyncRead(uint64_t offset, const std::shared_ptr<IOBuf>& data,
+                           const IOCallback& cb, IOClass io_class = kForegroundRead) = 0;
+
+  // Write multiple page aligned buffers to the continuous range starts from `offset`
+  // asynchronously, the callback will be invoked with the total size once all finished.
+  // Note that the buffers should not be touched until the callback was invoked.
+  virtual Status AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov,
+                             const IOCallback& cb, IOClass io_class = kFlush) = 0;
+
   // Append data to the target zone.
   virtual Status Append(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data) = 0;
 
@@ -45,64 +70,149 @@ class IOHandle {
   // append real 0s.
   virtual Status AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t size) = 0;
 
-//  virtual Status AsyncAppend(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data,
-//                             const std::function<void(uint64_t)>& cb) = 0;
+  // Append data to the target zone asynchronously, the zone's write pointer is moved forward on
+  // submission and the callback will be invoked with the write offset once the IO finished.
+  // For zoned devices it's a zone append, the offset is assigned by the device and could only be
+  // learned from the callback.
+  // Note that the data buffer should not be touched until the callback was invoked.
+  virtual Status AsyncAppend(const std::shared_ptr<Zone>& zone, const std::shared_ptr<IOBuf>& data,
+                             const IOCallback& cb, IOClass io_class = kFlush) = 0;
+
+  // Append multiple buffers to the target zone asynchronously with a single vectored IO, each part
+  // should be page aligned. The callback will be invoked with the total size once all finished.
+  // Note that the buffers should not be touched until the callback was invoked.
+  virtual Status AsyncAppendv(const std::shared_ptr<Zone>& zone,
+                              const std::vector<struct iovec>& iov, const IOCallback& cb,
+                              IOClass io_class = kFlush) = 0;
+
+  // Run the callbacks of all finished async IO requests and dispatch the queued ones.
+  // @return The number of finished requests.
+  virtual uint32_t Poll() = 0;
+
+  // Like Poll(), but block until any request finished or timeout instead of returning at once.
+  // Waiters should still check their own condition, as the completion could be reaped by another
+  // thread.
+  virtual uint32_t Wait(uint64_t timeout_us = kWaitTimeoutUs) = 0;
+
+  // @return The number of async IO requests that are either queued or submitted.
+  virtual uint32_t GetInFlightRequests() = 0;
+
+  // Adjust the bandwidth and IOPS limits of an IO class, could be called at runtime.
+  virtual void SetRateLimit(IOClass io_class, const RateLimit& limit) = 0;
+
+  // @return The total time that the IO class was held back by its rate limit.
+  virtual uint64_t GetThrottledTimeUs(IOClass io_class) = 0;
 
   virtual std::vector<std::shared_ptr<Zone>> GetDeviceZones() = 0;
 
+  // The zone could be reused at once, while its discard might be issued in background. Writes to
+  // the zone wait until the discard finished.
   virtual void ResetZone(const std::shared_ptr<Zone>& zone) = 0;
 
   virtual void Trim(int fd, uint64_t offset, uint64_t sz) = 0;
+
+  // Block until all discards of the reset zones finished.
+  virtual void WaitForDiscard() = 0;
+
+  // Make the finished writes durable, they could still be in the page cache of a buffered file or
+  // in the device's volatile write cache.
+  virtual Status Sync() = 0;
+
+  // A zoned device only takes the sequential writes of a zone, so a zone could not be written at
+  // multiple offsets in parallel.
+  virtual bool IsZoned() const { return false; }
 };
 
 // class S3IOHandle : public IOHandle {};
-//
-// class BdevIOHandle : public IOHandle {};
 
 class FileIOHandle : public IOHandle {
  public:
-  explicit FileIOHandle(std::string filename, uint64_t file_size, uint64_t zone_capacity)
-      : filename_(std::move(filename)), file_size_(file_size), zone_capacity_(zone_capacity) {
+  explicit FileIOHandle(const StoreOptions& options)
+      : FileIOHandle(options.device_path_, options.device_capacity_,
+                     options.device_zone_capacity_, options.io_engine_, options.read_io_mode_,
+                     options.write_io_mode_) {
+    ApplyIOOptions(options);
+  }
+
+  explicit FileIOHandle(std::string filename, uint64_t file_size, uint64_t zone_capacity,
+                        IOEngineType engine_type = kPosixAIO, IOMode read_mode = kDirectIO,
+                        IOMode write_mode = kDirectIO)
+      : filename_(std::move(filename)),
+        file_size_(file_size),
+        zone_capacity_(zone_capacity),
+        read_mode_(read_mode),
+        write_mode_(write_mode) {
     if (filename_.empty() || file_size_ == 0 || zone_capacity_ == 0) {
       LOG(ERROR, "FileIOHandle init failed, filename: {}, size: {}", filename_, file_size_);
       abort();
     }
-    write_fd_ = FileUtils::OpenDirectFile(filename_);
-    aio_engine_.reset(IOEngineUtils::GetInstance());
+    write_fd_ = FileUtils::OpenFile(filename_, false, &write_mode_);
+    io_scheduler_ = std::make_unique<IOScheduler>(
+        std::unique_ptr<AIOEngine>(IOEngineUtils::GetInstance(engine_type)));
 
     if (write_fd_ == -1) {
       LOG(ERROR, "open writable file failed: {}", std::strerror(errno));
       close(write_fd_);
       abort();
     }
-    read_fd_ = open(filename_.c_str(), O_RDONLY | O_SYNC);
+    read_fd_ = FileUtils::OpenFile(filename_, true, &read_mode_);
     if (read_fd_ == -1) {
       LOG(ERROR, "open readable file failed: {}", std::strerror(errno));
       close(read_fd_);
       abort();
     }
+    discard_queue_ = std::make_unique<DiscardQueue>(
+        [this](uint64_t offset, uint64_t size) { Trim(write_fd_, offset, size); });
   }
 
   ~FileIOHandle() override {
+    // Drain the queued and in-flight IO before closing the files.
+    discard_queue_.reset();
+    io_scheduler_.reset();
     close(write_fd_);
     close(read_fd_);
   }
 
   Status Write(uint64_t offset, std::shared_ptr<IOBuf> data) override;
 
-  Status AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data,
-                    const std::function<void(uint64_t)>& cb) override;
+  Status AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                    IOClass io_class = kFlush) override;
+
+  Status AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov, const IOCallback& cb,
+                     IOClass io_class = kFlush) override;
 
   Status ReadAppend(uint64_t offset, uint32_t size, std::shared_ptr<IOBuf> data) override;
 
   Status Read(uint64_t offset, std::shared_ptr<IOBuf> data) override;
 
+  Status AsyncRead(uint64_t offset, const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                   IOClass io_class = kForegroundRead) override;
+
   Status AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t size) override;
 
   Status Append(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data) override;
 
-//  Status AsyncAppend(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data,
-//                     const std::function<void(uint64_t)>& cb) override;
+  Status AsyncAppend(const std::shared_ptr<Zone>& zone, const std::shared_ptr<IOBuf>& data,
+                     const IOCallback& cb, IOClass io_class = kFlush) override;
+
+  Status AsyncAppendv(const std::shared_ptr<Zone>& zone, const std::vector<struct iovec>& iov,
+                      const IOCallback& cb, IOClass io_class = kFlush) override;
+
+  uint32_t Poll() override { return io_scheduler_->Poll(); }
+
+  uint32_t Wait(uint64_t timeout_us = kWaitTimeoutUs) override {
+    return io_scheduler_->Wait(timeout_us);
+  }
+
+  uint32_t GetInFlightRequests() override { return io_scheduler_->GetInFlightRequests(); }
+
+  void SetRateLimit(IOClass io_class, const RateLimit& limit) override {
+    io_scheduler_->SetRateLimit(io_class, limit);
+  }
+
+  uint64_t GetThrottledTimeUs(IOClass io_class) override {
+    return io_scheduler_->GetThrottledTimeUs(io_class);
+  }
 
   std::vector<std::shared_ptr<Zone>> GetDeviceZones() override;
 
@@ -110,7 +220,26 @@ class FileIOHandle : public IOHandle {
 
   void Trim(int fd, uint64_t offset, uint64_t sz) override;
 
- private:
+  void WaitForDiscard() override { discard_queue_->WaitForAll(); }
+
+  Status Sync() override;
+
+  void SetDiscardRateLimit(const RateLimit& limit) { discard_queue_->SetRateLimit(limit); }
+
+  uint64_t GetDiscardNum() const { return discard_queue_->GetDiscardNum(); }
+
+  uint64_t GetDiscardedBytes() const { return discard_queue_->GetDiscardedBytes(); }
+
+  // The IO modes in use, which could be different from the expected ones if O_DIRECT is not
+  // supported.
+  IOMode GetReadIOMode() const { return read_mode_; }
+
+  IOMode GetWriteIOMode() const { return write_mode_; }
+
+ protected:
+  // Apply the store's IO depth and rate limits to the IO scheduler.
+  void ApplyIOOptions(const StoreOptions& options);
+
   int write_fd_;
 
   int read_fd_;
@@ -121,7 +250,123 @@ class FileIOHandle : public IOHandle {
 
   uint64_t zone_capacity_;
 
-  // The async IO engine.
-  std::unique_ptr<AIOEngine> aio_engine_;
+ private:
+  // Drop the cached pages of the finished IO, if the IO mode asks for it.
+  static void DropPageCache(int fd, IOMode mode, uint64_t offset, uint64_t size);
+
+  // Drop the written pages before invoking `cb`, if the write IO mode asks for it.
+  IOCallback WrapWriteCallback(const IOCallback& cb);
+
+  IOMode read_mode_;
+
+  IOMode write_mode_;
+
+  // Queues the async IO by their classes and dispatches them to the async IO engine.
+  std::unique_ptr<IOScheduler> io_scheduler_;
+
+  // Discards the reset zones in background.
+  std::unique_ptr<DiscardQueue> discard_queue_;
+};
+
+// BlockIOHandle accesses a raw block device without any file system, zones are laid out from
+// `device_offset_` and a reset zone is discarded with BLKDISCARD. The usable capacity is
+// discovered with BLKGETSIZE64 and capped by `device_capacity_`.
+// A plain file is also accepted (e.g. for testing), in which case the capacity comes from the file
+// size and the discard falls back to punching holes.
+class BlockIOHandle : public FileIOHandle {
+ public:
+  explicit BlockIOHandle(const StoreOptions& options);
+
+  // The discards call the overridden Trim(), they should finish before this part is destroyed.
+  ~BlockIOHandle() override { WaitForDiscard(); }
+
+  std::vector<std::shared_ptr<Zone>> GetDeviceZones() override;
+
+  void Trim(int fd, uint64_t offset, uint64_t sz) override;
+
+  bool IsBlockDevice() const { return is_block_device_; }
+
+  // @return The size of the block device or the regular file, 0 if failed.
+  static uint64_t GetDeviceSize(const std::string& path);
+
+ private:
+  // The device range after `device_offset_` that fits whole zones.
+  static uint64_t GetUsableCapacity(const StoreOptions& options);
+
+  uint64_t device_offset_;
+
+  bool is_block_device_ = false;
+};
+
+// ZonedIOHandle emulates a zoned namespace device on top of a regular file, so the ZNS write path
+// could be validated without the hardware. The device keeps its own write pointer and state for
+// each zone, and enforces the ZNS rules:
+//  - A regular write should start exactly at the zone's write pointer.
+//  - Nothing could be written beyond the zone capacity, or into a FULL zone.
+//  - A zone becomes OPEN on its first write, and FULL once it's filled up or finished.
+//  - Padding zeros are written for real.
+// AsyncAppend() and AsyncAppendv() are zone appends, the device assigns the LBA from the zone's
+// write pointer and reports it to the callback, so several appends could be in flight for the
+// same zone. Appends of the same zone are placed in their submission order.
+class ZonedIOHandle : public FileIOHandle {
+ public:
+  explicit ZonedIOHandle(const StoreOptions& options);
+
+  explicit ZonedIOHandle(std::string filename, uint64_t file_size, uint64_t zone_capacity,
+                         IOEngineType engine_type = kPosixAIO);
+
+  Status Write(uint64_t offset, std::shared_ptr<IOBuf> data) override;
+
+  Status AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                    IOClass io_class = kFlush) override;
+
+  Status AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov, const IOCallback& cb,
+                     IOClass io_class = kFlush) override;
+
+  Status AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t size) override;
+
+  Status AsyncAppend(const std::shared_ptr<Zone>& zone, const std::shared_ptr<IOBuf>& data,
+                     const IOCallback& cb, IOClass io_class = kFlush) override;
+
+  Status AsyncAppendv(const std::shared_ptr<Zone>& zone, const std::vector<struct iovec>& iov,
+                      const IOCallback& cb, IOClass io_class = kFlush) override;
+
+  void ResetZone(const std::shared_ptr<Zone>& zone) override;
+
+  bool IsZoned() const override { return true; }
+
+  // Transit the zone to FULL, the rest of its space could not be written until reset.
+  Status FinishZone(const std::shared_ptr<Zone>& zone);
+
+  // The device's view of the zone, which could be ahead of the host's view.
+  ZoneState GetZoneState(uint64_t zone_id);
+
+  uint64_t GetZoneWritePointer(uint64_t zone_id);
+
+ private:
+  // Device side state of a zone.
+  struct DeviceZone {
+    ZoneState state_ = ZoneState::EMPTY;
+    uint64_t wp_ = 0;
+  };
+
+  void InitDeviceZones();
+
+  // Move the write pointer of the zone that covers `offset` forward for a regular write.
+  Status ReserveWrite(uint64_t offset, uint64_t size);
+
+  // Move the zone's write pointer forward for a zone append.
+  // @param lba The assigned LBA of the append.
+  Status ReserveAppend(uint64_t zone_id, uint64_t size, uint64_t* lba);
+
+  // Give back the reservation of a write that failed to submit. It's only possible if nothing was
+  // reserved after it, otherwise the zone is taken offline since it has a hole.
+  void CancelReservation(uint64_t offset, uint64_t size);
+
+  // Should be called with `device_zones_mtx_` held.
+  Status Advance(uint64_t zone_id, uint64_t size);
+
+  std::mutex device_zones_mtx_;
+  std::vector<DeviceZone> device_zones_;
 };
 }  // namespace neodb
@@ -3,9 +3,12 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
 
 #include "gtest/gtest.h"
+#include "rate_limiter.h"
+#include "sim_io_handle.h"
 #include "utils.h"
 
 namespace neodb {
@@ -70,6 +73,324 @@ TEST_F(IOHandleTest, MultiWriteTest) {
   RemoveFile(filename);
 }
 
+TEST_F(IOHandleTest, IOModeTest) {
+  for (auto mode : {kDirectIO, kBufferedIO, kBufferedIOWithFadvise}) {
+    auto filename = CreateRandomFile(1UL << 30);
+    FileIOHandle io_handle(filename, 1UL << 30, 256UL << 20, kPosixAIO, mode, mode);
+    EXPECT_EQ(io_handle.GetReadIOMode(), mode);
+    EXPECT_EQ(io_handle.GetWriteIOMode(), mode);
+
+    auto value = StringUtils::GenerateRandomString(10UL << 10);
+    auto buf = std::make_shared<IOBuf>(value);
+    bool done = false;
+    auto s = io_handle.AsyncWrite(4096, buf, [&](uint64_t offset, int64_t res) {
+      EXPECT_EQ(offset, 4096);
+      EXPECT_EQ(res, buf->Capacity());
+      done = true;
+    });
+    EXPECT_TRUE(s.ok());
+    while (!done) {
+      io_handle.Poll();
+    }
+
+    // Unaligned read.
+    auto read_buf = std::make_shared<IOBuf>(100);
+    s = io_handle.ReadAppend(4096 + 10, 100, read_buf);
+    EXPECT_TRUE(s.ok());
+    EXPECT_EQ(read_buf->Data(), value.substr(10, 100));
+
+    // Aligned read.
+    read_buf = std::make_shared<IOBuf>(value.size());
+    s = io_handle.Read(4096, read_buf);
+    EXPECT_TRUE(s.ok());
+    EXPECT_EQ(read_buf->Data().substr(0, value.size()), value);
+    RemoveFile(filename);
+  }
+}
+
+TEST_F(IOHandleTest, TmpfsFallbackTest) {
+  if (!FileUtils::FileExist("/dev/shm")) {
+    GTEST_SKIP() << "tmpfs is not available";
+  }
+  // tmpfs may reject O_DIRECT, in which case we should fallback to buffered IO.
+  auto filename = FileUtils::GenerateRandomFile("/dev/shm/io_test_file_", 64UL << 20);
+  FileIOHandle io_handle(filename, 64UL << 20, 16UL << 20);
+  auto buf = std::make_shared<IOBuf>(std::string("1234567890"));
+  Status s = io_handle.Write(0, buf);
+  EXPECT_TRUE(s.ok());
+  buf->Reset();
+  s = io_handle.ReadAppend(0, 10, buf);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(buf->Data(), "1234567890");
+  RemoveFile(filename);
+}
+
+TEST_F(IOHandleTest, BlockIOHandleTest) {
+  // A plain file works as a block device, except that discard becomes punching holes.
+  uint64_t device_size = 64UL << 20;
+  StoreOptions options;
+  options.device_path_ = CreateRandomFile(device_size);
+  options.type_ = kBlock;
+  options.device_offset_ = 20UL << 20;
+  options.device_zone_capacity_ = 8UL << 20;
+  BlockIOHandle io_handle(options);
+  EXPECT_FALSE(io_handle.IsBlockDevice());
+  EXPECT_EQ(BlockIOHandle::GetDeviceSize(options.device_path_), device_size);
+
+  // 44MB is left after the offset, which fits 5 zones.
+  auto zones = io_handle.GetDeviceZones();
+  ASSERT_EQ(zones.size(), 5);
+  for (size_t i = 0; i < zones.size(); ++i) {
+    EXPECT_EQ(zones[i]->offset_, options.device_offset_ + i * options.device_zone_capacity_);
+    EXPECT_EQ(zones[i]->wp_, zones[i]->offset_);
+  }
+
+  auto value = StringUtils::GenerateRandomString(IO_PAGE_SIZE);
+  auto buf = std::make_shared<IOBuf>(value);
+  auto s = io_handle.Append(zones[1], buf);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(zones[1]->wp_, zones[1]->offset_ + IO_PAGE_SIZE);
+  auto read_buf = std::make_shared<IOBuf>(IO_PAGE_SIZE);
+  s = io_handle.Read(zones[1]->offset_, read_buf);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(read_buf->Data(), value);
+
+  // The zone's data is discarded after reset.
+  io_handle.ResetZone(zones[1]);
+  EXPECT_EQ(zones[1]->wp_, zones[1]->offset_);
+  io_handle.WaitForDiscard();
+  read_buf->Reset();
+  s = io_handle.Read(zones[1]->offset_, read_buf);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(read_buf->Data(), std::string(IO_PAGE_SIZE, 0));
+}
+
+TEST_F(IOHandleTest, ZonedIOHandleTest) {
+  uint64_t zone_capacity = 1UL << 20;
+  auto filename = CreateRandomFile(8 * zone_capacity);
+  ZonedIOHandle io_handle(filename, 8 * zone_capacity, zone_capacity);
+  auto zones = io_handle.GetDeviceZones();
+  ASSERT_EQ(zones.size(), 8);
+  auto zone = zones[1];
+  EXPECT_EQ(io_handle.GetZoneState(zone->id_), ZoneState::EMPTY);
+
+  // Regular writes should start at the write pointer.
+  auto page = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(IO_PAGE_SIZE));
+  EXPECT_FALSE(io_handle.Write(zone->offset_ + IO_PAGE_SIZE, page).ok());
+  EXPECT_TRUE(io_handle.Append(zone, page).ok());
+  EXPECT_EQ(io_handle.GetZoneState(zone->id_), ZoneState::OPEN);
+  EXPECT_EQ(io_handle.GetZoneWritePointer(zone->id_), zone->offset_ + IO_PAGE_SIZE);
+  EXPECT_FALSE(io_handle.Write(zone->offset_, page).ok());
+  std::vector<struct iovec> iov = {{page->Buffer(), IO_PAGE_SIZE}};
+  EXPECT_FALSE(io_handle.AsyncWritev(zone->offset_, iov, nullptr).ok());
+  EXPECT_EQ(io_handle.GetZoneWritePointer(zone->id_), zone->offset_ + IO_PAGE_SIZE);
+
+  // Concurrent zone appends, the LBAs are learned on completion.
+  uint32_t total = 16;
+  std::vector<std::shared_ptr<IOBuf>> bufs;
+  std::map<uint64_t, uint32_t> lbas;
+  for (uint32_t i = 0; i < total; ++i) {
+    bufs.push_back(std::make_shared<IOBuf>(std::string(IO_PAGE_SIZE * 2, 'a' + i)));
+    auto s = io_handle.AsyncAppend(zone, bufs.back(), [&, i](uint64_t offset, int64_t res) {
+      EXPECT_EQ(res, IO_PAGE_SIZE * 2);
+      lbas[offset] = i;
+    });
+    ASSERT_TRUE(s.ok());
+  }
+  while (io_handle.GetInFlightRequests() > 0) {
+    io_handle.Wait();
+  }
+  ASSERT_EQ(lbas.size(), total);
+  uint64_t expected = zone->offset_ + IO_PAGE_SIZE;
+  for (auto& pair : lbas) {
+    EXPECT_EQ(pair.first, expected);
+    auto read_buf = std::make_shared<IOBuf>(IO_PAGE_SIZE * 2);
+    EXPECT_TRUE(io_handle.Read(pair.first, read_buf).ok());
+    EXPECT_EQ(read_buf->Data(), bufs[pair.second]->Data());
+    expected += IO_PAGE_SIZE * 2;
+  }
+
+  // Padding zeros are written for real, and the zone is FULL once filled up.
+  uint64_t left = zone->offset_ + zone_capacity - io_handle.GetZoneWritePointer(zone->id_);
+  EXPECT_TRUE(io_handle.AppendZeros(zone, left).ok());
+  EXPECT_EQ(io_handle.GetZoneState(zone->id_), ZoneState::FULL);
+  EXPECT_FALSE(io_handle.AsyncAppend(zone, page, nullptr).ok());
+
+  // A reset zone is writable again, and an unfinished zone could be finished explicitly.
+  io_handle.ResetZone(zone);
+  EXPECT_EQ(io_handle.GetZoneState(zone->id_), ZoneState::EMPTY);
+  EXPECT_TRUE(io_handle.Append(zone, page).ok());
+  EXPECT_TRUE(io_handle.FinishZone(zone).ok());
+  EXPECT_FALSE(io_handle.Append(zone, page).ok());
+}
+
+TEST_F(IOHandleTest, DiscardTest) {
+  uint64_t zone_capacity = 1UL << 20;
+  auto filename = CreateRandomFile(8 * zone_capacity);
+  FileIOHandle io_handle(filename, 8 * zone_capacity, zone_capacity);
+  auto zones = io_handle.GetDeviceZones();
+  auto page = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(IO_PAGE_SIZE));
+  for (auto& zone : zones) {
+    EXPECT_TRUE(io_handle.Append(zone, page).ok());
+  }
+  RateLimit limit;
+  limit.bytes_per_sec_ = zone_capacity;
+  io_handle.SetDiscardRateLimit(limit);
+
+  // The reset is recorded at once, and the first discard takes all the tokens of the next second.
+  io_handle.ResetZone(zones[0]);
+  EXPECT_EQ(zones[0]->wp_, zones[0]->offset_);
+  io_handle.WaitForDiscard();
+  EXPECT_EQ(io_handle.GetDiscardNum(), 1);
+
+  // Adjacent zones are merged into a single discard, and a write waiting for it skips the limit.
+  for (int i = 1; i < 4; ++i) {
+    io_handle.ResetZone(zones[i]);
+  }
+  auto start = Clock::Default()->NowInUs();
+  EXPECT_TRUE(io_handle.Append(zones[2], page).ok());
+  EXPECT_LT(Clock::Default()->NowInUs() - start, 500UL * 1000);
+  EXPECT_EQ(io_handle.GetDiscardNum(), 2);
+  EXPECT_EQ(io_handle.GetDiscardedBytes(), 4 * zone_capacity);
+
+  // The write is not lost by the discard, while the other zones are discarded.
+  auto read_buf = std::make_shared<IOBuf>(IO_PAGE_SIZE);
+  EXPECT_TRUE(io_handle.Read(zones[2]->offset_, read_buf).ok());
+  EXPECT_EQ(read_buf->Data(), page->Data());
+  read_buf->Reset();
+  EXPECT_TRUE(io_handle.Read(zones[1]->offset_, read_buf).ok());
+  EXPECT_EQ(read_buf->Data(), std::string(IO_PAGE_SIZE, 0));
+  read_buf->Reset();
+  EXPECT_TRUE(io_handle.Read(zones[4]->offset_, read_buf).ok());
+  EXPECT_EQ(read_buf->Data(), page->Data());
+}
+
+TEST_F(IOHandleTest, SimIOHandleTest) {
+  StoreOptions options;
+  options.type_ = kSimulated;
+  options.device_capacity_ = 8UL << 20;
+  options.device_zone_capacity_ = 1UL << 20;
+  options.sim_device_.write_latency_ = {2000, 0};
+  options.sim_device_.parallelism_ = 2;
+  SimIOHandle io_handle(options);
+  auto zones = io_handle.GetDeviceZones();
+  ASSERT_EQ(zones.size(), 8);
+
+  // A sync write takes its latency.
+  auto page = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(IO_PAGE_SIZE));
+  auto start = Clock::Default()->NowInUs();
+  EXPECT_TRUE(io_handle.Append(zones[1], page).ok());
+  EXPECT_GE(Clock::Default()->NowInUs() - start, 2000);
+  auto read_buf = std::make_shared<IOBuf>(IO_PAGE_SIZE);
+  EXPECT_TRUE(io_handle.Read(zones[1]->offset_, read_buf).ok());
+  EXPECT_EQ(read_buf->Data(), page->Data());
+  read_buf->Reset();
+  EXPECT_TRUE(io_handle.ReadAppend(zones[1]->offset_ + 10, 100, read_buf).ok());
+  EXPECT_EQ(read_buf->Data(), page->Data().substr(10, 100));
+
+  // The requests beyond the parallelism queue up, and the writes finish in order.
+  std::vector<uint64_t> finished;
+  start = Clock::Default()->NowInUs();
+  for (int i = 0; i < 6; ++i) {
+    auto s = io_handle.AsyncAppend(zones[2], page, [&](uint64_t offset, int64_t res) {
+      EXPECT_EQ(res, IO_PAGE_SIZE);
+      finished.push_back(offset);
+    });
+    EXPECT_TRUE(s.ok());
+  }
+  while (io_handle.GetInFlightRequests() > 0) {
+    io_handle.Wait();
+  }
+  EXPECT_GE(Clock::Default()->NowInUs() - start, 6000);
+  ASSERT_EQ(finished.size(), 6);
+  for (int i = 0; i < 6; ++i) {
+    EXPECT_EQ(finished[i], zones[2]->offset_ + i * IO_PAGE_SIZE);
+  }
+
+  // The zone's memory is released after reset.
+  EXPECT_EQ(io_handle.GetDevice()->GetMemoryUsage(), 2 * options.device_zone_capacity_);
+  io_handle.ResetZone(zones[1]);
+  EXPECT_EQ(io_handle.GetDevice()->GetMemoryUsage(), options.device_zone_capacity_);
+  read_buf->Reset();
+  EXPECT_TRUE(io_handle.Read(zones[1]->offset_, read_buf).ok());
+  EXPECT_EQ(read_buf->Data(), std::string(IO_PAGE_SIZE, 0));
+  EXPECT_FALSE(io_handle.Read(options.device_capacity_, read_buf).ok());
+}
+
+TEST_F(IOHandleTest, SimDeviceTest) {
+  SimDeviceOptions options;
+  options.read_latency_ = {0, 0};
+  options.read_bytes_per_sec_ = 0;
+  options.spike_ppm_ = 500000;
+  options.spike_latency_us_ = 1000;
+  options.seed_ = 42;
+
+  // The same seed always injects the same spikes.
+  SimDevice device1(8UL << 20, 1UL << 20, options);
+  SimDevice device2(8UL << 20, 1UL << 20, options);
+  std::vector<bool> spikes1;
+  std::vector<bool> spikes2;
+  for (int i = 0; i < 100; ++i) {
+    uint64_t spike_num = device1.GetSpikeNum();
+    device1.Schedule(kAsyncRead, IO_PAGE_SIZE);
+    spikes1.push_back(device1.GetSpikeNum() > spike_num);
+    spike_num = device2.GetSpikeNum();
+    device2.Schedule(kAsyncRead, IO_PAGE_SIZE);
+    spikes2.push_back(device2.GetSpikeNum() > spike_num);
+  }
+  EXPECT_EQ(spikes1, spikes2);
+  EXPECT_GT(device1.GetSpikeNum(), 20);
+  EXPECT_LT(device1.GetSpikeNum(), 80);
+
+  // The transfers are serialized on the bandwidth, with a manual clock the time is exact.
+  options.spike_ppm_ = 0;
+  options.read_bytes_per_sec_ = 100UL << 20;
+  SimDevice device3(8UL << 20, 1UL << 20, options);
+  ManualClock clock;
+  device3.SetClock(&clock);
+  auto start = clock.NowInUs();
+  uint64_t finish_us = 0;
+  for (int i = 0; i < 10; ++i) {
+    finish_us = device3.Schedule(kAsyncRead, 1UL << 20);
+  }
+  EXPECT_EQ(finish_us - start, 100UL * 1000);
+}
+
+TEST_F(IOHandleTest, SimManualClockTest) {
+  StoreOptions options;
+  options.type_ = kSimulated;
+  options.device_capacity_ = 8UL << 20;
+  options.device_zone_capacity_ = 1UL << 20;
+  options.sim_device_.write_latency_ = {2000, 0};
+  options.sim_device_.write_bytes_per_sec_ = 0;
+  options.sim_device_.parallelism_ = 2;
+  SimIOHandle io_handle(options);
+  ManualClock clock;
+  io_handle.SetClock(&clock);
+  auto zones = io_handle.GetDeviceZones();
+
+  // The waits only move the manual clock, by exactly the modelled time.
+  auto page = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(IO_PAGE_SIZE));
+  auto start = clock.NowInUs();
+  EXPECT_TRUE(io_handle.Append(zones[1], page).ok());
+  EXPECT_EQ(clock.NowInUs() - start, 2000);
+
+  start = clock.NowInUs();
+  uint32_t finished = 0;
+  for (int i = 0; i < 6; ++i) {
+    auto s = io_handle.AsyncAppend(zones[2], page, [&](uint64_t, int64_t res) {
+      EXPECT_EQ(res, IO_PAGE_SIZE);
+      finished++;
+    });
+    EXPECT_TRUE(s.ok());
+  }
+  while (io_handle.GetInFlightRequests() > 0) {
+    io_handle.Wait();
+  }
+  EXPECT_EQ(finished, 6);
+  EXPECT_EQ(clock.NowInUs() - start, 6000);
+}
+
 TEST_F(IOHandleTest, AsyncWriteTest) {}
 
 int main(int argc, char** argv) {
@@ -0,0 +1,274 @@
+#include "io_scheduler.h"
+
+#include <algorithm>
+
+#include "logger.h"
+
+namespace neodb {
+namespace {
+// Set while the thread runs an IO callback.
+thread_local bool in_callback = false;
+}  // namespace
+
+IOScheduler::~IOScheduler() {
+  while (GetInFlightRequests() > 0) {
+    Wait(1000);
+  }
+}
+
+Status IOScheduler::AsyncWrite(IOClass io_class, int fd, uint64_t offset, const char* buffer,
+                               uint64_t size, const IOCallback& cb) {
+  return Enqueue(io_class, kAsyncWrite, fd, offset, const_cast<char*>(buffer), size, nullptr, cb);
+}
+
+Status IOScheduler::AsyncRead(IOClass io_class, int fd, uint64_t offset, char* buffer,
+                              uint64_t size, const IOCallback& cb) {
+  return Enqueue(io_class, kAsyncRead, fd, offset, buffer, size, nullptr, cb);
+}
+
+Status IOScheduler::AsyncWritev(IOClass io_class, int fd, uint64_t offset,
+                                const std::vector<struct iovec>& iov, const IOCallback& cb) {
+  uint64_t size = 0;
+  for (auto& part : iov) {
+    size += part.iov_len;
+  }
+  return Enqueue(io_class, kAsyncWrite, fd, offset, nullptr, size, &iov, cb);
+}
+
+uint32_t IOScheduler::Poll() {
+  // A callback that submits the next IO of a chain should not reap the completions itself,
+  // otherwise the callbacks nest deeper with every chained request.
+  if (in_callback) {
+    Dispatch();
+    return 0;
+  }
+  uint32_t cnt = engine_->Poll();
+  Dispatch();
+  return cnt;
+}
+
+uint32_t IOScheduler::Wait(uint64_t timeout_us) {
+  uint64_t throttle_us = GetThrottleWaitUs();
+  if (throttle_us > 0) {
+    timeout_us = std::min(timeout_us, throttle_us);
+  }
+  uint32_t cnt = 0;
+  if (engine_->GetInFlightRequests() > 0) {
+    cnt = engine_->Wait(timeout_us);
+  } else if (throttle_us > 0) {
+    // Nothing to wait on the device, but the throttled requests will be ready by then.
+    clock_->SleepForUs(timeout_us);
+  } else if (busy_retries_ > 0 && queued_ > 0) {
+    // The engine rejected the queued requests while no finished request could wake us up, e.g.
+    // its slots were pinned by another thread's wait, so back off instead of spinning.
+    uint64_t backoff_us = std::min(kMaxBusyBackoffUs, kMinBusyBackoffUs << busy_retries_);
+    clock_->SleepForUs(std::min(timeout_us, backoff_us));
+  }
+  Dispatch();
+  return cnt;
+}
+
+void IOScheduler::SetClock(Clock* clock) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  clock_ = clock;
+  for (auto& limiter : limiters_) {
+    limiter.SetClock(clock);
+  }
+  engine_->SetClock(clock);
+}
+
+uint64_t IOScheduler::GetThrottleWaitUs() {
+  std::lock_guard<std::mutex> lk(mtx_);
+  uint64_t wait_us = 0;
+  for (int32_t i = 0; i < kIOClassNum; ++i) {
+    if (queues_[i].empty()) {
+      continue;
+    }
+    uint64_t class_wait_us = limiters_[i].GetWaitTimeUs();
+    if (class_wait_us > 0 && (wait_us == 0 || class_wait_us < wait_us)) {
+      wait_us = class_wait_us;
+    }
+  }
+  return wait_us;
+}
+
+uint32_t IOScheduler::GetQueuedRequests(IOClass io_class) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  return queues_[io_class].size();
+}
+
+Status IOScheduler::Enqueue(IOClass io_class, IORequestType type, int fd, uint64_t offset,
+                            char* buffer, uint64_t size, const std::vector<struct iovec>* iov,
+                            const IOCallback& cb) {
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    IOTask* task = AllocateTask();
+    task->io_class_ = io_class;
+    task->type_ = type;
+    task->fd_ = fd;
+    task->offset_ = offset;
+    task->buffer_ = buffer;
+    task->size_ = size;
+    task->iov_.clear();
+    if (iov != nullptr) {
+      task->iov_.assign(iov->begin(), iov->end());
+    }
+    task->cb_ = cb;
+    // An idle class restarts from the current virtual time.
+    if (queues_[io_class].empty()) {
+      class_vtime_[io_class] = std::max(class_vtime_[io_class], vtime_);
+    }
+    queues_[io_class].push_back(task);
+    queued_++;
+  }
+  Dispatch();
+  return Status::OK();
+}
+
+int32_t IOScheduler::PickClass() {
+  uint32_t depth = engine_->GetIODepth();
+  uint32_t in_flight = engine_->GetInFlightRequests();
+  uint32_t free_slots = in_flight >= depth ? 0 : depth - in_flight;
+  int32_t picked = -1;
+  for (int32_t i = 0; i < kIOClassNum; ++i) {
+    if (queues_[i].empty()) {
+      continue;
+    }
+    // A vectored write may take multiple slots in some engines, a longer one is split on dispatch.
+    auto* task = queues_[i].front();
+    uint32_t class_slots = GetClassSlots(i, depth);
+    uint32_t reserved = depth - class_slots;
+    uint32_t slots = task->iov_.empty() ? 1 : std::min<uint32_t>(task->iov_.size(), class_slots);
+    if (slots + reserved > free_slots) {
+      continue;
+    }
+    if (!limiters_[i].Ready()) {
+      if (throttled_since_us_[i] == 0) {
+        throttled_since_us_[i] = clock_->NowInUs();
+      }
+      continue;
+    }
+    if (throttled_since_us_[i] != 0) {
+      limiters_[i].AddThrottledTime(clock_->NowInUs() - throttled_since_us_[i]);
+      throttled_since_us_[i] = 0;
+    }
+    if (picked == -1 || class_vtime_[i] < class_vtime_[picked]) {
+      picked = i;
+    }
+  }
+  return picked;
+}
+
+void IOScheduler::Dispatch() {
+  std::vector<IOTask*> failed;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    int32_t io_class;
+    while ((io_class = PickClass()) != -1) {
+      IOTask* task = queues_[io_class].front();
+      uint32_t class_slots = GetClassSlots(io_class, engine_->GetIODepth());
+      if (task->iov_.size() > class_slots) {
+        task = SplitTask(io_class, class_slots);
+      }
+      // The engine's callback only captures two pointers, which fits the small buffer of
+      // std::function, while the real callback stays in the task.
+      auto cb = [this, task](uint64_t offset, int64_t res) { OnFinished(task, offset, res); };
+      Status s = Status::OK();
+      if (task->type_ == kAsyncRead) {
+        s = engine_->AsyncRead(task->fd_, task->offset_, task->buffer_, task->size_, cb);
+      } else if (task->iov_.empty()) {
+        s = engine_->AsyncWrite(task->fd_, task->offset_, task->buffer_, task->size_, cb);
+      } else {
+        s = engine_->AsyncWritev(task->fd_, task->offset_, task->iov_, cb);
+      }
+      if (s.code() == Status::kIOBusy) {
+        // The slots were taken by requests that bypassed the scheduler, retry on next Poll().
+        if (busy_retries_ < 7) {
+          busy_retries_++;
+        }
+        break;
+      }
+      busy_retries_ = 0;
+      queues_[io_class].pop_front();
+      queued_--;
+      if (!s.ok()) {
+        failed.push_back(task);
+        continue;
+      }
+      submitted_++;
+      limiters_[io_class].Consume(task->size_);
+      vtime_ = class_vtime_[io_class];
+      class_vtime_[io_class] += task->size_ * kClassWeights[kForegroundRead] /
+                                kClassWeights[io_class];
+    }
+  }
+  for (auto* task : failed) {
+    LOG(ERROR, "Failed to submit IO, type: {}, offset: {}, size: {}", (int)task->type_,
+        task->offset_, task->size_);
+    submitted_++;
+    OnFinished(task, task->offset_, -EIO);
+  }
+}
+
+void IOScheduler::OnFinished(IOTask* task, uint64_t offset, int64_t res) {
+  IOCallback cb = std::move(task->cb_);
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    task->cb_ = nullptr;
+    free_tasks_.push_back(task);
+  }
+  if (cb != nullptr) {
+    // A failed submission from a callback's Dispatch() runs its callback nested.
+    bool outer = in_callback;
+    in_callback = true;
+    cb(offset, res);
+    in_callback = outer;
+  }
+  submitted_--;
+}
+
+IOScheduler::IOTask* IOScheduler::SplitTask(int32_t io_class, uint32_t parts) {
+  IOTask* task = queues_[io_class].front();
+  IOTask* head = AllocateTask();
+  head->io_class_ = task->io_class_;
+  head->type_ = task->type_;
+  head->fd_ = task->fd_;
+  head->offset_ = task->offset_;
+  head->buffer_ = nullptr;
+  head->iov_.assign(task->iov_.begin(), task->iov_.begin() + parts);
+  head->size_ = 0;
+  for (auto& part : head->iov_) {
+    head->size_ += part.iov_len;
+  }
+  // The write callbacks are invoked in the submission order, so the rest of the write reports the
+  // result of the whole one.
+  auto err = std::make_shared<int64_t>(0);
+  head->cb_ = [err](uint64_t, int64_t res) {
+    if (res < 0) {
+      *err = res;
+    }
+  };
+  task->cb_ = [err, cb = std::move(task->cb_), offset = task->offset_, size = task->size_](
+                  uint64_t, int64_t res) {
+    if (cb != nullptr) {
+      cb(offset, *err < 0 ? *err : (res < 0 ? res : (int64_t)size));
+    }
+  };
+  task->iov_.erase(task->iov_.begin(), task->iov_.begin() + parts);
+  task->offset_ += head->size_;
+  task->size_ -= head->size_;
+  queues_[io_class].push_front(head);
+  queued_++;
+  return head;
+}
+
+IOScheduler::IOTask* IOScheduler::AllocateTask() {
+  if (free_tasks_.empty()) {
+    tasks_.emplace_back(new IOTask());
+    return tasks_.back().get();
+  }
+  IOTask* task = free_tasks_.back();
+  free_tasks_.pop_back();
+  return task;
+}
+}  // namespace neodb
@@ -0,0 +1,175 @@
+#pragma once
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "aio_engine.h"
+#include "neodb/options.h"
+#include "neodb/status.h"
+#include "rate_limiter.h"
+
+namespace neodb {
+
+// Priority classes of the device IO.
+enum IOClass { kForegroundRead = 0, kFlush, kGC, kIOClassNum };
+
+// IOScheduler sits between the IOHandle and the AIO engine. Requests are queued by their IO class
+// and dispatched to the engine with weighted fair queueing on bytes, so the background flush and
+// GC IO won't starve the foreground reads. A few engine slots are also reserved for the
+// foreground reads, which the background IO never takes.
+//
+// Requests are never rejected as busy, they wait in the queue until the engine has free slots.
+// Requests of the same class are dispatched in their submission order. A vectored write with more
+// parts than the slots its class could take is written in pieces, its callback is invoked once.
+//
+// Each class could also be rate limited, a throttled class is skipped until its token bucket was
+// refilled, which only happens on the next Poll() or submission.
+class IOScheduler {
+ public:
+  explicit IOScheduler(std::unique_ptr<AIOEngine> engine) : engine_(std::move(engine)) {}
+
+  ~IOScheduler();
+
+  Status AsyncWrite(IOClass io_class, int fd, uint64_t offset, const char* buffer, uint64_t size,
+                    const IOCallback& cb);
+
+  Status AsyncRead(IOClass io_class, int fd, uint64_t offset, char* buffer, uint64_t size,
+                   const IOCallback& cb);
+
+  Status AsyncWritev(IOClass io_class, int fd, uint64_t offset,
+                     const std::vector<struct iovec>& iov, const IOCallback& cb);
+
+  // Run the callbacks of the finished requests and dispatch the queued ones. Called from a
+  // callback, it only dispatches, the callbacks never nest.
+  // @return The number of finished requests.
+  uint32_t Poll();
+
+  // Block until any request finished, a throttled class could be dispatched, or timeout. Then
+  // run the callbacks and dispatch like Poll().
+  // @return The number of finished requests.
+  uint32_t Wait(uint64_t timeout_us);
+
+  // @return Both queued and submitted requests.
+  uint32_t GetInFlightRequests() { return queued_ + submitted_; }
+
+  uint32_t GetQueuedRequests(IOClass io_class);
+
+  // @param depth The engine's maximum in-flight requests, or the initial one if adaptive. It
+  // should be larger than the reserved foreground slots.
+  void SetIODepth(uint32_t depth, bool adaptive) {
+    engine_->SetIODepth(std::max(depth, kReservedForegroundSlots + 1), adaptive);
+  }
+
+  uint32_t GetIODepth() const { return engine_->GetIODepth(); }
+
+  // Adjust the class's bandwidth and IOPS limits, could be called at runtime.
+  void SetRateLimit(IOClass io_class, const RateLimit& limit) {
+    limiters_[io_class].SetLimit(limit.bytes_per_sec_, limit.iops_);
+  }
+
+  // Requests that bypass the queue (e.g. sync IO) should also take the class's tokens.
+  void AcquireRateLimit(IOClass io_class, uint64_t size) { limiters_[io_class].Acquire(size); }
+
+  // @return The total time that the class's requests were held back by its rate limit.
+  uint64_t GetThrottledTimeUs(IOClass io_class) {
+    return limiters_[io_class].GetThrottledTimeUs();
+  }
+
+  // Replace the time source of the rate limits, the throttling waits and the adaptive io depth.
+  // Should be called before any request was submitted.
+  void SetClock(Clock* clock);
+
+ private:
+  struct IOTask {
+    IOClass io_class_;
+    IORequestType type_;
+    int fd_;
+    uint64_t offset_;
+    char* buffer_;
+    uint64_t size_;
+    std::vector<struct iovec> iov_;
+    IOCallback cb_;
+  };
+
+  Status Enqueue(IOClass io_class, IORequestType type, int fd, uint64_t offset, char* buffer,
+                 uint64_t size, const std::vector<struct iovec>* iov, const IOCallback& cb);
+
+  // Submit queued requests to the engine as long as it has free slots.
+  void Dispatch();
+
+  // Pick the class with the minimal virtual time among the ones that could be dispatched now,
+  // should be called with `mtx_` held.
+  // @return The picked class, or -1 if nothing could be dispatched.
+  int32_t PickClass();
+
+  // @return The time until any throttled class could be dispatched, 0 if none is throttled.
+  uint64_t GetThrottleWaitUs();
+
+  void OnFinished(IOTask* task, uint64_t offset, int64_t res);
+
+  // Take a task from the pool, should be called with `mtx_` held.
+  IOTask* AllocateTask();
+
+  // Split the first `parts` parts of the class's head vectored write into a task of its own, which
+  // becomes the new head, should be called with `mtx_` held.
+  // @return The new head task.
+  IOTask* SplitTask(int32_t io_class, uint32_t parts);
+
+  // @return The engine slots that a request of the class could take at most, the background
+  // classes leave the reserved slots to the foreground reads. An engine that is not deeper than
+  // the reserved slots still leaves one slot to the background IO, so it's never starved.
+  static uint32_t GetClassSlots(int32_t io_class, uint32_t depth) {
+    if (io_class == kForegroundRead) {
+      return depth;
+    }
+    return depth > kReservedForegroundSlots ? depth - kReservedForegroundSlots : 1;
+  }
+
+  // Background IO could only use the engine slots except these ones.
+  static constexpr uint32_t kReservedForegroundSlots = 4;
+
+  // Backoff of Wait() if the engine rejected a request as busy while nothing was in flight, it's
+  // doubled on every rejection in a row.
+  static constexpr uint64_t kMinBusyBackoffUs = 10;
+  static constexpr uint64_t kMaxBusyBackoffUs = 1000;
+
+  // Relative bandwidth share of each class when all of them are backlogged.
+  static constexpr uint32_t kClassWeights[kIOClassNum] = {8, 4, 1};
+
+  std::unique_ptr<AIOEngine> engine_;
+
+  std::mutex mtx_;
+
+  std::deque<IOTask*> queues_[kIOClassNum];
+
+  // Virtual finish time of each class, it grows with the dispatched bytes divided by the weight.
+  uint64_t class_vtime_[kIOClassNum] = {0};
+
+  // Virtual time of the latest dispatched request, an idle class restarts from here so it cannot
+  // accumulate credits while idle.
+  uint64_t vtime_ = 0;
+
+  std::atomic<uint32_t> queued_{0};
+
+  std::atomic<uint32_t> submitted_{0};
+
+  // The engine rejected the dispatches as busy for this many times in a row.
+  std::atomic<uint32_t> busy_retries_{0};
+
+  Clock* clock_ = Clock::Default();
+
+  RateLimiter limiters_[kIOClassNum];
+
+  // Since when the class's head request was held back by its rate limit, 0 if not throttled.
+  uint64_t throttled_since_us_[kIOClassNum] = {0};
+
+  // Recycled tasks, so there's no allocation per request in the steady state.
+  std::vector<std::unique_ptr<IOTask>> tasks_;
+  std::vector<IOTask*> free_tasks_;
+};
+}  // namespace neodb
@@ -0,0 +1,375 @@
+#include "io_scheduler.h"
+
+#include <gtest/gtest.h>
+
+#include <functional>
+#include <memory>
+#include <thread>
+
+#include "logger.h"
+#include "neodb/definitions.h"
+
+namespace neodb {
+// An engine that only finishes the requests when the test asks, and records the submission order.
+class ManualAIOEngine : public AIOEngine {
+ public:
+  Status AsyncWrite(int /*fd*/, uint64_t offset, const char* /*buffer*/, uint64_t size,
+                    IOCallback cb) override {
+    return Submit(kAsyncWrite, offset, size, std::move(cb));
+  }
+
+  Status AsyncRead(int /*fd*/, uint64_t offset, char* /*buffer*/, uint64_t size,
+                   IOCallback cb) override {
+    return Submit(kAsyncRead, offset, size, std::move(cb));
+  }
+
+  Status AsyncWritev(int /*fd*/, uint64_t offset, const std::vector<struct iovec>& iov,
+                     IOCallback cb) override {
+    uint64_t size = 0;
+    for (auto& part : iov) {
+      size += part.iov_len;
+    }
+    return Submit(kAsyncWrite, offset, size, std::move(cb));
+  }
+
+  uint32_t Poll() override {
+    uint32_t cnt = 0;
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+      if (finish_budget_ == 0) {
+        return 0;
+      }
+      for (uint32_t slot = 0; slot < slots_.size() && finish_budget_ > 0; ++slot) {
+        if (slots_[slot].in_use_ && !slots_[slot].done_) {
+          cnt += FinishSlot(slot, (int64_t)slots_[slot].size_);
+          finish_budget_--;
+        }
+      }
+    }
+    RunCallbacks();
+    return cnt;
+  }
+
+  // Allow the next `n` requests to finish.
+  void Finish(uint32_t n) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    finish_budget_ += n;
+  }
+
+  std::vector<uint64_t> submitted_;
+
+  // Reject the next requests as busy even if the engine has free slots.
+  uint32_t busy_num_ = 0;
+
+  // Set the io depth as is, even a depth that SetIODepth() won't allow.
+  void ForceIODepth(uint32_t depth) { io_depth_ = depth; }
+
+  uint32_t max_in_flight_ = 0;
+
+ private:
+  Status Submit(IORequestType type, uint64_t offset, uint64_t size, IOCallback&& cb) {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (busy_num_ > 0) {
+      busy_num_--;
+      return Status::Busy();
+    }
+    if (AllocateSlot(type, offset, size, std::move(cb)) == -1) {
+      return Status::Busy();
+    }
+    max_in_flight_ = std::max<uint32_t>(max_in_flight_, in_flight_);
+    submitted_.push_back(offset);
+    return Status::OK();
+  }
+
+  uint64_t finish_budget_ = 0;
+};
+
+class IOSchedulerTest : public ::testing::Test {
+ public:
+  void SetUp() override {
+    InitLogger();
+    auto engine = std::make_unique<ManualAIOEngine>();
+    engine_ = engine.get();
+    scheduler_ = std::make_unique<IOScheduler>(std::move(engine));
+    scheduler_->SetClock(&clock_);
+  }
+
+  void TearDown() override {
+    engine_->Finish(UINT32_MAX);
+    scheduler_.reset();
+  }
+
+  ManualClock clock_;
+  ManualAIOEngine* engine_;
+  std::unique_ptr<IOScheduler> scheduler_;
+};
+
+TEST_F(IOSchedulerTest, ReservedForegroundSlotsTest) {
+  uint64_t io_size = 2UL << 20;
+  // The background writes could not take all engine slots.
+  for (int i = 0; i < 30; ++i) {
+    scheduler_->AsyncWrite(kFlush, 0, i * io_size, nullptr, io_size, nullptr);
+  }
+  uint32_t depth = engine_->GetIODepth();
+  EXPECT_LT(engine_->GetInFlightRequests(), depth);
+  EXPECT_EQ(scheduler_->GetInFlightRequests(), 30);
+  uint32_t background = engine_->GetInFlightRequests();
+
+  // So a foreground read is submitted immediately.
+  bool read_done = false;
+  scheduler_->AsyncRead(kForegroundRead, 0, 1, nullptr, IO_PAGE_SIZE,
+                        [&](uint64_t, int64_t) { read_done = true; });
+  EXPECT_EQ(engine_->GetInFlightRequests(), background + 1);
+  EXPECT_EQ(engine_->submitted_.back(), 1);
+
+  // All requests finished in the end, the flush writes are submitted in order.
+  while (scheduler_->GetInFlightRequests() > 0) {
+    engine_->Finish(1);
+    scheduler_->Poll();
+  }
+  EXPECT_TRUE(read_done);
+  uint64_t last_offset = 0;
+  for (auto offset : engine_->submitted_) {
+    if (offset != 1) {
+      EXPECT_GE(offset, last_offset);
+      last_offset = offset;
+    }
+  }
+}
+
+TEST_F(IOSchedulerTest, SplitVectoredWriteTest) {
+  scheduler_->SetIODepth(20, false);
+  // The flush class could take 16 slots, so the write is split into 16, 16 and 8 parts.
+  std::vector<struct iovec> iov(40, {nullptr, IO_PAGE_SIZE});
+  uint64_t offset = 1UL << 20;
+  int64_t result = 0;
+  uint32_t calls = 0;
+  scheduler_->AsyncWritev(kFlush, 0, offset, iov, [&](uint64_t cb_offset, int64_t res) {
+    EXPECT_EQ(cb_offset, offset);
+    result = res;
+    calls++;
+  });
+  while (scheduler_->GetInFlightRequests() > 0) {
+    engine_->Finish(1);
+    scheduler_->Poll();
+  }
+  EXPECT_EQ(calls, 1);
+  EXPECT_EQ(result, 40 * IO_PAGE_SIZE);
+  std::vector<uint64_t> expected = {offset, offset + 16 * IO_PAGE_SIZE, offset + 32 * IO_PAGE_SIZE};
+  EXPECT_EQ(engine_->submitted_, expected);
+}
+
+TEST_F(IOSchedulerTest, ShallowEngineTest) {
+  // An engine that is not deeper than the reserved foreground slots still takes the background
+  // IO, one request at a time.
+  engine_->ForceIODepth(2);
+  uint32_t finished = 0;
+  auto cb = [&](uint64_t, int64_t res) {
+    EXPECT_GT(res, 0);
+    finished++;
+  };
+  for (int i = 0; i < 3; ++i) {
+    scheduler_->AsyncWrite(kFlush, 0, i * IO_PAGE_SIZE, nullptr, IO_PAGE_SIZE, cb);
+  }
+  std::vector<struct iovec> iov(5, {nullptr, IO_PAGE_SIZE});
+  scheduler_->AsyncWritev(kGC, 0, 1UL << 20, iov, cb);
+  EXPECT_EQ(engine_->GetInFlightRequests(), 1);
+
+  // The foreground read takes the other slot.
+  scheduler_->AsyncRead(kForegroundRead, 0, 1, nullptr, IO_PAGE_SIZE, cb);
+  EXPECT_EQ(engine_->GetInFlightRequests(), 2);
+  while (scheduler_->GetInFlightRequests() > 0) {
+    engine_->Finish(1);
+    scheduler_->Poll();
+  }
+  EXPECT_EQ(finished, 5);
+  EXPECT_LE(engine_->max_in_flight_, 2);
+}
+
+TEST_F(IOSchedulerTest, WeightedFairDispatchTest) {
+  uint64_t io_size = 1UL << 20;
+  // Saturate the engine with GC reads first.
+  const uint64_t gc_base = 1UL << 40;
+  for (int i = 0; i < 200; ++i) {
+    scheduler_->AsyncRead(kGC, 0, gc_base + i * io_size, nullptr, io_size, nullptr);
+  }
+  for (int i = 0; i < 200; ++i) {
+    scheduler_->AsyncWrite(kFlush, 0, i * io_size, nullptr, io_size, nullptr);
+  }
+  uint32_t initial = engine_->submitted_.size();
+
+  // Once both classes are backlogged, flush should get about 4 times the bandwidth of GC.
+  while (engine_->submitted_.size() < initial + 100) {
+    engine_->Finish(1);
+    scheduler_->Poll();
+  }
+  uint32_t flush_cnt = 0;
+  uint32_t gc_cnt = 0;
+  for (uint32_t i = initial; i < initial + 100; ++i) {
+    if (engine_->submitted_[i] >= gc_base) {
+      gc_cnt++;
+    } else {
+      flush_cnt++;
+    }
+  }
+  LOG(INFO, "flush: {}, gc: {}", flush_cnt, gc_cnt);
+  EXPECT_GE(flush_cnt, 70);
+  EXPECT_GE(gc_cnt, 10);
+}
+
+TEST_F(IOSchedulerTest, ChainedCallbackTest) {
+  // Each callback submits the next read of the chain and polls, which must not run the next
+  // callback nested in it.
+  const uint32_t chain = 100;
+  uint32_t finished = 0;
+  uint32_t depth = 0;
+  uint32_t max_depth = 0;
+  std::function<void(uint64_t, int64_t)> next = [&](uint64_t offset, int64_t) {
+    depth++;
+    max_depth = std::max(max_depth, depth);
+    if (++finished < chain) {
+      scheduler_->AsyncRead(kForegroundRead, 0, offset + 1, nullptr, IO_PAGE_SIZE, next);
+      scheduler_->Poll();
+    }
+    depth--;
+  };
+  scheduler_->AsyncRead(kForegroundRead, 0, 0, nullptr, IO_PAGE_SIZE, next);
+  engine_->Finish(UINT32_MAX);
+  while (scheduler_->GetInFlightRequests() > 0) {
+    scheduler_->Poll();
+  }
+  EXPECT_EQ(finished, chain);
+  EXPECT_EQ(max_depth, 1);
+}
+
+TEST_F(IOSchedulerTest, BusyRetryTest) {
+  // The engine rejects the request while nothing is in flight, so no completion wakes up the
+  // waiter. Each Wait() backs off and retries once.
+  engine_->busy_num_ = 5;
+  bool done = false;
+  scheduler_->AsyncWrite(kFlush, 0, 0, nullptr, IO_PAGE_SIZE,
+                         [&](uint64_t, int64_t) { done = true; });
+  EXPECT_TRUE(engine_->submitted_.empty());
+  uint32_t waits = 0;
+  while (engine_->submitted_.empty()) {
+    scheduler_->Wait(1000000);
+    waits++;
+  }
+  EXPECT_EQ(waits, 5);
+  engine_->Finish(1);
+  while (!done) {
+    scheduler_->Wait(1000);
+  }
+}
+
+TEST_F(IOSchedulerTest, RateLimitTest) {
+  uint64_t io_size = 1UL << 20;
+  // 40MB/s, the bucket holds 4MB of idle tokens.
+  scheduler_->SetRateLimit(kFlush, {40UL << 20, 0});
+  uint64_t start = clock_.NowInUs();
+  for (int i = 0; i < 20; ++i) {
+    scheduler_->AsyncWrite(kFlush, 0, i * io_size, nullptr, io_size, nullptr);
+  }
+  // Only the burst was dispatched, the last one of which goes into debt.
+  EXPECT_EQ(engine_->submitted_.size(), 5);
+  EXPECT_EQ(scheduler_->GetQueuedRequests(kFlush), 15);
+
+  // The foreground reads are not limited.
+  bool read_done = false;
+  scheduler_->AsyncRead(kForegroundRead, 0, 1, nullptr, IO_PAGE_SIZE,
+                        [&](uint64_t, int64_t) { read_done = true; });
+  EXPECT_EQ(engine_->submitted_.back(), 1);
+
+  // Free engine slots won't help before the debt was paid off.
+  engine_->Finish(6);
+  scheduler_->Poll();
+  EXPECT_TRUE(read_done);
+  EXPECT_EQ(scheduler_->GetQueuedRequests(kFlush), 15);
+  clock_.Advance(24UL * 1000);
+  scheduler_->Poll();
+  EXPECT_EQ(scheduler_->GetQueuedRequests(kFlush), 15);
+  // Each 1MB takes 25ms.
+  clock_.Advance(1000);
+  scheduler_->Poll();
+  EXPECT_EQ(scheduler_->GetQueuedRequests(kFlush), 14);
+
+  while (scheduler_->GetInFlightRequests() > 0) {
+    clock_.Advance(1000);
+    engine_->Finish(1);
+    scheduler_->Poll();
+  }
+  // The 15 requests over the burst took 375ms.
+  uint64_t elapsed = clock_.NowInUs() - start;
+  EXPECT_GE(elapsed, 375UL * 1000);
+  EXPECT_LE(elapsed, 380UL * 1000);
+  EXPECT_GE(scheduler_->GetThrottledTimeUs(kFlush), 370UL * 1000);
+  EXPECT_LE(scheduler_->GetThrottledTimeUs(kFlush), elapsed);
+  EXPECT_EQ(scheduler_->GetThrottledTimeUs(kForegroundRead), 0);
+
+  // Lift the limit at runtime.
+  uint64_t throttled = scheduler_->GetThrottledTimeUs(kFlush);
+  scheduler_->SetRateLimit(kFlush, {0, 0});
+  for (int i = 0; i < 10; ++i) {
+    scheduler_->AsyncWrite(kFlush, 0, i * io_size, nullptr, io_size, nullptr);
+  }
+  EXPECT_EQ(scheduler_->GetQueuedRequests(kFlush), 0);
+  while (scheduler_->GetInFlightRequests() > 0) {
+    engine_->Finish(1);
+    scheduler_->Poll();
+  }
+  EXPECT_EQ(scheduler_->GetThrottledTimeUs(kFlush), throttled);
+}
+
+TEST_F(IOSchedulerTest, IOPSLimitTest) {
+  RateLimiter limiter(0, 100);
+  limiter.SetClock(&clock_);
+  uint64_t start = clock_.NowInUs();
+  // The first 10 requests are the burst, each of the other 20 waits 10ms for its token.
+  for (int i = 0; i < 10; ++i) {
+    limiter.Acquire(IO_PAGE_SIZE);
+  }
+  EXPECT_EQ(clock_.NowInUs(), start);
+  EXPECT_EQ(limiter.GetThrottledTimeUs(), 0);
+  for (int i = 0; i < 20; ++i) {
+    limiter.Acquire(IO_PAGE_SIZE);
+  }
+  uint64_t elapsed = clock_.NowInUs() - start;
+  EXPECT_GE(elapsed, 200UL * 1000);
+  EXPECT_LE(elapsed, 201UL * 1000);
+  EXPECT_EQ(limiter.GetThrottledTimeUs(), elapsed);
+}
+
+TEST_F(IOSchedulerTest, AdaptiveIODepthTest) {
+  scheduler_->SetIODepth(20, true);
+  uint64_t io_size = 128UL << 10;
+  uint64_t offset = 0;
+  // Keep the scheduler backlogged, and finish `finish(in_flight)` requests every `step_us`.
+  auto run = [&](uint32_t steps, uint64_t step_us,
+                 const std::function<uint32_t(uint32_t)>& finish) {
+    for (uint32_t i = 0; i < steps; ++i) {
+      while (scheduler_->GetQueuedRequests(kFlush) < 200) {
+        scheduler_->AsyncWrite(kFlush, 0, offset, nullptr, io_size, nullptr);
+        offset += io_size;
+      }
+      clock_.Advance(step_us);
+      engine_->Finish(finish(engine_->GetInFlightRequests()));
+      scheduler_->Poll();
+    }
+  };
+
+  // A device that scales with the depth, the latency stays the same so the depth keeps growing.
+  run(200, 2000, [](uint32_t in_flight) { return in_flight; });
+  uint32_t grown = scheduler_->GetIODepth();
+  LOG(INFO, "io depth of a scalable device: {}", grown);
+  EXPECT_GT(grown, 40);
+
+  // A saturated device with a fixed throughput, the latency grows with the depth but the
+  // throughput doesn't, so the depth should be reduced.
+  run(400, 2000, [](uint32_t in_flight) { return std::min(in_flight, 8U); });
+  uint32_t reduced = scheduler_->GetIODepth();
+  LOG(INFO, "io depth of a saturated device: {}", reduced);
+  EXPECT_LT(reduced, grown);
+  EXPECT_LE(reduced, 48);
+  EXPECT_GE(reduced, AIOEngine::kMinIODepth);
+}
+}  // namespace neodb
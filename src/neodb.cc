@@ -1,16 +1,54 @@
 #include "neodb/neodb.h"
 
+#include <algorithm>
+
 #include "utils.h"
 
 namespace neodb {
-Status NeoDB::Put(const std::string& key, const std::string& value) {
+Status NeoDB::Put(const std::string& key, const std::string& value,
+                  const WriteOptions& options) {
+  auto value_ptr = std::make_shared<IOBuf>(value);
+  return Put(key, value_ptr, options);
+}
+
+Status NeoDB::Put(const std::string& key, const std::shared_ptr<IOBuf>& value,
+                  const WriteOptions& options) {
+  uint32_t store_idx = HashUtils::FastHash(key) % store_num_;
+  return stores_[store_idx]->Put(key, value, options);
+}
+
+Status NeoDB::TryPut(const std::string& key, const std::string& value) {
   auto value_ptr = std::make_shared<IOBuf>(value);
-  return Put(key, value_ptr);
+  return TryPut(key, value_ptr);
 }
 
-Status NeoDB::Put(const std::string& key, const std::shared_ptr<IOBuf>& value) {
+Status NeoDB::TryPut(const std::string& key, const std::shared_ptr<IOBuf>& value) {
   uint32_t store_idx = HashUtils::FastHash(key) % store_num_;
-  return stores_[store_idx]->Put(key, value);
+  return stores_[store_idx]->TryPut(key, value);
+}
+
+Status NeoDB::Write(const WriteBatch& batch, const WriteOptions& options) {
+  std::vector<std::vector<const WriteBatch::Item*>> store_items(store_num_);
+  for (auto& item : batch.GetItems()) {
+    store_items[HashUtils::FastHash(item.first) % store_num_].push_back(&item);
+  }
+  Status status = Status::OK();
+  for (uint32_t i = 0; i < store_num_; ++i) {
+    if (store_items[i].empty()) {
+      continue;
+    }
+    auto s = stores_[i]->Write(store_items[i], options);
+    if (!s.ok()) {
+      status = s;
+    }
+  }
+  return status;
+}
+
+Status NeoDB::OpenValueWriter(const std::string& key, uint32_t value_size,
+                              std::unique_ptr<ValueWriter>* writer) {
+  uint32_t store_idx = HashUtils::FastHash(key) % store_num_;
+  return stores_[store_idx]->OpenValueWriter(key, value_size, writer);
 }
 
 Status NeoDB::Get(const std::string& key, std::string* value) {
@@ -28,4 +66,56 @@ Status NeoDB::Get(const std::string& key, std::shared_ptr<IOBuf>& value) {
   return stores_[store_idx]->Get(key, value);
 }
 
+Status NeoDB::AsyncGet(const std::string& key, const Store::GetCallback& cb) {
+  uint32_t store_idx = HashUtils::FastHash(key) % store_num_;
+  return stores_[store_idx]->AsyncGet(key, cb);
+}
+
+Status NeoDB::Flush() {
+  Status status = Status::OK();
+  for (auto& store : stores_) {
+    auto s = store->Flush();
+    if (!s.ok()) {
+      status = s;
+    }
+  }
+  return status;
+}
+
+WriteStallStats NeoDB::GetWriteStallStats() const {
+  WriteStallStats total;
+  for (auto& store : stores_) {
+    auto stats = store->GetWriteStallStats();
+    total.stall_num_ += stats.stall_num_;
+    total.stall_us_ += stats.stall_us_;
+    total.rejected_num_ += stats.rejected_num_;
+  }
+  return total;
+}
+
+uint32_t NeoDB::Poll() {
+  uint32_t cnt = 0;
+  for (auto& store : stores_) {
+    cnt += store->Poll();
+  }
+  return cnt;
+}
+
+uint32_t NeoDB::Wait(uint64_t timeout_us) {
+  uint32_t cnt = Poll();
+  if (cnt > 0 || stores_.empty()) {
+    return cnt;
+  }
+  // The stores are waited in turn, so the IO of the others wait at most their shares of the
+  // timeout.
+  uint64_t store_timeout_us = std::max<uint64_t>(1, timeout_us / stores_.size());
+  for (auto& store : stores_) {
+    cnt += store->Wait(store_timeout_us);
+    if (cnt > 0) {
+      break;
+    }
+  }
+  return cnt;
+}
+
 }  // namespace neodb
\ No newline at end of file
@@ -91,4 +91,83 @@ TEST_F(NeoDBTest, LargeAmountPutAndGetTest) {
   LOG(INFO, "hits: {}, not_found: {}, total: {}, hit rate: {}", hits, not_found, total,
       hits * 100 / total);
 }
-}  // namespace neodb
\ No newline at end of file
+
+TEST_F(NeoDBTest, AsyncGetTest) {
+  DBOptions db_options;
+  StoreOptions store_options;
+
+  store_options.device_capacity_ = 100UL << 20;
+  store_options.device_path_ = CreateRandomFile(store_options.device_capacity_);
+  store_options.device_zone_capacity_ = 10UL << 20;
+  store_options.write_buffer_size_ = 1UL << 20;
+
+  db_options.store_options_list_.push_back(store_options);
+  NeoDB db(db_options);
+
+  std::map<std::string, std::string> source;
+  for (int i = 0; i < 200; ++i) {
+    std::string key = StringUtils::GenerateRandomString(10);
+    std::string value = StringUtils::GenerateRandomString(100UL << 10);
+    db.Put(key, value);
+    source.emplace(key, value);
+  }
+
+  // Keep all reads in flight from a single thread and wait for them.
+  std::atomic<uint32_t> finished{0};
+  std::atomic<uint32_t> matched{0};
+  uint32_t submitted = 0;
+  for (auto& item : source) {
+    auto s = db.AsyncGet(item.first, [&](Status s, const std::shared_ptr<IOBuf>& value) {
+      if (s.ok() && value->Data() == item.second) {
+        matched++;
+      }
+      finished++;
+    });
+    if (s.ok()) {
+      submitted++;
+    }
+  }
+  while (finished < submitted) {
+    db.Wait();
+  }
+  EXPECT_EQ(submitted, source.size());
+  EXPECT_EQ(matched, submitted);
+}
+
+TEST_F(NeoDBTest, WriteBatchTest) {
+  DBOptions db_options;
+  for (int i = 0; i < 2; ++i) {
+    StoreOptions store_options;
+    store_options.device_capacity_ = 100UL << 20;
+    store_options.device_path_ = CreateRandomFile(store_options.device_capacity_);
+    store_options.device_zone_capacity_ = 10UL << 20;
+    store_options.write_buffer_size_ = 1UL << 20;
+    store_options.writable_buffer_num_ = 2;
+    db_options.store_options_list_.push_back(store_options);
+  }
+  NeoDB db(db_options);
+
+  // The batch spans both stores and a few write buffers of each.
+  std::map<std::string, std::string> source;
+  WriteBatch batch;
+  for (int i = 0; i < 300; ++i) {
+    std::string key = "key_" + std::to_string(i);
+    std::string value = StringUtils::GenerateRandomString(10UL << 10);
+    batch.Put(key, value);
+    source[key] = value;
+  }
+  // The later put of a key wins.
+  batch.Put("key_0", "overwritten");
+  source["key_0"] = "overwritten";
+  ASSERT_EQ(batch.Count(), 301);
+  WriteOptions write_options;
+  write_options.sync_ = true;
+  ASSERT_TRUE(db.Write(batch, write_options).ok());
+
+  for (auto& item : source) {
+    std::string value;
+    ASSERT_TRUE(db.Get(item.first, &value).ok());
+    EXPECT_EQ(value, item.second);
+  }
+}
+}  // namespace neodb
@@ -0,0 +1,95 @@
+#include "rate_limiter.h"
+
+#include <algorithm>
+
+namespace neodb {
+
+void RateLimiter::SetLimit(uint64_t bytes_per_sec, uint64_t iops) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  Refill();
+  bytes_per_sec_ = bytes_per_sec;
+  iops_ = iops;
+  // Start with a full bucket, and drop the debt of the old limit.
+  byte_tokens_ = double(bytes_per_sec) * kBurstUs / 1000000;
+  io_tokens_ = std::max(double(iops) * kBurstUs / 1000000, 1.0);
+  last_refill_us_ = clock_->NowInUs();
+}
+
+void RateLimiter::SetClock(Clock* clock) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  clock_ = clock;
+  last_refill_us_ = clock_->NowInUs();
+}
+
+bool RateLimiter::Ready() {
+  if (Unlimited()) {
+    return true;
+  }
+  std::lock_guard<std::mutex> lk(mtx_);
+  Refill();
+  return GetWaitTimeUsLocked() == 0;
+}
+
+void RateLimiter::Consume(uint64_t bytes) {
+  if (Unlimited()) {
+    return;
+  }
+  std::lock_guard<std::mutex> lk(mtx_);
+  byte_tokens_ -= double(bytes);
+  io_tokens_ -= 1;
+}
+
+void RateLimiter::Acquire(uint64_t bytes) {
+  uint64_t start = 0;
+  uint64_t wait_us;
+  while ((wait_us = GetWaitTimeUs()) > 0) {
+    if (start == 0) {
+      start = clock_->NowInUs();
+    }
+    clock_->SleepForUs(wait_us);
+  }
+  if (start != 0) {
+    AddThrottledTime(clock_->NowInUs() - start);
+  }
+  Consume(bytes);
+}
+
+uint64_t RateLimiter::GetWaitTimeUs() {
+  if (Unlimited()) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lk(mtx_);
+  Refill();
+  return GetWaitTimeUsLocked();
+}
+
+void RateLimiter::Refill() {
+  uint64_t now = clock_->NowInUs();
+  if (now <= last_refill_us_) {
+    return;
+  }
+  double elapsed = now - last_refill_us_;
+  last_refill_us_ = now;
+  if (bytes_per_sec_ > 0) {
+    double burst = double(bytes_per_sec_) * kBurstUs / 1000000;
+    byte_tokens_ = std::min(byte_tokens_ + elapsed * bytes_per_sec_ / 1000000, burst);
+  }
+  if (iops_ > 0) {
+    double burst = std::max(double(iops_) * kBurstUs / 1000000, 1.0);
+    io_tokens_ = std::min(io_tokens_ + elapsed * iops_ / 1000000, burst);
+  }
+}
+
+uint64_t RateLimiter::GetWaitTimeUsLocked() const {
+  uint64_t wait_us = 0;
+  // A debt of less than a byte is the rounding error of the refills.
+  if (bytes_per_sec_ > 0 && byte_tokens_ <= -1) {
+    wait_us = uint64_t(-byte_tokens_ * 1000000 / bytes_per_sec_) + 1;
+  }
+  // A request takes a whole IO token.
+  if (iops_ > 0 && io_tokens_ < 1) {
+    wait_us = std::max(wait_us, uint64_t((1 - io_tokens_) * 1000000 / iops_) + 1);
+  }
+  return wait_us;
+}
+}  // namespace neodb
@@ -0,0 +1,76 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+
+#include "clock.h"
+
+namespace neodb {
+
+// A token bucket limiter on both bandwidth and IOPS, 0 means unlimited.
+//
+// A request is admitted as long as the buckets are not in debt, and its cost is taken afterwards,
+// so a single request larger than the bucket could still pass and the following ones wait until
+// the debt was paid off. The buckets only keep `kBurstUs` worth of idle tokens.
+// The limits could be adjusted at runtime by any thread.
+class RateLimiter {
+ public:
+  RateLimiter() = default;
+
+  RateLimiter(uint64_t bytes_per_sec, uint64_t iops) { SetLimit(bytes_per_sec, iops); }
+
+  void SetLimit(uint64_t bytes_per_sec, uint64_t iops);
+
+  // Replace the time source, the bucket refills from the new clock's current time.
+  void SetClock(Clock* clock);
+
+  uint64_t GetBytesPerSec() const { return bytes_per_sec_; }
+
+  uint64_t GetIOPS() const { return iops_; }
+
+  bool Unlimited() const { return bytes_per_sec_ == 0 && iops_ == 0; }
+
+  // @return True if a request could be admitted now, no tokens are taken.
+  bool Ready();
+
+  // Take the tokens of an admitted request.
+  void Consume(uint64_t bytes);
+
+  // Wait until the request could be admitted and take its tokens. The waiting time is counted as
+  // throttled time.
+  void Acquire(uint64_t bytes);
+
+  // @return The time to wait until the next request could be admitted, 0 if it's ready now.
+  uint64_t GetWaitTimeUs();
+
+  void AddThrottledTime(uint64_t us) { throttled_us_ += us; }
+
+  // @return The total time that requests were held back by this limiter.
+  uint64_t GetThrottledTimeUs() const { return throttled_us_; }
+
+ private:
+  // Add the tokens since last refill, should be called with `mtx_` held.
+  void Refill();
+
+  // Should be called with `mtx_` held.
+  uint64_t GetWaitTimeUsLocked() const;
+
+  // Idle tokens are capped at this amount of time.
+  static constexpr uint64_t kBurstUs = 100UL * 1000;
+
+  std::mutex mtx_;
+
+  Clock* clock_ = Clock::Default();
+
+  std::atomic<uint64_t> bytes_per_sec_{0};
+  std::atomic<uint64_t> iops_{0};
+
+  // Could be negative if a request cost more than the available tokens.
+  double byte_tokens_ = 0;
+  double io_tokens_ = 0;
+
+  uint64_t last_refill_us_ = 0;
+
+  std::atomic<uint64_t> throttled_us_{0};
+};
+}  // namespace neodb
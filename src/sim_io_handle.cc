@@ -0,0 +1,376 @@
+#include "sim_io_handle.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "logger.h"
+#include "utils.h"
+
+namespace neodb {
+
+SimDevice::SimDevice(uint64_t capacity, uint64_t zone_capacity, const SimDeviceOptions& options)
+    : capacity_(capacity),
+      zone_capacity_(zone_capacity),
+      options_(options),
+      rng_(options.seed_),
+      channels_(std::max<uint32_t>(1, options.parallelism_), 0),
+      zone_data_((capacity + zone_capacity - 1) / zone_capacity) {}
+
+uint64_t SimDevice::Schedule(IORequestType type, uint64_t size) {
+  bool read = type == kAsyncRead;
+  auto& latency = read ? options_.read_latency_ : options_.write_latency_;
+  uint64_t bytes_per_sec = read ? options_.read_bytes_per_sec_ : options_.write_bytes_per_sec_;
+  uint64_t& transfer_free_us = read ? read_transfer_free_us_ : write_transfer_free_us_;
+
+  std::lock_guard<std::mutex> lk(model_mtx_);
+  uint64_t service_us = latency.base_us_;
+  if (latency.jitter_us_ > 0) {
+    std::exponential_distribution<double> jitter(1.0 / latency.jitter_us_);
+    service_us += uint64_t(jitter(rng_));
+  }
+  if (options_.spike_ppm_ > 0 && rng_() % 1000000 < options_.spike_ppm_) {
+    service_us += options_.spike_latency_us_;
+    spike_num_++;
+  }
+  // Wait for a free channel, so the requests queue up once they exceed the parallelism.
+  auto channel = std::min_element(channels_.begin(), channels_.end());
+  uint64_t finish_us = std::max(clock_->NowInUs(), *channel) + service_us;
+  if (bytes_per_sec > 0) {
+    finish_us = std::max(finish_us, transfer_free_us) + size * 1000000 / bytes_per_sec;
+    transfer_free_us = finish_us;
+  }
+  *channel = finish_us;
+  return finish_us;
+}
+
+Status SimDevice::CheckRange(uint64_t offset, uint64_t size) const {
+  if (offset + size > capacity_) {
+    LOG(ERROR, "Out of the simulated device, offset: {}, size: {}, capacity: {}", offset, size,
+        capacity_);
+    return Status::IOError("Out of device range");
+  }
+  return Status::OK();
+}
+
+Status SimDevice::Write(uint64_t offset, const char* buffer, uint64_t size) {
+  auto s = CheckRange(offset, size);
+  if (!s.ok()) {
+    return s;
+  }
+  while (size > 0) {
+    uint64_t zone_id = offset / zone_capacity_;
+    uint64_t zone_offset = offset % zone_capacity_;
+    uint64_t len = std::min(size, zone_capacity_ - zone_offset);
+    bool copied = false;
+    {
+      std::shared_lock<std::shared_mutex> lk(data_mtx_);
+      if (zone_data_[zone_id] != nullptr) {
+        memcpy(zone_data_[zone_id].get() + zone_offset, buffer, len);
+        copied = true;
+      }
+    }
+    if (!copied) {
+      // The first write of the zone.
+      std::unique_lock<std::shared_mutex> lk(data_mtx_);
+      if (zone_data_[zone_id] == nullptr) {
+        zone_data_[zone_id].reset(new char[zone_capacity_]());
+      }
+      memcpy(zone_data_[zone_id].get() + zone_offset, buffer, len);
+    }
+    offset += len;
+    buffer += len;
+    size -= len;
+  }
+  return Status::OK();
+}
+
+Status SimDevice::Read(uint64_t offset, char* buffer, uint64_t size) {
+  auto s = CheckRange(offset, size);
+  if (!s.ok()) {
+    return s;
+  }
+  std::shared_lock<std::shared_mutex> lk(data_mtx_);
+  while (size > 0) {
+    uint64_t zone_id = offset / zone_capacity_;
+    uint64_t zone_offset = offset % zone_capacity_;
+    uint64_t len = std::min(size, zone_capacity_ - zone_offset);
+    if (zone_data_[zone_id] != nullptr) {
+      memcpy(buffer, zone_data_[zone_id].get() + zone_offset, len);
+    } else {
+      memset(buffer, 0, len);
+    }
+    offset += len;
+    buffer += len;
+    size -= len;
+  }
+  return Status::OK();
+}
+
+void SimDevice::Discard(uint64_t offset, uint64_t size) {
+  if (!CheckRange(offset, size).ok()) {
+    return;
+  }
+  std::unique_lock<std::shared_mutex> lk(data_mtx_);
+  while (size > 0) {
+    uint64_t zone_id = offset / zone_capacity_;
+    uint64_t zone_offset = offset % zone_capacity_;
+    uint64_t len = std::min(size, zone_capacity_ - zone_offset);
+    if (len == zone_capacity_) {
+      zone_data_[zone_id].reset();
+    } else if (zone_data_[zone_id] != nullptr) {
+      memset(zone_data_[zone_id].get() + zone_offset, 0, len);
+    }
+    offset += len;
+    size -= len;
+  }
+}
+
+uint64_t SimDevice::GetMemoryUsage() {
+  std::shared_lock<std::shared_mutex> lk(data_mtx_);
+  uint64_t bytes = 0;
+  for (auto& data : zone_data_) {
+    bytes += data != nullptr ? zone_capacity_ : 0;
+  }
+  return bytes;
+}
+
+void SimDevice::WaitUntil(uint64_t finish_us) {
+  uint64_t now = clock_->NowInUs();
+  if (finish_us > now) {
+    clock_->SleepForUs(finish_us - now);
+  }
+}
+
+Status SimAIOEngine::AsyncWrite(int /*fd*/, uint64_t offset, const char* buffer, uint64_t size,
+                                IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  int32_t slot = AllocateSlot(kAsyncWrite, offset, size, std::move(cb));
+  if (slot == -1) {
+    return Status::Busy();
+  }
+  auto s = device_->Write(offset, buffer, size);
+  if (!s.ok()) {
+    CancelSlot(slot);
+    return s;
+  }
+  Submit(slot, kAsyncWrite, size);
+  return Status::OK();
+}
+
+Status SimAIOEngine::AsyncRead(int /*fd*/, uint64_t offset, char* buffer, uint64_t size,
+                               IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  int32_t slot = AllocateSlot(kAsyncRead, offset, size, std::move(cb));
+  if (slot == -1) {
+    return Status::Busy();
+  }
+  auto s = device_->Read(offset, buffer, size);
+  if (!s.ok()) {
+    CancelSlot(slot);
+    return s;
+  }
+  Submit(slot, kAsyncRead, size);
+  return Status::OK();
+}
+
+Status SimAIOEngine::AsyncWritev(int /*fd*/, uint64_t offset, const std::vector<struct iovec>& iov,
+                                 IOCallback cb) {
+  std::lock_guard<std::mutex> lk(mtx_);
+  uint64_t total = 0;
+  for (auto& part : iov) {
+    total += part.iov_len;
+  }
+  int32_t slot = AllocateSlot(kAsyncWrite, offset, total, std::move(cb));
+  if (slot == -1) {
+    return Status::Busy();
+  }
+  uint64_t part_offset = offset;
+  for (auto& part : iov) {
+    auto s = device_->Write(part_offset, static_cast<const char*>(part.iov_base), part.iov_len);
+    if (!s.ok()) {
+      CancelSlot(slot);
+      return s;
+    }
+    part_offset += part.iov_len;
+  }
+  Submit(slot, kAsyncWrite, total);
+  return Status::OK();
+}
+
+void SimAIOEngine::Submit(uint32_t slot, IORequestType type, uint64_t size) {
+  slots_[slot].res_ = int64_t(size);
+  pending_.emplace(device_->Schedule(type, size), slot);
+}
+
+uint32_t SimAIOEngine::Poll() {
+  uint32_t cnt = 0;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    uint64_t now = device_->NowInUs();
+    while (!pending_.empty() && pending_.top().first <= now) {
+      uint32_t slot = pending_.top().second;
+      pending_.pop();
+      cnt += FinishSlot(slot, slots_[slot].res_);
+    }
+  }
+  RunCallbacks();
+  return cnt;
+}
+
+uint32_t SimAIOEngine::Wait(uint64_t timeout_us) {
+  uint64_t deadline = device_->NowInUs() + timeout_us;
+  {
+    std::lock_guard<std::mutex> lk(mtx_);
+    if (!pending_.empty()) {
+      deadline = std::min(deadline, pending_.top().first);
+    }
+  }
+  device_->WaitUntil(deadline);
+  return Poll();
+}
+
+SimIOHandle::SimIOHandle(const StoreOptions& options)
+    : device_(std::make_shared<SimDevice>(options.device_capacity_,
+                                          options.device_zone_capacity_, options.sim_device_)) {
+  io_scheduler_ = std::make_unique<IOScheduler>(std::make_unique<SimAIOEngine>(device_));
+  io_scheduler_->SetIODepth(options.io_depth_, options.adaptive_io_depth_);
+  io_scheduler_->SetRateLimit(kFlush, options.flush_rate_limit_);
+  io_scheduler_->SetRateLimit(kGC, options.gc_rate_limit_);
+  LOG(INFO, "SimIOHandle opened, capacity: {}, zone capacity: {}, parallelism: {}",
+      options.device_capacity_, options.device_zone_capacity_, options.sim_device_.parallelism_);
+}
+
+Status SimIOHandle::Write(uint64_t offset, std::shared_ptr<IOBuf> data) {
+  uint32_t buf_sz = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
+  io_scheduler_->AcquireRateLimit(kFlush, buf_sz);
+  auto s = device_->Write(offset, data->Buffer(), buf_sz);
+  if (!s.ok()) {
+    return s;
+  }
+  device_->WaitUntil(device_->Schedule(kAsyncWrite, buf_sz));
+  return Status::OK();
+}
+
+Status SimIOHandle::AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data,
+                               const IOCallback& cb, IOClass io_class) {
+  uint32_t buf_sz = NumberUtils::AlignTo(data->Size(), IO_PAGE_SIZE);
+  auto s = io_scheduler_->AsyncWrite(io_class, -1, offset, data->Buffer(), buf_sz, cb);
+  if (!s.ok()) {
+    LOG(ERROR, "Failed to write data, code: {}, msg: {} ", s.code(), s.msg());
+    return s;
+  }
+  return Status::OK();
+}
+
+Status SimIOHandle::AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov,
+                                const IOCallback& cb, IOClass io_class) {
+  auto s = io_scheduler_->AsyncWritev(io_class, -1, offset, iov, cb);
+  if (!s.ok()) {
+    LOG(ERROR, "Failed to write data, code: {}, msg: {} ", s.code(), s.msg());
+    return s;
+  }
+  return Status::OK();
+}
+
+Status SimIOHandle::ReadAppend(uint64_t offset, uint32_t size, std::shared_ptr<IOBuf> data) {
+  assert(data->AvailableSize() >= size);
+  auto s = device_->Read(offset, data->Buffer(), size);
+  if (!s.ok()) {
+    return s;
+  }
+  data->IncreaseSize(size);
+  device_->WaitUntil(device_->Schedule(kAsyncRead, size));
+  return Status::OK();
+}
+
+Status SimIOHandle::Read(uint64_t offset, std::shared_ptr<IOBuf> data) {
+  assert(data->Capacity() % IO_PAGE_SIZE == 0);
+  auto s = device_->Read(offset, data->Buffer(), data->Capacity());
+  if (!s.ok()) {
+    return s;
+  }
+  data->IncreaseSize(data->Capacity());
+  device_->WaitUntil(device_->Schedule(kAsyncRead, data->Capacity()));
+  return Status::OK();
+}
+
+Status SimIOHandle::AsyncRead(uint64_t offset, const std::shared_ptr<IOBuf>& data,
+                              const IOCallback& cb, IOClass io_class) {
+  assert(data->Capacity() % IO_PAGE_SIZE == 0);
+  auto read_cb = [data, cb](uint64_t offset, int64_t res) {
+    if (res > 0) {
+      data->IncreaseSize(res);
+    }
+    cb(offset, res);
+  };
+  auto s = io_scheduler_->AsyncRead(io_class, -1, offset, data->Buffer(), data->Capacity(),
+                                    read_cb);
+  if (!s.ok()) {
+    LOG(ERROR, "Failed to submit read, msg: {}, offset: {}, read_sz: {}", s.msg(), offset,
+        data->Capacity());
+    return s;
+  }
+  return Status::OK();
+}
+
+Status SimIOHandle::Append(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data) {
+  auto s = Write(zone->wp_, data);
+  zone->wp_ += data->Size();
+  return s;
+}
+
+Status SimIOHandle::AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t size) {
+  zone->wp_ += size;
+  return Status::OK();
+}
+
+Status SimIOHandle::AsyncAppend(const std::shared_ptr<Zone>& zone,
+                                const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                                IOClass io_class) {
+  // The callback may recycle the buffer before AsyncWrite returns, so we should remember the size
+  // first.
+  uint64_t size = data->Size();
+  auto s = AsyncWrite(zone->wp_, data, cb, io_class);
+  if (s.ok()) {
+    zone->wp_ += size;
+  }
+  return s;
+}
+
+Status SimIOHandle::AsyncAppendv(const std::shared_ptr<Zone>& zone,
+                                 const std::vector<struct iovec>& iov, const IOCallback& cb,
+                                 IOClass io_class) {
+  uint64_t size = 0;
+  for (auto& part : iov) {
+    assert(part.iov_len % IO_PAGE_SIZE == 0);
+    size += part.iov_len;
+  }
+  auto s = AsyncWritev(zone->wp_, iov, cb, io_class);
+  if (s.ok()) {
+    zone->wp_ += size;
+  }
+  return s;
+}
+
+std::vector<std::shared_ptr<Zone>> SimIOHandle::GetDeviceZones() {
+  std::vector<std::shared_ptr<Zone>> zones;
+  uint64_t zone_num = device_->GetCapacity() / device_->GetZoneCapacity();
+  for (uint64_t i = 0; i < zone_num; ++i) {
+    auto zone = std::make_shared<Zone>();
+    zone->id_ = i;
+    zone->offset_ = i * device_->GetZoneCapacity();
+    zone->capacity_bytes_ = device_->GetZoneCapacity();
+    zone->wp_ = zone->offset_;
+    zones.push_back(std::move(zone));
+  }
+  return zones;
+}
+
+void SimIOHandle::ResetZone(const std::shared_ptr<Zone>& zone) {
+  zone->state_ = ZoneState::EMPTY;
+  zone->wp_ = zone->offset_;
+  Trim(-1, zone->offset_, zone->capacity_bytes_);
+}
+
+void SimIOHandle::Trim(int /*fd*/, uint64_t offset, uint64_t sz) { device_->Discard(offset, sz); }
+}  // namespace neodb
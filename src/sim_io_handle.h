@@ -0,0 +1,213 @@
+#pragma once
+#include <sys/uio.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+#include "aio_engine.h"
+#include "clock.h"
+#include "io_handle.h"
+#include "io_scheduler.h"
+#include "neodb/io_buf.h"
+#include "neodb/options.h"
+#include "neodb/status.h"
+#include "zone.h"
+
+namespace neodb {
+
+// SimDevice is an in-memory device with a timing model, see SimDeviceOptions.
+//
+// Each request takes the earliest free one of `parallelism_` channels, and holds it for its
+// latency plus the transfer time. The transfers of each direction are serialized on its own
+// bandwidth. The random parts come from a seeded generator and the time from the device's clock.
+// With the wall clock the finish times still depend on when the host submitted the requests, with
+// a ManualClock the same sequence of requests is always served the same way.
+//
+// The data of each zone is allocated on its first write and freed once the whole zone was
+// discarded, unwritten ranges read as zeros.
+class SimDevice {
+ public:
+  SimDevice(uint64_t capacity, uint64_t zone_capacity, const SimDeviceOptions& options);
+
+  // Model a request that is submitted now.
+  // @return The time when the request finished, in NowInUs().
+  uint64_t Schedule(IORequestType type, uint64_t size);
+
+  // Replace the time source, should be called before any request was scheduled.
+  void SetClock(Clock* clock) { clock_ = clock; }
+
+  uint64_t NowInUs() const { return clock_->NowInUs(); }
+
+  // Sleep until the time returned by Schedule().
+  void WaitUntil(uint64_t finish_us);
+
+  // The data are transferred at once, callers should wait for the scheduled time themselves.
+  Status Write(uint64_t offset, const char* buffer, uint64_t size);
+
+  Status Read(uint64_t offset, char* buffer, uint64_t size);
+
+  void Discard(uint64_t offset, uint64_t size);
+
+  uint64_t GetCapacity() const { return capacity_; }
+
+  uint64_t GetZoneCapacity() const { return zone_capacity_; }
+
+  // @return The number of the injected latency spikes.
+  uint64_t GetSpikeNum() const { return spike_num_; }
+
+  // @return The bytes of the allocated zone data.
+  uint64_t GetMemoryUsage();
+
+ private:
+  Status CheckRange(uint64_t offset, uint64_t size) const;
+
+  uint64_t capacity_;
+
+  uint64_t zone_capacity_;
+
+  SimDeviceOptions options_;
+
+  Clock* clock_ = Clock::Default();
+
+  std::mutex model_mtx_;
+
+  std::mt19937_64 rng_;
+
+  // The time when each channel becomes free.
+  std::vector<uint64_t> channels_;
+
+  // The time when the transfers of each direction become free.
+  uint64_t read_transfer_free_us_ = 0;
+  uint64_t write_transfer_free_us_ = 0;
+
+  std::atomic<uint64_t> spike_num_{0};
+
+  // The data are copied with the shared lock, and the zones are allocated or freed with the
+  // exclusive one.
+  std::shared_mutex data_mtx_;
+
+  std::vector<std::unique_ptr<char[]>> zone_data_;
+};
+
+// SimAIOEngine serves the requests with a SimDevice, a request finishes once its scheduled time
+// has come. The data are transferred on submission, which is fine since the buffers should not be
+// touched until the callbacks were invoked. The fd is ignored.
+class SimAIOEngine : public AIOEngine {
+ public:
+  explicit SimAIOEngine(std::shared_ptr<SimDevice> device) : device_(std::move(device)) {}
+
+  ~SimAIOEngine() override {
+    while (GetInFlightRequests() > 0) {
+      Wait(1000);
+    }
+  }
+
+  Status AsyncWrite(int fd, uint64_t offset, const char* buffer, uint64_t size,
+                    IOCallback cb) override;
+
+  Status AsyncRead(int fd, uint64_t offset, char* buffer, uint64_t size, IOCallback cb) override;
+
+  Status AsyncWritev(int fd, uint64_t offset, const std::vector<struct iovec>& iov,
+                     IOCallback cb) override;
+
+  uint32_t Poll() override;
+
+  // Sleep until the earliest request finished or timeout.
+  uint32_t Wait(uint64_t timeout_us) override;
+
+  // The device's model follows the same clock.
+  void SetClock(Clock* clock) override {
+    AIOEngine::SetClock(clock);
+    device_->SetClock(clock);
+  }
+
+ private:
+  // Should be called with `mtx_` held.
+  void Submit(uint32_t slot, IORequestType type, uint64_t size);
+
+  std::shared_ptr<SimDevice> device_;
+
+  // Finish time and slot of the in-flight requests, the earliest on top.
+  using Pending = std::pair<uint64_t, uint32_t>;
+  std::priority_queue<Pending, std::vector<Pending>, std::greater<>> pending_;
+};
+
+// SimIOHandle is a conventional device on top of a SimDevice, it behaves like the FileIOHandle
+// except that everything stays in memory and the timing comes from the device model. The async IO
+// still goes through the IO scheduler, so the IO classes and rate limits work as usual.
+class SimIOHandle : public IOHandle {
+ public:
+  explicit SimIOHandle(const StoreOptions& options);
+
+  Status Write(uint64_t offset, std::shared_ptr<IOBuf> data) override;
+
+  Status AsyncWrite(uint64_t offset, const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                    IOClass io_class = kFlush) override;
+
+  Status AsyncWritev(uint64_t offset, const std::vector<struct iovec>& iov, const IOCallback& cb,
+                     IOClass io_class = kFlush) override;
+
+  Status ReadAppend(uint64_t offset, uint32_t size, std::shared_ptr<IOBuf> data) override;
+
+  Status Read(uint64_t offset, std::shared_ptr<IOBuf> data) override;
+
+  Status AsyncRead(uint64_t offset, const std::shared_ptr<IOBuf>& data, const IOCallback& cb,
+                   IOClass io_class = kForegroundRead) override;
+
+  Status Append(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf> data) override;
+
+  Status AppendZeros(const std::shared_ptr<Zone>& zone, uint32_t size) override;
+
+  Status AsyncAppend(const std::shared_ptr<Zone>& zone, const std::shared_ptr<IOBuf>& data,
+                     const IOCallback& cb, IOClass io_class = kFlush) override;
+
+  Status AsyncAppendv(const std::shared_ptr<Zone>& zone, const std::vector<struct iovec>& iov,
+                      const IOCallback& cb, IOClass io_class = kFlush) override;
+
+  uint32_t Poll() override { return io_scheduler_->Poll(); }
+
+  uint32_t Wait(uint64_t timeout_us = kWaitTimeoutUs) override {
+    return io_scheduler_->Wait(timeout_us);
+  }
+
+  uint32_t GetInFlightRequests() override { return io_scheduler_->GetInFlightRequests(); }
+
+  void SetRateLimit(IOClass io_class, const RateLimit& limit) override {
+    io_scheduler_->SetRateLimit(io_class, limit);
+  }
+
+  uint64_t GetThrottledTimeUs(IOClass io_class) override {
+    return io_scheduler_->GetThrottledTimeUs(io_class);
+  }
+
+  std::vector<std::shared_ptr<Zone>> GetDeviceZones() override;
+
+  void ResetZone(const std::shared_ptr<Zone>& zone) override;
+
+  // The fd is ignored, the range is discarded at once.
+  void Trim(int fd, uint64_t offset, uint64_t sz) override;
+
+  // Discards are never deferred.
+  void WaitForDiscard() override {}
+
+  // Nothing is lost by a simulated crash.
+  Status Sync() override { return Status::OK(); }
+
+  const std::shared_ptr<SimDevice>& GetDevice() const { return device_; }
+
+  // Drive the device model, the rate limits and the io depth with another time source, e.g. a
+  // ManualClock for reproducible runs. Should be called before any request was submitted.
+  void SetClock(Clock* clock) { io_scheduler_->SetClock(clock); }
+
+ private:
+  std::shared_ptr<SimDevice> device_;
+
+  std::unique_ptr<IOScheduler> io_scheduler_;
+};
+}  // namespace neodb
@@ -1,11 +1,35 @@
 #include "store.h"
 
 namespace neodb {
-Status Store::Put(const std::string& key, const std::shared_ptr<IOBuf>& value) {
-  return zone_manager_->Append(key, value);
+Status Store::Put(const std::string& key, const std::shared_ptr<IOBuf>& value,
+                  const WriteOptions& options) {
+  return zone_manager_->Append(key, value, options.sync_);
 }
 
 Status Store::Get(const std::string& key, std::shared_ptr<IOBuf>& value) {
+  // Completion context shared with the callback, we wait on the device until it's done.
+  struct GetContext {
+    std::atomic<bool> done_{false};
+    Status status_ = Status::OK();
+  };
+  auto ctx = std::make_shared<GetContext>();
+  auto s = AsyncGet(key, [ctx, &value](Status s, const std::shared_ptr<IOBuf>& read_value) {
+    if (s.ok()) {
+      value = read_value;
+    }
+    ctx->status_ = s;
+    ctx->done_ = true;
+  });
+  if (!s.ok()) {
+    return s;
+  }
+  while (!ctx->done_) {
+    zone_manager_->WaitIO();
+  }
+  return ctx->status_;
+}
+
+Status Store::AsyncGet(const std::string& key, const GetCallback& cb) {
   Index::ValueVariant value_variant;
   auto s = index_->Get(key, value_variant);
   if (!s.ok()) {
@@ -13,16 +37,20 @@ Status Store::Get(const std::string& key, std::shared_ptr<IOBuf>& value) {
   }
 
   if (std::holds_alternative<Index::MemValue>(value_variant)) {
-    value = (Index::MemValue)std::get<Index::MemValue>(value_variant);
+    cb(Status::OK(), (Index::MemValue)std::get<Index::MemValue>(value_variant));
     return Status::OK();
   } else {
     uint64_t lba = std::get<Index::LBAValue>(value_variant);
-    std::string read_key;
-    zone_manager_->ReadSingleItem(lba, &read_key, value);
-    if (key != read_key) {
-      return Status::IOError("Read single item error, key : " + key);
-    }
-    return Status::OK();
+    return zone_manager_->AsyncReadSingleItem(
+        lba, [key, cb](Status s, const std::string& read_key, const std::shared_ptr<IOBuf>& value) {
+          if (!s.ok()) {
+            cb(s, nullptr);
+          } else if (key != read_key) {
+            cb(Status::IOError("Read single item error, key : " + key), nullptr);
+          } else {
+            cb(Status::OK(), value);
+          }
+        });
   }
 }
 }  // namespace neodb
\ No newline at end of file
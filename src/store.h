@@ -7,6 +7,8 @@
 #include "io_handle.h"
 #include "neodb/options.h"
 #include "neodb/status.h"
+#include "sim_io_handle.h"
+#include "value_writer.h"
 #include "zone_manager.h"
 
 namespace neodb {
@@ -14,11 +16,25 @@ namespace neodb {
 // Single device storage engine.
 class Store {
  public:
-  explicit Store(const StoreOptions& options) : options_(options) {
-    auto io_handle = std::make_unique<FileIOHandle>(options.device_path_, options.device_capacity_,
-                                                    options.device_zone_capacity_);
+  // Callback of an async Get, the value is only valid if the status is OK.
+  using GetCallback = std::function<void(Status s, const std::shared_ptr<IOBuf>& value)>;
+
+  // @param budget The write budget shared with the other stores, unlimited if null.
+  explicit Store(const StoreOptions& options, std::shared_ptr<WriteBudget> budget = nullptr)
+      : options_(options) {
+    std::unique_ptr<IOHandle> io_handle;
+    if (options.type_ == kBlock) {
+      io_handle = std::make_unique<BlockIOHandle>(options);
+    } else if (options.type_ == kZonedFile) {
+      io_handle = std::make_unique<ZonedIOHandle>(options);
+    } else if (options.type_ == kSimulated) {
+      io_handle = std::make_unique<SimIOHandle>(options);
+    } else {
+      io_handle = std::make_unique<FileIOHandle>(options);
+    }
     index_ = std::make_shared<Index>();
-    zone_manager_ = std::make_unique<ZoneManager>(options, std::move(io_handle), index_);
+    zone_manager_ =
+        std::make_unique<ZoneManager>(options, std::move(io_handle), index_, std::move(budget));
     zone_manager_->StartFlushWorker();
     zone_manager_->StartGCWorker();
   }
@@ -29,10 +45,57 @@ class Store {
   }
 
   // Put an already exist key will simply overwrite the old one.
-  Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value);
+  Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value,
+             const WriteOptions& options = WriteOptions());
+
+  // Like Put(), but return Status::Busy() instead of waiting if the write budget ran out or the
+  // flush is behind, so the caller could shed the write.
+  Status TryPut(const std::string& key, const std::shared_ptr<IOBuf>& value) {
+    return zone_manager_->Append(key, value, false, false);
+  }
+
+  // Put the items of a batch together, see ZoneManager::AppendBatch().
+  Status Write(const std::vector<const WriteBatch::Item*>& items,
+               const WriteOptions& options = WriteOptions()) {
+    return zone_manager_->AppendBatch(items, options.sync_);
+  }
+
+  // Stream a large value to the device, see ValueWriter.
+  Status OpenValueWriter(const std::string& key, uint32_t value_size,
+                         std::unique_ptr<ValueWriter>* writer) {
+    return zone_manager_->OpenValueWriter(key, value_size, writer);
+  }
+
+  // Wait until all the finished puts were written to the device.
+  Status Flush() { return zone_manager_->Flush(); }
 
   Status Get(const std::string& key, std::shared_ptr<IOBuf>& value);
 
+  // If the value is still in memory, the callback will be invoked immediately, otherwise it will
+  // be invoked by Poll() once the device read finished. So a single thread could keep many device
+  // reads in flight.
+  Status AsyncGet(const std::string& key, const GetCallback& cb);
+
+  // Run the callbacks of finished async reads.
+  // @return The number of finished IO requests.
+  uint32_t Poll() { return zone_manager_->PollIO(); }
+
+  // Like Poll(), but block until any IO finished or timeout, so the caller won't spin.
+  uint32_t Wait(uint64_t timeout_us) { return zone_manager_->WaitIO(timeout_us); }
+
+  // Adjust the bandwidth and IOPS limits of an IO class at runtime, e.g. to give the foreground
+  // reads more room during peak hours.
+  void SetRateLimit(IOClass io_class, const RateLimit& limit) {
+    zone_manager_->SetRateLimit(io_class, limit);
+  }
+
+  // @return The total time that the IO class was held back by its rate limit.
+  uint64_t GetThrottledTimeUs(IOClass io_class) {
+    return zone_manager_->GetThrottledTimeUs(io_class);
+  }
+
+  WriteStallStats GetWriteStallStats() const { return zone_manager_->GetWriteStallStats(); }
+
   std::shared_ptr<Index> DEBUG_GetIndex() { return index_; }
 
  private:
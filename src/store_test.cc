@@ -4,6 +4,7 @@
 #include <gtest/gtest.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
 
 #include "utils.h"
@@ -39,4 +40,29 @@ class StoreTest : public ::testing::Test {
 };
 
 TEST_F(StoreTest, SingleWriteTest) {}
+
+TEST_F(StoreTest, SimulatedDeviceTest) {
+  StoreOptions options;
+  options.type_ = kSimulated;
+  options.device_capacity_ = 64UL << 20;
+  options.device_zone_capacity_ = 8UL << 20;
+  options.write_buffer_size_ = 1UL << 20;
+  options.writable_buffer_num_ = 2;
+  options.immutable_buffer_num_ = 2;
+  auto store = std::make_unique<Store>(options);
+
+  // Enough data to be flushed to the device, all of them should be read back.
+  std::map<std::string, std::string> kvs;
+  for (int i = 0; i < 200; ++i) {
+    auto key = StringUtils::GenerateRandomString(16);
+    kvs[key] = StringUtils::GenerateRandomString(64UL << 10);
+    EXPECT_TRUE(store->Put(key, std::make_shared<IOBuf>(kvs[key])).ok());
+  }
+  for (auto& kv : kvs) {
+    std::shared_ptr<IOBuf> value;
+    EXPECT_TRUE(store->Get(kv.first, value).ok());
+    ASSERT_NE(value, nullptr);
+    EXPECT_EQ(value->Data(), kv.second);
+  }
+}
 }  // namespace neodb
\ No newline at end of file
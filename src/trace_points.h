@@ -8,7 +8,10 @@
 #include "utils.h"
 
 #ifndef ENABLE_TRACE_POINT
-#define TRACE_POINT(name, code)
+#define TRACE_POINT(name, code) \
+  do {                          \
+    code;                       \
+  } while (0)
 #define PRINT_TRACE_POINT(name)
 #define PRINT_ALL_TRACE_POINTS()
 #else
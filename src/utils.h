@@ -80,6 +80,29 @@ class FileUtils {
     return total;
   }
 
+  // Open the file with the target IO mode. If the file system doesn't support O_DIRECT (e.g.
+  // tmpfs), fallback to buffered IO and update the `mode`.
+  static int OpenFile(const std::string& filename, bool read_only, IOMode* mode) {
+    int flags = read_only ? O_RDONLY : O_RDWR | O_CREAT;
+    if (*mode == kDirectIO) {
+#ifdef __APPLE__
+      int fd = open(filename.c_str(), flags, S_IRUSR | S_IWUSR);
+      if (fd != -1) {
+        fcntl(fd, F_NOCACHE, 1);
+      }
+      return fd;
+#else
+      int fd = open(filename.c_str(), flags | O_DIRECT, S_IRUSR | S_IWUSR);
+      if (fd != -1 || errno != EINVAL) {
+        return fd;
+      }
+      LOG(WARNING, "O_DIRECT is not supported, fallback to buffered IO, file: {}", filename);
+      *mode = kBufferedIO;
+#endif
+    }
+    return open(filename.c_str(), flags, S_IRUSR | S_IWUSR);
+  }
+
   static int OpenDirectFile(const std::string& filename, bool read_only = false) {
     int fd_ = -1;
 #ifdef __APPLE__
@@ -96,11 +119,19 @@ class FileUtils {
 
 class IOEngineUtils {
  public:
-  static AIOEngine* GetInstance() {
+  static AIOEngine* GetInstance(IOEngineType type = kPosixAIO) {
     AIOEngine* engine;
 #ifdef __APPLE__
     engine = new MockAIOEngine();
 #else
+    if (type == kIOUring) {
+      auto* uring = new IOUringEngine();
+      if (uring->Valid()) {
+        return uring;
+      }
+      LOG(WARNING, "io_uring is not available, fallback to posix aio engine");
+      delete uring;
+    }
     engine = new PosixAIOEngine();
 #endif
     return engine;
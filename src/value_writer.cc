@@ -0,0 +1,43 @@
+#include "value_writer.h"
+
+#include <string>
+
+namespace neodb {
+
+ValueWriter::~ValueWriter() {
+  if (!closed_) {
+    zone_manager_->CloseValueWriter(*this, false);
+  }
+}
+
+Status ValueWriter::Append(const char* data, uint32_t size) {
+  if (closed_) {
+    return Status::IOError("The value writer was closed");
+  }
+  if (!status_.ok()) {
+    return status_;
+  }
+  if (size > value_size_ - appended_) {
+    return Status::IOError("The value exceeds its declared size: " + std::to_string(value_size_));
+  }
+  return zone_manager_->AppendToValueWriter(*this, data, size);
+}
+
+Status ValueWriter::Commit() {
+  if (closed_) {
+    return Status::IOError("The value writer was closed");
+  }
+  Status s = status_;
+  if (s.ok() && appended_ != value_size_) {
+    s = Status::IOError("The value is incomplete, appended: " + std::to_string(appended_) +
+                        ", declared: " + std::to_string(value_size_));
+  }
+  if (s.ok()) {
+    s = zone_manager_->CommitValueWriter(*this);
+  }
+  if (!closed_) {
+    zone_manager_->CloseValueWriter(*this, false);
+  }
+  return s;
+}
+}  // namespace neodb
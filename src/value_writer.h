@@ -0,0 +1,74 @@
+#pragma once
+
+#include <memory>
+#include <string>
+
+#include "neodb/io_buf.h"
+#include "neodb/status.h"
+#include "zone_manager.h"
+
+namespace neodb {
+
+// ValueWriter puts a large value of a declared size, whose chunks are appended as they arrive. The
+// item is only visible to the readers once committed, and it's durable by then.
+//
+// The item is written to a range reserved from a data zone, the chunks are written as they are
+// appended, so the value is never resident in memory as a whole. This requires the streams to take
+// ranges, i.e. a conventional device with multiple flush encoders. Otherwise, e.g. a zoned device or
+// the default single encoder, the stream's zone is only appended by its encoder, and the writer
+// could not be opened.
+//
+// A writer holds its zone until it's closed, the zone is never switched meanwhile. Once the zone
+// is full, the flush of its stream waits for the writer, so the blocking puts to the store may
+// wait until the writer is closed. So a writer should be committed promptly, the writer's thread
+// should only put to the same store with TryPut() before that, and neither open another writer of
+// the store. All the writers should be closed before the store.
+//
+// NOT THREAD SAFE.
+class ValueWriter {
+ public:
+  // Drop the value if it was not committed, the written data are left as garbage of the zone.
+  ~ValueWriter();
+
+  // @return Status::IOError() if the value would exceed the declared size or its write failed.
+  Status Append(const char* data, uint32_t size);
+
+  Status Append(const std::string& data) { return Append(data.data(), data.size()); }
+
+  // Wait until the whole value was written to the device, then index the item. The writer is
+  // closed regardless of the result.
+  // @return Status::IOError() if the value is incomplete or its write failed.
+  Status Commit();
+
+  const std::string& GetKey() const { return key_; }
+
+  uint32_t GetValueSize() const { return value_size_; }
+
+  uint32_t GetAppendedSize() const { return appended_; }
+
+ private:
+  friend class ZoneManager;
+
+  ValueWriter(ZoneManager* zone_manager, std::string key, uint32_t value_size)
+      : zone_manager_(zone_manager), key_(std::move(key)), value_size_(value_size) {}
+
+  ZoneManager* zone_manager_;
+  const std::string key_;
+  const uint32_t value_size_;
+  uint32_t appended_ = 0;
+
+  // Writes the item to its reserved range, null once closed.
+  std::unique_ptr<ZoneManager::Encoder> encoder_;
+
+  // The IO buffer being filled.
+  std::shared_ptr<IOBuf> buf_;
+
+  // The item's LBA, which is the start of its range.
+  uint64_t lba_ = 0;
+
+  // The first failure, the writer rejects the further appends once failed.
+  Status status_ = Status::OK();
+
+  bool closed_ = false;
+};
+}  // namespace neodb
@@ -0,0 +1,48 @@
+#include "write_budget.h"
+
+#include "utils.h"
+
+namespace neodb {
+
+bool WriteBudget::TryAcquire(uint64_t bytes) {
+  if (TryTake(bytes)) {
+    return true;
+  }
+  pressure_epoch_++;
+  return false;
+}
+
+uint64_t WriteBudget::Acquire(uint64_t bytes) {
+  if (TryAcquire(bytes)) {
+    return 0;
+  }
+  auto t1 = TimeUtils::GetCurrentTimeInUs();
+  std::unique_lock<std::mutex> lk(mtx_);
+  // Both are sequentially consistent, so either the releaser sees the waiter, or the waiter sees
+  // the released bytes.
+  waiters_++;
+  cv_.wait(lk, [&]() { return TryTake(bytes); });
+  waiters_--;
+  return TimeUtils::GetCurrentTimeInUs() - t1;
+}
+
+void WriteBudget::Release(uint64_t bytes) {
+  used_ -= bytes;
+  if (waiters_ > 0) {
+    {
+      std::lock_guard<std::mutex> lk(mtx_);
+    }
+    cv_.notify_all();
+  }
+}
+
+bool WriteBudget::TryTake(uint64_t bytes) {
+  uint64_t used = used_;
+  do {
+    if (used > 0 && used + bytes > capacity_) {
+      return false;
+    }
+  } while (!used_.compare_exchange_weak(used, used + bytes));
+  return true;
+}
+}  // namespace neodb
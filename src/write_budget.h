@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+namespace neodb {
+
+// How often the writes were held back by the memory limits.
+struct WriteStallStats {
+  // Number of the writes that had to wait, and their total waiting time.
+  uint64_t stall_num_ = 0;
+  uint64_t stall_us_ = 0;
+
+  // Number of the non-blocking writes that were rejected with Status::Busy().
+  uint64_t rejected_num_ = 0;
+};
+
+// WriteBudget limits the bytes of the buffered writes that are not yet flushed, it's shared by all
+// the stores of a DB so the memory is bounded regardless of the store number.
+//
+// A write takes the bytes of its item before being buffered, and they are given back once the
+// item's write buffer was flushed. A single write that is larger than the budget is still admitted
+// if nothing else is buffered.
+//
+// If a write doesn't fit, the pressure epoch is bumped. The flush workers of every store watch it
+// and seal their partially filled buffers, otherwise the budget could be held by the buffers that
+// never fill up.
+class WriteBudget {
+ public:
+  explicit WriteBudget(uint64_t capacity) : capacity_(capacity) {}
+
+  // @return False if the bytes don't fit, the pressure is raised.
+  bool TryAcquire(uint64_t bytes);
+
+  // Wait until the bytes fit.
+  // @return The waiting time in microseconds.
+  uint64_t Acquire(uint64_t bytes);
+
+  void Release(uint64_t bytes);
+
+  uint64_t GetCapacity() const { return capacity_; }
+
+  uint64_t GetUsedBytes() const { return used_; }
+
+  // Bumped whenever a write doesn't fit.
+  uint64_t GetPressureEpoch() const { return pressure_epoch_; }
+
+ private:
+  // Take the bytes if they fit, without raising the pressure.
+  bool TryTake(uint64_t bytes);
+
+  const uint64_t capacity_;
+
+  std::atomic<uint64_t> used_{0};
+
+  std::atomic<uint64_t> pressure_epoch_{0};
+
+  // The waiters are only notified if there are any, so the release is lock free otherwise.
+  std::atomic<uint32_t> waiters_{0};
+  std::mutex mtx_;
+  std::condition_variable cv_;
+};
+}  // namespace neodb
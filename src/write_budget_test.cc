@@ -0,0 +1,55 @@
+#include "write_budget.h"
+
+#include <thread>
+
+#include "gtest/gtest.h"
+#include "utils.h"
+
+namespace neodb {
+class WriteBudgetTest : public ::testing::Test {
+ public:
+  void SetUp() override { InitLogger(); }
+
+  void TearDown() override {}
+};
+
+TEST_F(WriteBudgetTest, AcquireTest) {
+  WriteBudget budget(100);
+  ASSERT_TRUE(budget.TryAcquire(60));
+  ASSERT_TRUE(budget.TryAcquire(40));
+  EXPECT_EQ(budget.GetUsedBytes(), 100);
+
+  // A write that doesn't fit raises the pressure.
+  uint64_t epoch = budget.GetPressureEpoch();
+  ASSERT_FALSE(budget.TryAcquire(1));
+  EXPECT_GT(budget.GetPressureEpoch(), epoch);
+
+  // The waiter is admitted once enough bytes were given back.
+  std::atomic<bool> acquired{false};
+  std::thread waiter([&]() {
+    budget.Acquire(50);
+    acquired = true;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(acquired);
+  budget.Release(40);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  EXPECT_FALSE(acquired);
+  budget.Release(60);
+  waiter.join();
+  EXPECT_TRUE(acquired);
+  EXPECT_EQ(budget.GetUsedBytes(), 50);
+  budget.Release(50);
+
+  // A write larger than the budget is still admitted if nothing else is buffered.
+  ASSERT_TRUE(budget.TryAcquire(1000));
+  ASSERT_FALSE(budget.TryAcquire(1));
+  budget.Release(1000);
+  EXPECT_EQ(budget.GetUsedBytes(), 0);
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+}  // namespace neodb
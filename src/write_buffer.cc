@@ -1,22 +1,189 @@
 #include "write_buffer.h"
 
+#include <algorithm>
+#include <thread>
+
 #include "codec.h"
 #include "logger.h"
+#include "utils.h"
 
 namespace neodb {
 
-// TODO (Roy Guo) Change to blocking write if the buffer is FULL.
-Status WriteBuffer::Put(const std::string& key, const std::shared_ptr<IOBuf>& value) {
-  if (immutable_) {
-    return Status::StatusError("Put failed, WriteBuffer is already FULL and immutable_!");
+WriteBuffer::WriteBuffer(uint64_t capacity_bytes, Temperature temperature)
+    : capacity_bytes_(capacity_bytes),
+      max_items_(std::max(kChunkItems, capacity_bytes / kMinItemBytes)),
+      temperature_(temperature) {
+  uint64_t chunk_num = (max_items_ + kChunkItems - 1) / kChunkItems;
+  chunks_ = std::make_unique<std::atomic<Chunk*>[]>(chunk_num);
+  for (uint64_t i = 0; i < chunk_num; ++i) {
+    chunks_[i] = nullptr;
+  }
+  // A chunk is flushed with a single IO, one more chunk is left for the tails that didn't fit.
+  arena_chunk_size_ = std::min<uint64_t>(IO_FLUSH_SIZE,
+                                         NumberUtils::AlignTo(capacity_bytes, IO_PAGE_SIZE));
+  max_arena_chunks_ = (capacity_bytes + arena_chunk_size_ - 1) / arena_chunk_size_ + 1;
+  arena_ = std::make_unique<std::atomic<ArenaChunk*>[]>(max_arena_chunks_);
+  for (uint64_t i = 0; i < max_arena_chunks_; ++i) {
+    arena_[i] = nullptr;
+  }
+}
+
+WriteBuffer::~WriteBuffer() {
+  uint64_t chunk_num = (max_items_ + kChunkItems - 1) / kChunkItems;
+  for (uint64_t i = 0; i < chunk_num; ++i) {
+    delete chunks_[i].load();
   }
-  items_.emplace_back(key, value);
-  used_bytes_ += (key.size() + value->Size());
-  // If the capacity is exceeded, we should change this buffer to immutable_.
-  if (used_bytes_ >= capacity_bytes_) {
-    LOG(DEBUG, "Convert to immutable_ write buffer, used_bytes: {}", used_bytes_);
-    immutable_ = true;
+  for (uint64_t i = 0; i < max_arena_chunks_; ++i) {
+    delete arena_[i].load();
+  }
+}
+
+bool WriteBuffer::Enter() {
+  // Both are sequentially consistent, so either the writer sees the seal, or the sealer waits for
+  // the writer.
+  writers_.fetch_add(1);
+  if (sealed_) {
+    Leave();
+    return false;
+  }
+  return true;
+}
+
+Status WriteBuffer::Put(const std::string& key, const std::shared_ptr<IOBuf>& value, bool encode,
+                        std::shared_ptr<IOBuf>* stored_value) {
+  // The slot is reserved before the arena, so every encoded item has a slot and is flushed with
+  // its key. If the arena is full the slot is left empty, the flush skips it, so its chunk is
+  // allocated anyway.
+  uint64_t slot = item_num_.fetch_add(1);
+  if (slot >= max_items_) {
+    return Status::Busy();
+  }
+  Chunk* chunk = GetChunk(slot / kChunkItems);
+  Item item;
+  item.key_ = key;
+  item.value_ = value;
+  if (encode) {
+    auto s = Encode(key, value, item);
+    if (!s.ok()) {
+      return s;
+    }
+  }
+  *stored_value = item.value_;
+  chunk->items_[slot % kChunkItems] = std::move(item);
+  uint64_t item_bytes = GetItemBytes(key, value);
+  uint64_t used_bytes = used_bytes_.fetch_add(item_bytes) + item_bytes;
+  if (used_bytes >= capacity_bytes_ && used_bytes - item_bytes < capacity_bytes_) {
+    LOG(DEBUG, "WriteBuffer is full, used_bytes: {}", used_bytes);
   }
   return Status::OK();
 }
-}  // namespace neodb
\ No newline at end of file
+
+Status WriteBuffer::Encode(const std::string& key, const std::shared_ptr<IOBuf>& value,
+                           Item& item) {
+  const uint16_t key_sz = key.size();
+  const uint32_t value_sz = value->Size();
+  uint64_t size = ITEM_META_SIZE + key_sz + value_sz;
+  if (size > arena_chunk_size_) {
+    return Status::OK();
+  }
+  for (;;) {
+    uint64_t idx = arena_idx_;
+    if (idx >= max_arena_chunks_) {
+      return Status::Busy();
+    }
+    auto* chunk = GetArenaChunk(idx, true);
+    uint64_t offset = chunk->used_.fetch_add(size);
+    if (offset + size <= arena_chunk_size_) {
+      char* dst = chunk->buf_->Buffer() + offset;
+      memcpy(dst, &key_sz, 2);
+      memcpy(dst + 2, &value_sz, 4);
+      memcpy(dst + ITEM_META_SIZE, key.data(), key_sz);
+      memcpy(dst + ITEM_META_SIZE + key_sz, value->Buffer(), value_sz);
+      item.value_ = std::make_shared<IOBuf>(chunk->buf_, offset + ITEM_META_SIZE + key_sz,
+                                            value_sz);
+      item.chunk_ = idx;
+      item.offset_ = offset;
+      return Status::OK();
+    }
+    // Only the first item that didn't fit starts within the chunk.
+    if (offset <= arena_chunk_size_) {
+      chunk->end_ = offset;
+    }
+    arena_idx_.compare_exchange_strong(idx, idx + 1);
+  }
+}
+
+void WriteBuffer::WaitForWriters() {
+  assert(sealed_);
+  // The writers only stay for a single Put, so it won't be long.
+  while (writers_.load(std::memory_order_acquire) > 0) {
+    std::this_thread::yield();
+  }
+}
+
+uint32_t WriteBuffer::GetArenaChunkNum() const {
+  return std::min(arena_idx_.load() + 1, max_arena_chunks_);
+}
+
+std::shared_ptr<IOBuf> WriteBuffer::GetArenaChunk(uint32_t idx) {
+  auto* chunk = GetArenaChunk(idx, false);
+  if (chunk == nullptr) {
+    return nullptr;
+  }
+  uint64_t end = chunk->used_ <= arena_chunk_size_ ? chunk->used_.load() : chunk->end_.load();
+  if (end == 0) {
+    return nullptr;
+  }
+  auto& buf = chunk->buf_;
+  // The padding is never read, but it's still cleared rather than leaking the old memory.
+  uint64_t aligned_end = NumberUtils::AlignTo(end, IO_PAGE_SIZE);
+  memset(buf->Buffer() + end, 0, aligned_end - end);
+  buf->Resize(aligned_end);
+  return buf;
+}
+
+void WriteBuffer::Reset(Temperature temperature) {
+  uint64_t item_num = GetItemNum();
+  for (uint64_t i = 0; i < item_num; ++i) {
+    GetItem(i) = Item();
+  }
+  for (uint64_t i = 0; i < max_arena_chunks_; ++i) {
+    delete arena_[i].exchange(nullptr);
+  }
+  temperature_ = temperature;
+  item_num_ = 0;
+  used_bytes_ = 0;
+  arena_idx_ = 0;
+  ticket_ = std::make_shared<FlushTicket>();
+  sync_requested_ = false;
+  sealed_ = false;
+}
+
+WriteBuffer::Chunk* WriteBuffer::GetChunk(uint64_t chunk_idx) {
+  auto& chunk = chunks_[chunk_idx];
+  Chunk* cur = chunk.load(std::memory_order_acquire);
+  if (cur != nullptr) {
+    return cur;
+  }
+  auto* allocated = new Chunk();
+  if (chunk.compare_exchange_strong(cur, allocated)) {
+    return allocated;
+  }
+  delete allocated;
+  return cur;
+}
+
+WriteBuffer::ArenaChunk* WriteBuffer::GetArenaChunk(uint64_t idx, bool create) {
+  auto& chunk = arena_[idx];
+  ArenaChunk* cur = chunk.load(std::memory_order_acquire);
+  if (cur != nullptr || !create) {
+    return cur;
+  }
+  auto* allocated = new ArenaChunk(arena_chunk_size_);
+  if (chunk.compare_exchange_strong(cur, allocated)) {
+    return allocated;
+  }
+  delete allocated;
+  return cur;
+}
+}  // namespace neodb
@@ -2,48 +2,202 @@
 
 #include <unistd.h>
 
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
 
 #include "neodb/io_buf.h"
 #include "neodb/status.h"
+#include "zone.h"
 
 namespace neodb {
+// The flush of a write buffer, so the durable writers could wait for their items to be on the
+// device. It's done once the flush worker and all the flush IO of the buffer released it.
+struct FlushTicket {
+  std::atomic<int64_t> pending_{1};
+
+  // The bytes of the buffer that were charged to the write budget, given back once it's done.
+  uint64_t bytes_ = 0;
+
+  std::atomic<bool> done_{false};
+
+  // Any flush IO of the buffer failed.
+  std::atomic<bool> failed_{false};
+};
+
 // A write buffer contains a set of KV items that was written to this system.
 // If a write buffer exceeds its capacity, it will be convert into a immutable_
 // write buffer.
-// WriteBuffer could be used in a multi-thread environment.
+//
+// WriteBuffer could be written by multiple threads without any lock. A writer reserves an item
+// slot and the bytes with atomic increments, and the items are stored in chunks that are
+// allocated on demand. Writers should be wrapped by Enter() and Leave(), and the buffer could only
+// be read once it was sealed and all writers left, see WaitForWriters().
+//
+// The items are encoded into an arena of page aligned chunks as they are written, with the same
+// [key_sz][value_sz][key][value] layout as the data zone, so a chunk is flushed as is and the
+// buffered memory is proportional to the items' size. The item keeps a view of its value in the
+// arena. Items that don't fit a chunk, or the callers want to write without copying, keep the
+// reference to their values instead.
+//
+// The buffers are recycled with Reset(), they are never freed while the writers may still hold
+// them, so a writer with a stale buffer could still Enter() it safely, and it should check that
+// the buffer is still the one it wants to write afterwards.
 class WriteBuffer {
  public:
-  using Item = std::pair<std::string, std::shared_ptr<IOBuf>>;
+  struct Item {
+    std::string key_;
+
+    // A view of the encoded value in the arena, or the referenced value. Empty if the Put() that
+    // reserved the slot found the arena full, such a slot should be skipped.
+    std::shared_ptr<IOBuf> value_;
+
+    // Where the encoded item is in the arena, `chunk_` is kNotEncoded if it's referenced.
+    uint32_t chunk_ = kNotEncoded;
+    uint32_t offset_ = 0;
+  };
+
+  static constexpr uint32_t kNotEncoded = UINT32_MAX;
 
  public:
-  explicit WriteBuffer(uint64_t capacity_bytes)
-      : capacity_bytes_(capacity_bytes) {}
+  explicit WriteBuffer(uint64_t capacity_bytes, Temperature temperature = kCold);
+
+  ~WriteBuffer();
+
+  // @return False if the buffer was already sealed, the writer should not touch it.
+  bool Enter();
+
+  void Leave() { writers_.fetch_sub(1, std::memory_order_release); }
 
-  WriteBuffer(WriteBuffer&& buffer) noexcept {
-    items_ = std::move(buffer.items_);
-    capacity_bytes_ = buffer.capacity_bytes_;
-    used_bytes_ = buffer.used_bytes_;
+  // Should be called between Enter() and Leave().
+  // @param encode Copy the item into the arena if it fits, otherwise keep the value's reference.
+  // @param stored_value Set to the value kept by the buffer, which should be used by the index.
+  // @return Status::Busy() if no item slot or arena space is left, the writer should wait for a
+  // new buffer.
+  Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value, bool encode,
+             std::shared_ptr<IOBuf>* stored_value);
+
+  // @return The bytes that an item takes in the buffer, which is its encoded size.
+  static uint64_t GetItemBytes(const std::string& key, const std::shared_ptr<IOBuf>& value) {
+    return ITEM_META_SIZE + key.size() + value->Size();
+  }
+
+  // @return The bytes of the items that were put.
+  uint64_t GetUsedBytes() const { return used_bytes_; }
+
+  bool IsFull() const {
+    return used_bytes_ >= capacity_bytes_ || item_num_ >= max_items_ ||
+           arena_idx_ >= max_arena_chunks_;
   }
 
-  Status Put(const std::string& key, const std::shared_ptr<IOBuf>& value);
+  // Stop accepting new writers.
+  // @return True if the buffer was sealed by this call.
+  bool Seal() { return !sealed_.exchange(true); }
+
+  bool IsSealed() const { return sealed_; }
+
+  // Wait until all writers of a sealed buffer left, so the items could be read.
+  void WaitForWriters();
+
+  // Should be called after WaitForWriters().
+  uint64_t GetItemNum() const { return std::min(item_num_.load(), max_items_); }
+
+  Item& GetItem(uint64_t i) { return chunks_[i / kChunkItems].load()->items_[i % kChunkItems]; }
+
+  // Should be called after WaitForWriters().
+  uint32_t GetArenaChunkNum() const;
+
+  // Should be called after WaitForWriters().
+  // @return The arena chunk, whose size is the encoded items' size aligned to the page size, or
+  // nullptr if nothing was encoded to the chunk.
+  std::shared_ptr<IOBuf> GetArenaChunk(uint32_t idx);
+
+  // @return The bytes taken by the allocated arena chunks.
+  uint64_t GetArenaBytes() const { return GetArenaChunkNum() * arena_chunk_size_; }
 
-  bool IsFull() const { return used_bytes_ >= capacity_bytes_; }
+  // Should be called between Enter() and Leave(), so the ticket belongs to the written items.
+  std::shared_ptr<FlushTicket> GetFlushTicket() const { return ticket_; }
 
-  bool IsImmutable() const { return immutable_; }
+  // Give the buffer a new ticket before it's flushed again, the old one already reported the
+  // failed flush to its waiters.
+  void RenewFlushTicket() { ticket_ = std::make_shared<FlushTicket>(); }
 
-  void MarkImmutable() { immutable_ = true; }
+  // A durable writer is waiting, the buffer should be flushed even if it's not full.
+  void RequestSync() { sync_requested_ = true; }
 
-  std::vector<Item>* GetItems() { return &items_; }
+  bool IsSyncRequested() const { return sync_requested_; }
+
+  // All items of the buffer have the same temperature, so they are flushed to the same zone.
+  Temperature GetTemperature() const { return temperature_; }
+
+  // Drop the items and reopen the buffer for reuse. The item chunks are kept, while the arena is
+  // freed, since the views of the values may still refer to it.
+  void Reset(Temperature temperature);
 
  private:
-  std::vector<Item> items_;
+  static constexpr uint64_t kChunkItems = 1024;
+
+  // The item slots are bounded by assuming an item takes at least this bytes on average.
+  static constexpr uint64_t kMinItemBytes = 64;
+
+  struct Chunk {
+    Item items_[kChunkItems];
+  };
+
+  struct ArenaChunk {
+    explicit ArenaChunk(uint64_t size) : buf_(std::make_shared<IOBuf>(size)) {}
+
+    std::shared_ptr<IOBuf> buf_;
+
+    // Reserved bytes, which could exceed the chunk for the items that didn't fit.
+    std::atomic<uint64_t> used_{0};
+
+    // Set by the first item that didn't fit, where the encoded items end.
+    std::atomic<uint64_t> end_{0};
+  };
+
+  // Allocate the chunk on demand, a racing allocation is dropped.
+  Chunk* GetChunk(uint64_t chunk_idx);
+
+  ArenaChunk* GetArenaChunk(uint64_t idx, bool create);
+
+  // Encode the item into the arena, an item larger than a chunk is left as is.
+  // @return Status::Busy() if the arena is full.
+  Status Encode(const std::string& key, const std::shared_ptr<IOBuf>& value, Item& item);
+
+  uint64_t capacity_bytes_;
+
+  uint64_t max_items_;
+
+  Temperature temperature_;
+
+  std::unique_ptr<std::atomic<Chunk*>[]> chunks_;
+
+  std::atomic<uint64_t> item_num_{0};
+
+  std::atomic<uint64_t> used_bytes_{0};
+
+  // The arena chunks are freed on reset, so their memory is only pinned by the values that are
+  // still referred to.
+  uint64_t arena_chunk_size_;
+
+  uint64_t max_arena_chunks_;
+
+  std::unique_ptr<std::atomic<ArenaChunk*>[]> arena_;
+
+  // The chunk that takes the new items.
+  std::atomic<uint64_t> arena_idx_{0};
+
+  std::atomic<uint32_t> writers_{0};
 
-  uint32_t capacity_bytes_ = 256UL << 20;
+  // Renewed on reset, the old one is kept by its waiters and the flush.
+  std::shared_ptr<FlushTicket> ticket_ = std::make_shared<FlushTicket>();
 
-  uint32_t used_bytes_ = 0;
+  std::atomic<bool> sync_requested_{false};
 
-  bool immutable_ = false;
+  std::atomic<bool> sealed_{false};
 };
 }  // namespace neodb
@@ -0,0 +1,212 @@
+#include "write_buffer.h"
+
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "utils.h"
+
+namespace neodb {
+class WriteBufferTest : public ::testing::Test {
+ public:
+  void SetUp() override { InitLogger(); }
+
+  void TearDown() override {}
+};
+
+TEST_F(WriteBufferTest, EncodeTest) {
+  WriteBuffer buffer(1UL << 20);
+  std::vector<std::string> keys;
+  for (uint32_t i = 0; i < 100; ++i) {
+    keys.push_back("key" + std::to_string(i));
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(100 + i * 10));
+    std::shared_ptr<IOBuf> stored;
+    ASSERT_TRUE(buffer.Enter());
+    ASSERT_TRUE(buffer.Put(keys.back(), value, true, &stored).ok());
+    buffer.Leave();
+    // The stored value is a copy in the arena.
+    EXPECT_NE(stored, value);
+    EXPECT_EQ(stored->Data(), value->Data());
+  }
+  // A referenced item keeps the value as is.
+  auto referenced = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000));
+  std::shared_ptr<IOBuf> stored;
+  ASSERT_TRUE(buffer.Put("referenced", referenced, false, &stored).ok());
+  EXPECT_EQ(stored, referenced);
+  EXPECT_EQ(buffer.GetItem(100).chunk_, WriteBuffer::kNotEncoded);
+
+  ASSERT_TRUE(buffer.Seal());
+  buffer.WaitForWriters();
+  ASSERT_EQ(buffer.GetItemNum(), 101);
+  ASSERT_EQ(buffer.GetArenaChunkNum(), 1);
+  auto chunk = buffer.GetArenaChunk(0);
+  ASSERT_NE(chunk, nullptr);
+  EXPECT_EQ(chunk->Size() % IO_PAGE_SIZE, 0);
+
+  // The chunk is laid out as the data zone, so each item could be decoded at its offset.
+  uint64_t encoded_size = 0;
+  for (uint32_t i = 0; i < 100; ++i) {
+    auto& item = buffer.GetItem(i);
+    ASSERT_EQ(item.chunk_, 0);
+    const char* p = chunk->Buffer() + item.offset_;
+    uint16_t key_sz = 0;
+    uint32_t value_sz = 0;
+    memcpy(&key_sz, p, 2);
+    memcpy(&value_sz, p + 2, 4);
+    ASSERT_EQ(std::string(p + ITEM_META_SIZE, key_sz), item.key_);
+    ASSERT_EQ(value_sz, item.value_->Size());
+    ASSERT_EQ(p + ITEM_META_SIZE + key_sz, item.value_->Buffer());
+    encoded_size += ITEM_META_SIZE + key_sz + value_sz;
+  }
+  // The buffered memory is proportional to the items' size.
+  EXPECT_EQ(chunk->Size(), NumberUtils::AlignTo(encoded_size, IO_PAGE_SIZE));
+
+  // The views keep the arena alive after the reset.
+  auto view = buffer.GetItem(0).value_;
+  std::string data = view->Data();
+  buffer.Reset(kCold);
+  EXPECT_EQ(buffer.GetItemNum(), 0);
+  EXPECT_EQ(buffer.GetArenaChunk(0), nullptr);
+  EXPECT_EQ(view->Data(), data);
+}
+
+TEST_F(WriteBufferTest, ConcurrentPutTest) {
+  // A few chunks are filled by the writers together, an item never crosses a chunk.
+  const uint64_t capacity = 4 * IO_FLUSH_SIZE;
+  WriteBuffer buffer(capacity);
+  const uint32_t thread_num = 4;
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      for (uint32_t i = 0;; ++i) {
+        auto value = std::make_shared<IOBuf>(std::string(1000 + i % 3000, 'a' + t));
+        std::shared_ptr<IOBuf> stored;
+        if (!buffer.Enter()) {
+          return;
+        }
+        auto s = buffer.Put(std::to_string(t) + "-" + std::to_string(i), value, true, &stored);
+        bool full = buffer.IsFull();
+        buffer.Leave();
+        if (!s.ok() || full) {
+          return;
+        }
+      }
+    });
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  buffer.Seal();
+  buffer.WaitForWriters();
+  EXPECT_LE(buffer.GetArenaBytes(), capacity + IO_FLUSH_SIZE);
+  for (uint64_t i = 0; i < buffer.GetItemNum(); ++i) {
+    auto& item = buffer.GetItem(i);
+    // The slot of a Put that found the arena full.
+    if (item.value_ == nullptr) {
+      continue;
+    }
+    ASSERT_NE(item.chunk_, WriteBuffer::kNotEncoded);
+    auto chunk = buffer.GetArenaChunk(item.chunk_);
+    ASSERT_NE(chunk, nullptr);
+    ASSERT_LE(item.offset_ + ITEM_META_SIZE + item.key_.size() + item.value_->Size(),
+              chunk->Size());
+    // Each writer fills its values with its own letter.
+    char expected = 'a' + (item.key_[0] - '0');
+    ASSERT_EQ(item.value_->Data(), std::string(item.value_->Size(), expected));
+  }
+}
+
+TEST_F(WriteBufferTest, LargeItemTest) {
+  // An item larger than a chunk is referenced, the arena stays untouched.
+  WriteBuffer buffer(64 * IO_PAGE_SIZE);
+  auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(64 * IO_PAGE_SIZE));
+  std::shared_ptr<IOBuf> stored;
+  ASSERT_TRUE(buffer.Put("large", value, true, &stored).ok());
+  EXPECT_EQ(stored, value);
+  EXPECT_TRUE(buffer.IsFull());
+  buffer.Seal();
+  buffer.WaitForWriters();
+  EXPECT_EQ(buffer.GetArenaChunk(0), nullptr);
+}
+
+TEST_F(WriteBufferTest, FailedPutTest) {
+  // Once the slots ran out, nothing is encoded, so the arena only holds the items with slots.
+  WriteBuffer buffer(64 * IO_PAGE_SIZE);
+  auto value = std::make_shared<IOBuf>(std::string(1, 'v'));
+  std::shared_ptr<IOBuf> stored;
+  uint64_t item_num = 0;
+  while (buffer.Put(std::to_string(item_num), value, true, &stored).ok()) {
+    item_num++;
+  }
+  EXPECT_TRUE(buffer.IsFull());
+  buffer.Seal();
+  buffer.WaitForWriters();
+  ASSERT_EQ(buffer.GetItemNum(), item_num);
+  uint64_t encoded_size = 0;
+  for (uint64_t i = 0; i < item_num; ++i) {
+    encoded_size += WriteBuffer::GetItemBytes(buffer.GetItem(i).key_, value);
+  }
+  auto chunk = buffer.GetArenaChunk(0);
+  ASSERT_NE(chunk, nullptr);
+  EXPECT_EQ(chunk->Size(), NumberUtils::AlignTo(encoded_size, IO_PAGE_SIZE));
+
+  // Once the arena ran out, the slot is left without a value.
+  WriteBuffer small(IO_PAGE_SIZE);
+  auto page = std::make_shared<IOBuf>(std::string(IO_PAGE_SIZE / 2, 'v'));
+  item_num = 0;
+  while (small.Put(std::to_string(item_num), page, true, &stored).ok()) {
+    item_num++;
+  }
+  small.Seal();
+  small.WaitForWriters();
+  ASSERT_EQ(small.GetItemNum(), item_num + 1);
+  EXPECT_EQ(small.GetItem(item_num).value_, nullptr);
+}
+
+TEST_F(WriteBufferTest, ArenaFullAcrossChunksTest) {
+  // Each encoded item takes an arena chunk of its own, and the arena runs out exactly at the first
+  // slot of the second item chunk, so the failed slots are the only ones of that chunk.
+  WriteBuffer buffer(128UL << 10);
+  std::shared_ptr<IOBuf> stored;
+  auto small = std::make_shared<IOBuf>(std::string(10, 'r'));
+  for (uint32_t i = 0; i < 1022; ++i) {
+    ASSERT_TRUE(buffer.Put(std::to_string(i), small, false, &stored).ok());
+  }
+  auto large = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(80UL << 10));
+  ASSERT_TRUE(buffer.Put("encoded0", large, true, &stored).ok());
+  ASSERT_TRUE(buffer.Put("encoded1", large, true, &stored).ok());
+  for (uint32_t i = 0; i < 10; ++i) {
+    EXPECT_FALSE(buffer.Put("failed" + std::to_string(i), large, true, &stored).ok());
+  }
+  buffer.Seal();
+  buffer.WaitForWriters();
+
+  // Read it like the flush does, the failed slots are empty.
+  ASSERT_EQ(buffer.GetItemNum(), 1034);
+  uint64_t items = 0;
+  for (uint64_t i = 0; i < buffer.GetItemNum(); ++i) {
+    auto& item = buffer.GetItem(i);
+    if (item.value_ == nullptr) {
+      EXPECT_GE(i, 1024);
+      continue;
+    }
+    items++;
+  }
+  EXPECT_EQ(items, 1024);
+  EXPECT_NE(buffer.GetArenaChunk(0), nullptr);
+  EXPECT_NE(buffer.GetArenaChunk(1), nullptr);
+
+  // The buffer is reused afterwards.
+  buffer.Reset(kCold);
+  EXPECT_EQ(buffer.GetItemNum(), 0);
+  ASSERT_TRUE(buffer.Put("reused", large, true, &stored).ok());
+  EXPECT_EQ(stored->Data(), large->Data());
+}
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+}  // namespace neodb
@@ -6,6 +6,9 @@
 namespace neodb {
 enum ZoneState { EMPTY, OPEN, FULL, OFFLINE };
 
+// Expected lifetime of the data, hot data is likely to be overwritten soon.
+enum Temperature { kCold, kHot };
+
 class Zone {
  public:
   [[nodiscard]] uint64_t GetAvailableBytes() const {
@@ -21,14 +24,18 @@ class Zone {
   uint64_t wp_ = 0;
   uint64_t capacity_bytes_ = 0;
 
-  uint64_t expired_items_ = 0;
-  uint64_t expired_bytes_ = 0;
+  // Updated by the writers without a lock.
+  std::atomic<uint64_t> expired_items_{0};
+  std::atomic<uint64_t> expired_bytes_{0};
   uint64_t total_items_ = 0;
   uint64_t total_pinned_items_ = 0;
   uint64_t finish_time_us_ = 0;
 
   ZoneState state_ = ZoneState::EMPTY;
 
+  // Temperature of the data written to the zone.
+  Temperature temperature_ = kCold;
+
   uint64_t open_time_us_ = 0;
   uint64_t close_time_us_ = 0;
 };
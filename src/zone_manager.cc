@@ -1,142 +1,745 @@
 #include "zone_manager.h"
 
+#include <sched.h>
+
 #include <algorithm>
 #include <cassert>
 #include <memory>
+#include <thread>
 
 #include "codec.h"
 #include "gc.h"
 #include "trace_points.h"
 #include "utils.h"
+#include "value_writer.h"
 
 namespace neodb {
+namespace {
+uint32_t GetCPUNum() {
+  static const uint32_t cpu_num = std::max(std::thread::hardware_concurrency(), 1U);
+  return cpu_num;
+}
+}  // namespace
 
-Status ZoneManager::Append(const std::string& key, const std::shared_ptr<IOBuf>& value) {
-  uint64_t idx = HashUtils::FastHash(key) % options_.writable_buffer_num_;
-  // Each of the WriteBuffer can only be accessed by a single write thread.
-  // TODO(Roy Guo) Wait-Free is required in the future.
-  std::unique_lock<std::mutex> lk(writable_buffer_mtx_[idx]);
-  auto& write_buffer = writable_buffers_[idx];
-  auto status = write_buffer->Put(key, value);
-  if (!status.ok()) {
-    LOG(ERROR, "WriteBuffer {} put failed, key : {}, msg: {}", idx, key, status.msg());
-    return status;
-  }
-
-  // upsert index item
-  TRACE_POINT("IndexPut", { index_->Put(key, value); });
-
-  // TODO(Roy Guo) Move to background thread
-  // If the WriteBuffer exceeds its capacity, we should create a new empty
-  // buffer and seal the old one as immutable_ buffer.
-  if (write_buffer->IsFull() || write_buffer->IsImmutable()) {
-    write_buffer->MarkImmutable();
-    {
-      // If the immutable_ buffer exceeds limit, we should wait.
+Status ZoneManager::Append(const std::string& key, const std::shared_ptr<IOBuf>& value,
+                           bool sync, bool wait) {
+  // The item is charged to the write budget until its buffer was flushed.
+  uint64_t charge = WriteBuffer::GetItemBytes(key, value);
+  if (budget_ != nullptr && !budget_->TryAcquire(charge)) {
+    if (!wait) {
+      rejected_write_num_++;
+      return Status::Busy("Out of the write budget");
+    }
+    // Our flush workers are woken up to seal the buffers, the other stores' check it periodically.
+    NotifyFlushWorkers();
+    RecordWriteStall(budget_->Acquire(charge));
+  }
+  auto status = AppendToBuffer(key, value, sync, wait);
+  if (status.code() == Status::Code::kIOBusy) {
+    // Not buffered, so nothing will give the bytes back.
+    if (budget_ != nullptr) {
+      budget_->Release(charge);
+    }
+    rejected_write_num_++;
+  }
+  return status;
+}
+
+Status ZoneManager::AppendBatch(const std::vector<const WriteBatch::Item*>& items, bool sync) {
+  uint64_t charge = 0;
+  for (auto* item : items) {
+    charge += WriteBuffer::GetItemBytes(item->first, item->second);
+  }
+  if (budget_ != nullptr && !budget_->TryAcquire(charge)) {
+    NotifyFlushWorkers();
+    RecordWriteStall(budget_->Acquire(charge));
+  }
+  // Group the items by their write buffer slots, the batch's order is kept within each group.
+  std::vector<std::vector<const WriteBatch::Item*>> groups(writable_buffers_.size());
+  uint32_t cpu = GetCurrentCPU();
+  for (auto* item : items) {
+    groups[PickWritableBuffer(item->first, sync, cpu)].push_back(item);
+  }
+  std::vector<std::shared_ptr<FlushTicket>> tickets;
+  for (uint64_t idx = 0; idx < groups.size(); ++idx) {
+    if (!groups[idx].empty()) {
+      AppendGroup(idx, groups[idx], sync, &tickets);
+    }
+  }
+  if (!sync) {
+    return Status::OK();
+  }
+  NotifyFlushWorkers();
+  Status status = Status::OK();
+  for (auto& ticket : tickets) {
+    auto s = WaitForFlushTicket(ticket);
+    if (!s.ok()) {
+      status = s;
+    }
+  }
+  return status.ok() ? SyncDevice() : status;
+}
+
+void ZoneManager::AppendGroup(uint64_t idx, const std::vector<const WriteBatch::Item*>& items,
+                              bool sync, std::vector<std::shared_ptr<FlushTicket>>* tickets) {
+  std::vector<std::pair<std::string, Index::MemValue>> index_items;
+  index_items.reserve(items.size());
+  for (uint64_t next = 0; next < items.size();) {
+    auto* write_buffer = writable_buffers_[idx].load();
+    if (!write_buffer->Enter()) {
+      WaitForNewWriteBuffer(idx, write_buffer);
+      continue;
+    }
+    // The buffer may be recycled for another slot after we loaded it.
+    if (writable_buffers_[idx].load() != write_buffer) {
+      write_buffer->Leave();
+      continue;
+    }
+    // Fill the buffer until it's full, the rest go to the next one.
+    index_items.clear();
+    for (; next < items.size() && !write_buffer->IsFull(); ++next) {
+      auto& [key, value] = *items[next];
+      std::shared_ptr<IOBuf> stored_value;
+      if (!write_buffer->Put(key, value, !IsZeroCopyValue(value), &stored_value).ok()) {
+        break;
+      }
+      index_items.emplace_back(key, std::move(stored_value));
+    }
+    if (!index_items.empty()) {
+      // A single index update before leaving, so the flush always sees the MemValues to update.
+      std::vector<Index::LBAValue> replaced;
+      TRACE_POINT("IndexPut", { index_->MultiPut(index_items, &replaced); });
+      for (auto lba_value : replaced) {
+        ExpireItem(lba_value);
+      }
+      if (sync) {
+        tickets->push_back(write_buffer->GetFlushTicket());
+        write_buffer->RequestSync();
+      }
+    }
+    // Only one of the writers seals the full buffer and swaps in a new one.
+    bool sealed = write_buffer->IsFull() && write_buffer->Seal();
+    write_buffer->Leave();
+    if (sealed) {
+      SealWriteBuffer(idx, write_buffer);
+    } else if (next < items.size()) {
+      WaitForNewWriteBuffer(idx, write_buffer);
+    }
+  }
+}
+
+uint64_t ZoneManager::PickWritableBuffer(const std::string& key, bool sync, uint32_t cpu) {
+  // An overwrite is hot since the key is likely to be overwritten again. The flushed version it
+  // replaces is expired once the index was updated. Without the hot buffers the lookup is skipped.
+  Temperature temperature = kCold;
+  Index::ValueVariant old_value;
+  if (temperature_num_ > 1 && index_->Get(key, old_value).ok()) {
+    temperature = kHot;
+  }
+  // The durable appends take the first slot, so they are committed together.
+  return temperature * options_.writable_buffer_num_ + (sync ? 0 : GetWriteSlot(key, cpu));
+}
+
+Status ZoneManager::AppendToBuffer(const std::string& key, const std::shared_ptr<IOBuf>& value,
+                                   bool sync, bool wait) {
+  // The flush is behind, a non-blocking writer backs off rather than filling up another buffer.
+  // The count is read without the lock as it's only a hint.
+  if (!wait && immutable_buffer_count_ >= options_.immutable_buffer_num_) {
+    return Status::Busy("Too many immutable buffers");
+  }
+  uint64_t idx = PickWritableBuffer(key, sync, GetCurrentCPU());
+  std::shared_ptr<FlushTicket> ticket;
+  for (;;) {
+    auto* write_buffer = writable_buffers_[idx].load();
+    if (!write_buffer->Enter()) {
+      if (!wait && writable_buffers_[idx].load() == write_buffer) {
+        return Status::Busy("The write buffer is being sealed");
+      }
+      WaitForNewWriteBuffer(idx, write_buffer);
+      continue;
+    }
+    // The buffer may be recycled for another slot after we loaded it.
+    if (writable_buffers_[idx].load() != write_buffer) {
+      write_buffer->Leave();
+      continue;
+    }
+    // The zero-copy values are kept as is, the others are encoded into the buffer's arena and the
+    // index refers to the encoded copy.
+    std::shared_ptr<IOBuf> stored_value;
+    auto status = write_buffer->Put(key, value, !IsZeroCopyValue(value), &stored_value);
+    if (status.ok()) {
+      // upsert index item before leaving, so the flush always sees the MemValue to update.
+      Index::LBAValue replaced = 0;
+      bool expired = false;
+      TRACE_POINT("IndexPut", { expired = index_->Put(key, stored_value, &replaced); });
+      if (expired) {
+        ExpireItem(replaced);
+      }
+      if (sync) {
+        ticket = write_buffer->GetFlushTicket();
+        write_buffer->RequestSync();
+      }
+    }
+    // Only one of the writers seals the full buffer and swaps in a new one.
+    bool sealed = write_buffer->IsFull() && write_buffer->Seal();
+    write_buffer->Leave();
+    if (sealed) {
+      SealWriteBuffer(idx, write_buffer, wait);
+    }
+    if (status.ok() && !sync) {
+      return status;
+    }
+    if (status.ok()) {
+      // Wake up the idle flush workers, or the busy ones will seal the buffer once they are done.
+      NotifyFlushWorkers();
+      status = WaitForFlushTicket(ticket);
+      return status.ok() ? SyncDevice() : status;
+    }
+    // No slot is left in the buffer, retry with the new one.
+    if (!sealed) {
+      if (!wait && writable_buffers_[idx].load() == write_buffer) {
+        return status;
+      }
+      WaitForNewWriteBuffer(idx, write_buffer);
+    }
+  }
+}
+
+Status ZoneManager::OpenValueWriter(const std::string& key, uint32_t value_size,
+                                    std::unique_ptr<ValueWriter>* writer) {
+  if (key.size() > MAX_KEY_SIZE || value_size > MAX_VALUE_SIZE) {
+    return Status::IOError("Invalid key or value size of the value writer, key: " + key);
+  }
+  // Nothing else could write between the items of a single encoder.
+  if (!reserve_ranges_) {
+    return Status::NotSupported("The value writer requires multiple flush encoders");
+  }
+  writer->reset(new ValueWriter(this, key, value_size));
+  auto& w = **writer;
+  // An overwrite is hot like the buffered ones, the streams of a temperature are picked by the key.
+  Temperature temperature = kCold;
+  Index::ValueVariant old_value;
+  if (temperature_num_ > 1 && index_->Get(key, old_value).ok()) {
+    temperature = kHot;
+  }
+  std::vector<DataStream*> candidates;
+  for (auto& stream : streams_) {
+    if (stream->temperature_ == temperature) {
+      candidates.push_back(stream.get());
+    }
+  }
+  w.encoder_ = std::make_unique<Encoder>();
+  auto& encoder = *w.encoder_;
+  // The writer is not one of `encoders_`, its IO buffer is always submitted by itself, so the id
+  // is never used to flush it.
+  encoder.id_ = UINT32_MAX;
+  encoder.stream_ = candidates[HashUtils::FastHash(key) % candidates.size()];
+  // The ticket only collects the failures of the writer's IO.
+  encoder.ticket_ = std::make_shared<FlushTicket>();
+  w.buf_ = AcquireIOBuffer(IO_FLUSH_SIZE, encoder);
+  // The whole item is reserved at once, so the writer never switches the zone.
+  JoinDataZone(encoder);
+  ReserveZoneRange(encoder, w.buf_, ITEM_META_SIZE + key.size() + value_size, true);
+  w.lba_ = encoder.wp_;
+  const uint16_t key_sz = key.size();
+  w.buf_->Append(reinterpret_cast<const char*>(&key_sz), 2);
+  w.buf_->Append(reinterpret_cast<const char*>(&value_size), 4);
+  w.buf_->Append(key.data(), key_sz);
+  return Status::OK();
+}
+
+Status ZoneManager::AppendToValueWriter(ValueWriter& writer, const char* data, uint32_t size) {
+  auto& buf = writer.buf_;
+  auto& encoder = *writer.encoder_;
+  while (size > 0) {
+    uint32_t append_sz = std::min(buf->AvailableSize(), size);
+    buf->Append(data, append_sz);
+    data += append_sz;
+    size -= append_sz;
+    writer.appended_ += append_sz;
+    if (buf->AvailableSize() > 0) {
+      break;
+    }
+    // A full IO buffer is written right away, at most `flush_io_buffer_num_` are in flight.
+    std::shared_ptr<IOBuf> flushing = std::move(buf);
+    writer.status_ = SubmitFlushIO(flushing, nullptr, 0, encoder, true);
+    buf = AcquireIOBuffer(IO_FLUSH_SIZE, encoder);
+    if (!writer.status_.ok()) {
+      return writer.status_;
+    }
+  }
+  return Status::OK();
+}
+
+Status ZoneManager::CommitValueWriter(ValueWriter& writer) {
+  auto& encoder = *writer.encoder_;
+  auto& stream = *encoder.stream_;
+  auto& buf = writer.buf_;
+  if (buf->Size() > 0) {
+    buf->AlignBufferSize();
+    std::shared_ptr<IOBuf> flushing = std::move(buf);
+    writer.status_ = SubmitFlushIO(flushing, nullptr, 0, encoder, true);
+    buf = AcquireIOBuffer(IO_FLUSH_SIZE, encoder);
+  }
+  WaitForFlushIO(encoder);
+  if (writer.status_.ok() && encoder.ticket_->failed_) {
+    writer.status_ = Status::IOError("Failed to write the value of key: " + writer.key_);
+  }
+  if (writer.status_.ok()) {
+    writer.status_ = SyncDevice();
+  }
+  if (!writer.status_.ok()) {
+    return writer.status_;
+  }
+  uint64_t item_read_size = ITEM_META_SIZE + writer.key_.size() + writer.value_size_;
+  Index::LBAValue lba_value = Index::EncodeLBAValue(writer.lba_, item_read_size);
+  // A buffered version that is not yet flushed is expired once its flush finds it replaced.
+  Index::LBAValue replaced = 0;
+  if (index_->Put(writer.key_, lba_value, &replaced)) {
+    ExpireItem(replaced);
+  }
+  {
+    // The key is added before leaving, so it's in the meta of the zone.
+    std::lock_guard<std::mutex> lk(stream.data_zone_key_buffers_mtx_);
+    stream.data_zone_key_buffers_.emplace_back(writer.key_, lba_value);
+  }
+  CloseValueWriter(writer, true);
+  return Status::OK();
+}
+
+void ZoneManager::CloseValueWriter(ValueWriter& writer, bool committed) {
+  writer.closed_ = true;
+  auto& encoder = *writer.encoder_;
+  // The IO callbacks reference the encoder, so they should finish before it's freed.
+  WaitForFlushIO(encoder);
+  if (!committed && encoder.wp_ > writer.lba_) {
+    auto zone = GetZoneByLBA(writer.lba_);
+    zone->expired_items_++;
+    zone->expired_bytes_ += encoder.wp_ - writer.lba_;
+  }
+  // The unwritten data are dropped, and the tail of the range is given back if nobody reserved
+  // after it.
+  writer.buf_->Reset();
+  LeaveDataZone(encoder, writer.buf_, false);
+  ReleaseIOBuffer(writer.buf_);
+  writer.buf_ = nullptr;
+  writer.encoder_ = nullptr;
+}
+
+void ZoneManager::NotifyFlushWorkers() {
+  // The lock is taken so the notification won't slip between the workers' check and wait.
+  {
+    std::lock_guard<std::mutex> lk(immutable_buffer_mtx_);
+  }
+  immutable_buffer_cv_.notify_all();
+}
+
+void ZoneManager::RecordWriteStall(uint64_t stall_us) {
+  if (stall_us > 0) {
+    write_stall_num_++;
+    write_stall_us_ += stall_us;
+  }
+}
+
+WriteStallStats ZoneManager::GetWriteStallStats() const {
+  WriteStallStats stats;
+  stats.stall_num_ = write_stall_num_;
+  stats.stall_us_ = write_stall_us_;
+  stats.rejected_num_ = rejected_write_num_;
+  return stats;
+}
+
+uint32_t ZoneManager::GetCurrentCPU() {
+  uint32_t cpu_num = GetCPUNum();
+  // Spread the threads evenly if the CPU is unknown.
+  static std::atomic<uint32_t> next_cpu{0};
+  thread_local uint32_t thread_cpu = next_cpu++ % cpu_num;
+  uint32_t cpu = thread_cpu;
+#ifndef __APPLE__
+  int cur = sched_getcpu();
+  if (cur >= 0) {
+    cpu = cur % cpu_num;
+  }
+#endif
+  return cpu;
+}
+
+uint64_t ZoneManager::GetWriteSlot(const std::string& key, uint32_t cpu) const {
+  uint32_t cpu_num = GetCPUNum();
+  // The core owns the slots cpu, cpu + cpu_num, ..., the keys are spread among them so all the
+  // slots are used even if there are fewer cores.
+  uint64_t slot_num = options_.writable_buffer_num_;
+  if (cpu_num >= slot_num) {
+    return cpu % slot_num;
+  }
+  uint64_t owned = (slot_num - cpu + cpu_num - 1) / cpu_num;
+  return cpu + cpu_num * (HashUtils::FastHash(key) % owned);
+}
+
+WriteBuffer* ZoneManager::AllocateWriteBuffer(Temperature temperature) {
+  if (!free_write_buffers_.empty()) {
+    auto* buffer = free_write_buffers_.back();
+    free_write_buffers_.pop_back();
+    buffer->Reset(temperature);
+    return buffer;
+  }
+  write_buffers_.emplace_back(new WriteBuffer(options_.write_buffer_size_, temperature));
+  return write_buffers_.back().get();
+}
+
+void ZoneManager::SealWriteBuffer(uint64_t idx, WriteBuffer* buffer, bool wait) {
+  {
+    std::unique_lock<std::mutex> immutable_lk(immutable_buffer_mtx_);
+    // If the immutable_ buffer exceeds limit, we should wait. Only the wait for the flush is a
+    // stall, a non-blocking sealer goes over the limit instead.
+    auto has_room = [&]() { return immutable_buffers_.size() < options_.immutable_buffer_num_; };
+    if (wait && !has_room()) {
       auto t1 = TimeUtils::GetCurrentTimeInUs();
-      std::unique_lock<std::mutex> immutable_lk(immutable_buffer_mtx_);
-      immutable_buffer_cv_.wait(immutable_lk, [&]() {
-        return immutable_buffers_.size() < options_.immutable_buffer_num_;
-      });
+      immutable_buffer_cv_.wait(immutable_lk, has_room);
       auto t2 = TimeUtils::GetCurrentTimeInUs();
-      LOG(INFO, "Acquire new write buffer's lock, time: {}us", t2 - t1);
-      immutable_buffers_.emplace_back(std::move(writable_buffers_[idx]));
-      writable_buffers_[idx] = std::make_unique<WriteBuffer>(options_.write_buffer_size_);
-      LOG(DEBUG,
-          "WriteBuffer {} is full, move to immutable_ buffer list, total immutable_ buffer num: {}",
-          idx, immutable_buffers_.size());
+      LOG(DEBUG, "Wait for the immutable buffers to be flushed, time: {}us", t2 - t1);
+      RecordWriteStall(t2 - t1);
     }
-    immutable_buffer_cv_.notify_all();
+    immutable_buffers_.push_back(buffer);
+    immutable_buffer_count_++;
+    flushing_tickets_.remove_if([](auto& ticket) { return ticket->done_.load(); });
+    flushing_tickets_.push_back(buffer->GetFlushTicket());
+    writable_buffers_[idx] = AllocateWriteBuffer(buffer->GetTemperature());
+    LOG(DEBUG,
+        "WriteBuffer {} is full, move to immutable_ buffer list, total immutable_ buffer num: {}",
+        idx, immutable_buffers_.size());
+  }
+  immutable_buffer_cv_.notify_all();
+}
+
+void ZoneManager::WaitForNewWriteBuffer(uint64_t idx, WriteBuffer* buffer) {
+  std::unique_lock<std::mutex> lk(immutable_buffer_mtx_);
+  immutable_buffer_cv_.wait(lk, [&]() { return writable_buffers_[idx].load() != buffer; });
+}
+
+void ZoneManager::SealWritableBuffer(uint64_t idx, bool sync_only) {
+  auto* buffer = writable_buffers_[idx].load();
+  // Enter the buffer like a writer, so it won't be recycled for another slot meanwhile.
+  if (!buffer->Enter()) {
+    return;
+  }
+  bool sealed = writable_buffers_[idx].load() == buffer && buffer->GetItemNum() > 0 &&
+                (!sync_only || buffer->IsSyncRequested()) && buffer->Seal();
+  buffer->Leave();
+  if (sealed) {
+    SealWriteBuffer(idx, buffer);
+  }
+}
+
+bool ZoneManager::HasSyncRequest(Temperature temperature) const {
+  for (uint64_t i = 0; i < options_.writable_buffer_num_; ++i) {
+    auto* buffer = writable_buffers_[temperature * options_.writable_buffer_num_ + i].load();
+    if (buffer->IsSyncRequested() && !buffer->IsSealed()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+Status ZoneManager::Flush() {
+  // The appends that returned are either in the non-empty buffers or the ones sealed before.
+  for (uint64_t idx = 0; idx < writable_buffers_.size(); ++idx) {
+    SealWritableBuffer(idx, false);
+  }
+  std::list<std::shared_ptr<FlushTicket>> tickets;
+  {
+    std::lock_guard<std::mutex> lk(immutable_buffer_mtx_);
+    tickets = flushing_tickets_;
+  }
+  Status status = Status::OK();
+  for (auto& ticket : tickets) {
+    auto s = WaitForFlushTicket(ticket);
+    if (!s.ok()) {
+      status = s;
+    }
+  }
+  return status.ok() ? SyncDevice() : status;
+}
+
+void ZoneManager::ReleaseFlushTicket(const std::shared_ptr<FlushTicket>& ticket) {
+  if (ticket == nullptr || --ticket->pending_ > 0) {
+    return;
+  }
+  // The items of a failed flush are still buffered, the bytes are given back by their retry.
+  if (budget_ != nullptr && !ticket->failed_) {
+    budget_->Release(ticket->bytes_);
+  }
+  {
+    std::lock_guard<std::mutex> lk(durable_mtx_);
+    ticket->done_ = true;
+  }
+  durable_cv_.notify_all();
+}
+
+void ZoneManager::RecycleFlushedBuffers(Encoder& encoder) {
+  while (!encoder.flushed_buffers_.empty()) {
+    auto* buffer = encoder.flushed_buffers_.front();
+    auto ticket = buffer->GetFlushTicket();
+    if (!ticket->done_) {
+      return;
+    }
+    encoder.flushed_buffers_.pop_front();
+    std::lock_guard<std::mutex> lk(immutable_buffer_mtx_);
+    if (ticket->failed_ && !flush_worker_stopped_) {
+      LOG(ERROR, "Flush write buffer failed, retry its {} items", buffer->GetItemNum());
+      buffer->RenewFlushTicket();
+      immutable_buffers_.push_front(buffer);
+      immutable_buffer_count_++;
+      // Flush() waits for the retry instead.
+      flushing_tickets_.remove(ticket);
+      flushing_tickets_.push_back(buffer->GetFlushTicket());
+      continue;
+    }
+    if (ticket->failed_) {
+      LOG(ERROR, "Flush write buffer failed on shutdown, {} items are dropped",
+          buffer->GetItemNum());
+    }
+    // Drop the values now, and keep the buffer for the next seal.
+    buffer->Reset(buffer->GetTemperature());
+    free_write_buffers_.push_back(buffer);
+  }
+}
+
+Status ZoneManager::WaitForFlushTicket(const std::shared_ptr<FlushTicket>& ticket) {
+  std::unique_lock<std::mutex> lk(durable_mtx_);
+  durable_cv_.wait(lk, [&]() { return ticket->done_.load(); });
+  if (ticket->failed_) {
+    return Status::IOError("Failed to flush the write buffer");
   }
   return Status::OK();
 }
 
+Status ZoneManager::SyncDevice() {
+  uint64_t request = ++sync_requests_;
+  std::lock_guard<std::mutex> lk(sync_mtx_);
+  // The sync that finished meanwhile started after our call.
+  if (synced_requests_ >= request) {
+    return sync_status_;
+  }
+  uint64_t requests = sync_requests_;
+  sync_status_ = io_handle_->Sync();
+  synced_requests_ = requests;
+  return sync_status_;
+}
+
 // Try to pick a immutable_ write buffer and encode, flush it to disk. This function is called
 // before flush worker was stopped.
-void ZoneManager::FlushImmutableBuffers() {
-  if (data_zone_ == nullptr || data_zone_->state_ == ZoneState::FULL) {
-    Status s = SwitchDataZone();
+void ZoneManager::FlushImmutableBuffers(uint32_t encoder_id) {
+  auto& encoder = *encoders_[encoder_id];
+  auto& stream = *encoder.stream_;
+  auto& data_zone = stream.data_zone_;
+  // The zone of multiple encoders is switched once they all left it.
+  if (!reserve_ranges_ && (data_zone == nullptr || data_zone->state_ == ZoneState::FULL)) {
+    Status s = SwitchDataZone(stream.id_);
     if (!s.ok()) {
       LOG(ERROR, "No available data zone for writing, retry later...");
       return;
     }
   };
 
-  std::unique_ptr<WriteBuffer> immutable;
+  RecycleFlushedBuffers(encoder);
+  WriteBuffer* immutable = nullptr;
   {
+    // The oldest immutable_ buffer of the stream's temperature.
+    auto next = [&]() {
+      return std::find_if(immutable_buffers_.begin(), immutable_buffers_.end(), [&](auto& buf) {
+        return buf->GetTemperature() == stream.temperature_;
+      });
+    };
     std::unique_lock<std::mutex> lk(immutable_buffer_mtx_);
-    immutable_buffer_cv_.wait_for(lk, std::chrono::seconds(1),
-                                  [&]() { return !immutable_buffers_.empty(); });
-    if (immutable_buffers_.empty()) {
+    if (next() == immutable_buffers_.end() && encoder.inflight_flush_io_ > 0) {
+      // Nothing to encode, finish the in-flight IO first so the related index could be updated.
+      lk.unlock();
+      WaitForFlushIO(encoder);
+      RecycleFlushedBuffers(encoder);
+      lk.lock();
+    }
+    auto& seen_pressure = seen_pressure_epoch_[stream.temperature_];
+    auto under_pressure = [&]() {
+      return budget_ != nullptr && budget_->GetPressureEpoch() != seen_pressure;
+    };
+    immutable_buffer_cv_.wait_for(lk, std::chrono::seconds(1), [&]() {
+      return next() != immutable_buffers_.end() || HasSyncRequest(stream.temperature_) ||
+             under_pressure();
+    });
+    if (next() == immutable_buffers_.end() &&
+        (HasSyncRequest(stream.temperature_) || under_pressure())) {
+      // Group commit, the durable appends that arrived while we were busy are flushed together.
+      // If the write budget ran out, all the buffered writes are flushed to give it back.
+      bool sync_only = !under_pressure();
+      seen_pressure = budget_ != nullptr ? budget_->GetPressureEpoch() : 0;
+      lk.unlock();
+      for (uint64_t i = 0; i < options_.writable_buffer_num_; ++i) {
+        SealWritableBuffer(stream.temperature_ * options_.writable_buffer_num_ + i, sync_only);
+      }
+      lk.lock();
+    }
+    auto it = next();
+    if (it == immutable_buffers_.end()) {
       return;
     }
 
     // steal one immutable_ buffer out of the list
-    immutable = std::move(immutable_buffers_.front());
-    immutable_buffers_.pop_front();
+    immutable = *it;
+    immutable_buffers_.erase(it);
+    immutable_buffer_count_--;
     LOG(DEBUG, "Take immutable_ buffer for flush success, immutable_ buffer size: {}",
         immutable_buffers_.size());
-    immutable_buffer_cv_.notify_one();
+    // Both the writers and the other flush workers wait on the cv.
+    immutable_buffer_cv_.notify_all();
   }
 
-  auto encoded_buf = std::make_shared<IOBuf>(IO_FLUSH_SIZE);
-  std::vector<uint64_t> lba_vec;
-  auto* items = immutable->GetItems();
-  for (int i = 0; i < items->size(); ++i) {
-    auto& item = (*items)[i];
-
-    // Check whether current data zone can hold the next item.
-    uint64_t meta_size = NumberUtils::AlignTo(expect_data_zone_meta_size_, IO_PAGE_SIZE);
-    // IO_FLUSH_SIZE + MAX_KEY_SIZE + IO_PAGE_SIZE should be enough to hold the
-    // current buffer and next item's key and related meta. So if the free space
-    // is less, we should switch to another data zone.
-    uint64_t max_cur_buffer_size = IO_FLUSH_SIZE;
-    // key size + value size + max possible alignment size
-    uint64_t max_next_item_encoded_size = MAX_KEY_SIZE + item.second->Size() + IO_PAGE_SIZE;
-    if (data_zone_->GetAvailableBytes() <=
-        meta_size + footer_size_ + max_cur_buffer_size + max_next_item_encoded_size) {
-      // Before switch to new zone, we should flush the current buffer because the related LBA were
-      // already calculated.
-      FlushAndResetIOBuffer(encoded_buf);
-      TRACE_POINT("SwitchDataZone", { SwitchDataZone(); });
-      data_zone_key_buffers_.clear();
-      assert(data_zone_->GetUsedBytes() % IO_PAGE_SIZE == 0);
+  auto encoded_buf = AcquireIOBuffer(IO_FLUSH_SIZE, encoder_id);
+  if (reserve_ranges_) {
+    JoinDataZone(encoder);
+  }
+  // The writers that entered before the seal may still be writing their items.
+  immutable->WaitForWriters();
+  encoder.ticket_ = immutable->GetFlushTicket();
+  encoder.ticket_->bytes_ = immutable->GetUsedBytes();
+  // The encoded items are written chunk by chunk, then the referenced ones are encoded as before.
+  uint64_t item_num = immutable->GetItemNum();
+  std::vector<std::vector<uint64_t>> chunk_items(immutable->GetArenaChunkNum());
+  std::vector<uint64_t> referenced_items;
+  for (uint64_t i = 0; i < item_num; ++i) {
+    auto& item = immutable->GetItem(i);
+    if (item.value_ == nullptr) {
+      continue;
     }
+    if (item.chunk_ == WriteBuffer::kNotEncoded) {
+      referenced_items.push_back(i);
+    } else {
+      chunk_items[item.chunk_].push_back(i);
+    }
+  }
+  for (uint32_t c = 0; c < chunk_items.size(); ++c) {
+    auto chunk = immutable->GetArenaChunk(c);
+    if (chunk != nullptr) {
+      FlushArenaChunk(encoder, encoded_buf, chunk, immutable, chunk_items[c]);
+    }
+  }
+  for (uint64_t i = 0; i < referenced_items.size(); ++i) {
+    auto& item = immutable->GetItem(referenced_items[i]);
+    // key size + value size + max possible alignment size
+    EnsureZoneRoom(encoder, encoded_buf, MAX_KEY_SIZE + item.value_->Size() + IO_PAGE_SIZE);
 
     // Continue to flush next item to the new data zone.
     // Note that this operation may not flush the data into disk, instead, only flush to the IO
     // buffer for batch processing. But the returned LBA is expected to be correct later.
-    uint64_t lba =
-        TryFlushSingleItem(encoded_buf, item.first, item.second, i == (items->size() - 1));
-    lba_vec.push_back(lba);
-    //  All keys & LBA of current data zone
-    data_zone_key_buffers_.emplace_back(item.first, lba);
+    uint64_t lba = TryFlushSingleItem(encoded_buf, item.key_, item.value_,
+                                      i == referenced_items.size() - 1, encoder_id);
+    // Carry the item's read size with its LBA, so the item could be read out with a single IO.
+    uint64_t item_read_size = lba % IO_PAGE_SIZE + ITEM_META_SIZE + item.key_.size() +
+                              item.value_->Size();
+    Index::LBAValue lba_value = Index::EncodeLBAValue(lba, item_read_size);
     // Keys & LBA of current IO Buffer (not current data zone), because current IO Buffer probally
-    // not fully flushed at once.
-    encoded_io_key_buf_.emplace_back(item.first, lba);
+    // not fully flushed at once. They are added to the data zone's keys once the IO finished.
+    encoder.encoded_io_key_buf_.push_back({item.key_, lba_value, item.value_});
+  }
+  if (reserve_ranges_) {
+    LeaveDataZone(encoder, encoded_buf, false);
+  }
+  ReleaseIOBuffer(encoded_buf);
+  // All the IO of the buffer were submitted, the ticket is done once they finished. The buffer is
+  // kept until then, in case it has to be flushed again.
+  encoder.flushed_buffers_.push_back(immutable);
+  ReleaseFlushTicket(encoder.ticket_);
+  encoder.ticket_ = nullptr;
+  RecycleFlushedBuffers(encoder);
+}
+
+void ZoneManager::EnsureZoneRoom(Encoder& encoder, std::shared_ptr<IOBuf>& buf, uint64_t size) {
+  auto& stream = *encoder.stream_;
+  auto& data_zone = stream.data_zone_;
+  // Check whether current data zone can hold the next item.
+  uint64_t meta_size = NumberUtils::AlignTo(expect_data_zone_meta_size_, IO_PAGE_SIZE);
+  // IO_FLUSH_SIZE + MAX_KEY_SIZE + IO_PAGE_SIZE should be enough to hold the
+  // current buffer and next item's key and related meta. So if the free space
+  // is less, we should switch to another data zone.
+  uint64_t max_cur_buffer_size = IO_FLUSH_SIZE;
+  if (reserve_ranges_) {
+    // The zone's room was checked when the range was reserved. The range only has to hold the
+    // encoded data and the item, as the unused tail of a range is wasted.
+    ReserveZoneRange(encoder, buf, buf->Size() + size + IO_PAGE_SIZE);
+  } else if (data_zone->GetAvailableBytes() <=
+             meta_size + footer_size_ + max_cur_buffer_size + size) {
+    // Before switch to new zone, we should flush the current buffer because the related LBA were
+    // already calculated.
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder.id_);
+    Status s = Status::OK();
+    TRACE_POINT("SwitchDataZone", { s = SwitchDataZone(stream.id_); });
+    while (!s.ok()) {
+      // The zone has no room for the item, so nothing could be written until it's switched.
+      LOG(ERROR, "Stream[{}] failed to switch the data zone, retry later: {}", stream.id_,
+          s.msg());
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      s = SwitchDataZone(stream.id_);
+    }
+    {
+      std::lock_guard<std::mutex> lk(stream.data_zone_key_buffers_mtx_);
+      stream.data_zone_key_buffers_.clear();
+    }
+    assert(data_zone->GetUsedBytes() % IO_PAGE_SIZE == 0);
   }
 }
 
-uint64_t ZoneManager::TryFlushSingleItem(const std::shared_ptr<IOBuf>& buf, const std::string& key,
-                                         const std::shared_ptr<IOBuf>& value, bool force_flush) {
+void ZoneManager::FlushArenaChunk(Encoder& encoder, std::shared_ptr<IOBuf>& buf,
+                                  const std::shared_ptr<IOBuf>& chunk, WriteBuffer* write_buffer,
+                                  const std::vector<uint64_t>& items) {
+  EnsureZoneRoom(encoder, buf, chunk->Size());
+  // The chunk is written right after the encoded data, which has to be aligned first.
+  if (buf->Size() > 0) {
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder.id_);
+  }
+  uint64_t base = GetWritePointer(encoder);
+  for (uint64_t i : items) {
+    auto& item = write_buffer->GetItem(i);
+    uint64_t lba = base + item.offset_;
+    uint64_t item_read_size = lba % IO_PAGE_SIZE + ITEM_META_SIZE + item.key_.size() +
+                              item.value_->Size();
+    encoder.encoded_io_key_buf_.push_back(
+        {item.key_, Index::EncodeLBAValue(lba, item_read_size), item.value_});
+  }
+  while (encoder.inflight_flush_io_ >= options_.flush_io_buffer_num_) {
+    io_handle_->Wait();
+  }
+  // The values in the index are views of the chunk, so it's never recycled for other IO.
+  auto s = SubmitFlushIO(chunk, nullptr, 0, encoder, false);
+  if (!s.ok()) {
+    LOG(ERROR, "Flush arena chunk failed: " + s.msg());
+  }
+}
+
+uint64_t ZoneManager::TryFlushSingleItem(std::shared_ptr<IOBuf>& buf, const std::string& key,
+                                         const std::shared_ptr<IOBuf>& value, bool force_flush,
+                                         uint32_t encoder_id) {
   assert(key.size() <= MAX_KEY_SIZE);
+  if (IsZeroCopyValue(value)) {
+    return FlushZeroCopyItem(buf, key, value, force_flush, encoder_id);
+  }
+  auto& encoder = *encoders_[encoder_id];
   // Expected flush LBA for current key value item.
-  uint64_t lba = data_zone_->wp_ + buf->Size();
+  uint64_t lba = GetWritePointer(encoder) + buf->Size();
 
   // meta: Key Len 2B + Value Len 4B
   // TODO: add CRC to protect the meta info.
-  const uint16_t meta_sz = 6;
+  const uint16_t meta_sz = ITEM_META_SIZE;
   const uint16_t key_sz = key.size();
   const uint32_t value_sz = value->Size();
   // We should process item buffer and then reset it if there's no enough free space for key data
   // and meta
-  if (buf->AvailableSize() <= (key_sz + meta_sz)) {
+  if (buf->AvailableSize() <= uint32_t(key_sz + meta_sz)) {
     LOG(DEBUG, "buffer almost full, flush it now, size: {}", buf->Size());
     // skip the last few bytes for next writing as item lba offset.
     lba += (buf->AvailableSize());
-    FlushAndResetIOBuffer(buf);
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder_id);
     LOG(DEBUG, "buffer flushed, buffer cap: {}, buffer size: {}, lba: {}", buf->Capacity(),
-        buf->Size(), data_zone_->wp_);
+        buf->Size(), GetWritePointer(encoder));
   }
 
   // Append item meta (key sz, value sz) and key data
@@ -165,8 +768,8 @@ uint64_t ZoneManager::TryFlushSingleItem(const std::shared_ptr<IOBuf>& buf, cons
     // the buffer.
     if (buf->AvailableSize() == 0) {
       LOG(DEBUG, "Buffer is full, flushed, io size: {}, lba = {}", buf->Capacity(),
-          data_zone_->wp_);
-      FlushAndResetIOBuffer(buf);
+          GetWritePointer(encoder));
+      FlushAndResetIOBuffer(buf, nullptr, 0, encoder_id);
     }
   }
 
@@ -174,49 +777,144 @@ uint64_t ZoneManager::TryFlushSingleItem(const std::shared_ptr<IOBuf>& buf, cons
   // the item to the disk.
   if (force_flush) {
     LOG(DEBUG, "buffer force flushed, buffer size: {}", buf->Size());
-    FlushAndResetIOBuffer(buf);
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder_id);
   }
   return lba;
 }
 
-Status ZoneManager::ReadSingleItem(uint64_t offset, std::string* key,
-                                   std::shared_ptr<IOBuf>& value) {
-  const int meta_sz = 6;
-  int header_read_size = IO_PAGE_SIZE;
-  uint64_t align = offset % IO_PAGE_SIZE;
-  if (IO_PAGE_SIZE - align < meta_sz) {
-    header_read_size *= 2;
+uint64_t ZoneManager::FlushZeroCopyItem(std::shared_ptr<IOBuf>& buf, const std::string& key,
+                                        const std::shared_ptr<IOBuf>& value, bool force_flush,
+                                        uint32_t encoder_id) {
+  auto& encoder = *encoders_[encoder_id];
+  const uint16_t key_sz = key.size();
+  const uint32_t value_sz = value->Size();
+  auto padding = [&]() -> uint32_t {
+    uint32_t header_end = (buf->Size() + ITEM_META_SIZE + key_sz) % IO_PAGE_SIZE;
+    return header_end == 0 ? 0 : IO_PAGE_SIZE - header_end;
+  };
+  uint32_t pad = padding();
+  if (buf->AvailableSize() < pad + ITEM_META_SIZE + key_sz) {
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder_id);
+    pad = padding();
+  }
+  // The padding bytes are never read, items are only located by their LBA.
+  buf->AppendZeros(pad);
+  uint64_t lba = GetWritePointer(encoder) + buf->Size();
+  buf->Append(reinterpret_cast<const char*>(&key_sz), 2);
+  buf->Append(reinterpret_cast<const char*>(&value_sz), 4);
+  buf->Append(key.data(), key_sz);
+  assert(buf->Size() % IO_PAGE_SIZE == 0);
+
+  uint32_t aligned_value_sz = value_sz / IO_PAGE_SIZE * IO_PAGE_SIZE;
+  FlushAndResetIOBuffer(buf, value, aligned_value_sz, encoder_id);
+  buf->Append(value->Buffer() + aligned_value_sz, value_sz - aligned_value_sz);
+  if (force_flush) {
+    LOG(DEBUG, "buffer force flushed, buffer size: {}", buf->Size());
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder_id);
   }
-  auto header = std::make_shared<IOBuf>(header_read_size);
-  auto s = io_handle_->Read(offset - align, header);
+  return lba;
+}
+
+Status ZoneManager::ReadSingleItem(uint64_t lba_value, std::string* key,
+                                   std::shared_ptr<IOBuf>& value) {
+  // Completion context shared with the callback, we wait on the device until it's done.
+  struct ReadContext {
+    std::atomic<bool> done_{false};
+    Status status_ = Status::OK();
+  };
+  auto ctx = std::make_shared<ReadContext>();
+  auto s = AsyncReadSingleItem(
+      lba_value, [ctx, key, &value](Status s, const std::string& read_key,
+                                    const std::shared_ptr<IOBuf>& read_value) {
+        if (s.ok()) {
+          *key = read_key;
+          value = read_value;
+        }
+        ctx->status_ = s;
+        ctx->done_ = true;
+      });
   if (!s.ok()) {
     return s;
   }
-  uint64_t key_sz = *reinterpret_cast<uint16_t*>(header->Buffer() + align);
-  uint32_t value_sz = *reinterpret_cast<uint32_t*>(header->Buffer() + align + 2 /* skip key_sz */);
-  uint64_t unaligned_total_sz = align + meta_sz + key_sz + value_sz;
-  uint64_t aligned_total_sz = (unaligned_total_sz + IO_PAGE_SIZE - 1) / IO_PAGE_SIZE * IO_PAGE_SIZE;
-  // Read out all key value data.
-  value = std::make_shared<IOBuf>(aligned_total_sz);
-  s = io_handle_->Read(offset - align, value);
+  while (!ctx->done_) {
+    io_handle_->Wait();
+  }
+  return ctx->status_;
+}
+
+Status ZoneManager::AsyncReadSingleItem(uint64_t lba_value, const ReadItemCallback& cb) {
+  uint64_t offset = Index::DecodeLBA(lba_value);
+  uint64_t align = offset % IO_PAGE_SIZE;
+  // If the index knows the item's size, the whole item could be read with a single IO. Otherwise
+  // we have to read the item header first.
+  uint64_t read_size = Index::DecodeItemReadSize(lba_value);
+  if (read_size == 0) {
+    read_size = IO_PAGE_SIZE;
+    if (IO_PAGE_SIZE - align < ITEM_META_SIZE) {
+      read_size *= 2;
+    }
+  }
+  auto buf = std::make_shared<IOBuf>(read_size);
+  auto read_cb = [this, buf, offset, cb](uint64_t, int64_t res) {
+    if (res < 0) {
+      cb(Status::IOError(std::strerror(-res)), "", nullptr);
+      return;
+    }
+    DecodeSingleItem(offset, buf, cb);
+  };
+  return io_handle_->AsyncRead(offset - align, buf, read_cb);
+}
+
+void ZoneManager::DecodeSingleItem(uint64_t offset, const std::shared_ptr<IOBuf>& buf,
+                                   const ReadItemCallback& cb) {
+  uint64_t align = offset % IO_PAGE_SIZE;
+  uint64_t key_sz = *reinterpret_cast<uint16_t*>(buf->Buffer() + align);
+  uint32_t value_sz = *reinterpret_cast<uint32_t*>(buf->Buffer() + align + 2 /* skip key_sz */);
+  if (key_sz > MAX_KEY_SIZE || value_sz > MAX_VALUE_SIZE) {
+    LOG(ERROR, "Invalid item header, offset: {}, key sz: {}, value sz: {}", offset, key_sz,
+        value_sz);
+    cb(Status::IOError("invalid item header"), "", nullptr);
+    return;
+  }
+  uint64_t unaligned_total_sz = align + ITEM_META_SIZE + key_sz + value_sz;
+  if (unaligned_total_sz <= buf->Size()) {
+    std::string key(buf->Buffer() + align + ITEM_META_SIZE, key_sz);
+    buf->Shrink(align + ITEM_META_SIZE + key_sz, value_sz);
+    cb(Status::OK(), key, buf);
+    return;
+  }
+
+  // Only the header was read, read out all key value data.
+  auto value = std::make_shared<IOBuf>(NumberUtils::AlignTo(unaligned_total_sz, IO_PAGE_SIZE));
+  auto read_item_cb = [this, value, offset, cb](uint64_t, int64_t res) {
+    if (res < 0) {
+      // A corrupt LBA may be out of the device.
+      auto zone = GetZoneByLBA(offset);
+      if (zone == nullptr) {
+        LOG(ERROR, "Read failed, offset: {} is out of the zones", offset);
+      } else {
+        LOG(ERROR, "Read failed, offset: {}, zone id: {}, zone state: {}", offset, zone->id_,
+            (int)zone->state_);
+      }
+      cb(Status::IOError(std::strerror(-res)), "", nullptr);
+      return;
+    }
+    DecodeSingleItem(offset, value, cb);
+  };
+  auto s = io_handle_->AsyncRead(offset - align, value, read_item_cb);
   if (!s.ok()) {
-    uint64_t zone_id = offset / options_.device_zone_capacity_;
-    LOG(ERROR, "Read failed, zone id: " + std::to_string(zone_id) +
-                   ", zone state: " + std::to_string(zones_[zone_id]->state_));
-    return s;
+    cb(s, "", nullptr);
   }
-  *key = std::string(value->Buffer() + align + meta_sz, key_sz);
-  value->Shrink(align + meta_sz + key_sz, value_sz);
-  return Status::OK();
 }
 
-Status ZoneManager::SwitchDataZone() {
+Status ZoneManager::SwitchDataZone(uint32_t stream_id) {
   auto t1 = TimeUtils::GetCurrentTimeInUs();
+  auto& data_zone = streams_[stream_id]->data_zone_;
   // Finish the current data zone before open next one.
-  if (data_zone_ != nullptr) {
-    LOG(INFO, "Zone[{}] need to be finished before switching new data zone.", data_zone_->id_);
+  if (data_zone != nullptr) {
+    LOG(INFO, "Zone[{}] need to be finished before switching new data zone.", data_zone->id_);
     Status s = Status::OK();
-    TRACE_POINT("FinishCurrentDataZone", { s = FinishCurrentDataZone(); });
+    TRACE_POINT("FinishCurrentDataZone", { s = FinishCurrentDataZone(stream_id); });
     if (!s.ok()) {
       return s;
     }
@@ -228,12 +926,20 @@ Status ZoneManager::SwitchDataZone() {
   std::unique_lock<std::mutex> lk(empty_zones_mtx_);
   empty_zones_cv_.wait(lk, [&]() { return !empty_zones_.empty(); });
 
-  data_zone_ = empty_zones_.back();
+  data_zone = empty_zones_.back();
   empty_zones_.pop_back();
-  data_zone_->state_ = ZoneState::OPEN;
-  data_zone_->open_time_us_ = TimeUtils::GetCurrentTimeInUs();
+  data_zone->state_ = ZoneState::OPEN;
+  data_zone->temperature_ = streams_[stream_id]->temperature_;
+  data_zone->open_time_us_ = TimeUtils::GetCurrentTimeInUs();
+  // Keep an IO buffer of room for the zone meta, like the single encoder does.
+  auto& stream = *streams_[stream_id];
+  stream.reserved_wp_ = data_zone->wp_;
+  stream.reserve_limit_ = data_zone->offset_ + data_zone->capacity_bytes_ - footer_size_ -
+                          NumberUtils::AlignTo(expect_data_zone_meta_size_, IO_PAGE_SIZE) -
+                          IO_FLUSH_SIZE;
   auto t2 = TimeUtils::GetCurrentTimeInUs();
-  LOG(INFO, "Switched to a new data zone: {}, time cost: {}us", data_zone_->id_, (t2 - t1));
+  LOG(INFO, "Stream[{}] switched to a new data zone: {}, time cost: {}us", stream_id,
+      data_zone->id_, (t2 - t1));
   return Status::OK();
 }
 
@@ -257,72 +963,336 @@ void ZoneManager::RecoverZoneStates(bool reuse_db) {
 }
 
 // The real device IO happens here.
-Status ZoneManager::FlushAndResetIOBuffer(const std::shared_ptr<IOBuf>& buf) {
+Status ZoneManager::FlushAndResetIOBuffer(std::shared_ptr<IOBuf>& buf,
+                                          const std::shared_ptr<IOBuf>& value, uint32_t value_size,
+                                          uint32_t encoder_id) {
+  auto& encoder = *encoders_[encoder_id];
+  auto& stream = *encoder.stream_;
   buf->AlignBufferSize();
-  auto s = io_handle_->Append(data_zone_, buf);
+  if (buf->Size() == 0 && value == nullptr) {
+    // The pending keys' data were all in previous IO buffers, which may be still in flight.
+    WaitForFlushIO(encoder);
+    SettleFlushedKeys(stream, encoder.encoded_io_key_buf_, encoder.last_flush_delta_);
+    encoder.encoded_io_key_buf_.clear();
+    return Status::OK();
+  }
+
+  std::shared_ptr<IOBuf> flushing = std::move(buf);
+  Status s = SubmitFlushIO(flushing, value, value_size, encoder, true);
+  buf = AcquireIOBuffer(flushing->Capacity(), encoder_id);
   if (!s.ok()) {
     LOG(ERROR, "Flush IO buffer failed: " + s.msg());
     return s;
   }
+  return Status::OK();
+}
+
+Status ZoneManager::SubmitFlushIO(const std::shared_ptr<IOBuf>& flushing,
+                                  const std::shared_ptr<IOBuf>& value, uint32_t value_size,
+                                  Encoder& encoder, bool recycle) {
+  auto& stream = *encoder.stream_;
+  // The callback owns the IO buffer and its related keys until the IO finished, after that we
+  // can update the index and recycle the buffer.
+  // Note that the callback could be invoked by any thread that polls the IOHandle.
+  auto keys = std::move(encoder.encoded_io_key_buf_);
+  encoder.encoded_io_key_buf_.clear();
+  encoder.inflight_flush_io_++;
+  // The LBAs were calculated from the zone's write pointer, but a zoned device decides the real
+  // offset of an append, so we only learn it on completion.
+  uint64_t expected_offset = GetWritePointer(encoder);
+  auto ticket = encoder.ticket_;
+  if (ticket != nullptr) {
+    ticket->pending_++;
+  }
+  // The zero-copy value is also kept alive by the callback.
+  auto flush_cb = [this, &encoder, flushing, value, keys, expected_offset, recycle, ticket](
+                      uint64_t offset, int64_t res) {
+    if (res < 0) {
+      // The items are still available in the memory index, they are flushed again along with
+      // their write buffer, see RecycleFlushedBuffers().
+      LOG(ERROR, "Flush IO buffer failed, offset: {}, msg: {}", offset, std::strerror(-res));
+      if (ticket != nullptr) {
+        ticket->failed_ = true;
+      }
+    } else {
+      // The buffer's items are moved along with it. The appends of a zone are placed in their
+      // submission order, so an item spanning multiple buffers is moved by the same distance.
+      int64_t delta = (int64_t)offset - (int64_t)expected_offset;
+      encoder.last_flush_delta_ = delta;
+      SettleFlushedKeys(*encoder.stream_, keys, delta);
+    }
+    if (recycle) {
+      ReleaseIOBuffer(flushing);
+    }
+    ReleaseFlushTicket(ticket);
+    encoder.inflight_flush_io_--;
+  };
+  // The callback may recycle the buffer before the submission returns, remember the size first.
+  uint64_t size = flushing->Size() + value_size;
+  Status s = Status::OK();
+  if (value == nullptr) {
+    // The reserved ranges are written at their offsets, and the zone's write pointer is left as is.
+    s = reserve_ranges_ ? io_handle_->AsyncWrite(encoder.wp_, flushing, flush_cb)
+                        : io_handle_->AsyncAppend(stream.data_zone_, flushing, flush_cb);
+  } else {
+    std::vector<struct iovec> iov;
+    if (flushing->Size() > 0) {
+      iov.push_back({flushing->Buffer(), flushing->Size()});
+    }
+    iov.push_back({value->Buffer(), value_size});
+    s = reserve_ranges_ ? io_handle_->AsyncWritev(encoder.wp_, iov, flush_cb)
+                        : io_handle_->AsyncAppendv(stream.data_zone_, iov, flush_cb);
+  }
+  if (!s.ok()) {
+    if (ticket != nullptr) {
+      ticket->failed_ = true;
+      ReleaseFlushTicket(ticket);
+    }
+    encoder.inflight_flush_io_--;
+  } else if (reserve_ranges_) {
+    encoder.wp_ += size;
+    assert(encoder.wp_ <= encoder.end_);
+  }
+  return s;
+}
+
+void ZoneManager::SettleFlushedKeys(DataStream& stream, const std::vector<EncodedKey>& keys,
+                                    int64_t delta) {
+  std::lock_guard<std::mutex> lk(stream.data_zone_key_buffers_mtx_);
   // update current io buffer's related key index.
-  for (auto pair : encoded_io_key_buf_) {
-    index_->Update(pair.first, pair.second);
+  std::vector<Index::LBAValue> replaced;
+  for (auto& item : keys) {
+    auto lba_value = Index::MoveLBAValue(item.lba_value_, delta);
+    // A newer version of the key could be flushed earlier by another stream, so the index is
+    // only moved if it still refers to this version. Otherwise the item is already expired.
+    if (!index_->UpdateIfMatch(item.key_, item.value_, lba_value, &replaced)) {
+      ExpireItem(lba_value);
+    }
+    stream.data_zone_key_buffers_.emplace_back(item.key_, lba_value);
+  }
+  for (auto old_value : replaced) {
+    ExpireItem(old_value);
+  }
+}
+
+std::shared_ptr<Zone> ZoneManager::GetZoneByLBA(uint64_t lba) {
+  // The zones are sorted by their offsets.
+  auto it = std::upper_bound(zones_.begin(), zones_.end(), lba,
+                             [](uint64_t offset, auto& zone) { return offset < zone->offset_; });
+  if (it == zones_.begin() || lba >= (*(it - 1))->offset_ + (*(it - 1))->capacity_bytes_) {
+    return nullptr;
+  }
+  return *(it - 1);
+}
+
+void ZoneManager::ExpireItem(Index::LBAValue lba_value) {
+  auto zone = GetZoneByLBA(Index::DecodeLBA(lba_value));
+  if (zone == nullptr) {
+    return;
+  }
+  // Large items carry no size, they take at least the maximum size that could be encoded.
+  uint64_t size = Index::DecodeItemReadSize(lba_value);
+  if (size == 0) {
+    size = Index::kMaxItemReadSize;
+  }
+  zone->expired_items_++;
+  zone->expired_bytes_ += size;
+}
+
+void ZoneManager::WaitForFlushIO() {
+  for (auto& encoder : encoders_) {
+    WaitForFlushIO(*encoder);
+  }
+}
+
+void ZoneManager::WaitForFlushIO(Encoder& encoder) {
+  while (encoder.inflight_flush_io_ > 0) {
+    io_handle_->Wait();
+  }
+}
+
+void ZoneManager::JoinDataZone(Encoder& encoder) {
+  auto& stream = *encoder.stream_;
+  std::unique_lock<std::mutex> lk(stream.zone_mtx_);
+  // If the last encoder that left failed to switch the full zone, retry it.
+  while (stream.zone_full_ && (stream.zone_users_ > 0 || !SwitchFullDataZone(stream))) {
+    stream.zone_cv_.wait_for(lk, std::chrono::milliseconds(100));
+  }
+  stream.zone_users_++;
+  encoder.wp_ = 0;
+  encoder.end_ = 0;
+}
+
+void ZoneManager::ReserveZoneRange(Encoder& encoder, std::shared_ptr<IOBuf>& buf, uint64_t size,
+                                   bool exact) {
+  if (encoder.end_ - encoder.wp_ >= size) {
+    return;
+  }
+  auto& stream = *encoder.stream_;
+  size = NumberUtils::AlignTo(size, IO_PAGE_SIZE);
+  // Reserve a few IO buffers at once if the zone has room, so the encoders rarely race on the
+  // write pointer.
+  uint64_t max_size =
+      exact ? size : std::max<uint64_t>(size, IO_FLUSH_SIZE * options_.flush_io_buffer_num_);
+  for (;;) {
+    uint64_t start = stream.reserved_wp_;
+    uint64_t end = 0;
+    do {
+      end = std::min(start + max_size, stream.reserve_limit_);
+    } while (start + size <= end && !stream.reserved_wp_.compare_exchange_weak(start, end));
+    if (start + size <= end) {
+      // The encoded data stays where it is if the new range follows the current one, otherwise
+      // it's written to the current range first.
+      if (start != encoder.end_) {
+        if (buf->Size() > 0) {
+          FlushAndResetIOBuffer(buf, nullptr, 0, encoder.id_);
+        }
+        encoder.wp_ = start;
+      }
+      encoder.end_ = end;
+      return;
+    }
+    LOG(DEBUG, "Stream[{}] has no room for encoder {}, switch to the next zone", stream.id_,
+        encoder.id_);
+    LeaveDataZone(encoder, buf, true);
+    JoinDataZone(encoder);
+  }
+}
+
+void ZoneManager::LeaveDataZone(Encoder& encoder, std::shared_ptr<IOBuf>& buf, bool full) {
+  auto& stream = *encoder.stream_;
+  // The zone meta takes the keys once their IO finished, so the pending keys should be settled.
+  if (buf->Size() > 0) {
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder.id_);
+  }
+  if (!encoder.encoded_io_key_buf_.empty()) {
+    FlushAndResetIOBuffer(buf, nullptr, 0, encoder.id_);
+  }
+  uint64_t end = encoder.end_;
+  stream.reserved_wp_.compare_exchange_strong(end, encoder.wp_);
+
+  std::lock_guard<std::mutex> lk(stream.zone_mtx_);
+  stream.zone_full_ |= full;
+  if (--stream.zone_users_ > 0 || !stream.zone_full_) {
+    return;
   }
-  encoded_io_key_buf_.clear();
+  // The last encoder switches the zone, all the others are waiting for it.
+  SwitchFullDataZone(stream);
+}
+
+bool ZoneManager::SwitchFullDataZone(DataStream& stream) {
+  Status s = Status::OK();
+  TRACE_POINT("SwitchDataZone", { s = SwitchDataZone(stream.id_); });
+  if (!s.ok()) {
+    LOG(ERROR, "Stream[{}] failed to switch the full data zone, retry later: {}", stream.id_,
+        s.msg());
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> key_lk(stream.data_zone_key_buffers_mtx_);
+    stream.data_zone_key_buffers_.clear();
+  }
+  stream.zone_full_ = false;
+  stream.zone_cv_.notify_all();
+  return true;
+}
+
+std::shared_ptr<IOBuf> ZoneManager::AcquireIOBuffer(uint32_t capacity, Encoder& encoder) {
+  while (encoder.inflight_flush_io_ >= options_.flush_io_buffer_num_) {
+    io_handle_->Wait();
+  }
+  std::lock_guard<std::mutex> lk(free_io_bufs_mtx_);
+  for (auto it = free_io_bufs_.begin(); it != free_io_bufs_.end(); ++it) {
+    if ((*it)->Capacity() == capacity) {
+      auto buf = std::move(*it);
+      free_io_bufs_.erase(it);
+      return buf;
+    }
+  }
+  return std::make_shared<IOBuf>(capacity);
+}
+
+void ZoneManager::ReleaseIOBuffer(const std::shared_ptr<IOBuf>& buf) {
   buf->Reset();
-  return Status::OK();
+  std::lock_guard<std::mutex> lk(free_io_bufs_mtx_);
+  if (free_io_bufs_.size() < options_.flush_io_buffer_num_ * encoders_.size()) {
+    free_io_bufs_.push_back(buf);
+  }
 }
 
-Status ZoneManager::FinishCurrentDataZone() {
+Status ZoneManager::FinishCurrentDataZone(uint32_t stream_id) {
   auto t1 = TimeUtils::GetCurrentTimeInUs();
-  if (data_zone_ == nullptr || data_zone_key_buffers_.empty()) {
+  auto& stream = *streams_[stream_id];
+  auto& data_zone = stream.data_zone_;
+  auto& data_zone_key_buffers = stream.data_zone_key_buffers_;
+  // All data of the zone should be persisted before the zone meta. The last flushed item's key
+  // may still be pending for the next IO buffer, so settle it with an empty flush.
+  for (auto* encoder : stream.encoders_) {
+    if (!encoder->encoded_io_key_buf_.empty()) {
+      auto empty_buf = AcquireIOBuffer(IO_FLUSH_SIZE, encoder->id_);
+      FlushAndResetIOBuffer(empty_buf, nullptr, 0, encoder->id_);
+      ReleaseIOBuffer(empty_buf);
+    }
+    WaitForFlushIO(*encoder);
+  }
+  if (data_zone == nullptr) {
     return Status::IOError("No available data zone, finish zone skipped.");
   }
+  if (reserve_ranges_) {
+    // The meta follows the last reserved range, the unused tails of the ranges are never read.
+    data_zone->wp_ = stream.reserved_wp_;
+  }
 
-  uint64_t meta_offset = data_zone_->wp_;
-  std::shared_ptr<IOBuf> zone_meta;
-  auto d = TimeUtils::GetCurrentTimeInUs();
-  uint32_t real_size = Codec::GenerateDataZoneMeta(data_zone_key_buffers_, zone_meta);
+  uint64_t meta_offset = data_zone->wp_;
+  uint32_t real_size = 0;
+  Status s = Status::OK();
+  // A zone may have no keys, e.g. it only holds the data of aborted value writers, then it's
+  // finished with an empty meta.
+  if (!data_zone_key_buffers.empty()) {
+    std::shared_ptr<IOBuf> zone_meta;
+    auto d = TimeUtils::GetCurrentTimeInUs();
+    real_size = Codec::GenerateDataZoneMeta(data_zone_key_buffers, zone_meta);
 
-  assert(data_zone_->wp_ % IO_PAGE_SIZE == 0);
-  assert(zone_meta->Size() > 0);
-  auto e = TimeUtils::GetCurrentTimeInUs();
-  auto s = io_handle_->Append(data_zone_, zone_meta);
-  auto f = TimeUtils::GetCurrentTimeInUs();
-  LOG(INFO, "Zone[{}] finishing, metadata encoding: {}us, flush: {}us, encoded size: {}",
-      data_zone_->id_, e - d, f - e, zone_meta->Size());
-  if (!s.ok()) {
-    LOG(ERROR, "finish zone failed during flush the zone meta: {}", std::strerror(errno));
-    return s;
+    assert(data_zone->wp_ % IO_PAGE_SIZE == 0);
+    assert(zone_meta->Size() > 0);
+    auto e = TimeUtils::GetCurrentTimeInUs();
+    s = io_handle_->Append(data_zone, zone_meta);
+    auto f = TimeUtils::GetCurrentTimeInUs();
+    LOG(INFO, "Zone[{}] finishing, metadata encoding: {}us, flush: {}us, encoded size: {}",
+        data_zone->id_, e - d, f - e, zone_meta->Size());
+    if (!s.ok()) {
+      LOG(ERROR, "finish zone failed during flush the zone meta: {}", std::strerror(errno));
+      return s;
+    }
   }
 
-  // This buffer includes pre-footer padding.
-  auto footer = std::make_shared<IOBuf>(data_zone_->GetAvailableBytes());
+  // The footer is the zone's last page, append zeros to the zone first.
+  auto footer = std::make_shared<IOBuf>(IO_PAGE_SIZE);
   auto a = TimeUtils::GetCurrentTimeInUs();
-  // Encoding data zone's footer (last page) and append zeros to the zone first.
-  Codec::EncodeDataZoneFooter(data_zone_key_buffers_, footer, meta_offset, real_size);
-  io_handle_->AppendZeros(data_zone_, footer->Capacity() - IO_PAGE_SIZE);
-  footer->Shrink(footer->Capacity() - IO_PAGE_SIZE, IO_PAGE_SIZE);
+  Codec::EncodeDataZoneFooter(data_zone_key_buffers, footer, meta_offset, real_size);
+  io_handle_->AppendZeros(data_zone, data_zone->GetAvailableBytes() - IO_PAGE_SIZE);
   auto b = TimeUtils::GetCurrentTimeInUs();
-  s = io_handle_->Append(data_zone_, footer);
+  s = io_handle_->Append(data_zone, footer);
   auto c = TimeUtils::GetCurrentTimeInUs();
   LOG(INFO, "Zone[{}] finishing, footer encoding: {}us, flush: {}us, encoded size: {}",
-      data_zone_->id_, (b - a), (c - b), footer->Size());
+      data_zone->id_, (b - a), (c - b), footer->Size());
   if (!s.ok()) {
     LOG(ERROR,
         "finish zone failed during flush the zone footer, zone id: {}, "
         "meta_offset: {}, real_size: {}, msg: {}",
-        data_zone_->id_, meta_offset, real_size, std::strerror(errno));
+        data_zone->id_, meta_offset, real_size, std::strerror(errno));
     return s;
   }
 
   // update zone state and clear zone key buffer.
-  data_zone_->state_ = ZoneState::FULL;
-  data_zone_->close_time_us_ = TimeUtils::GetCurrentTimeInUs();
+  data_zone->state_ = ZoneState::FULL;
+  data_zone->close_time_us_ = TimeUtils::GetCurrentTimeInUs();
+  data_zone->finish_time_us_ = data_zone->close_time_us_;
+  data_zone->total_items_ = data_zone_key_buffers.size();
 
-  uint64_t duration = data_zone_->close_time_us_ - data_zone_->open_time_us_;
+  uint64_t duration = data_zone->close_time_us_ - data_zone->open_time_us_;
   double write_speed =
-      (double(data_zone_->GetUsedBytes()) / 1024.0 / 1024) / (double(duration) / 1000.0 / 1000);
+      (double(data_zone->GetUsedBytes()) / 1024.0 / 1024) / (double(duration) / 1000.0 / 1000);
   auto t2 = TimeUtils::GetCurrentTimeInUs();
   LOG(INFO,
       "Zone[{}] finished, immutable_ buffer: {}, "
@@ -330,8 +1300,8 @@ Status ZoneManager::FinishCurrentDataZone() {
       "active duration: {} us, "
       "speed: {:.2f} MiB/s, "
       "time cost: {}us",
-      data_zone_->id_, immutable_buffers_.size(), writable_buffers_.size(), duration, write_speed,
-      (t2 - t1));
+      data_zone->id_, immutable_buffer_count_.load(), writable_buffers_.size(), duration,
+      write_speed, (t2 - t1));
   return Status::OK();
 }
 
@@ -350,17 +1320,23 @@ void ZoneManager::GC() {
   LOG(INFO, "Decoding a zone meta for GC, id : {}", target_zone->id_);
   std::shared_ptr<IOBuf> meta;
   ReadDataZoneMeta(target_zone, meta);
-  Codec::DecodeDataZoneMeta(meta->Buffer(), meta->Size(),
-                            [&](const std::string& key, uint64_t lba) {
-                              bool deleted = index_->Delete(key);
-                              assert(deleted);
-                            });
+  // Only drop the keys whose latest version is still in the zone.
+  if (meta->Size() > 0) {
+    Codec::DecodeDataZoneMeta(
+        meta->Buffer(), meta->Size(),
+        [&](const std::string& key, uint64_t lba) { index_->DeleteIfMatch(key, lba); });
+  }
 
-  // Reset the zone
+  // Reset the zone, its discard is issued in background so it's done without holding the lock.
+  io_handle_->ResetZone(target_zone);
+  target_zone->expired_items_ = 0;
+  target_zone->expired_bytes_ = 0;
+  target_zone->total_items_ = 0;
   {
     std::unique_lock<std::mutex> lk(empty_zones_mtx_);
-    io_handle_->ResetZone(target_zone);
-    empty_zones_.push_back(target_zone);
+    // Zones are taken from the back, so the just reset zone will be the last one to reuse, by then
+    // its discard should have finished.
+    empty_zones_.insert(empty_zones_.begin(), target_zone);
     empty_zones_cv_.notify_all();
     LOG(INFO, "Reset a FULL zone to empty, zone id : {}", target_zone->id_);
   }
@@ -370,20 +1346,50 @@ void ZoneManager::ReadDataZoneMeta(const std::shared_ptr<Zone>& zone,
                                    std::shared_ptr<IOBuf>& meta_buf) {
   std::shared_ptr<IOBuf> footer = std::make_shared<IOBuf>(IO_PAGE_SIZE);
   // read out the last 4KB footer
-  io_handle_->Read(zone->offset_ + zone->capacity_bytes_ - IO_PAGE_SIZE, footer);
+  ReadAndWait(zone->offset_ + zone->capacity_bytes_ - IO_PAGE_SIZE, footer, kGC);
   // decode the footer and get the offset of the metadata.
   uint64_t meta_offset = 0;
   uint32_t meta_size = 0;
   Codec::DecodeDataZoneFooter(footer, &meta_offset, &meta_size);
   assert(meta_offset > 0);
-  assert(meta_size > 0);
+  if (meta_size == 0) {
+    // The zone was finished without keys.
+    meta_buf = std::make_shared<IOBuf>();
+    return;
+  }
 
   // Read out meta buffer
   meta_buf = std::make_shared<IOBuf>(NumberUtils::AlignTo(meta_size, IO_PAGE_SIZE));
-  auto s = io_handle_->Read(meta_offset, meta_buf);
+  auto s = ReadAndWait(meta_offset, meta_buf, kGC);
   // Reset the size to its real byte length
   meta_buf->Resize(meta_size);
   assert(s.ok());
 }
 
-}  // namespace neodb
\ No newline at end of file
+Status ZoneManager::ReadAndWait(uint64_t offset, const std::shared_ptr<IOBuf>& buf,
+                                IOClass io_class) {
+  struct ReadContext {
+    std::atomic<bool> done_{false};
+    int64_t res_ = 0;
+  };
+  auto ctx = std::make_shared<ReadContext>();
+  auto s = io_handle_->AsyncRead(
+      offset, buf,
+      [ctx](uint64_t, int64_t res) {
+        ctx->res_ = res;
+        ctx->done_ = true;
+      },
+      io_class);
+  if (!s.ok()) {
+    return s;
+  }
+  while (!ctx->done_) {
+    io_handle_->Wait();
+  }
+  if (ctx->res_ < 0) {
+    return Status::IOError(std::strerror(-ctx->res_));
+  }
+  return Status::OK();
+}
+
+}  // namespace neodb
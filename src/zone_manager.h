@@ -1,4 +1,6 @@
 #pragma once
+#include <algorithm>
+#include <deque>
 #include <functional>
 #include <list>
 #include <memory>
@@ -9,6 +11,8 @@
 #include "index.h"
 #include "io_handle.h"
 #include "neodb/io_buf.h"
+#include "neodb/write_batch.h"
+#include "write_budget.h"
 #include "neodb/options.h"
 #include "neodb/status.h"
 #include "write_buffer.h"
@@ -16,54 +20,108 @@
 
 namespace neodb {
 
+class ValueWriter;
+
 class ZoneManager {
  public:
+  // Callback of an async item read, the key and value are only valid if the status is OK.
+  using ReadItemCallback = std::function<void(Status s, const std::string& key,
+                                              const std::shared_ptr<IOBuf>& value)>;
+
+  // @param budget The write budget shared with the other stores, unlimited if null.
   explicit ZoneManager(StoreOptions options, std::unique_ptr<IOHandle> io_handle,
-                       const std::shared_ptr<Index>& index)
-      : options_(std::move(options)), io_handle_(std::move(io_handle)), index_(index) {
-    for (int i = 0; i < options_.writable_buffer_num_; ++i) {
-      writable_buffers_.emplace_back(new WriteBuffer(options_.write_buffer_size_));
-    }
-    // We cannot `resize` the writable_buffer_mtx_ directly because std::mutex
-    // is not movable but the std::vector is.
-    std::vector<std::mutex> mutexes(options_.writable_buffer_num_);
-    writable_buffer_mtx_ = std::move(mutexes);
+                       const std::shared_ptr<Index>& index,
+                       std::shared_ptr<WriteBudget> budget = nullptr)
+      : options_(std::move(options)),
+        io_handle_(std::move(io_handle)),
+        index_(index),
+        budget_(std::move(budget)) {
     zones_ = io_handle_->GetDeviceZones();
     RecoverZoneStates(options_.recover_exist_db_);
-    // After db initialized, we should switch to a new empty zone for writing.
-    SwitchDataZone();
+    // Each stream holds an open zone, so we can't open more streams than the empty zones.
+    uint32_t stream_num = std::max<uint32_t>(
+        1, std::min<uint64_t>(options_.open_data_zone_num_, empty_zones_.size()));
+    // The last streams take the hot data, at least one stream is left for the cold data.
+    uint32_t hot_stream_num = std::min(options_.hot_data_zone_num_, stream_num - 1);
+    temperature_num_ = hot_stream_num > 0 ? 2 : 1;
+    for (uint32_t i = 0; i < stream_num; ++i) {
+      streams_.emplace_back(std::make_unique<DataStream>());
+      streams_.back()->id_ = i;
+      streams_.back()->temperature_ = i + hot_stream_num >= stream_num ? kHot : kCold;
+      // After db initialized, we should switch to a new empty zone for writing.
+      SwitchDataZone(i);
+    }
+    // The first encoders of the streams take the stream ids, so a single encoder stream could be
+    // addressed by either.
+    uint32_t encoder_num = io_handle_->IsZoned() ? 1 : std::max(1U, options_.flush_encoder_num_);
+    reserve_ranges_ = encoder_num > 1;
+    for (uint32_t i = 0; i < encoder_num * stream_num; ++i) {
+      encoders_.emplace_back(std::make_unique<Encoder>());
+      encoders_.back()->id_ = i;
+      encoders_.back()->stream_ = streams_[i % stream_num].get();
+      encoders_.back()->stream_->encoders_.push_back(encoders_.back().get());
+    }
+    // Each temperature has its own writable buffers. We cannot `resize` the writable_buffers_
+    // directly because std::atomic is not movable but the std::vector is.
+    std::vector<std::atomic<WriteBuffer*>> writable_buffers(temperature_num_ *
+                                                            options_.writable_buffer_num_);
+    writable_buffers_ = std::move(writable_buffers);
+    for (uint64_t i = 0; i < writable_buffers_.size(); ++i) {
+      writable_buffers_[i] =
+          AllocateWriteBuffer(static_cast<Temperature>(i / options_.writable_buffer_num_));
+    }
   }
 
-  // Start a dedicated flush worker
+  // The in-flight IO callbacks may still reference the members, so we should drain them first.
+  ~ZoneManager() {
+    while (io_handle_->GetInFlightRequests() > 0) {
+      io_handle_->Wait();
+    }
+  }
+
+  // Start a dedicated flush worker for each encoder. The workers take the immutable buffers of
+  // their temperature from the same list, so the buffers are striped over the open zones.
   void StartFlushWorker() {
-    flush_worker_ = std::thread([&]() {
-      // IIF all buffers were flushed and the flag was turned off, we can stop background job.
-      while (!flush_worker_stopped_ || !immutable_buffers_.empty()) {
-        FlushImmutableBuffers();
-      }
-      // When the thread is about to stop, we should flush all immutable_ buffers.
-      for (auto& buffer : writable_buffers_) {
-        if (!buffer->GetItems()->empty()) {
-          buffer->MarkImmutable();
-          immutable_buffers_.emplace_back(std::move(buffer));
+    for (auto& encoder : encoders_) {
+      encoder->flush_worker_ = std::thread([this, id = encoder->id_]() {
+        // IIF all buffers were flushed and the flag was turned off, we can stop background job.
+        while (!flush_worker_stopped_ || immutable_buffer_count_ > 0 ||
+               !encoders_[id]->flushed_buffers_.empty()) {
+          FlushImmutableBuffers(id);
         }
-      }
-      // Flush all reminding data and finish the last zone.
-      while (!immutable_buffers_.empty()) {
-        FlushImmutableBuffers();
-      }
-      FinishCurrentDataZone();
-      LOG(INFO,
-          "ZoneManager flush worker stopped, "
-          "immutable_ buffers {}, writable buffers: {}, empty zones: {}",
-          immutable_buffers_.size(), writable_buffers_.size(), empty_zones_.size());
-    });
-    LOG(INFO, "ZoneManager flush worker started");
+      });
+    }
+    LOG(INFO, "ZoneManager flush workers started, data streams: {}, encoders: {}", streams_.size(),
+        encoders_.size());
   }
 
   void StopFlushWorker() {
+    // Before the workers stop, we should seal all writable buffers so they will be flushed too.
+    {
+      std::lock_guard<std::mutex> lk(immutable_buffer_mtx_);
+      for (auto& slot : writable_buffers_) {
+        auto* buffer = slot.load();
+        if (buffer->GetItemNum() > 0 && buffer->Seal()) {
+          immutable_buffers_.push_back(buffer);
+          immutable_buffer_count_++;
+          flushing_tickets_.push_back(buffer->GetFlushTicket());
+          slot = AllocateWriteBuffer(buffer->GetTemperature());
+        }
+      }
+    }
+    immutable_buffer_cv_.notify_all();
     flush_worker_stopped_ = true;
-    flush_worker_.join();
+    for (auto& encoder : encoders_) {
+      encoder->flush_worker_.join();
+    }
+    // Finish the last zone of each stream.
+    for (auto& stream : streams_) {
+      FinishCurrentDataZone(stream->id_);
+    }
+    LOG(INFO,
+        "ZoneManager flush workers stopped, "
+        "immutable_ buffers {}, writable buffers: {}, empty zones: {}",
+        immutable_buffer_count_.load(), writable_buffers_.size(), empty_zones_.size());
   }
 
   void StartGCWorker() {
@@ -85,10 +143,35 @@ class ZoneManager {
     gc_worker_.join();
   }
 
-  Status Append(const std::string& key, const std::shared_ptr<IOBuf>& value);
+  // @param sync Return only after the item was written to the device. The durable appends of a
+  // temperature share a write buffer, which is sealed once a flush worker is free, so the appends
+  // that arrived meanwhile are group committed by its flush.
+  // @param wait If false, return Status::Busy() instead of waiting for the write budget or the
+  // flush to catch up.
+  Status Append(const std::string& key, const std::shared_ptr<IOBuf>& value, bool sync = false,
+                bool wait = true);
+
+  // Append the items grouped by their write buffer slots, each group is put to the buffer within a
+  // single entrance and indexed with a single update.
+  // @param sync Return only after all the items were written to the device.
+  Status AppendBatch(const std::vector<const WriteBatch::Item*>& items, bool sync = false);
+
+  // Open a writer that streams a value of `value_size` bytes to the device, see ValueWriter.
+  // @return Status::IOError() if the key or the value is too large, Status::NotSupported() if the
+  // streams don't take ranges.
+  Status OpenValueWriter(const std::string& key, uint32_t value_size,
+                         std::unique_ptr<ValueWriter>* writer);
+
+  // @return How often the appends were held back by the write budget and the immutable buffers.
+  WriteStallStats GetWriteStallStats() const;
+
+  // Wait until all the appends that returned before were written to the device and synced. The
+  // non-empty writable buffers are sealed for flushing.
+  Status Flush();
 
   // Obtain an immutable_ buffer and flush its items to the disk.
-  void FlushImmutableBuffers();
+  // @param encoder_id The encoder to work with, which writes to its stream's open zone.
+  void FlushImmutableBuffers(uint32_t encoder_id = 0);
 
   // Encode a single key value item into the target buffer. If the target buffer
   // is full,we we will flush to disk. Then continue to encode the rest of the
@@ -96,32 +179,65 @@ class ZoneManager {
   // consumed, then stop the processing. Note that after the processing, the
   // target buffer may still contain some data.
   //
+  // @param buf The encoding IO buffer, could be replaced by an empty one if it was flushed.
   // @param force_flush Flush to disk even if the buffer is not yet full.
   // @return The flushed item's target LBA (possible not yet flushed to disk)
-  uint64_t TryFlushSingleItem(const std::shared_ptr<IOBuf>& buf, const std::string& key,
-                              const std::shared_ptr<IOBuf>& value, bool force_flush = false);
+  uint64_t TryFlushSingleItem(std::shared_ptr<IOBuf>& buf, const std::string& key,
+                              const std::shared_ptr<IOBuf>& value, bool force_flush = false,
+                              uint32_t encoder_id = 0);
 
-  // Flush a single IO buffer.
+  // Flush a single IO buffer asynchronously.
   // The IO buffer holds a list of encoded items and should be aligned before
-  // the flushing. Note that the buffer will be reset to empty for further usage
-  // after the resetting.
-  Status FlushAndResetIOBuffer(const std::shared_ptr<IOBuf>& buf);
+  // the flushing. The buffer is handed to the device and `buf` will be replaced by an empty IO
+  // buffer for further usage. Related keys' index will be updated once the IO finished.
+  // @param value If set, the first `value_size` bytes of the value are written right after the IO
+  // buffer with the same vectored IO, without copying.
+  Status FlushAndResetIOBuffer(std::shared_ptr<IOBuf>& buf,
+                               const std::shared_ptr<IOBuf>& value = nullptr,
+                               uint32_t value_size = 0, uint32_t encoder_id = 0);
+
+  // Wait until all in-flight flush IO of every encoder finished and their callbacks were invoked.
+  void WaitForFlushIO();
 
   // Finish the zone means to flush the zone meta and zone footer, reject all
   // further write requests and mark the zone as FULL.
-  Status FinishCurrentDataZone();
+  Status FinishCurrentDataZone(uint32_t stream_id = 0);
 
   // Read a single key value item from the device
-  // @param offset The item's LBA offset on the device, including item meta.
-  Status ReadSingleItem(uint64_t offset, std::string* key, std::shared_ptr<IOBuf>& value);
+  // @param lba_value The item's LBA offset on the device, including item meta. It could also be
+  // an index value that carries the item's size.
+  Status ReadSingleItem(uint64_t lba_value, std::string* key, std::shared_ptr<IOBuf>& value);
+
+  // Read a single key value item from the device asynchronously, the callback will be invoked by
+  // PollIO() once finished. If `lba_value` carries the item's size, the item is read with a single
+  // IO, otherwise the item header is read first and then the whole item.
+  Status AsyncReadSingleItem(uint64_t lba_value, const ReadItemCallback& cb);
+
+  // Run the callbacks of finished async IO requests, could be called by any thread.
+  uint32_t PollIO() { return io_handle_->Poll(); }
+
+  // Block until any IO finished or timeout, then run the callbacks like PollIO().
+  uint32_t WaitIO(uint64_t timeout_us = IOHandle::kWaitTimeoutUs) {
+    return io_handle_->Wait(timeout_us);
+  }
+
+  void SetRateLimit(IOClass io_class, const RateLimit& limit) {
+    io_handle_->SetRateLimit(io_class, limit);
+  }
+
+  uint64_t GetThrottledTimeUs(IOClass io_class) { return io_handle_->GetThrottledTimeUs(io_class); }
 
   uint32_t GetWritableBufferNum() const { return writable_buffers_.size(); }
 
-  uint32_t GetImmutableBufferNum() const { return immutable_buffers_.size(); }
+  uint32_t GetImmutableBufferNum() const { return immutable_buffer_count_; }
+
+  uint32_t GetDataStreamNum() const { return streams_.size(); }
+
+  uint32_t GetEncoderNum() const { return encoders_.size(); }
 
   // Get a new empty zone from the empty list and use it a the current data
-  // zone.
-  Status SwitchDataZone();
+  // zone of the stream.
+  Status SwitchDataZone(uint32_t stream_id = 0);
 
   // Recover all existing zones.
   void RecoverZoneStates(bool reuse_db = false);
@@ -132,27 +248,281 @@ class ZoneManager {
   // Read data zone's footer and then get the meta buffer.
   void ReadDataZoneMeta(const std::shared_ptr<Zone>& zone, std::shared_ptr<IOBuf>& meta_buf);
 
-  std::shared_ptr<Zone> GetCurrentDataZone() { return data_zone_; }
+  std::shared_ptr<Zone> GetCurrentDataZone(uint32_t stream_id = 0) {
+    return streams_[stream_id]->data_zone_;
+  }
+
+  // @return The zone that holds the LBA, or nullptr if it's out of the device.
+  std::shared_ptr<Zone> GetZoneByLBA(uint64_t lba);
+
+  Temperature GetDataStreamTemperature(uint32_t stream_id) const {
+    return streams_[stream_id]->temperature_;
+  }
 
  private:
+  friend class ValueWriter;
+
+  // An encoded item whose index is updated once its IO buffer was flushed.
+  struct EncodedKey {
+    std::string key_;
+    Index::LBAValue lba_value_;
+    // The in-memory value, the index is only moved to the LBA if it still refers to it.
+    Index::MemValue value_;
+  };
+
+  struct Encoder;
+
+  // An open data zone and its write stream. Each stream is encoded and flushed by its own
+  // encoders, so the streams could write to different zones in parallel.
+  struct DataStream {
+    uint32_t id_ = 0;
+
+    // Only the immutable buffers of the same temperature are flushed by the stream.
+    Temperature temperature_ = kCold;
+
+    // data_zone_ only takes zone from the empty zone list.
+    std::shared_ptr<Zone> data_zone_;
+
+    // This map holds all the key->LBA items.
+    // Before the data zone closes, we should generate zone meta from this map and
+    // flush it. During the recovery process, we should be able to recovery all
+    // the items from the meta.
+    // Items are added by the flush callbacks once their IO finished.
+    std::list<std::pair<std::string, uint64_t>> data_zone_key_buffers_;
+    std::mutex data_zone_key_buffers_mtx_;
+
+    std::vector<Encoder*> encoders_;
+
+    // If the stream has multiple encoders, each of them writes to the ranges it reserved from the
+    // zone by moving `reserved_wp_` forward, up to `reserve_limit_` which leaves room for the zone
+    // meta and footer. The zone's own write pointer is only moved once the zone is finished.
+    std::atomic<uint64_t> reserved_wp_{0};
+    uint64_t reserve_limit_ = 0;
+
+    // The zone could only be switched once all the encoders that joined it left, the last one
+    // switches it if the zone is full.
+    std::mutex zone_mtx_;
+    std::condition_variable zone_cv_;
+    uint32_t zone_users_ = 0;
+    bool zone_full_ = false;
+  };
+
+  // An encoding worker of a data stream.
+  struct Encoder {
+    uint32_t id_ = 0;
+
+    DataStream* stream_ = nullptr;
+
+    // The range reserved from the stream's zone, the IO buffers are written from `wp_`. They are
+    // unused if the stream has a single encoder, which appends to the zone directly.
+    uint64_t wp_ = 0;
+    uint64_t end_ = 0;
+
+    // Compared to the data_zone_key_buffers, this `encoded_io_key_buf` only used for current io
+    // buffer's related keys. So after each flush we can update the related key index.
+    std::vector<EncodedKey> encoded_io_key_buf_;
+
+    // Number of IO buffers that were submitted but not yet finished.
+    std::atomic<uint32_t> inflight_flush_io_{0};
+
+    // How far the device moved the latest finished flush IO from its expected offset, which is
+    // always 0 for conventional devices.
+    std::atomic<int64_t> last_flush_delta_{0};
+
+    // The flush of the write buffer being encoded, each flush IO holds it until finished.
+    std::shared_ptr<FlushTicket> ticket_;
+
+    // The encoded write buffers whose flush IO may be still in flight, in their flush order.
+    std::deque<WriteBuffer*> flushed_buffers_;
+
+    std::thread flush_worker_;
+  };
+
+  // @return The CPU that the calling thread runs on.
+  static uint32_t GetCurrentCPU();
+
+  // @return The writable buffer slot of the CPU among the temperature's slots.
+  uint64_t GetWriteSlot(const std::string& key, uint32_t cpu) const;
+
+  // Take a recycled write buffer or allocate a new one, should be called with
+  // `immutable_buffer_mtx_` held.
+  WriteBuffer* AllocateWriteBuffer(Temperature temperature);
+
+  // Move the sealed buffer of the slot to the immutable_ list and swap in a new one. It waits if
+  // there are already `immutable_buffer_num_` immutable_ buffers.
+  // @param wait If false, the buffer is moved regardless of the limit, a non-blocking writer only
+  // seals a buffer if the limit was not yet reached when it started, so the limit is exceeded by
+  // few buffers at most.
+  void SealWriteBuffer(uint64_t idx, WriteBuffer* buffer, bool wait = true);
+
+  // @param cpu The writer's CPU, a batch picks it once, so all the versions of a key in the batch
+  // go to the same slot in order even if the thread migrated meanwhile.
+  // @return The writable buffer slot of the key, an overwrite goes to the hot slots.
+  uint64_t PickWritableBuffer(const std::string& key, bool sync, uint32_t cpu);
+
+  // Put the items of a slot to its buffers, the write budget was already taken.
+  // @param tickets The flush tickets of the buffers are added if `sync`.
+  void AppendGroup(uint64_t idx, const std::vector<const WriteBatch::Item*>& items, bool sync,
+                   std::vector<std::shared_ptr<FlushTicket>>* tickets);
+
+  // Put the item to a writable buffer, the write budget was already taken.
+  Status AppendToBuffer(const std::string& key, const std::shared_ptr<IOBuf>& value, bool sync,
+                        bool wait);
+
+  // Copy the data into the writer's IO buffer, which is written to its range once full.
+  Status AppendToValueWriter(ValueWriter& writer, const char* data, uint32_t size);
+
+  // Write the rest of the value and wait for all its IO, then index the item.
+  Status CommitValueWriter(ValueWriter& writer);
+
+  // Wait for the writer's IO and leave its zone, the data of an uncommitted value are expired.
+  void CloseValueWriter(ValueWriter& writer, bool committed);
+
+  // Wake up the flush workers that are waiting for the immutable_ buffers.
+  void NotifyFlushWorkers();
+
+  void RecordWriteStall(uint64_t stall_us);
+
+  // Wait until the sealed buffer of the slot is replaced.
+  void WaitForNewWriteBuffer(uint64_t idx, WriteBuffer* buffer);
+
+  // Seal the slot's buffer for flushing if it's still in the slot and not empty.
+  // @param sync_only Only seal the buffer if a durable writer is waiting for it.
+  void SealWritableBuffer(uint64_t idx, bool sync_only);
+
+  // @return True if a durable writer is waiting for a writable buffer of the temperature.
+  bool HasSyncRequest(Temperature temperature) const;
+
+  // Drop a reference of the flush, the waiters are woken up by the last one.
+  void ReleaseFlushTicket(const std::shared_ptr<FlushTicket>& ticket);
+
+  // Recycle the encoder's flushed buffers whose tickets are done. A buffer whose flush failed is
+  // put back to the immutable_ list with a new ticket, so its items are flushed again, they are
+  // still served from the memory index meanwhile.
+  void RecycleFlushedBuffers(Encoder& encoder);
+
+  // @return Status::IOError() if any flush IO of the buffer failed.
+  Status WaitForFlushTicket(const std::shared_ptr<FlushTicket>& ticket);
+
+  // Make the writes that finished before the call durable. The concurrent callers share a sync,
+  // a caller returns once a sync that started after its call finished.
+  Status SyncDevice();
+
+  // @return The offset that the encoder's next IO buffer will be written to.
+  uint64_t GetWritePointer(const Encoder& encoder) const {
+    return reserve_ranges_ ? encoder.wp_ : encoder.stream_->data_zone_->wp_;
+  }
+
+  // Start writing to the stream's open zone, wait if the zone is being switched.
+  void JoinDataZone(Encoder& encoder);
+
+  // Make sure the encoder's range has `size` bytes left from its write pointer. A new range is
+  // reserved with an atomic increment of the zone's reserved write pointer, if the zone has no
+  // room for it, the encoder leaves the zone and joins the next one.
+  // @param exact Reserve only `size` bytes rather than a few IO buffers ahead.
+  void ReserveZoneRange(Encoder& encoder, std::shared_ptr<IOBuf>& buf, uint64_t size,
+                        bool exact = false);
+
+  // Flush the encoder's IO buffer and settle its keys, then stop writing to the zone. The unused
+  // tail of its range is given back if nobody reserved after it.
+  // @param full If the zone has no room for the encoder, it will be switched by the last encoder
+  // that leaves.
+  void LeaveDataZone(Encoder& encoder, std::shared_ptr<IOBuf>& buf, bool full);
+
+  // Switch the stream's full zone once all its encoders left, with `zone_mtx_` held.
+  // @return False if the switch failed, the zone is left full so the next encoder that joins
+  // retries it.
+  bool SwitchFullDataZone(DataStream& stream);
+
+  // Get an empty IO buffer for encoding. If there are already `flush_io_buffer_num_` buffers of
+  // the encoder in flight, we should wait for one of them to finish.
+  std::shared_ptr<IOBuf> AcquireIOBuffer(uint32_t capacity, uint32_t encoder_id) {
+    return AcquireIOBuffer(capacity, *encoders_[encoder_id]);
+  }
+
+  std::shared_ptr<IOBuf> AcquireIOBuffer(uint32_t capacity, Encoder& encoder);
+
+  // Return a finished IO buffer for reuse.
+  void ReleaseIOBuffer(const std::shared_ptr<IOBuf>& buf);
+
+  // Read the buffer's capacity through the IO scheduler with the given IO class and wait until
+  // it's done.
+  Status ReadAndWait(uint64_t offset, const std::shared_ptr<IOBuf>& buf, IOClass io_class);
+
+  // Encode a large page aligned item without copying its value. The item header is padded so the
+  // value starts at a page boundary, then the aligned part of the value is flushed together with
+  // the IO buffer and the value's tail is copied into the next IO buffer.
+  // @return The item's target LBA.
+  uint64_t FlushZeroCopyItem(std::shared_ptr<IOBuf>& buf, const std::string& key,
+                             const std::shared_ptr<IOBuf>& value, bool force_flush,
+                             uint32_t encoder_id);
+
+  // @return True if the value could be written without copying, see FlushZeroCopyItem().
+  bool IsZeroCopyValue(const std::shared_ptr<IOBuf>& value) const {
+    return options_.zero_copy_value_size_ > 0 && value->Size() > options_.zero_copy_value_size_ &&
+           value->Size() >= IO_PAGE_SIZE &&
+           reinterpret_cast<uintptr_t>(value->Buffer()) % IO_PAGE_SIZE == 0;
+  }
+
+  // Make sure the open zone has room for the encoded IO buffer and another `size` bytes, the IO
+  // buffer is flushed before the zone is switched.
+  void EnsureZoneRoom(Encoder& encoder, std::shared_ptr<IOBuf>& buf, uint64_t size);
+
+  // Write an arena chunk of the write buffer as is, its items were already encoded.
+  // @param items The indexes of the chunk's items in the write buffer.
+  void FlushArenaChunk(Encoder& encoder, std::shared_ptr<IOBuf>& buf,
+                       const std::shared_ptr<IOBuf>& chunk, WriteBuffer* write_buffer,
+                       const std::vector<uint64_t>& items);
+
+  // Submit the IO buffer (and the value) with the encoder's pending keys, whose index will be
+  // updated once the IO finished.
+  // @param recycle Give the IO buffer back for reuse once the IO finished.
+  Status SubmitFlushIO(const std::shared_ptr<IOBuf>& flushing, const std::shared_ptr<IOBuf>& value,
+                       uint32_t value_size, Encoder& encoder, bool recycle);
+
+  // Wait until the encoder's in-flight flush IO finished.
+  void WaitForFlushIO(Encoder& encoder);
+
+  // Move the flushed keys to their LBAs and add them to the zone's keys.
+  void SettleFlushedKeys(DataStream& stream, const std::vector<EncodedKey>& keys, int64_t delta);
+
+  // Account an overwritten item as expired bytes of its zone, so GC could pick the zones whose
+  // data are mostly dead.
+  void ExpireItem(Index::LBAValue lba_value);
+
+  // Decode the item at `offset` from `buf`, which was read from the item's first page. If the
+  // buffer doesn't hold the whole item, the rest will be read with another IO.
+  void DecodeSingleItem(uint64_t offset, const std::shared_ptr<IOBuf>& buf,
+                        const ReadItemCallback& cb);
+
   const uint64_t footer_size_ = IO_PAGE_SIZE;
   StoreOptions options_;
   std::unique_ptr<IOHandle> io_handle_;
   std::shared_ptr<Index> index_;
+  std::shared_ptr<WriteBudget> budget_;
+
+  // The pressure epoch of the write budget that the flush workers of each temperature responded.
+  std::atomic<uint64_t> seen_pressure_epoch_[2] = {0, 0};
+
+  std::atomic<uint64_t> write_stall_num_{0};
+  std::atomic<uint64_t> write_stall_us_{0};
+  std::atomic<uint64_t> rejected_write_num_{0};
+
+  // Each stream appends to its own open zone, which fits the append-only IO pattern of a zone.
+  std::vector<std::unique_ptr<DataStream>> streams_;
+
+  // `flush_encoder_num_` encoders for each stream.
+  std::vector<std::unique_ptr<Encoder>> encoders_;
 
-  // Only a single data zone is writable at the same time to fit the append-only
-  // IO pattern.
-  // data_zone_ only takes zone from the empty zone list.
-  std::shared_ptr<Zone> data_zone_;
+  // True if the streams have multiple encoders, which write to their reserved ranges.
+  bool reserve_ranges_ = false;
 
-  // This map holds all the key->LBA items.
-  // Before the data zone closes, we should generate zone meta from this map and
-  // flush it. During the recovery process, we should be able to recovery all
-  // the items from the meta.
-  std::list<std::pair<std::string, uint64_t>> data_zone_key_buffers_;
-  // Compared to the data_zone_key_buffers, this `encoded_io_key_buf` only used for current io
-  // buffer's related keys. So after each flush we can update the related key index.
-  std::vector<std::pair<std::string, uint64_t>> encoded_io_key_buf_;
+  // 2 if the hot data is separated from the cold data, otherwise 1.
+  uint32_t temperature_num_ = 1;
+
+  // Reusable IO buffers which were already flushed, shared by all streams.
+  std::vector<std::shared_ptr<IOBuf>> free_io_bufs_;
+  std::mutex free_io_bufs_mtx_;
 
   // Accurate size of the data zone's meta, which should be flushed before the
   // 4KB zone footer.
@@ -170,20 +540,38 @@ class ZoneManager {
   // list again during the system running.
   std::vector<std::shared_ptr<Zone>> zones_;
 
-  std::vector<std::unique_ptr<WriteBuffer>> writable_buffers_;
-  // Each of the write buffer slot need to have a lock.
-  std::vector<std::mutex> writable_buffer_mtx_;
+  // `writable_buffer_num_` buffers for each temperature, a full buffer is swapped out atomically.
+  std::vector<std::atomic<WriteBuffer*>> writable_buffers_;
+
+  // All write buffers, they are recycled instead of freed since the writers may still hold them.
+  std::vector<std::unique_ptr<WriteBuffer>> write_buffers_;
+  // Recycled write buffers, protected by `immutable_buffer_mtx_`.
+  std::vector<WriteBuffer*> free_write_buffers_;
 
-  std::list<std::unique_ptr<WriteBuffer>> immutable_buffers_;
+  std::list<WriteBuffer*> immutable_buffers_;
+  // The size of `immutable_buffers_`, only updated with the lock but could be read without it.
+  std::atomic<uint64_t> immutable_buffer_count_{0};
   std::condition_variable immutable_buffer_cv_;
   std::mutex immutable_buffer_mtx_;
 
+  // The flushes of the sealed buffers, which are waited by Flush(). The finished ones are pruned
+  // on the next seal, protected by `immutable_buffer_mtx_`.
+  std::list<std::shared_ptr<FlushTicket>> flushing_tickets_;
+
+  // The durable writers wait for their flush tickets.
+  std::mutex durable_mtx_;
+  std::condition_variable durable_cv_;
+
+  // The calls of SyncDevice(), and the ones covered by the latest sync with its result.
+  std::mutex sync_mtx_;
+  std::atomic<uint64_t> sync_requests_{0};
+  uint64_t synced_requests_ = 0;
+  Status sync_status_ = Status::OK();
+
   std::atomic<bool> flush_worker_stopped_{false};
 
   std::atomic<bool> gc_worker_stopped_{false};
 
-  std::thread flush_worker_;
-
   std::thread gc_worker_;
 };
 }  // namespace neodb
\ No newline at end of file
@@ -3,10 +3,14 @@
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <map>
 #include <memory>
+#include <set>
+#include <thread>
 
 #include "gtest/gtest.h"
 #include "utils.h"
+#include "value_writer.h"
 
 namespace neodb {
 class ZoneManagerTest : public ::testing::Test {
@@ -38,6 +42,8 @@ TEST_F(ZoneManagerTest, ProcessSingleItemTest) {
   auto zone = zone_manager_->GetCurrentDataZone();
   // IO flush size set to 32KB
   std::shared_ptr<IOBuf> buffer = std::make_shared<IOBuf>(32UL << 10);
+  // The buffer will be replaced once it was flushed, so we keep the original one alive.
+  std::shared_ptr<IOBuf> first_buffer = buffer;
   char* ptr = buffer->Buffer();
 
   std::string key = StringUtils::GenerateRandomString(10);
@@ -95,8 +101,11 @@ TEST_F(ZoneManagerTest, LargeWriteAndReadTest) {
   std::shared_ptr<IOBuf> value =
       std::make_shared<IOBuf>(StringUtils::GenerateRandomString(100UL << 10));
   uint64_t lba = zone_manager_->TryFlushSingleItem(buffer, key, value, true);
-  EXPECT_EQ(lba, zone->offset_ + 0);
+  // The large value is written without copying, so the item header is padded to let the value
+  // start at a page boundary.
+  EXPECT_EQ(lba, zone->offset_ + IO_PAGE_SIZE - ITEM_META_SIZE - key.size());
   LOG(INFO, "100K item appended, lba offset: {}", lba);
+  zone_manager_->WaitForFlushIO();
 
   std::string read_key;
   std::shared_ptr<IOBuf> read_value;
@@ -105,6 +114,68 @@ TEST_F(ZoneManagerTest, LargeWriteAndReadTest) {
   EXPECT_EQ(value->Data(), read_value->Data());
 }
 
+TEST_F(ZoneManagerTest, SizeHintReadTest) {
+  // The item's read size is rounded up to pages, oversized items carry no size.
+  uint64_t lba_value = Index::EncodeLBAValue(12345, 10UL << 10);
+  EXPECT_EQ(Index::DecodeLBA(lba_value), 12345);
+  EXPECT_EQ(Index::DecodeItemReadSize(lba_value), 12UL << 10);
+  lba_value = Index::EncodeLBAValue(12345, 1UL << 20);
+  EXPECT_EQ(Index::DecodeLBA(lba_value), 12345);
+  EXPECT_EQ(Index::DecodeItemReadSize(lba_value), 0);
+
+  auto zone = zone_manager_->GetCurrentDataZone();
+  std::shared_ptr<IOBuf> buffer = std::make_shared<IOBuf>(32UL << 10);
+  std::string key = StringUtils::GenerateRandomString(10);
+  std::shared_ptr<IOBuf> value =
+      std::make_shared<IOBuf>(StringUtils::GenerateRandomString(100UL << 10));
+  uint64_t lba = zone_manager_->TryFlushSingleItem(buffer, key, value, true);
+  zone_manager_->WaitForFlushIO();
+
+  // Read with an accurate size hint.
+  uint64_t read_size = lba % IO_PAGE_SIZE + ITEM_META_SIZE + key.size() + value->Size();
+  std::string read_key;
+  std::shared_ptr<IOBuf> read_value;
+  auto s = zone_manager_->ReadSingleItem(Index::EncodeLBAValue(lba, read_size), &read_key,
+                                         read_value);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(key, read_key);
+  EXPECT_EQ(value->Data(), read_value->Data());
+
+  // A short size hint still works, the rest of the item is read with another IO.
+  read_value = nullptr;
+  s = zone_manager_->ReadSingleItem(Index::EncodeLBAValue(lba, IO_PAGE_SIZE), &read_key,
+                                    read_value);
+  EXPECT_TRUE(s.ok());
+  EXPECT_EQ(key, read_key);
+  EXPECT_EQ(value->Data(), read_value->Data());
+}
+
+TEST_F(ZoneManagerTest, ZeroCopyWriteAndReadTest) {
+  std::shared_ptr<IOBuf> buffer = std::make_shared<IOBuf>(IO_FLUSH_SIZE);
+  // Mix small items with large ones, whose values are aligned or not.
+  std::vector<uint32_t> value_sizes = {1000,      100UL << 10, 10,        (1UL << 20) + 123,
+                                       4UL << 20, 3000,        64UL << 10, (300UL << 10) + 1};
+  std::vector<std::string> keys;
+  std::vector<std::shared_ptr<IOBuf>> values;
+  std::vector<uint64_t> lbas;
+  for (size_t i = 0; i < value_sizes.size(); ++i) {
+    keys.emplace_back(StringUtils::GenerateRandomString(10 + i));
+    values.emplace_back(std::make_shared<IOBuf>(StringUtils::GenerateRandomString(value_sizes[i])));
+    lbas.emplace_back(zone_manager_->TryFlushSingleItem(buffer, keys[i], values[i],
+                                                        i == value_sizes.size() - 1));
+  }
+  zone_manager_->WaitForFlushIO();
+
+  for (size_t i = 0; i < value_sizes.size(); ++i) {
+    std::string read_key;
+    std::shared_ptr<IOBuf> read_value;
+    auto s = zone_manager_->ReadSingleItem(lbas[i], &read_key, read_value);
+    EXPECT_TRUE(s.ok());
+    EXPECT_EQ(keys[i], read_key);
+    EXPECT_EQ(values[i]->Data(), read_value->Data());
+  }
+}
+
 TEST_F(ZoneManagerTest, WriteAndReadTest) {
   auto zone = zone_manager_->GetCurrentDataZone();
 
@@ -125,6 +196,7 @@ TEST_F(ZoneManagerTest, WriteAndReadTest) {
   LOG(INFO, "item appended, lba offset: {}", lba);
 
   // Read them out and verify
+  zone_manager_->WaitForFlushIO();
   std::shared_ptr<IOBuf> read_value1;
   std::string read_key1;
   zone_manager_->ReadSingleItem(zone->offset_ + 0, &read_key1, read_value1);
@@ -138,6 +210,711 @@ TEST_F(ZoneManagerTest, WriteAndReadTest) {
   EXPECT_EQ(read_value2->Data(), value2->Data());
 }
 
+TEST_F(ZoneManagerTest, ZonedDeviceWriteAndReadTest) {
+  // 8 zones, so a few zones will be filled up and finished.
+  options_.device_capacity_ = 64UL << 20;
+  options_.device_zone_capacity_ = 8UL << 20;
+  auto io_handle = std::make_unique<ZonedIOHandle>(filename_, options_.device_capacity_,
+                                                   options_.device_zone_capacity_);
+  auto* zoned = io_handle.get();
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  uint64_t first_zone = zone_manager_->GetCurrentDataZone()->id_;
+  zone_manager_->StartFlushWorker();
+
+  std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
+  for (int i = 0; i < 200; ++i) {
+    std::string key = StringUtils::GenerateRandomString(10);
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(100UL << 10));
+    EXPECT_TRUE(zone_manager_->Append(key, value).ok());
+    data.emplace(key, value);
+  }
+  zone_manager_->StopFlushWorker();
+  // The zone was finished with its meta and footer, all written sequentially.
+  EXPECT_EQ(zoned->GetZoneState(first_zone), ZoneState::FULL);
+
+  // The index learned the LBAs from the zone appends.
+  for (auto& pair : data) {
+    Index::ValueVariant value_variant;
+    ASSERT_TRUE(index_->Get(pair.first, value_variant).ok());
+    ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+    std::string read_key;
+    std::shared_ptr<IOBuf> read_value;
+    auto s = zone_manager_->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                           read_value);
+    ASSERT_TRUE(s.ok());
+    EXPECT_EQ(read_key, pair.first);
+    EXPECT_EQ(read_value->Data(), pair.second->Data());
+  }
+}
+
+TEST_F(ZoneManagerTest, MultipleDataStreamsTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 8UL << 20;
+  options_.writable_buffer_num_ = 4;
+  options_.immutable_buffer_num_ = 4;
+  options_.open_data_zone_num_ = 4;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  ASSERT_EQ(zone_manager_->GetDataStreamNum(), 4);
+  std::set<uint64_t> open_zones;
+  for (uint32_t i = 0; i < 4; ++i) {
+    open_zones.insert(zone_manager_->GetCurrentDataZone(i)->id_);
+  }
+  EXPECT_EQ(open_zones.size(), 4);
+  zone_manager_->StartFlushWorker();
+
+  // Every key is written twice, the older version may be flushed after the newer one by another
+  // stream, but it should never replace the newer one in the index.
+  std::vector<std::string> keys;
+  for (int i = 0; i < 200; ++i) {
+    keys.push_back(StringUtils::GenerateRandomString(10));
+  }
+  std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
+  for (int round = 0; round < 2; ++round) {
+    for (auto& key : keys) {
+      auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(100UL << 10));
+      EXPECT_TRUE(zone_manager_->Append(key, value).ok());
+      data[key] = value;
+    }
+  }
+  zone_manager_->StopFlushWorker();
+
+  for (auto& pair : data) {
+    Index::ValueVariant value_variant;
+    ASSERT_TRUE(index_->Get(pair.first, value_variant).ok());
+    ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+    std::string read_key;
+    std::shared_ptr<IOBuf> read_value;
+    auto s = zone_manager_->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                           read_value);
+    ASSERT_TRUE(s.ok());
+    EXPECT_EQ(read_key, pair.first);
+    EXPECT_EQ(read_value->Data(), pair.second->Data());
+  }
+}
+
+// Reports the first few appends as failed, their data are still written though.
+class FailingIOHandle : public FileIOHandle {
+ public:
+  FailingIOHandle(const std::string& filename, uint64_t capacity, uint64_t zone_capacity,
+                  uint32_t fail_num)
+      : FileIOHandle(filename, capacity, zone_capacity), fail_num_(fail_num) {}
+
+  Status AsyncAppend(const std::shared_ptr<Zone>& zone, const std::shared_ptr<IOBuf>& data,
+                     const IOCallback& cb, IOClass io_class) override {
+    if (fail_num_ == 0) {
+      return FileIOHandle::AsyncAppend(zone, data, cb, io_class);
+    }
+    fail_num_--;
+    auto fail_cb = [cb](uint64_t offset, int64_t) { cb(offset, -EIO); };
+    return FileIOHandle::AsyncAppend(zone, data, fail_cb, io_class);
+  }
+
+  std::atomic<uint32_t> fail_num_;
+};
+
+// Counts the device syncs, and fails them if asked.
+class SyncCountingIOHandle : public FileIOHandle {
+ public:
+  SyncCountingIOHandle(const std::string& filename, uint64_t capacity, uint64_t zone_capacity)
+      : FileIOHandle(filename, capacity, zone_capacity) {}
+
+  Status Sync() override {
+    sync_num_++;
+    return fail_sync_ ? Status::IOError("Sync failed") : FileIOHandle::Sync();
+  }
+
+  std::atomic<uint32_t> sync_num_{0};
+  std::atomic<bool> fail_sync_{false};
+};
+
+TEST_F(ZoneManagerTest, DurableSyncTest) {
+  auto io_handle = std::make_unique<SyncCountingIOHandle>(filename_, options_.device_capacity_,
+                                                          options_.device_zone_capacity_);
+  auto* counting = io_handle.get();
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  // The non-durable appends never sync, the durable ones and Flush() do.
+  auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000));
+  ASSERT_TRUE(zone_manager_->Append("async", value).ok());
+  EXPECT_EQ(counting->sync_num_, 0);
+  ASSERT_TRUE(zone_manager_->Append("durable", value, true).ok());
+  EXPECT_EQ(counting->sync_num_, 1);
+  WriteBatch::Item item("batch", value);
+  ASSERT_TRUE(zone_manager_->AppendBatch({&item}, true).ok());
+  EXPECT_EQ(counting->sync_num_, 2);
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  EXPECT_EQ(counting->sync_num_, 3);
+
+  // A failed sync fails the durable append.
+  counting->fail_sync_ = true;
+  EXPECT_EQ(zone_manager_->Append("unsynced", value, true).code(), Status::Code::kIOError);
+  counting->fail_sync_ = false;
+  zone_manager_->StopFlushWorker();
+}
+
+TEST_F(ZoneManagerTest, FlushRetryTest) {
+  auto budget = std::make_shared<WriteBudget>(64UL << 20);
+  auto io_handle = std::make_unique<FailingIOHandle>(filename_, options_.device_capacity_,
+                                                     options_.device_zone_capacity_, 1);
+  auto* failing = io_handle.get();
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_, budget);
+  zone_manager_->StartFlushWorker();
+
+  // The durable append learns that its flush failed, but the item is still served from memory.
+  auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000));
+  EXPECT_EQ(zone_manager_->Append("key", value, true).code(), Status::Code::kIOError);
+  EXPECT_EQ(failing->fail_num_, 0);
+  Index::ValueVariant value_variant;
+  ASSERT_TRUE(index_->Get("key", value_variant).ok());
+
+  // The buffer is flushed again in the background, which gives the write budget back.
+  for (int i = 0; i < 10000; ++i) {
+    ASSERT_TRUE(index_->Get("key", value_variant).ok());
+    if (std::holds_alternative<Index::LBAValue>(value_variant)) {
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  EXPECT_EQ(budget->GetUsedBytes(), 0);
+  std::string read_key;
+  std::shared_ptr<IOBuf> read_value;
+  ASSERT_TRUE(zone_manager_
+                  ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                   read_value)
+                  .ok());
+  EXPECT_EQ(read_key, "key");
+  EXPECT_EQ(read_value->Data(), value->Data());
+  zone_manager_->StopFlushWorker();
+}
+
+TEST_F(ZoneManagerTest, ConcurrentAppendTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 8UL << 20;
+  options_.writable_buffer_num_ = 2;
+  options_.immutable_buffer_num_ = 2;
+  options_.write_buffer_size_ = 256UL << 10;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  // The threads share the write buffers, so the buffers are sealed while the others are writing.
+  const int thread_num = 4;
+  const int key_num = 500;
+  std::vector<std::unordered_map<std::string, std::shared_ptr<IOBuf>>> data(thread_num);
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < key_num; ++i) {
+        auto key = std::to_string(t) + "_" + std::to_string(i);
+        auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(4UL << 10));
+        EXPECT_TRUE(zone_manager_->Append(key, value).ok());
+        data[t][key] = value;
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  zone_manager_->StopFlushWorker();
+
+  for (auto& kvs : data) {
+    ASSERT_EQ(kvs.size(), key_num);
+    for (auto& pair : kvs) {
+      Index::ValueVariant value_variant;
+      ASSERT_TRUE(index_->Get(pair.first, value_variant).ok());
+      ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+      std::string read_key;
+      std::shared_ptr<IOBuf> read_value;
+      ASSERT_TRUE(zone_manager_
+                      ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                       read_value)
+                      .ok());
+      EXPECT_EQ(read_key, pair.first);
+      EXPECT_EQ(read_value->Data(), pair.second->Data());
+    }
+  }
+}
+
+TEST_F(ZoneManagerTest, DurableAppendTest) {
+  options_.writable_buffer_num_ = 2;
+  options_.immutable_buffer_num_ = 2;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  // A durable append returns once its flush IO finished, which also moved its index to the LBA.
+  auto is_flushed = [&](const std::string& key) {
+    Index::ValueVariant value_variant;
+    return index_->Get(key, value_variant).ok() &&
+           std::holds_alternative<Index::LBAValue>(value_variant);
+  };
+  const int thread_num = 8;
+  const int key_num = 30;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < key_num; ++i) {
+        auto key = "sync_" + std::to_string(t) + "_" + std::to_string(i);
+        auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000));
+        ASSERT_TRUE(zone_manager_->Append(key, value, true).ok());
+        ASSERT_TRUE(is_flushed(key));
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  // Flush() waits for the appends that are still buffered.
+  std::vector<std::string> keys;
+  for (int i = 0; i < 100; ++i) {
+    keys.push_back("async_" + std::to_string(i));
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000));
+    ASSERT_TRUE(zone_manager_->Append(keys.back(), value).ok());
+  }
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  for (auto& key : keys) {
+    ASSERT_TRUE(is_flushed(key));
+  }
+  // Nothing is buffered, so it returns immediately.
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  zone_manager_->StopFlushWorker();
+}
+
+TEST_F(ZoneManagerTest, WriteBudgetTest) {
+  options_.immutable_buffer_num_ = 4;
+  auto budget = std::make_shared<WriteBudget>(3UL << 20);
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_, budget);
+
+  // Nothing is flushed yet, so the non-blocking appends are rejected once the budget ran out.
+  std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
+  Status s = Status::OK();
+  for (int i = 0; s.ok(); ++i) {
+    auto key = "key_" + std::to_string(i);
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(4000));
+    s = zone_manager_->Append(key, value, false, false);
+    if (s.ok()) {
+      data[key] = value;
+    }
+  }
+  EXPECT_EQ(s.code(), Status::Code::kIOBusy);
+  EXPECT_LE(budget->GetUsedBytes(), 3UL << 20);
+  EXPECT_GE(data.size(), (2UL << 20) / 4000);
+  EXPECT_EQ(zone_manager_->GetWriteStallStats().rejected_num_, 1);
+  // The non-blocking writers never stall, even if they sealed the buffers.
+  EXPECT_EQ(zone_manager_->GetWriteStallStats().stall_num_, 0);
+
+  // A blocking append waits until the flush gave the budget back.
+  std::thread writer([&]() {
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(4000));
+    ASSERT_TRUE(zone_manager_->Append("blocked", value).ok());
+    data["blocked"] = value;
+  });
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  zone_manager_->StartFlushWorker();
+  writer.join();
+  auto stats = zone_manager_->GetWriteStallStats();
+  EXPECT_GE(stats.stall_num_, 1);
+  EXPECT_GE(stats.stall_us_, 100UL * 1000);
+  zone_manager_->StopFlushWorker();
+  EXPECT_EQ(budget->GetUsedBytes(), 0);
+
+  for (auto& pair : data) {
+    Index::ValueVariant value_variant;
+    ASSERT_TRUE(index_->Get(pair.first, value_variant).ok());
+    ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+    std::string read_key;
+    std::shared_ptr<IOBuf> read_value;
+    ASSERT_TRUE(zone_manager_
+                    ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                     read_value)
+                    .ok());
+    EXPECT_EQ(read_value->Data(), pair.second->Data());
+  }
+}
+
+TEST_F(ZoneManagerTest, ParallelEncodersTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 16UL << 20;
+  options_.writable_buffer_num_ = 4;
+  options_.immutable_buffer_num_ = 4;
+  options_.flush_encoder_num_ = 4;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  ASSERT_EQ(zone_manager_->GetEncoderNum(), 4);
+  uint64_t first_zone = zone_manager_->GetCurrentDataZone()->id_;
+  zone_manager_->StartFlushWorker();
+
+  // Both the copied and the zero-copy values, the zones are switched while the encoders write.
+  std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
+  for (int i = 0; i < 600; ++i) {
+    auto key = StringUtils::GenerateRandomString(10);
+    uint64_t value_sz = i % 2 == 0 ? (100UL << 10) : 5000;
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(value_sz));
+    EXPECT_TRUE(zone_manager_->Append(key, value).ok());
+    data[key] = value;
+  }
+  zone_manager_->StopFlushWorker();
+  EXPECT_NE(zone_manager_->GetCurrentDataZone()->id_, first_zone);
+
+  for (auto& pair : data) {
+    Index::ValueVariant value_variant;
+    ASSERT_TRUE(index_->Get(pair.first, value_variant).ok());
+    ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+    std::string read_key;
+    std::shared_ptr<IOBuf> read_value;
+    auto s = zone_manager_->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                           read_value);
+    ASSERT_TRUE(s.ok());
+    EXPECT_EQ(read_key, pair.first);
+    EXPECT_EQ(read_value->Data(), pair.second->Data());
+  }
+
+  // A zoned device only takes sequential writes, so it keeps a single encoder.
+  auto zoned = std::make_unique<ZonedIOHandle>(filename_, options_.device_capacity_,
+                                               options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(zoned), index_);
+  EXPECT_EQ(zone_manager_->GetEncoderNum(), 1);
+}
+
+TEST_F(ZoneManagerTest, ValueWriterTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 32UL << 20;
+  options_.flush_encoder_num_ = 2;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  auto read_value = [&](const std::string& key) -> std::string {
+    Index::ValueVariant value_variant;
+    if (!index_->Get(key, value_variant).ok()) {
+      return "";
+    }
+    EXPECT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+    std::string read_key;
+    std::shared_ptr<IOBuf> value;
+    EXPECT_TRUE(zone_manager_
+                    ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key, value)
+                    .ok());
+    EXPECT_EQ(read_key, key);
+    return value->Data();
+  };
+  // The value spans a few IO buffers and is appended in odd sized chunks, while the buffered
+  // appends write to the same zones.
+  std::string value = StringUtils::GenerateRandomString(3 * IO_FLUSH_SIZE + 12345);
+  std::unique_ptr<ValueWriter> writer;
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("streamed", value.size(), &writer).ok());
+  std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
+  for (uint64_t offset = 0; offset < value.size(); offset += 100000) {
+    uint32_t size = std::min<uint64_t>(100000, value.size() - offset);
+    ASSERT_TRUE(writer->Append(value.data() + offset, size).ok());
+    auto key = StringUtils::GenerateRandomString(10);
+    data[key] = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(20000));
+    ASSERT_TRUE(zone_manager_->Append(key, data[key]).ok());
+  }
+  // Not visible until committed, and the declared size is never exceeded.
+  Index::ValueVariant value_variant;
+  EXPECT_FALSE(index_->Get("streamed", value_variant).ok());
+  EXPECT_FALSE(writer->Append("x").ok());
+  ASSERT_TRUE(writer->Commit().ok());
+  EXPECT_EQ(read_value("streamed"), value);
+  EXPECT_FALSE(writer->Append("x").ok());
+
+  // An incomplete or dropped value leaves the index untouched.
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("incomplete", 1UL << 20, &writer).ok());
+  ASSERT_TRUE(writer->Append(value.substr(0, 1000)).ok());
+  EXPECT_FALSE(writer->Commit().ok());
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("dropped", 2 * IO_FLUSH_SIZE, &writer).ok());
+  ASSERT_TRUE(writer->Append(value.substr(0, IO_FLUSH_SIZE + 1000)).ok());
+  writer = nullptr;
+  EXPECT_FALSE(index_->Get("incomplete", value_variant).ok());
+  EXPECT_FALSE(index_->Get("dropped", value_variant).ok());
+
+  // Overwrite the streamed value, then stream an empty one.
+  std::string new_value = StringUtils::GenerateRandomString(IO_FLUSH_SIZE);
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("streamed", new_value.size(), &writer).ok());
+  ASSERT_TRUE(writer->Append(new_value).ok());
+  ASSERT_TRUE(writer->Commit().ok());
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("empty", 0, &writer).ok());
+  ASSERT_TRUE(writer->Commit().ok());
+  EXPECT_FALSE(zone_manager_->OpenValueWriter("large", MAX_VALUE_SIZE + 1, &writer).ok());
+  zone_manager_->StopFlushWorker();
+  EXPECT_EQ(read_value("streamed"), new_value);
+  EXPECT_EQ(read_value("empty"), "");
+  for (auto& pair : data) {
+    EXPECT_EQ(read_value(pair.first), pair.second->Data());
+  }
+
+  // A single encoder can't stream a value.
+  options_.flush_encoder_num_ = 1;
+  io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                             options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  writer = nullptr;
+  EXPECT_EQ(zone_manager_->OpenValueWriter("collected", value.size(), &writer).code(),
+            Status::Code::kNotSupported);
+  EXPECT_EQ(writer, nullptr);
+}
+
+TEST_F(ZoneManagerTest, ValueWriterHoldsZoneTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 16UL << 20;
+  options_.flush_encoder_num_ = 2;
+  options_.write_buffer_size_ = 4UL << 20;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  // The puts fill the writer's zone while it's open, so the flush waits for the writer. The
+  // writer's thread only puts without waiting meanwhile, which never hangs.
+  std::string value = StringUtils::GenerateRandomString(2 * IO_FLUSH_SIZE);
+  std::unique_ptr<ValueWriter> writer;
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("streamed", value.size(), &writer).ok());
+  ASSERT_TRUE(writer->Append(value.substr(0, IO_FLUSH_SIZE)).ok());
+  std::unordered_map<std::string, std::string> data;
+  for (int i = 0; i < 128; i++) {
+    auto key = "key" + std::to_string(i);
+    auto item = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1UL << 20));
+    auto s = zone_manager_->Append(key, item, false, false);
+    if (s.code() == Status::Code::kIOBusy) {
+      break;
+    }
+    ASSERT_TRUE(s.ok());
+    data[key] = item->Data();
+  }
+  ASSERT_TRUE(writer->Append(value.substr(IO_FLUSH_SIZE)).ok());
+  ASSERT_TRUE(writer->Commit().ok());
+  // Closing the writer releases the zone.
+  writer = nullptr;
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  zone_manager_->StopFlushWorker();
+
+  auto read_value = [&](const std::string& key) -> std::string {
+    Index::ValueVariant value_variant;
+    if (!index_->Get(key, value_variant).ok()) {
+      return "";
+    }
+    std::string read_key;
+    std::shared_ptr<IOBuf> read;
+    EXPECT_TRUE(zone_manager_
+                    ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key, read)
+                    .ok());
+    return read->Data();
+  };
+  EXPECT_EQ(read_value("streamed"), value);
+  for (auto& pair : data) {
+    EXPECT_EQ(read_value(pair.first), pair.second);
+  }
+}
+
+TEST_F(ZoneManagerTest, FinishZoneWithoutKeysTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 16UL << 20;
+  options_.flush_encoder_num_ = 2;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  // The dropped writers fill a few zones with data but no keys, which are still switched.
+  std::string value = StringUtils::GenerateRandomString(4UL << 20);
+  std::unique_ptr<ValueWriter> writer;
+  for (int i = 0; i < 10; i++) {
+    ASSERT_TRUE(zone_manager_->OpenValueWriter("dropped", value.size(), &writer).ok());
+    ASSERT_TRUE(writer->Append(value.substr(0, value.size() - 1)).ok());
+    writer = nullptr;
+  }
+  ASSERT_TRUE(zone_manager_->OpenValueWriter("dropped", value.size(), &writer).ok());
+  ASSERT_TRUE(writer->Append(value).ok());
+  ASSERT_TRUE(writer->Commit().ok());
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  zone_manager_->StopFlushWorker();
+
+  Index::ValueVariant value_variant;
+  ASSERT_TRUE(index_->Get("dropped", value_variant).ok());
+  std::string read_key;
+  std::shared_ptr<IOBuf> read_value;
+  ASSERT_TRUE(zone_manager_
+                  ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key, read_value)
+                  .ok());
+  EXPECT_EQ(read_value->Data(), value);
+}
+
+TEST_F(ZoneManagerTest, HotColdPlacementTest) {
+  options_.device_capacity_ = 512UL << 20;
+  options_.device_zone_capacity_ = 64UL << 20;
+  options_.open_data_zone_num_ = 2;
+  options_.hot_data_zone_num_ = 1;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  ASSERT_EQ(zone_manager_->GetDataStreamTemperature(0), kCold);
+  ASSERT_EQ(zone_manager_->GetDataStreamTemperature(1), kHot);
+  EXPECT_EQ(zone_manager_->GetWritableBufferNum(), 2);
+  zone_manager_->StartFlushWorker();
+
+  // The first half of the keys are overwritten 3 times.
+  std::vector<std::string> keys;
+  for (int i = 0; i < 100; ++i) {
+    keys.push_back(StringUtils::GenerateRandomString(10));
+  }
+  std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
+  for (int round = 0; round < 4; ++round) {
+    for (int i = 0; i < (round == 0 ? 100 : 50); ++i) {
+      auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(100UL << 10));
+      EXPECT_TRUE(zone_manager_->Append(keys[i], value).ok());
+      data[keys[i]] = value;
+    }
+  }
+  zone_manager_->StopFlushWorker();
+
+  // The overwrites were placed into the hot zone, apart from the keys that were written once.
+  std::shared_ptr<Zone> hot_zone;
+  std::shared_ptr<Zone> cold_zone;
+  for (int i = 0; i < 100; ++i) {
+    Index::ValueVariant value_variant;
+    ASSERT_TRUE(index_->Get(keys[i], value_variant).ok());
+    ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+    auto lba_value = std::get<Index::LBAValue>(value_variant);
+    auto zone = zone_manager_->GetZoneByLBA(Index::DecodeLBA(lba_value));
+    ASSERT_NE(zone, nullptr);
+    EXPECT_EQ(zone->temperature_, i < 50 ? kHot : kCold);
+    (i < 50 ? hot_zone : cold_zone) = zone;
+
+    std::string read_key;
+    std::shared_ptr<IOBuf> read_value;
+    ASSERT_TRUE(zone_manager_->ReadSingleItem(lba_value, &read_key, read_value).ok());
+    EXPECT_EQ(read_value->Data(), data[keys[i]]->Data());
+  }
+
+  // Each overwrite expired the previous version, 2/3 of the hot zone is dead while the cold zone
+  // only lost the first versions of the hot keys.
+  LOG(INFO, "expired items, hot zone: {}/{}, cold zone: {}/{}",
+      hot_zone->expired_items_.load(), hot_zone->total_items_, cold_zone->expired_items_.load(),
+      cold_zone->total_items_);
+  EXPECT_EQ(hot_zone->total_items_, 150);
+  EXPECT_EQ(cold_zone->total_items_, 100);
+  EXPECT_GE(hot_zone->expired_items_.load(), 90);
+  EXPECT_LE(cold_zone->expired_items_.load(), 50);
+  EXPECT_GT(hot_zone->expired_bytes_.load(), cold_zone->expired_bytes_.load());
+  EXPECT_EQ(hot_zone->state_, ZoneState::FULL);
+  EXPECT_GT(hot_zone->finish_time_us_, 0);
+}
+
+TEST_F(ZoneManagerTest, ExpireOnceTest) {
+  zone_manager_->StartFlushWorker();
+  std::vector<std::string> keys;
+  for (int i = 0; i < 10; ++i) {
+    keys.push_back("key_" + std::to_string(i));
+    auto value = std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000));
+    ASSERT_TRUE(zone_manager_->Append(keys.back(), value).ok());
+  }
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  std::set<std::shared_ptr<Zone>> zones;
+  auto collect_zones = [&]() {
+    for (auto& key : keys) {
+      Index::ValueVariant value_variant;
+      ASSERT_TRUE(index_->Get(key, value_variant).ok());
+      ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+      zones.insert(zone_manager_->GetZoneByLBA(
+          Index::DecodeLBA(std::get<Index::LBAValue>(value_variant))));
+    }
+  };
+  collect_zones();
+
+  // Each flushed version is expired once, though its key is put twice in the batch. The first put
+  // of the batch is flushed as well, and expired by the second one.
+  std::vector<WriteBatch::Item> items;
+  for (auto& key : keys) {
+    items.emplace_back(key, std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000)));
+    items.emplace_back(key, std::make_shared<IOBuf>(StringUtils::GenerateRandomString(1000)));
+  }
+  std::vector<const WriteBatch::Item*> batch;
+  for (auto& item : items) {
+    batch.push_back(&item);
+  }
+  ASSERT_TRUE(zone_manager_->AppendBatch(batch).ok());
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  collect_zones();
+  zone_manager_->StopFlushWorker();
+  uint64_t expired_items = 0;
+  for (auto& zone : zones) {
+    expired_items += zone->expired_items_;
+  }
+  EXPECT_EQ(expired_items, keys.size() * 2);
+}
+
+TEST_F(ZoneManagerTest, DuplicateKeyBatchTest) {
+  options_.device_capacity_ = 256UL << 20;
+  options_.device_zone_capacity_ = 16UL << 20;
+  options_.writable_buffer_num_ = 4;
+  options_.immutable_buffer_num_ = 4;
+  options_.flush_encoder_num_ = 4;
+  auto io_handle = std::make_unique<FileIOHandle>(filename_, options_.device_capacity_,
+                                                  options_.device_zone_capacity_);
+  zone_manager_ = std::make_unique<ZoneManager>(options_, std::move(io_handle), index_);
+  zone_manager_->StartFlushWorker();
+
+  // Each writer puts every key of its batch a few times, the last version of the batch wins even
+  // if the writer moved to another CPU meanwhile.
+  const uint32_t thread_num = 4;
+  std::vector<std::map<std::string, std::string>> expected(thread_num);
+  std::vector<std::thread> threads;
+  for (uint32_t t = 0; t < thread_num; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int round = 0; round < 20; ++round) {
+        std::vector<WriteBatch::Item> items;
+        for (int version = 0; version < 3; ++version) {
+          for (int i = 0; i < 20; ++i) {
+            auto key = std::to_string(t) + "_key_" + std::to_string(i);
+            auto value = StringUtils::GenerateRandomString(1000);
+            items.emplace_back(key, std::make_shared<IOBuf>(value));
+            expected[t][key] = value;
+          }
+        }
+        std::vector<const WriteBatch::Item*> batch;
+        for (auto& item : items) {
+          batch.push_back(&item);
+        }
+        ASSERT_TRUE(zone_manager_->AppendBatch(batch).ok());
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_TRUE(zone_manager_->Flush().ok());
+  zone_manager_->StopFlushWorker();
+
+  for (auto& data : expected) {
+    for (auto& pair : data) {
+      Index::ValueVariant value_variant;
+      ASSERT_TRUE(index_->Get(pair.first, value_variant).ok());
+      ASSERT_TRUE(std::holds_alternative<Index::LBAValue>(value_variant));
+      std::string read_key;
+      std::shared_ptr<IOBuf> read_value;
+      ASSERT_TRUE(zone_manager_
+                      ->ReadSingleItem(std::get<Index::LBAValue>(value_variant), &read_key,
+                                       read_value)
+                      .ok());
+      EXPECT_EQ(read_key, pair.first);
+      EXPECT_EQ(read_value->Data(), pair.second);
+    }
+  }
+}
+
 TEST_F(ZoneManagerTest, TryFlushTest) {
   std::unordered_map<std::string, std::shared_ptr<IOBuf>> data;
   for (int i = 0; i < 15; ++i) {
@@ -162,6 +939,7 @@ TEST_F(ZoneManagerTest, TryFlushTest) {
   // After flush, the immutable_ buffer should be consumed.
   zone_manager_->FlushImmutableBuffers();
   EXPECT_EQ(0, zone_manager_->GetImmutableBufferNum());
+  zone_manager_->WaitForFlushIO();
 
   //   Check Key Value
   for (auto& item : data) {
@@ -269,6 +1047,7 @@ TEST_F(ZoneManagerTest, LayoutTest) {
 
     // Flush buffer each 2 items and then read them out to verify
     zone_manager_->FlushAndResetIOBuffer(io_buffer);
+    zone_manager_->WaitForFlushIO();
     EXPECT_TRUE(keys.size() == batch_size);
     for (int i = 0; i < batch_size; ++i) {
       std::string read_key;
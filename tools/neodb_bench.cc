@@ -14,6 +14,16 @@ DEFINE_uint32(read_ratio, 10, "read percent of total operations");
 DEFINE_uint64(device_capacity_gb, 10, "");
 DEFINE_uint64(zone_capacity_mb, 256, "");
 DEFINE_uint32(workers, 2, "client thread number");
+DEFINE_uint32(flush_encoders, 1, "encoding workers of each open data zone");
+DEFINE_uint32(batch_size, 1, "puts of each WriteBatch in the run, 1 disables the batching");
+DEFINE_bool(sync_put, false, "return each put of the run only after it was written to the device");
+DEFINE_bool(simulated_device, false, "keep the data in memory and model the device timing");
+DEFINE_uint64(sim_read_latency_us, 80, "base read latency of the simulated device");
+DEFINE_uint64(sim_write_latency_us, 20, "base write latency of the simulated device");
+DEFINE_uint32(sim_parallelism, 8, "requests served in parallel by the simulated device");
+DEFINE_uint32(sim_spike_ppm, 0, "latency spikes per million ops of the simulated device");
+DEFINE_uint64(sim_spike_latency_us, 10000, "latency of each spike of the simulated device");
+DEFINE_uint64(sim_seed, 0, "random seed of the simulated device");
 
 namespace neodb::tools {
 
@@ -28,10 +38,22 @@ class Benchmark {
     LOG(INFO, "Benchmarking Initialized!");
     StoreOptions store_options1;
     store_options1.name_ = "store1";
-    store_options1.device_path_ =
-        FileUtils::GenerateRandomFile(device_prefix_, FLAGS_device_capacity_gb << 30);
+    if (FLAGS_simulated_device) {
+      store_options1.type_ = kSimulated;
+      auto& sim = store_options1.sim_device_;
+      sim.read_latency_.base_us_ = FLAGS_sim_read_latency_us;
+      sim.write_latency_.base_us_ = FLAGS_sim_write_latency_us;
+      sim.parallelism_ = FLAGS_sim_parallelism;
+      sim.spike_ppm_ = FLAGS_sim_spike_ppm;
+      sim.spike_latency_us_ = FLAGS_sim_spike_latency_us;
+      sim.seed_ = FLAGS_sim_seed;
+    } else {
+      store_options1.device_path_ =
+          FileUtils::GenerateRandomFile(device_prefix_, FLAGS_device_capacity_gb << 30);
+    }
     store_options1.device_zone_capacity_ = FLAGS_zone_capacity_mb << 20;
     store_options1.device_capacity_ = FLAGS_device_capacity_gb << 30;
+    store_options1.flush_encoder_num_ = FLAGS_flush_encoders;
 
     //    StoreOptions store_options2;
     //    store_options2.name_ = "store2";
@@ -116,23 +138,38 @@ class Benchmark {
     LOG(INFO, "item_cnt_per_worker: {}", item_cnt_per_worker);
 
     std::string common_value = StringUtils::GenerateRandomString(FLAGS_value_sz);
+    WriteOptions write_options;
+    write_options.sync_ = FLAGS_sync_put;
 
     // Put key values in to the store.
     auto start = TimeUtils::GetCurrentTimeInMs();
     for (int i = 0; i < FLAGS_workers; ++i) {
       write_stats_.emplace_back();
       workers_.emplace_back([&, i]() {
-        // Write data
+        // Write data, the latency is recorded for each put or batch.
+        WriteBatch batch;
         while (written_bytes < target_write_bytes) {
           std::string key = StringUtils::GenerateRandomString(FLAGS_key_sz);
           auto t1 = TimeUtils::GetCurrentTimeInUs();
-          auto s = db_->Put(key, common_value);
+          auto s = Status::OK();
+          if (FLAGS_batch_size > 1) {
+            batch.Put(key, common_value);
+            if (batch.Count() >= FLAGS_batch_size) {
+              s = db_->Write(batch, write_options);
+              batch.Clear();
+            }
+          } else {
+            s = db_->Put(key, common_value, write_options);
+          }
           assert(s.ok());
           write_stats_[i].Append(TimeUtils::GetCurrentTimeInUs() - t1);
           written_bytes += (key.size() + common_value.size());
           verify_keys_[std::this_thread::get_id()].emplace_back(std::move(key));
           total_item++;
         }
+        if (batch.Count() > 0) {
+          db_->Write(batch, write_options);
+        }
       });
     }
 
@@ -144,6 +181,7 @@ class Benchmark {
     uint64_t throughput = ((target_write_bytes / (end - start)) * 1000) >> 20;
     LOG(INFO, "======================== Finish Benchmarking Insertion =================");
 
+    auto stall_stats = db_->GetWriteStallStats();
     db_ = nullptr;
     HistStats stats;
     for (auto& stat : write_stats_) {
@@ -157,6 +195,9 @@ class Benchmark {
     LOG(INFO, line);
     LOG(INFO, "{}", stats.ToString(" us"));
     LOG(INFO, line);
+    LOG(INFO, "Write stalls: {}, stall time: {} us", stall_stats.stall_num_,
+        stall_stats.stall_us_);
+    LOG(INFO, line);
   }
 
  private:
@@ -198,9 +239,10 @@ int main(int argc, char** argv) {
       "zone size: {} MB\n"
       "preload size: {} GB\n"
       "write size: {} GB\n"
-      "read ratio: {}%",
+      "read ratio: {}%\n"
+      "simulated device: {}",
       FLAGS_key_sz, FLAGS_value_sz, FLAGS_device_capacity_gb, FLAGS_zone_capacity_mb,
-      FLAGS_preload_size_gb, FLAGS_write_size_gb, FLAGS_read_ratio);
+      FLAGS_preload_size_gb, FLAGS_write_size_gb, FLAGS_read_ratio, FLAGS_simulated_device);
   neodb::InitLogger();
   neodb::tools::Benchmark benchmark;
   benchmark.Prefill();